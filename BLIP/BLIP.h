@@ -8,8 +8,10 @@
 
 #import "BLIPMessage.h"
 #import "BLIPConnection.h"
+#import "BLIPConnectionPool.h"
 #import "BLIPDispatcher.h"
 #import "BLIPRequest.h"
 #import "BLIPProperties.h"
+#import "BLIPResponseCache.h"
 #import "BLIPFileRequest.h"
 #import "BLIPFileResponse.h"
@@ -6,7 +6,7 @@
 //  Copyright 2008 Jens Alfke. All rights reserved.
 //
 
-@class BLIPRequest, BLIPResponse, BLIPDispatcher;
+@class BLIPRequest, BLIPResponse, BLIPDispatcher, BLIPResponseCache;
 @protocol BLIPConnectionDelegate;
 
 
@@ -45,9 +45,30 @@
     Call this instead of calling -send on the request itself, if the request was created with
     +[BLIPRequest requestWithBody:] and hasn't yet been assigned to any connection.
     This method will assign it to this connection before sending it.
-    The request's matching response object will be returned, or nil if the request couldn't be sent. */
+    The request's matching response object will be returned, or nil if the request couldn't be sent.
+    Once the connection has been opened, this (or -[BLIPRequest send]) may be called on any
+    thread. A request sent from another thread is handed to the connection's thread without
+    blocking; it's assigned its number there, so its number stays zero until then. */
 - (BLIPResponse*) sendRequest: (BLIPRequest*)request;
 
+/** An optional cache of responses to idempotent requests. Requests whose responses are in the
+    cache, or identical to a request already in flight, aren't sent at all.
+    A cache may be shared by several connections to the same service. Defaults to nil. */
+@property (strong) BLIPResponseCache *responseCache;
+
+/** The number of requests sent over this connection whose responses haven't finished arriving. */
+@property (readonly) NSUInteger pendingResponseCount;
+
+/** The number of bytes of outgoing messages that are queued but not yet written to the socket. */
+@property (readonly) NSUInteger queuedByteCount;
+
+/** If nonzero, whenever nothing has been received for this many seconds a BLIP "Ping" is sent;
+    if the peer doesn't answer within the same interval, the connection is disconnected with a
+    kBLIPError_Timeout error. This notices a peer that's gone, or stopped reading, even while
+    replies are pending. (For a cheaper check that involves only the OS, see keepAliveInterval.)
+    Defaults to zero (off). */
+@property NSTimeInterval pingInterval;
+
 /** Specifies the class of object to be used for requests
     Subclasses may override, but MUST be a subclass of BLIPRequest
  */
@@ -98,4 +119,7 @@
     dispatcher will be checked next. Only if it fails too will the delegate be called. */
 @property (readonly) BLIPDispatcher *dispatcher;
 
+/** The pingInterval given to the connections this listener accepts. */
+@property NSTimeInterval pingInterval;
+
 @end
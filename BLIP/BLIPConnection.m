@@ -11,23 +11,79 @@
 #import "TCP_Internal.h"
 #import "BLIPReader.h"
 #import "BLIPWriter.h"
+#import "BLIPEngine.h"
 #import "BLIPDispatcher.h"
 
 #import "Logging.h"
 #import "Test.h"
-#import "ExceptionUtils.h"
-#import "Target.h"
 
 
-@interface BLIPConnection ()
-- (void) _handleCloseRequest: (BLIPRequest*)request;
+@interface BLIPConnection () <BLIPEngineDelegate>
 @end
 
 
 @implementation BLIPConnection
 {
-    BLIPDispatcher *_dispatcher;
-    BOOL _blipClosing;
+    BLIPEngine *_engine;
+    MYSubmissionQueue *_submissions;
+}
+
+
+- (void) dealloc
+{
+    [_submissions unschedule];
+}
+
+
+- (void) open
+{
+    // The streams are scheduled on the current thread's run loop, which makes it the I/O thread.
+    // Other threads hand their requests and responses to it through the submission queue.
+    if( ! _submissions ) {
+        _submissions = [[MYSubmissionQueue alloc] initWithHandler: ^(id block) {
+            ((void(^)(void))block)();
+        }];
+        [_submissions scheduleOnCurrentRunLoop];
+    }
+    [super open];
+}
+
+
+/* Runs the block asynchronously on the I/O thread. */
+- (void) _submit: (void(^)(void))block
+{
+    [_submissions push: [block copy]];
+}
+
+/* Runs the block on the I/O thread: right away if this is the I/O thread (or the connection
+   hasn't been opened yet), otherwise asynchronously via the submission queue. */
+- (void) _onIOThread: (void(^)(void))block
+{
+    if( ! _submissions || _submissions.isOnConsumerThread )
+        block();
+    else
+        [self _submit: block];
+}
+
+
+- (BLIPEngine*) _engine
+{
+    if( ! _engine ) {
+        _engine = [[BLIPEngine alloc] initWithDelegate: self transport: kBLIPTransport_Stream];
+        _engine.requestClass = [self requestClass];
+        _engine.dispatcher.parent = ((BLIPListener*)self.server).dispatcher;
+        _engine.pingInterval = ((BLIPListener*)self.server).pingInterval;
+    }
+    return _engine;
+}
+
+
+- (void) _streamOpened: (TCPStream*)stream
+{
+    // Greet the peer before the delegate hears that I'm open, so the greeting goes out first:
+    if( self.status==kTCP_Opening && self.reader.isOpen && self.writer.isOpen )
+        [self._engine sendHello];
+    [super _streamOpened: stream];
 }
 
 
@@ -45,54 +101,19 @@
 
 - (BLIPDispatcher*) dispatcher
 {
-    if( ! _dispatcher ) {
-        _dispatcher = [[BLIPDispatcher alloc] init];
-        _dispatcher.parent = ((BLIPListener*)self.server).dispatcher;
-    }
-    return _dispatcher;
+    return self._engine.dispatcher;
 }
 
 
-- (BOOL) _dispatchMetaRequest: (BLIPRequest*)request
+- (BOOL) blipEngine: (BLIPEngine*)engine receivedRequest: (BLIPRequest*)request
 {
-    NSString* profile = request.profile;
-    if( [profile isEqualToString: kBLIPProfile_Bye] ) {
-        [self _handleCloseRequest: request];
-        return YES;
-    }
+    if( [_delegate respondsToSelector: @selector(connection:receivedRequest:)] )
+        return [_delegate connection: self receivedRequest: request];
     return NO;
 }
 
-
-- (void) _dispatchRequest: (BLIPRequest*)request
-{
-    LogTo(BLIP,@"Received all of %@",request.descriptionWithProperties);
-    @try{
-        BOOL handled;
-        if( request._flags & kBLIP_Meta )
-            handled =[self _dispatchMetaRequest: request];
-        else {
-            handled = [self.dispatcher dispatchMessage: request];
-            if (!handled && [_delegate respondsToSelector: @selector(connection:receivedRequest:)])
-                handled = [_delegate connection: self receivedRequest: request];
-        }
-        
-        if (!handled) {
-            LogTo(BLIP,@"No handler found for incoming %@",request);
-            [request respondWithErrorCode: kBLIPError_NotFound message: @"No handler was found"];
-        } else if( ! request.noReply && ! request.repliedTo ) {
-            LogTo(BLIP,@"Returning default empty response to %@",request);
-            [request respondWithData: nil contentType: nil];
-        }
-    }@catch( NSException *x ) {
-        MYReportException(x,@"Dispatching BLIP request");
-        [request respondWithException: x];
-    }
-}
-
-- (void) _dispatchResponse: (BLIPResponse*)response
+- (void) blipEngine: (BLIPEngine*)engine receivedResponse: (BLIPResponse*)response
 {
-    LogTo(BLIP,@"Received all of %@",response);
     [self tellDelegate: @selector(connection:receivedResponse:) withObject: response];
 }
 
@@ -129,17 +150,70 @@
 }
 
 
+- (NSUInteger) pendingResponseCount {
+    return _engine.pendingResponseCount;
+}
+
+- (NSUInteger) queuedByteCount {
+    return _engine.queuedByteCount;
+}
+
+
+- (BLIPResponseCache*) responseCache                        {return self._engine.responseCache;}
+- (void) setResponseCache: (BLIPResponseCache*)cache        {self._engine.responseCache = cache;}
+
+
 - (BOOL) _sendRequest: (BLIPRequest*)q response: (BLIPResponse*)response {
-    BLIPWriter *writer = (BLIPWriter*)self.writer;
-    Assert(writer,@"%@'s connection has no writer (already closed?)",self);
-    return [writer sendRequest: q response: response];
+    if( _submissions && ! _submissions.isOnConsumerThread ) {
+        // Called on another thread. The request will be numbered and queued on the I/O thread,
+        // so its number will be zero until then.
+        [self _submit: ^{
+            if( ! [self _sendRequestNow: q response: response] && response ) {
+                [response _failWithError: BLIPMakeError(kBLIPError_Disconnected,
+                                             @"Connection closed before request could be sent")];
+                [self tellDelegate: @selector(connection:receivedResponse:) withObject: response];
+            }
+        }];
+        return YES;
+    }
+    Assert(self.writer || self._isConnecting,
+           @"%@'s connection has no writer (already closed?)",self);
+    return [self _sendRequestNow: q response: response];
+}
+
+- (BOOL) _sendRequestNow: (BLIPRequest*)q response: (BLIPResponse*)response {
+    // While the socket is still connecting there's no writer yet; the engine queues the request
+    // and the writer sends it once the streams open.
+    if( ! self.writer && ! self._isConnecting )
+        return NO;
+    return [self._engine sendRequest: q response: response];
+}
+
+
+- (void) _cancelRequest: (BLIPRequest*)q
+{
+    [self _onIOThread: ^{
+        [self._engine cancelRequest: q];
+    }];
 }
 
 
 - (BOOL) _sendResponse: (BLIPResponse*)response {
-    BLIPWriter *writer = (BLIPWriter*)self.writer;
-    Assert(writer,@"%@'s connection has no writer (already closed?)",self);
-    return [writer sendMessage: response];
+    if( _submissions && ! _submissions.isOnConsumerThread ) {
+        // Response from a handler running on another thread (see BLIPDispatchPolicy):
+        [self _submit: ^{
+            [self._engine sendResponse: response];
+        }];
+        return YES;
+    }
+    Assert(self.writer,@"%@'s connection has no writer (already closed?)",self);
+    return [self._engine sendResponse: response];
+}
+
+
+- (void) blipEngineHasFramesToSend: (BLIPEngine*)engine
+{
+    [(BLIPWriter*)self.writer framesAvailable];
 }
 
 
@@ -147,48 +221,59 @@
 #pragma mark CLOSING:
 
 
+- (void) _closed
+{
+    // Override of TCPConnection method. If the socket never connected there was no writer to
+    // disconnect the engine, so fail the requests that were queued while connecting:
+    [_engine disconnect];
+    [super _closed];
+}
+
+
 - (void) _beginClose
 {
-    // Override of TCPConnection method. Instead of closing the socket, send a 'bye' request:
-    if( ! _blipClosing ) {
-        LogTo(BLIPVerbose,@"Sending close request...");
-        BLIPRequest *r = [self request];
-        [r _setFlag: kBLIP_Meta value: YES];
-        r.profile = kBLIPProfile_Bye;
-        BLIPResponse *response = [r send];
-        response.onComplete = $target(self,_receivedCloseResponse:);
-    }
-    // Put the writer in close mode, to prevent client from sending any more requests:
+    // Override of TCPConnection method. Instead of closing the socket, send a 'bye' request
+    // (unless the peer already sent one):
+    if( ! self._engine.closing )
+        [self._engine sendCloseRequest];
+    // Put the writer in close mode; it closes once the engine has no more frames to send:
     [self.writer close];
 }
 
-- (void) _receivedCloseResponse: (BLIPResponse*)response
+
+- (BOOL) blipEngineShouldAcceptCloseRequest: (BLIPEngine*)engine
 {
-    NSError *error = response.error;
-    LogTo(BLIPVerbose,@"Received close response: error=%@",error);
-    if( error ) {
-        [self _unclose];
-        [self tellDelegate: @selector(connection:closeRequestFailedWithError:) withObject: error];
-    } else {
-        // Now finally close the socket:
-        [super _beginClose];
-    }
+    if( [_delegate respondsToSelector: @selector(connectionReceivedCloseRequest:)] )
+        return [_delegate connectionReceivedCloseRequest: self];
+    return YES;
 }
 
+- (void) blipEngineReadyToClose: (BLIPEngine*)engine
+{
+    if( self.status == kTCP_Closing )
+        [super _beginClose];    // The peer agreed to my close request; now close the socket
+    else
+        [self close];           // The peer asked to close
+}
 
-- (void) _handleCloseRequest: (BLIPRequest*)request
+- (void) blipEngine: (BLIPEngine*)engine closeRequestFailedWithError: (NSError*)error
 {
-    LogTo(BLIPVerbose,@"Received a close request");
-    if( [_delegate respondsToSelector: @selector(connectionReceivedCloseRequest:)] )
-        if( ! [_delegate connectionReceivedCloseRequest: self] ) {
-            LogTo(BLIPVerbose,@"Responding with denial of close request");
-            [request respondWithErrorCode: kBLIPError_Forbidden message: @"Close request denied"];
-            return;
-        }
-    
-    LogTo(BLIPVerbose,@"Close request accepted");
-    _blipClosing = YES; // this prevents _beginClose from sending a close request back
-    [self close];
+    [self _unclose];
+    [self tellDelegate: @selector(connection:closeRequestFailedWithError:) withObject: error];
+}
+
+
+#pragma mark -
+#pragma mark KEEPALIVE:
+
+
+- (NSTimeInterval) pingInterval                             {return self._engine.pingInterval;}
+- (void) setPingInterval: (NSTimeInterval)interval          {self._engine.pingInterval = interval;}
+
+- (void) blipEngine: (BLIPEngine*)engine pingFailedWithError: (NSError*)error
+{
+    // The peer is gone, or so backed up it might as well be:
+    [self _stream: self.reader gotError: error];
 }
 
 
@@ -201,6 +286,7 @@
 @implementation BLIPListener
 {
     BLIPDispatcher *_dispatcher;
+    NSTimeInterval _pingInterval;
 }
 
 
@@ -221,6 +307,8 @@
     return _dispatcher;
 }
 
+@synthesize pingInterval=_pingInterval;
+
 @end
 
 
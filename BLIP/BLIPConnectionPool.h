@@ -0,0 +1,97 @@
+//
+//  BLIPConnectionPool.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "BLIPConnection.h"
+@class BLIPRequest, BLIPResponse, BLIPDispatcher, BLIPResponseCache;
+
+
+/** How a BLIPConnectionPool chooses which connection to send a request over. */
+typedef enum {
+    kBLIPPoolLeastPendingResponses,     // Connection with the fewest responses still outstanding
+    kBLIPPoolLeastQueuedBytes           // Connection with the fewest unsent bytes in its queue
+} BLIPConnectionPoolBalancing;
+
+
+/** Maintains a fixed number of BLIPConnections to a peer (or to a set of peer endpoints),
+    spreading outgoing requests across them, and reopening connections that close or fail.
+
+    The pool becomes the delegate of every connection it creates, and forwards the
+    BLIPConnectionDelegate messages to its own delegate, passing the individual connection.
+    Incoming requests are dispatched by each connection's dispatcher, whose parent is the pool's
+    dispatcher, so rules added to the pool apply to all of its connections. */
+@interface BLIPConnectionPool : NSObject
+
+/** Initializes a pool of `size` connections to a single address.
+    Call -open after configuring settings. */
+- (id) initToAddress: (IPAddress*)address size: (NSUInteger)size;
+
+/** Initializes a pool of `size` connections spread across several endpoints.
+    Each item in the array may be an IPAddress or a MYBonjourService; connections are assigned
+    to endpoints round-robin. */
+- (id) initToEndpoints: (NSArray*)endpoints size: (NSUInteger)size;
+
+/** The endpoints (IPAddress or MYBonjourService objects) that connections are made to. */
+@property (readonly) NSArray *endpoints;
+
+/** The number of connections the pool tries to keep open. */
+@property (readonly) NSUInteger size;
+
+/** The delegate that will receive the BLIPConnectionDelegate messages of every pooled connection. */
+@property (weak) id<BLIPConnectionDelegate> delegate;
+
+/** The pool's request dispatcher; it's the parent of each pooled connection's dispatcher. */
+@property (readonly) BLIPDispatcher *dispatcher;
+
+/** SSL properties to apply to every connection the pool opens. (See TCPEndpoint.) */
+@property (copy) NSDictionary *SSLProperties;
+
+/** Timeout for each connection to open. (See TCPConnection.) */
+@property NSTimeInterval openTimeout;
+
+/** A response cache shared by all the pool's connections. (See BLIPConnection.)
+    Only affects connections opened after it's set. */
+@property (strong) BLIPResponseCache *responseCache;
+
+/** The policy for picking a connection to send a request over.
+    Defaults to kBLIPPoolLeastPendingResponses. */
+@property BLIPConnectionPoolBalancing balancing;
+
+/** Delay before reopening a connection that closed or failed. Each consecutive failure of the
+    same connection slot doubles the delay, up to maxReconnectDelay. Defaults to 1 second. */
+@property NSTimeInterval reconnectDelay;
+
+/** Upper limit on the reconnect delay. Defaults to 60 seconds. */
+@property NSTimeInterval maxReconnectDelay;
+
+/** The pool's current connections, some of which may not be open yet. */
+@property (readonly) NSArray *connections;
+
+/** The number of pooled connections that are currently open. */
+@property (readonly) NSUInteger openCount;
+
+/** Opens all of the pool's connections. */
+- (void) open;
+
+/** Closes all of the pool's connections and stops reconnecting. */
+- (void) close;
+
+/** Creates a new, empty outgoing request that isn't yet assigned to a connection.
+    Send it by calling -sendRequest: on the pool. */
+- (BLIPRequest*) request;
+
+/** Sends a request over the least-loaded open connection, as determined by the balancing policy.
+    The request's matching response is returned, or nil if no connection is available. */
+- (BLIPResponse*) sendRequest: (BLIPRequest*)request;
+
+/** Sends a request over the connection associated with `orderingKey`.
+    All requests sent with the same key go over the same connection (as long as it stays open),
+    so the peer receives them in the order they were sent. A nil key is the same as calling
+    -sendRequest:. */
+- (BLIPResponse*) sendRequest: (BLIPRequest*)request orderingKey: (id<NSCopying>)orderingKey;
+
+@end
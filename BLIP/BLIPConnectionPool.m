@@ -0,0 +1,522 @@
+//
+//  BLIPConnectionPool.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "BLIPConnectionPool.h"
+#import "BLIP_Internal.h"
+#import "BLIPDispatcher.h"
+#import "IPAddress.h"
+#import "MYBonjourService.h"
+
+#import "Logging.h"
+#import "Test.h"
+
+
+@interface BLIPConnectionPool () <BLIPConnectionDelegate>
+@end
+
+
+@implementation BLIPConnectionPool
+{
+    NSArray *_endpoints;
+    NSUInteger _size;
+    __weak id<BLIPConnectionDelegate> _delegate;
+    BLIPDispatcher *_dispatcher;
+    NSDictionary *_SSLProperties;
+    BLIPResponseCache *_responseCache;
+    NSTimeInterval _openTimeout, _reconnectDelay, _maxReconnectDelay;
+    BLIPConnectionPoolBalancing _balancing;
+
+    NSMutableArray *_connections;       // One per slot; NSNull while the slot waits to reconnect
+    NSUInteger *_failureCounts;         // Consecutive failures of each slot
+    NSMutableDictionary *_keyAffinity;  // Maps ordering keys to BLIPConnections
+    NSUInteger _nextIndex;              // Rotates the starting point of the load search
+    BOOL _open;
+}
+
+
+- (id) initToEndpoints: (NSArray*)endpoints size: (NSUInteger)size
+{
+    Assert(endpoints.count > 0);
+    Assert(size > 0);
+    self = [super init];
+    if (self != nil) {
+        _endpoints = [endpoints copy];
+        _size = size;
+        _reconnectDelay = 1.0;
+        _maxReconnectDelay = 60.0;
+        _balancing = kBLIPPoolLeastPendingResponses;
+        _connections = [[NSMutableArray alloc] initWithCapacity: size];
+        for( NSUInteger i=0; i<size; i++ )
+            [_connections addObject: [NSNull null]];
+        _failureCounts = calloc(size, sizeof(NSUInteger));
+        _keyAffinity = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (id) initToAddress: (IPAddress*)address size: (NSUInteger)size
+{
+    Assert(address);
+    return [self initToEndpoints: @[address] size: size];
+}
+
+
+- (void) dealloc
+{
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    free(_failureCounts);
+}
+
+
+- (NSString*) description
+{
+    return $sprintf(@"%@[%lu x %@]", self.class, (unsigned long)_size, _endpoints);
+}
+
+
+@synthesize endpoints=_endpoints, size=_size, delegate=_delegate, SSLProperties=_SSLProperties,
+            openTimeout=_openTimeout, responseCache=_responseCache, balancing=_balancing,
+            reconnectDelay=_reconnectDelay, maxReconnectDelay=_maxReconnectDelay;
+
+
+- (BLIPDispatcher*) dispatcher
+{
+    if( ! _dispatcher )
+        _dispatcher = [[BLIPDispatcher alloc] init];
+    return _dispatcher;
+}
+
+
+- (NSArray*) connections
+{
+    NSMutableArray *connections = [NSMutableArray arrayWithCapacity: _size];
+    for( id conn in _connections )
+        if( conn != [NSNull null] )
+            [connections addObject: conn];
+    return connections;
+}
+
+- (NSUInteger) openCount
+{
+    NSUInteger count = 0;
+    for( id conn in _connections )
+        if( conn != [NSNull null] && ((BLIPConnection*)conn).status == kTCP_Open )
+            count++;
+    return count;
+}
+
+
+#pragma mark -
+#pragma mark OPENING / CLOSING:
+
+
+- (void) open
+{
+    if( _open )
+        return;
+    LogTo(BLIP,@"%@ opening",self);
+    _open = YES;
+    for( NSUInteger slot=0; slot<_size; slot++ )
+        if( _connections[slot] == [NSNull null] )
+            [self _openSlot: slot];
+}
+
+
+- (void) close
+{
+    if( ! _open )
+        return;
+    LogTo(BLIP,@"%@ closing",self);
+    _open = NO;
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    [_keyAffinity removeAllObjects];
+    // The slots are emptied as each connection's -connectionDidClose: arrives.
+    for( id conn in [_connections copy] )
+        if( conn != [NSNull null] )
+            [conn close];
+}
+
+
+- (void) _openSlot: (NSUInteger)slot
+{
+    id endpoint = _endpoints[slot % _endpoints.count];
+    BLIPConnection *conn;
+    if( [endpoint isKindOfClass: [MYBonjourService class]] )
+        conn = [[BLIPConnection alloc] initToBonjourService: endpoint];
+    else
+        conn = [[BLIPConnection alloc] initToAddress: endpoint];
+    if( ! conn ) {
+        Warn(@"%@: couldn't create connection to %@",self,endpoint);
+        _failureCounts[slot]++;
+        [self _scheduleReconnectOfSlot: slot];
+        return;
+    }
+    conn.delegate = self;
+    conn.dispatcher.parent = self.dispatcher;
+    if( _SSLProperties )
+        conn.SSLProperties = [_SSLProperties mutableCopy];
+    conn.openTimeout = _openTimeout;
+    conn.responseCache = _responseCache;
+    _connections[slot] = conn;
+    LogTo(BLIPVerbose,@"%@: slot %lu opening %@",self,(unsigned long)slot,conn);
+    [conn open];
+}
+
+
+- (void) _scheduleReconnectOfSlot: (NSUInteger)slot
+{
+    if( ! _open )
+        return;
+    NSTimeInterval delay = _reconnectDelay;
+    for( NSUInteger i=1; i<_failureCounts[slot] && delay < _maxReconnectDelay; i++ )
+        delay *= 2;
+    delay = MIN(delay, _maxReconnectDelay);
+    LogTo(BLIP,@"%@: will reopen slot %lu in %.1f sec",self,(unsigned long)slot,delay);
+    [self performSelector: @selector(_reconnectSlot:) withObject: @(slot) afterDelay: delay];
+}
+
+- (void) _reconnectSlot: (NSNumber*)slotObj
+{
+    NSUInteger slot = slotObj.unsignedIntegerValue;
+    if( _open && _connections[slot] == [NSNull null] )
+        [self _openSlot: slot];
+}
+
+
+// Called when a pooled connection has closed or failed to open.
+- (void) _connectionEnded: (TCPConnection*)connection failed: (BOOL)failed
+{
+    NSUInteger slot = [_connections indexOfObjectIdenticalTo: connection];
+    if( slot == NSNotFound )
+        return;
+    _connections[slot] = [NSNull null];
+    [_keyAffinity removeObjectsForKeys: [_keyAffinity allKeysForObject: connection]];
+    if( failed )
+        _failureCounts[slot]++;
+    else
+        _failureCounts[slot] = 0;
+    [self _scheduleReconnectOfSlot: slot];
+}
+
+
+#pragma mark -
+#pragma mark SENDING:
+
+
+- (BLIPRequest*) request
+{
+    return [BLIPRequest requestWithBody: nil];
+}
+
+
+// Returns the least-loaded open connection according to the balancing policy.
+// If none is open yet, falls back to one that's still opening (its engine will queue the request
+// until the connection opens.)
+- (BLIPConnection*) _bestConnection
+{
+    NSUInteger n = _connections.count;
+    BLIPConnection *best = nil, *opening = nil;
+    NSUInteger bestLoad = NSUIntegerMax;
+    for( NSUInteger j=0; j<n; j++ ) {
+        id slotObj = _connections[(_nextIndex + j) % n];
+        if( slotObj == [NSNull null] )
+            continue;
+        BLIPConnection *conn = slotObj;
+        TCPConnectionStatus status = conn.status;
+        if( status == kTCP_Opening ) {
+            if( ! opening )
+                opening = conn;
+        } else if( status == kTCP_Open ) {
+            NSUInteger load;
+            if( _balancing == kBLIPPoolLeastQueuedBytes )
+                load = conn.queuedByteCount;
+            else
+                load = conn.pendingResponseCount;
+            if( load < bestLoad ) {
+                best = conn;
+                bestLoad = load;
+                if( load == 0 )
+                    break;
+            }
+        }
+    }
+    _nextIndex++;
+    return best ?: opening;
+}
+
+
+- (BLIPResponse*) sendRequest: (BLIPRequest*)request
+{
+    return [self sendRequest: request orderingKey: nil];
+}
+
+
+- (BLIPResponse*) sendRequest: (BLIPRequest*)request orderingKey: (id<NSCopying>)orderingKey
+{
+    BLIPConnection *conn = nil;
+    if( orderingKey ) {
+        conn = _keyAffinity[orderingKey];
+        if( conn.status > kTCP_Open || conn.status < kTCP_Opening )
+            conn = nil;
+    }
+    if( ! conn ) {
+        conn = [self _bestConnection];
+        if( ! conn ) {
+            Warn(@"%@: no connection available to send %@",self,request);
+            return nil;
+        }
+        if( orderingKey )
+            _keyAffinity[orderingKey] = conn;
+    }
+    LogTo(BLIPVerbose,@"%@: sending %@ over %@",self,request,conn);
+    return [conn sendRequest: request];
+}
+
+
+#pragma mark -
+#pragma mark CONNECTION DELEGATE:
+
+
+- (void) connectionDidOpen: (TCPConnection*)connection
+{
+    NSUInteger slot = [_connections indexOfObjectIdenticalTo: connection];
+    if( slot != NSNotFound )
+        _failureCounts[slot] = 0;
+    if( [_delegate respondsToSelector: @selector(connectionDidOpen:)] )
+        [_delegate connectionDidOpen: connection];
+}
+
+- (void) connection: (TCPConnection*)connection failedToOpen: (NSError*)error
+{
+    LogTo(BLIP,@"%@: %@ failed to open: %@",self,connection,error);
+    [self _connectionEnded: connection failed: YES];
+    if( [_delegate respondsToSelector: @selector(connection:failedToOpen:)] )
+        [_delegate connection: connection failedToOpen: error];
+}
+
+- (void) connectionDidClose: (TCPConnection*)connection
+{
+    [self _connectionEnded: connection failed: (connection.error != nil)];
+    if( [_delegate respondsToSelector: @selector(connectionDidClose:)] )
+        [_delegate connectionDidClose: connection];
+}
+
+- (BOOL) connection: (TCPConnection*)connection authorizeSSLPeer: (SecCertificateRef)peerCert
+{
+    if( [_delegate respondsToSelector: @selector(connection:authorizeSSLPeer:)] )
+        return [_delegate connection: connection authorizeSSLPeer: peerCert];
+    return YES;
+}
+
+- (BOOL) connection: (BLIPConnection*)connection receivedRequest: (BLIPRequest*)request
+{
+    if( [_delegate respondsToSelector: @selector(connection:receivedRequest:)] )
+        return [_delegate connection: connection receivedRequest: request];
+    return NO;
+}
+
+- (void) connection: (BLIPConnection*)connection receivedResponse: (BLIPResponse*)response
+{
+    if( [_delegate respondsToSelector: @selector(connection:receivedResponse:)] )
+        [_delegate connection: connection receivedResponse: response];
+}
+
+- (BOOL) connectionReceivedCloseRequest: (BLIPConnection*)connection
+{
+    if( [_delegate respondsToSelector: @selector(connectionReceivedCloseRequest:)] )
+        return [_delegate connectionReceivedCloseRequest: connection];
+    return YES;
+}
+
+- (void) connection: (BLIPConnection*)connection closeRequestFailedWithError: (NSError*)error
+{
+    if( [_delegate respondsToSelector: @selector(connection:closeRequestFailedWithError:)] )
+        [_delegate connection: connection closeRequestFailedWithError: error];
+}
+
+
+@end
+
+
+#pragma mark -
+#pragma mark TESTS:
+
+#if DEBUG
+
+/** The server side of the pool tests: accepts connections and answers requests, optionally
+    holding the responses until told to send them. */
+@interface BLIPPoolTestServer : NSObject <TCPListenerDelegate, BLIPConnectionDelegate>
+{
+    @public
+    BLIPListener *listener;
+    NSMutableArray *accepted;
+    NSMutableArray *deferred;
+    BOOL deferResponses;
+}
+@end
+
+@implementation BLIPPoolTestServer
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        accepted = [[NSMutableArray alloc] init];
+        deferred = [[NSMutableArray alloc] init];
+        listener = [[BLIPListener alloc] initWithPort: 0];
+        listener.delegate = self;
+        NSError *error;
+        CAssert([listener open: &error], @"Listener failed to open: %@", error);
+    }
+    return self;
+}
+
+- (void) listener: (TCPListener*)l didAcceptConnection: (TCPConnection*)connection {
+    [accepted addObject: connection];
+    connection.delegate = self;
+}
+
+- (BOOL) connection: (BLIPConnection*)connection receivedRequest: (BLIPRequest*)request {
+    if (deferResponses) {
+        [request deferResponse];
+        [deferred addObject: request];
+    } else {
+        [request respondWithString: @"ok"];
+    }
+    return YES;
+}
+
+- (void) connectionDidClose: (TCPConnection*)connection {
+    [accepted removeObjectIdenticalTo: connection];
+}
+
+- (void) respondToDeferred {
+    for (BLIPRequest *request in deferred)
+        [request respondWithString: @"ok"];
+    [deferred removeAllObjects];
+}
+
+@end
+
+
+// Runs the run loop until `done` returns YES, or fails after a few seconds.
+static void runPoolUntil( BOOL (^done)(void) ) {
+    NSDate *giveUp = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    while( !done() && [giveUp timeIntervalSinceNow] > 0 )
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+    CAssert(done(), @"Timed out");
+}
+
+static BLIPResponse* sendAndWait( BLIPConnectionPool *pool, id<NSCopying> orderingKey ) {
+    BLIPResponse *response = [pool sendRequest: [pool request] orderingKey: orderingKey];
+    CAssert(response);
+    runPoolUntil(^BOOL{ return response.complete; });
+    CAssertEqual(response.bodyString, @"ok");
+    return response;
+}
+
+
+TestCase(BLIPConnectionPool) {
+    BLIPPoolTestServer *server = [[BLIPPoolTestServer alloc] init];
+    IPAddress *addr = [[IPAddress alloc] initWithHostname: @"127.0.0.1"
+                                                     port: server->listener.port];
+    BLIPConnectionPool *pool = [[BLIPConnectionPool alloc] initToAddress: addr size: 3];
+    pool.reconnectDelay = 0.1;
+    [pool open];
+    runPoolUntil(^BOOL{ return pool.openCount == 3 && server->accepted.count == 3; });
+
+    // The pool never opens more than `size` connections to its host:
+    CAssertEq(pool.connections.count, 3u);
+    CAssertEq(server->listener.acceptedCount, 3u);
+
+    // Requests sent one at a time reuse the idle connections; no new ones are opened:
+    NSSet *original = [NSSet setWithArray: pool.connections];
+    for( int i=0; i<10; i++ ) {
+        BLIPResponse *response = sendAndWait(pool, nil);
+        CAssert([original containsObject: response.connection]);
+        CAssertEq(((BLIPConnection*)response.connection).pendingResponseCount, 0u);
+    }
+    CAssertEq(server->listener.acceptedCount, 3u);
+
+    // While requests are outstanding, each new one goes to a connection that isn't busy; once
+    // they're answered, the connections are free again:
+    server->deferResponses = YES;
+    NSMutableArray *responses = [NSMutableArray array];
+    NSMutableSet *used = [NSMutableSet set];
+    for( int i=0; i<3; i++ ) {
+        BLIPResponse *response = [pool sendRequest: [pool request]];
+        [responses addObject: response];
+        [used addObject: response.connection];
+    }
+    CAssertEq(used.count, 3u);
+    runPoolUntil(^BOOL{ return server->deferred.count == 3; });
+    server->deferResponses = NO;
+    [server respondToDeferred];
+    runPoolUntil(^BOOL{
+        for( BLIPResponse *response in responses )
+            if( !response.complete )
+                return NO;
+        return YES;
+    });
+    for( BLIPConnection *conn in pool.connections )
+        CAssertEq(conn.pendingResponseCount, 0u);
+
+    // An ordering key sticks to one connection:
+    BLIPConnection *keyed = (BLIPConnection*)sendAndWait(pool, @"key").connection;
+    for( int i=0; i<5; i++ )
+        CAssertEq((BLIPConnection*)sendAndWait(pool, @"key").connection, keyed);
+
+    // A connection that closes is evicted from the pool, along with its ordering keys, and its
+    // slot is refilled with a new one:
+    [keyed close];
+    runPoolUntil(^BOOL{ return ![pool.connections containsObject: keyed]; });
+    runPoolUntil(^BOOL{ return pool.openCount == 3; });
+    CAssertEq(pool.connections.count, 3u);
+    CAssertEq(server->listener.acceptedCount, 4u);
+    CAssert(sendAndWait(pool, @"key").connection != keyed);
+
+    // Closing the pool closes everything and doesn't reconnect:
+    [pool close];
+    runPoolUntil(^BOOL{ return pool.connections.count == 0 && server->accepted.count == 0; });
+    [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                             beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.3]];
+    CAssertEq(pool.connections.count, 0u);
+    CAssertEq(server->listener.acceptedCount, 4u);
+    [server->listener close];
+}
+
+
+TestCase(BLIPSendWhileConnecting) {
+    // A connection to a host name has no streams until its connect race is won, but it takes
+    // requests as soon as it's opened, and sends them once it's connected:
+    BLIPPoolTestServer *server = [[BLIPPoolTestServer alloc] init];
+    IPAddress *addr = [[IPAddress alloc] initWithHostname: @"localhost"
+                                                     port: server->listener.port];
+    CAssert([addr isKindOfClass: [HostAddress class]]);
+    BLIPConnection *conn = [[BLIPConnection alloc] initToAddress: addr];
+    [conn open];
+    CAssertEq(conn.writer, nil);
+    BLIPResponse *response = [conn sendRequest: [conn request]];
+    CAssert(response);
+    runPoolUntil(^BOOL{ return response.complete; });
+    CAssert(response.error == nil, @"Request failed: %@", response.error);
+    CAssertEqual(response.bodyString, @"ok");
+
+    // So does a pool whose connections are all still connecting:
+    BLIPConnectionPool *pool = [[BLIPConnectionPool alloc] initToAddress: addr size: 2];
+    [pool open];
+    CAssertEq(pool.openCount, 0u);
+    sendAndWait(pool, nil);
+
+    [conn close];
+    [pool close];
+    runPoolUntil(^BOOL{ return server->accepted.count == 0; });
+    [server->listener close];
+}
+
+#endif
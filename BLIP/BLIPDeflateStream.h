@@ -0,0 +1,35 @@
+//
+//  BLIPDeflateStream.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/** Compresses, or decompresses, a series of messages as one continuous DEFLATE stream, so that
+    each message can refer back to text in earlier ones ("context takeover".) Many small messages
+    with similar contents compress far better this way than one at a time.
+    Each message is encoded the same way as in the WebSocket permessage-deflate extension
+    (RFC 7692): raw DEFLATE data, flushed at the end of the message, minus the final
+    00 00 FF FF bytes of the flush. Both ends must process the same messages in the same order. */
+@interface BLIPDeflateStream : NSObject
+
+/** Initializes a stream for compressing (if `compress` is YES) or decompressing. */
+- (id) initForCompression: (BOOL)compress;
+
+@property (readonly) BOOL compressing;
+
+/** Compresses or decompresses the next message. Returns nil if the input is corrupt, or if it
+    would decompress to more than maxOutputSize bytes; the stream can't be used after that. */
+- (NSData*) processBytes: (const void*)bytes length: (size_t)length;
+
+/** The largest message that will be decompressed. Defaults to 1MB. */
+@property size_t maxOutputSize;
+
+/** Statistics: total bytes passed to -processBytes:length:, and total bytes returned. */
+@property (readonly) UInt64 bytesIn, bytesOut;
+
+@end
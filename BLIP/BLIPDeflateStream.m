@@ -0,0 +1,187 @@
+//
+//  BLIPDeflateStream.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "BLIPDeflateStream.h"
+#import "GTMNSData+zlib.h"
+
+#import "Logging.h"
+#import "Test.h"
+#import "CollectionUtils.h"
+
+#include <zlib.h>
+
+
+// The bytes that end every Z_SYNC_FLUSH; they're left off the wire and restored before inflating.
+static const UInt8 kFlushTrailer[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+#define kCompressionLevel 6
+#define kDefaultMaxOutputSize (1<<20)
+
+
+@implementation BLIPDeflateStream
+{
+    z_stream _z;
+    BOOL _compressing, _open, _failed;
+    size_t _maxOutputSize;
+    UInt64 _bytesIn, _bytesOut;
+}
+
+
+- (id) initForCompression: (BOOL)compress
+{
+    self = [super init];
+    if (self != nil) {
+        _compressing = compress;
+        _maxOutputSize = kDefaultMaxOutputSize;
+        // Negative window bits means raw DEFLATE data, with no zlib header or checksum:
+        int err = compress ? deflateInit2(&_z, kCompressionLevel, Z_DEFLATED, -MAX_WBITS,
+                                          8, Z_DEFAULT_STRATEGY)
+                           : inflateInit2(&_z, -MAX_WBITS);
+        if( err != Z_OK ) {
+            Warn(@"BLIPDeflateStream: zlib init failed (%d)", err);
+            return nil;
+        }
+        _open = YES;
+    }
+    return self;
+}
+
+
+- (void) dealloc
+{
+    if( _open ) {
+        if( _compressing )
+            deflateEnd(&_z);
+        else
+            inflateEnd(&_z);
+    }
+}
+
+
+@synthesize compressing=_compressing, maxOutputSize=_maxOutputSize,
+            bytesIn=_bytesIn, bytesOut=_bytesOut;
+
+
+// Runs deflate or inflate over the input until it's all consumed, growing the malloced output
+// buffer as needed. Returns NO on error, or if the output would exceed `maxSize`.
+- (BOOL) _run: (const void*)input length: (size_t)inputLength
+           to: (UInt8**)output used: (size_t*)used capacity: (size_t*)capacity
+      maxSize: (size_t)maxSize
+{
+    _z.next_in = (Bytef*)input;
+    _z.avail_in = (uInt)inputLength;
+    for(;;) {
+        if( *capacity - *used < 64 ) {
+            if( *capacity >= maxSize )
+                return NO;
+            *capacity = MIN(2 * *capacity, maxSize);
+            UInt8 *grown = realloc(*output, *capacity);
+            if( ! grown )
+                return NO;
+            *output = grown;
+        }
+        _z.next_out = *output + *used;
+        _z.avail_out = (uInt)(*capacity - *used);
+        int err = _compressing ? deflate(&_z, Z_SYNC_FLUSH) : inflate(&_z, Z_SYNC_FLUSH);
+        *used = *capacity - _z.avail_out;
+        if( err == Z_BUF_ERROR )
+            err = Z_OK;         // just means no progress was possible
+        if( err != Z_OK )
+            return NO;
+        // Done when all the input is consumed and zlib had output space left over:
+        if( _z.avail_in == 0 && _z.avail_out > 0 )
+            return YES;
+    }
+}
+
+
+- (NSData*) processBytes: (const void*)bytes length: (size_t)length
+{
+    if( _failed )
+        return nil;
+    size_t capacity = _compressing ? deflateBound(&_z, length) + 16 : MAX(4*length, 256u);
+    size_t used = 0;
+    UInt8 *output = malloc(capacity);
+    BOOL ok = output != NULL;
+    if( _compressing ) {
+        ok = ok && [self _run: bytes length: length to: &output used: &used capacity: &capacity
+                      maxSize: SIZE_MAX];
+        // Strip the flush trailer:
+        if( ok && used >= 4 && memcmp(output + used - 4, kFlushTrailer, 4) == 0 )
+            used -= 4;
+    } else {
+        ok = ok && [self _run: bytes length: length to: &output used: &used capacity: &capacity
+                      maxSize: _maxOutputSize]
+                && [self _run: kFlushTrailer length: 4 to: &output used: &used capacity: &capacity
+                      maxSize: _maxOutputSize];
+    }
+    if( ! ok ) {
+        Warn(@"BLIPDeflateStream: %s failed: %s", (_compressing ? "deflate" : "inflate"),
+             (_z.msg ?: "output too large"));
+        free(output);
+        _failed = YES;
+        return nil;
+    }
+    _bytesIn += length;
+    _bytesOut += used;
+    return [[NSData alloc] initWithBytesNoCopy: output length: used freeWhenDone: YES];
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+TestCase(BLIPDeflateStream) {
+    BLIPDeflateStream *deflater = [[BLIPDeflateStream alloc] initForCompression: YES];
+    BLIPDeflateStream *inflater = [[BLIPDeflateStream alloc] initForCompression: NO];
+    CAssert(deflater && inflater);
+
+    // Lots of small, similar JSON messages:
+    const int kNMessages = 1000;
+    size_t rawBytes = 0, gzipBytes = 0;
+    for( int i=0; i<kNMessages; i++ ) {
+        NSData *message = [$sprintf(@"{\"op\":\"get\",\"key\":\"user/%d\",\"fields\":[\"name\","
+                                     "\"email\",\"lastLogin\"],\"seq\":%d}", i*7919 % 10007, i)
+                           dataUsingEncoding: NSUTF8StringEncoding];
+        NSData *compressed = [deflater processBytes: message.bytes length: message.length];
+        CAssert(compressed.length > 0);
+        NSData *decompressed = [inflater processBytes: compressed.bytes length: compressed.length];
+        CAssertEqual(decompressed, message);
+        rawBytes += message.length;
+        gzipBytes += [NSData gtm_dataByGzippingData: message compressionLevel: 5].length;
+    }
+    CAssertEq(deflater.bytesIn, (UInt64)rawBytes);
+    CAssertEq(inflater.bytesOut, (UInt64)rawBytes);
+    CAssert(deflater.bytesOut < rawBytes / 2);
+    Log(@"%d messages: %zu bytes raw, %zu gzipped one at a time, %llu as a deflate stream (%.0f%%)",
+        kNMessages, rawBytes, gzipBytes, deflater.bytesOut, 100.0*deflater.bytesOut/rawBytes);
+
+    // An empty message still round-trips:
+    NSData *empty = [deflater processBytes: "" length: 0];
+    CAssert(empty != nil);
+    CAssertEq([inflater processBytes: empty.bytes length: empty.length].length, 0u);
+
+    // Garbage makes the inflater fail, permanently:
+    const UInt8 kGarbage[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    CAssertEq([inflater processBytes: kGarbage length: sizeof(kGarbage)], (id)nil);
+    CAssertEq([inflater processBytes: empty.bytes length: empty.length], (id)nil);
+
+    // So does a message that inflates to more than the limit:
+    BLIPDeflateStream *smallInflater = [[BLIPDeflateStream alloc] initForCompression: NO];
+    smallInflater.maxOutputSize = 1000;
+    NSData *big = [NSMutableData dataWithLength: 100000];
+    BLIPDeflateStream *deflater2 = [[BLIPDeflateStream alloc] initForCompression: YES];
+    NSData *bigCompressed = [deflater2 processBytes: big.bytes length: big.length];
+    CAssert(bigCompressed.length < 1000);
+    CAssertEq([smallInflater processBytes: bigCompressed.bytes length: bigCompressed.length], (id)nil);
+}
+
+#endif
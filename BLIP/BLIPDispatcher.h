@@ -10,6 +10,14 @@
 @class MYTarget, BLIPMessage;
 
 
+/** Where a dispatcher rule's target runs. */
+typedef enum {
+    kBLIPDispatchInline,        // Synchronously on the connection's thread (the default)
+    kBLIPDispatchSerial,        // On the dispatcher's serial queue, one request at a time
+    kBLIPDispatchConcurrent     // On a concurrent background queue
+} BLIPDispatchPolicy;
+
+
 /** Routes BLIP messages to targets based on a series of rules.
  
     Every BLIPConnection has a BLIPDispatcher, which is initially empty, but you can add rules
@@ -36,6 +44,23 @@
 /** Adds a new rule, to call a given target method if a given predicate matches the message. */
 - (void)addTarget: (MYTarget*)target forPredicate:(NSPredicate*)predicate;
 
+/** Adds a new rule whose target runs according to the given policy.
+    Targets that run off the connection's thread get the request with its response already
+    allocated, so no default response is sent when dispatching returns. The target may respond
+    from whatever thread it's on; the response is handed to the connection's thread to be sent.
+    If it returns without responding or calling -deferResponse, an empty response is sent.
+    Messages that aren't BLIPRequests always run inline. */
+- (void) addTarget: (MYTarget*)target
+      forPredicate: (NSPredicate*)predicate
+            policy: (BLIPDispatchPolicy)policy;
+
+/** Convenience method that adds a rule that compares a property against a string,
+    and runs its target according to the given policy. */
+- (void) addTarget: (MYTarget*)target
+forValueOfProperty: (NSString*)value
+            forKey: (NSString*)key
+            policy: (BLIPDispatchPolicy)policy;
+
 /** Removes all rules with the given target method. */
 - (void) removeTarget: (MYTarget*)target;
 
@@ -10,14 +10,17 @@
 #import "Target.h"
 #import "BLIPRequest.h"
 #import "BLIPProperties.h"
+#import "BLIP_Internal.h"
 #import "Logging.h"
 #import "Test.h"
+#import "ExceptionUtils.h"
 
 
 @implementation BLIPDispatcher
 {
-    NSMutableArray *_predicates, *_targets;
+    NSMutableArray *_predicates, *_targets, *_policies;
     BLIPDispatcher *_parent;
+    dispatch_queue_t _serialQueue;
 }
 
 
@@ -27,6 +30,7 @@
     if (self != nil) {
         _targets = [[NSMutableArray alloc] init];
         _predicates = [[NSMutableArray alloc] init];
+        _policies = [[NSMutableArray alloc] init];
     }
     return self;
 }
@@ -36,10 +40,18 @@
 @synthesize parent=_parent;
 
 
-- (void) addTarget: (MYTarget*)target forPredicate: (NSPredicate*)predicate
+- (void) addTarget: (MYTarget*)target
+      forPredicate: (NSPredicate*)predicate
+            policy: (BLIPDispatchPolicy)policy
 {
     [_targets addObject: target];
     [_predicates addObject: predicate];
+    [_policies addObject: @(policy)];
+}
+
+- (void) addTarget: (MYTarget*)target forPredicate: (NSPredicate*)predicate
+{
+    [self addTarget: target forPredicate: predicate policy: kBLIPDispatchInline];
 }
 
 
@@ -49,17 +61,27 @@
     if( i != NSNotFound ) {
         [_targets removeObjectAtIndex: i];
         [_predicates removeObjectAtIndex: i];
+        [_policies removeObjectAtIndex: i];
     }
 }
 
 
-- (void) addTarget: (MYTarget*)target forValueOfProperty: (NSString*)value forKey: (NSString*)key
+- (void) addTarget: (MYTarget*)target
+forValueOfProperty: (NSString*)value
+            forKey: (NSString*)key
+            policy: (BLIPDispatchPolicy)policy
 {
     [self addTarget:target forPredicate:[NSComparisonPredicate predicateWithLeftExpression: [NSExpression expressionForKeyPath: key]
                                                                            rightExpression: [NSExpression expressionForConstantValue: value]
                                                                                   modifier: NSDirectPredicateModifier
                                                                                       type: NSEqualToPredicateOperatorType
-                                                                                   options: 0]];
+                                                                                   options: 0]
+              policy: policy];
+}
+
+- (void) addTarget: (MYTarget*)target forValueOfProperty: (NSString*)value forKey: (NSString*)key
+{
+    [self addTarget: target forValueOfProperty: value forKey: key policy: kBLIPDispatchInline];
 }
 
 
@@ -77,7 +99,11 @@ static BOOL testPredicate( id predicate, NSDictionary *properties ) {
         if( testPredicate(p, properties) ) {
             MYTarget *target = _targets[i];
             LogTo(BLIP,@"Dispatcher matched %@ -- calling %@",p,target);
-            [target invokeWithSender: message];
+            BLIPDispatchPolicy policy = [_policies[i] intValue];
+            if( policy == kBLIPDispatchInline || ! [message isKindOfClass: [BLIPRequest class]] )
+                [target invokeWithSender: message];
+            else
+                [self _invokeTarget: target withRequest: (BLIPRequest*)message policy: policy];
             return YES;
         }
     }
@@ -85,6 +111,39 @@ static BOOL testPredicate( id predicate, NSDictionary *properties ) {
 }
 
 
+- (void) _invokeTarget: (MYTarget*)target
+           withRequest: (BLIPRequest*)request
+                policy: (BLIPDispatchPolicy)policy
+{
+    dispatch_queue_t queue;
+    if( policy == kBLIPDispatchSerial ) {
+        if( ! _serialQueue )
+            _serialQueue = dispatch_queue_create("BLIPDispatcher", DISPATCH_QUEUE_SERIAL);
+        queue = _serialQueue;
+    } else {
+        queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    }
+
+    // Allocate the response now, on the connection's thread, so the connection won't send a
+    // default response when dispatching returns:
+    [request response];
+    dispatch_async(queue, ^{
+        @try{
+            [target invokeWithSender: request];
+            if( ! request.noReply && ! request.response.sent && ! request._responseDeferred ) {
+                LogTo(BLIP,@"Returning default empty response to %@",request);
+                [request respondWithData: nil contentType: nil];
+            }
+        }@catch( NSException *x ) {
+            MYReportException(x,@"Dispatching BLIP request");
+            // (If the target already responded, it's too late to report the exception.)
+            if( ! request.noReply && ! request.response.sent )
+                [request respondWithException: x];
+        }
+    });
+}
+
+
 - (MYTarget*) asTarget;
 {
     return $target(self,dispatchMessage:);
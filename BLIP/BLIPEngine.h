@@ -0,0 +1,148 @@
+//
+//  BLIPEngine.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "BLIPMessage.h"
+@class BLIPDispatcher, BLIPResponseCache;
+@protocol BLIPEngineDelegate;
+
+
+/** How the transport under a BLIPEngine delimits the data it carries. */
+typedef enum {
+    kBLIPTransport_Stream,          // A byte stream (TCP); frames arrive in arbitrary pieces
+    kBLIPTransport_Messages,        // Discrete messages (WebSocket), each holding whole frames
+} BLIPTransportType;
+
+/** A good size for the buffers passed to -[BLIPEngine writeFramesTo:maxSize:]. */
+#define kBLIPEngineWriteBufferSize 16384
+
+
+/** INTERNAL class that implements the BLIP protocol independently of any transport.
+    It numbers outgoing messages and multiplexes them into frames, reassembles incoming frames
+    into messages and dispatches them, and handles the meta-messages: "Hi" for framing
+    negotiation and "Bye" for the close handshake.
+    BLIPConnection (TCP) and BLIPWebSocket are thin adapters that pass bytes between an engine and
+    their transport, and implement the BLIPMessageSender methods by calling the engine.
+    An engine isn't thread-safe; only call it on the transport's I/O thread. */
+@interface BLIPEngine : NSObject
+
+- (id) initWithDelegate: (id<BLIPEngineDelegate>)delegate
+              transport: (BLIPTransportType)transport;
+
+@property (readonly, weak) id<BLIPEngineDelegate> delegate;
+@property (readonly) BLIPTransportType transport;
+
+/** The dispatcher for incoming requests. Requests it doesn't handle go to the delegate. */
+@property (readonly) BLIPDispatcher *dispatcher;
+
+/** Optional cache of responses to idempotent requests (see BLIPResponseCache.) */
+@property (strong) BLIPResponseCache *responseCache;
+
+/** The class instantiated for incoming requests. Defaults to BLIPRequest. */
+@property (strong) Class requestClass;
+
+/** The frame formats in use in each direction (kBLIPFraming_v1 or _v2.) */
+@property (readonly) int readFramingVersion, writeFramingVersion;
+
+/** Sends a "Hi" offering the newer frame formats. Adapters call this as soon as the transport
+    opens, before anything else is sent. */
+- (void) sendHello;
+
+/** If nonzero, whenever nothing has been received from the peer for this many seconds, a "Ping"
+    meta-request is sent. If no reply arrives within pingTimeout, the delegate is told the peer is
+    unresponsive. Pinging starts with -sendHello. Defaults to zero (off). */
+@property NSTimeInterval pingInterval;
+
+/** How long to wait for the reply to a ping. Defaults to zero, meaning the same as pingInterval. */
+@property NSTimeInterval pingTimeout;
+
+
+// SENDING:
+
+/** Numbers and queues a request; the response, if any, is registered to receive the reply.
+    Returns NO if the engine is closing or disconnected. */
+- (BOOL) sendRequest: (BLIPRequest*)request response: (BLIPResponse*)response;
+
+/** Queues a response to a request from the peer. */
+- (BOOL) sendResponse: (BLIPResponse*)response;
+
+/** Stops sending a request and fails its response. If the request hasn't started going out
+    it's replaced by a placeholder; otherwise a CNCL frame tells the peer to discard it. */
+- (void) cancelRequest: (BLIPRequest*)request;
+
+/** Are there frames waiting to be sent? */
+@property (readonly) BOOL hasFramesToSend;
+
+/** Writes queued frames into `dst` and returns the number of bytes written (0 if there's nothing
+    to send.) Frames are packed into the buffer until it's nearly full, except with v1 framing
+    over a message transport, where each transport message holds exactly one frame.
+    When a frame-format switch is due, the buffer ends right before the first frame in the new
+    format, so the switch lines up with a transport message. */
+- (size_t) writeFramesTo: (UInt8*)dst maxSize: (size_t)maxSize;
+
+/** Total bytes of queued messages that haven't been written yet. */
+@property (readonly) NSUInteger queuedByteCount;
+
+
+// RECEIVING:
+
+/** Processes incoming frames and dispatches any messages they complete.
+    With a stream transport the data may end with a partial frame, which is left unconsumed for
+    the caller to pass in again with more data; with a message transport it must hold only whole
+    frames. Returns the number of bytes consumed, or -1 if the data is invalid. */
+- (ssize_t) receiveBytes: (const void*)bytes length: (size_t)length error: (NSError**)outError;
+
+/** The number of sent requests whose responses haven't finished arriving. */
+@property (readonly) NSUInteger pendingResponseCount;
+
+/** Is the engine waiting for the rest of an incoming request, or for a response? */
+@property (readonly) BOOL isAwaitingFrames;
+
+
+// CLOSING:
+
+/** Asks the peer to close, by sending a "Bye" request. No more requests can be sent unless the
+    peer refuses. The delegate hears the outcome. */
+- (void) sendCloseRequest;
+
+/** YES once a close has been requested, by either side, and not refused. */
+@property (readonly) BOOL closing;
+
+/** Call when the transport has closed. Pending responses fail, and queued messages are dropped. */
+- (void) disconnect;
+
+@end
+
+
+
+/** Callbacks from a BLIPEngine to the transport adapter that owns it. Messages created by the
+    engine use the delegate as their connection. */
+@protocol BLIPEngineDelegate <BLIPMessageSender>
+
+/** Called when frames become available to send after the queue was empty. */
+- (void) blipEngineHasFramesToSend: (BLIPEngine*)engine;
+
+/** Called with an incoming request that the dispatcher didn't handle. Return YES if handled. */
+- (BOOL) blipEngine: (BLIPEngine*)engine receivedRequest: (BLIPRequest*)request;
+
+/** Called when a response to one of my requests is complete, or has failed. */
+- (void) blipEngine: (BLIPEngine*)engine receivedResponse: (BLIPResponse*)response;
+
+/** Called when the peer asks to close. Return NO to refuse with a kBLIPError_Forbidden error. */
+- (BOOL) blipEngineShouldAcceptCloseRequest: (BLIPEngine*)engine;
+
+/** Called once both sides have agreed to close: the transport should close after the engine's
+    remaining frames have been sent. */
+- (void) blipEngineReadyToClose: (BLIPEngine*)engine;
+
+/** Called if the peer refused (or failed to answer) my close request. */
+- (void) blipEngine: (BLIPEngine*)engine closeRequestFailedWithError: (NSError*)error;
+
+/** Called if the peer didn't reply to a ping in time. The transport should be disconnected. */
+- (void) blipEngine: (BLIPEngine*)engine pingFailedWithError: (NSError*)error;
+
+@end
@@ -0,0 +1,1226 @@
+//
+//  BLIPEngine.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "BLIPEngine.h"
+#import "BLIP_Internal.h"
+#import "BLIPDispatcher.h"
+#import "BLIPFrameScanner.h"
+#import "BLIPFileRequest.h"
+
+#import "Logging.h"
+#import "Test.h"
+#import "CollectionUtils.h"
+#import "ExceptionUtils.h"
+
+#import <fcntl.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+
+#define kDefaultFrameSize 4096
+
+// A frame isn't started unless at least this many bytes are left in the output buffer.
+#define kMinCoalescedFrameSize 64
+
+// The most frames decoded per call to BLIPScanFrames.
+#define kMaxFramesPerScan 32
+
+#define kTimeoutTickInterval 0.1
+#define kTimeoutWheelSlots   512
+
+
+@interface BLIPEngine ()
+- (void) _dispatchRequest: (BLIPRequest*)request;
+- (void) _dispatchResponse: (BLIPResponse*)response;
+@end
+
+
+@implementation BLIPEngine
+{
+    __weak id<BLIPEngineDelegate> _delegate;
+    BLIPTransportType _transport;
+    BLIPDispatcher *_dispatcher;
+    BLIPResponseCache *_responseCache;
+    Class _requestClass;
+    MYTimerWheel *_timeoutWheel;
+    BOOL _opened, _closing, _disconnected;
+
+    // Keepalive:
+    NSTimeInterval _pingInterval, _pingTimeout;
+    MYTimer _pingTimer;
+    CFAbsoluteTime _lastReceived;
+    BLIPResponse *_pingResponse;
+
+    // Outgoing:
+    NSMutableArray *_outBox;
+    NSMutableArray *_cancelNumbers;     // numbers of requests to send CNCL frames for
+    UInt32 _numRequestsSent;
+    NSUInteger _queuedByteCount;
+    int _writeFramingVersion, _nextFramingVersion;
+    BLIPMessage *_framingSwitchMessage;
+    BLIPResponse *_helloResponse, *_closeResponse;
+
+    // Incoming:
+    int _readFramingVersion;
+    UInt32 _numRequestsReceived;
+    NSMutableDictionary *_pendingRequests, *_pendingResponses;
+}
+
+
+- (id) initWithDelegate: (id<BLIPEngineDelegate>)delegate
+              transport: (BLIPTransportType)transport
+{
+    self = [super init];
+    if (self != nil) {
+        _delegate = delegate;
+        _transport = transport;
+        _dispatcher = [[BLIPDispatcher alloc] init];
+        _requestClass = [BLIPRequest class];
+        _pendingRequests = [[NSMutableDictionary alloc] init];
+        _pendingResponses = [[NSMutableDictionary alloc] init];
+        _writeFramingVersion = _readFramingVersion = kBLIPFraming_v1;
+    }
+    return self;
+}
+
+
+- (void) dealloc
+{
+    [_timeoutWheel cancelAll];
+    MYTimerCancel(&_pingTimer);
+}
+
+
+@synthesize delegate=_delegate, transport=_transport, dispatcher=_dispatcher,
+            responseCache=_responseCache, requestClass=_requestClass,
+            readFramingVersion=_readFramingVersion, writeFramingVersion=_writeFramingVersion,
+            queuedByteCount=_queuedByteCount, closing=_closing, pingTimeout=_pingTimeout;
+
+
+// The frame header format to use for a framing version on this transport. In a v1 frame that has
+// a transport message to itself, the header leaves out the magic number and size.
+- (int) _frameFormat: (int)version
+{
+    if( version < kBLIPFraming_v2 && _transport == kBLIPTransport_Messages )
+        return kBLIPFraming_v1Message;
+    return version;
+}
+
+
+- (BLIPRequest*) _newRequest
+{
+    return [[_requestClass alloc] _initWithConnection: _delegate body: nil properties: nil];
+}
+
+
+#pragma mark -
+#pragma mark SENDING:
+
+
+- (BOOL) hasFramesToSend
+{
+    return _outBox.count > 0 || _cancelNumbers.count > 0;
+}
+
+
+- (void) _queueMessage: (BLIPMessage*)msg isNew: (BOOL)isNew
+{
+    NSInteger n = _outBox.count, index;
+    if( msg.urgent && n > 1 ) {
+        // High-priority gets queued after the last existing high-priority message,
+        // leaving one regular-priority message in between if possible.
+        for( index=n-1; index>0; index-- ) {
+            BLIPMessage *otherMsg = _outBox[index];
+            if( [otherMsg urgent] ) {
+                index = MIN(index+2, n);
+                break;
+            } else if( isNew && otherMsg._bytesWritten==0 ) {
+                // But have to keep message starts in order
+                index = index+1;
+                break;
+            }
+        }
+        if( index==0 )
+            index = 1;
+    } else {
+        // Regular priority goes at the end of the queue:
+        index = n;
+    }
+    if( ! _outBox )
+        _outBox = [[NSMutableArray alloc] init];
+    [_outBox insertObject: msg atIndex: index];
+
+    if( isNew ) {
+        LogTo(BLIP,@"%@ queuing outgoing %@ at index %li",self,msg,(long)index);
+        if( n==0 && _cancelNumbers.count==0 )
+            [_delegate blipEngineHasFramesToSend: self];
+    }
+}
+
+
+- (BOOL) _queueNewMessage: (BLIPMessage*)message
+{
+    // (Don't assert that the message hasn't been sent: if it was submitted from another thread,
+    // that thread has already marked it as sent.)
+    Assert(message._bytesWritten==0,@"message has already been sent");
+    _queuedByteCount += message._bytesRemaining;
+    [self _queueMessage: message isNew: YES];
+    return YES;
+}
+
+
+- (BOOL) sendRequest: (BLIPRequest*)q response: (BLIPResponse*)response
+{
+    if( _closing || _disconnected ) {
+        Warn(@"%@: Attempt to send a request after the connection has started closing: %@",self,q);
+        return NO;
+    }
+    if( response && [_responseCache _handleRequest: q response: response] )
+        return YES;     // Cache hit, or merged with an identical request in flight
+    [q _assignedNumber: ++_numRequestsSent];
+    if( response ) {
+        [response _assignedNumber: _numRequestsSent];
+        _pendingResponses[$object(_numRequestsSent)] = response;
+        [_responseCache _sentRequest: q response: response];
+        if( q.timeout > 0 )
+            [self _armTimeout: q.timeout forResponse: response];
+    }
+    return [self _queueNewMessage: q];
+}
+
+
+- (BOOL) sendResponse: (BLIPResponse*)response
+{
+    if( _disconnected ) {
+        LogTo(BLIP,@"%@: connection closed before %@ could be sent",self,response);
+        return NO;
+    }
+    return [self _queueNewMessage: response];
+}
+
+
+- (void) cancelRequest: (BLIPRequest*)q
+{
+    BLIPResponse *response = q.noReply ?nil :q.response;
+    if( response.complete )
+        return;         // Too late; nothing left to cancel
+    LogTo(BLIP,@"%@: canceling %@",self,q);
+    if( q.number == 0 )
+        [_responseCache _removeResponse: response];     // Never went over the wire
+    else if( ! _disconnected )
+        [self _cancelOutgoingRequest: q];
+    if( response ) {
+        [_pendingResponses removeObjectForKey: $object(response.number)];
+        [response _failWithError: BLIPMakeError(kBLIPError_Cancelled, @"Request was canceled")];
+        [self _dispatchResponse: response];
+    }
+}
+
+- (void) _cancelOutgoingRequest: (BLIPRequest*)q
+{
+    NSUInteger index = [_outBox indexOfObjectIdenticalTo: q];
+    if( index != NSNotFound ) {
+        _queuedByteCount -= MIN(_queuedByteCount, q._bytesRemaining);
+        if( q._bytesWritten == 0 ) {
+            // Peer hasn't seen any of it, so it can just be sent as a tiny placeholder:
+            LogTo(BLIP,@"%@: canceling %@ before sending it",self,q);
+            [q _cancelBeforeSending];
+            _queuedByteCount += q._bytesRemaining;
+            return;
+        }
+        [_outBox removeObjectAtIndex: index];
+    }
+
+    // Tell the peer to discard what it has of the request, and not to bother replying:
+    LogTo(BLIP,@"%@: sending cancel of %@",self,q);
+    BOOL wasIdle = !self.hasFramesToSend;
+    if( ! _cancelNumbers )
+        _cancelNumbers = [[NSMutableArray alloc] init];
+    [_cancelNumbers addObject: $object(q.number)];
+    if( wasIdle )
+        [_delegate blipEngineHasFramesToSend: self];
+}
+
+
+// Gives up on a request that can't produce the rest of its body. The peer is told to discard what
+// it's received, just as if the request were canceled, and the response fails with the error.
+// (Called from -writeFramesTo:maxSize:, after the request has been taken off the queue.)
+- (void) _abortOutgoingRequest: (BLIPRequest*)q error: (NSError*)error
+{
+    LogTo(BLIP,@"%@: aborting %@: %@",self,q,error);
+    _queuedByteCount -= MIN(_queuedByteCount, q._bytesRemaining);
+    if( q._bytesWritten == 0 ) {
+        // The peer hasn't seen it, but it has to get something with its number:
+        [q _cancelBeforeSending];
+        _queuedByteCount += q._bytesRemaining;
+        [self _queueMessage: q isNew: NO];
+    } else {
+        if( ! _cancelNumbers )
+            _cancelNumbers = [[NSMutableArray alloc] init];
+        [_cancelNumbers addObject: $object(q.number)];
+    }
+    BLIPResponse *response = _pendingResponses[$object(q.number)];
+    if( response ) {
+        [_pendingResponses removeObjectForKey: $object(q.number)];
+        [response _failWithError: error];
+        [self _dispatchResponse: response];
+    }
+}
+
+
+// Drops the remaining frames of my response to the peer's request, because the peer canceled it.
+- (void) _cancelResponseNumber: (UInt32)number
+{
+    NSUInteger n = _outBox.count;
+    for( NSUInteger i=0; i<n; i++ ) {
+        BLIPMessage *msg = _outBox[i];
+        if( msg.number == number && [msg isKindOfClass: [BLIPResponse class]] ) {
+            LogTo(BLIP,@"%@: peer canceled request; dropping %@",self,msg);
+            _queuedByteCount -= MIN(_queuedByteCount, msg._bytesRemaining);
+            [_outBox removeObjectAtIndex: i];
+            break;
+        }
+    }
+}
+
+
+- (size_t) writeFramesTo: (UInt8*)dst maxSize: (size_t)maxSize
+{
+    int format = [self _frameFormat: _writeFramingVersion];
+    BOOL coalesce = (format != kBLIPFraming_v1Message);
+    size_t length = 0;
+
+    // Cancellations go first; they're just headers:
+    while( _cancelNumbers.count > 0 && maxSize - length >= kBLIPMaxFrameHeaderSize ) {
+        UInt32 number = [_cancelNumbers[0] unsignedIntValue];
+        [_cancelNumbers removeObjectAtIndex: 0];
+        length += BLIPEncodeFrameHeader(dst + length, format, number, kBLIP_CNCL, 0);
+        if( ! coalesce )
+            return length;
+    }
+
+    while( _outBox.count > 0 && maxSize - length >= kMinCoalescedFrameSize ) {
+        // Pop first message in queue:
+        BLIPMessage *msg = _outBox[0];
+        [_outBox removeObjectAtIndex: 0];
+
+        // As an optimization, allow message to send a big frame unless there's a higher-priority
+        // message right behind it:
+        size_t frameSize = kDefaultFrameSize;
+        if( msg.urgent || _outBox.count==0 || ! [_outBox[0] urgent] )
+            frameSize *= 4;
+        frameSize = MIN(frameSize, maxSize - length);
+
+        NSInteger bytesWrittenBefore = msg._bytesWritten;
+        BOOL moreComing = NO;
+        size_t frameLength = [msg _writeFrameTo: dst + length
+                                        maxSize: frameSize
+                                 framingVersion: format
+                                     moreComing: &moreComing];
+        length += frameLength;
+        _queuedByteCount -= MIN(_queuedByteCount, (NSUInteger)(msg._bytesWritten - bytesWrittenBefore));
+        LogTo(BLIPVerbose,@"%@: Sending frame of %@",self, msg);
+        if( msg._writeError && msg.isMine && [msg isKindOfClass: [BLIPRequest class]] ) {
+            [self _abortOutgoingRequest: (BLIPRequest*)msg error: msg._writeError];
+        } else if( moreComing ) {
+            // add it back so it can send its next frame later:
+            [self _queueMessage: msg isNew: NO];
+            if( frameLength == 0 )
+                break;  // its frame didn't fit in what's left of the buffer
+        } else if( msg == _framingSwitchMessage ) {
+            LogTo(BLIP,@"%@ switching to v%d framing",self,_nextFramingVersion);
+            _writeFramingVersion = _nextFramingVersion;
+            _framingSwitchMessage = nil;
+            break;      // the next frame is in the new format
+        }
+        if( ! coalesce )
+            break;      // one frame per transport message
+    }
+    if( length == 0 )
+        LogTo(BLIPVerbose,@"%@: no more work for writer",self);
+    return length;
+}
+
+
+#pragma mark -
+#pragma mark TIMEOUTS:
+
+
+- (void) _armTimeout: (NSTimeInterval)timeout forResponse: (BLIPResponse*)response
+{
+    if( ! _timeoutWheel )
+        _timeoutWheel = [[MYTimerWheel alloc] initWithTickInterval: kTimeoutTickInterval
+                                                             slots: kTimeoutWheelSlots];
+    MYTimer *timer = response._timeoutTimer;
+    timer->target = self;
+    timer->action = @selector(_responseTimedOut:);
+    timer->context = response;
+    [_timeoutWheel arm: timer after: timeout];
+}
+
+
+- (void) _responseTimedOut: (MYTimer*)timer
+{
+    BLIPResponse *response = timer->context;
+    LogTo(BLIP,@"%@: timed out waiting for %@",self,response);
+    [_pendingResponses removeObjectForKey: $object(response.number)];
+    [response _failWithError: BLIPMakeError(kBLIPError_Timeout,
+                                            @"Timed out waiting for response")];
+    [self _dispatchResponse: response];
+}
+
+
+#pragma mark -
+#pragma mark RECEIVING FRAMES:
+
+
+- (NSUInteger) pendingResponseCount
+{
+    return _pendingResponses.count;
+}
+
+- (BOOL) isAwaitingFrames
+{
+    return _pendingRequests.count > 0 || _pendingResponses.count > 0;
+}
+
+
+static BOOL gotError( NSError *error, NSError **outError ) {
+    if( outError )
+        *outError = error;
+    return NO;
+}
+
+
+- (ssize_t) receiveBytes: (const void*)bytes length: (size_t)length error: (NSError**)outError
+{
+    const UInt8 *start = bytes;
+    if( _pingInterval > 0 )
+        _lastReceived = CFAbsoluteTimeGetCurrent();
+    if( [self _frameFormat: _readFramingVersion] == kBLIPFraming_v1Message ) {
+        // The transport message is exactly one frame, with a short header:
+        if( length < kBLIPWebSocketFrameHeaderSize
+                || length - kBLIPWebSocketFrameHeaderSize > UINT16_MAX ) {
+            Warn(@"%@ received a message that isn't a valid frame",self);
+            gotError(BLIPMakeError(kBLIPError_BadData, @"Invalid frame header"), outError);
+            return -1;
+        }
+        const BLIPWebSocketFrameHeader *header = bytes;
+        BLIPFrameDescriptor frame = {
+            .number     = NSSwapBigIntToHost(header->number),
+            .flags      = NSSwapBigShortToHost(header->flags),
+            .bodySize   = (UInt16)(length - kBLIPWebSocketFrameHeaderSize),
+            .bodyOffset = kBLIPWebSocketFrameHeaderSize
+        };
+        if( ! [self _receivedFrame: &frame in: start error: outError] )
+            return -1;
+        return length;
+    }
+
+    // Decode all the complete frames, a batch at a time:
+    BLIPFrameDescriptor frames[kMaxFramesPerScan];
+    size_t pos = 0;
+    ssize_t nFrames;
+    BOOL rescan;
+    do {
+        int version = _readFramingVersion;
+        size_t consumed;
+        if( version >= kBLIPFraming_v2 )
+            nFrames = BLIPScanFramesV2(start + pos, length - pos, frames, kMaxFramesPerScan, &consumed);
+        else
+            nFrames = BLIPScanFrames(start + pos, length - pos, frames, kMaxFramesPerScan, &consumed);
+        if( nFrames < 0 ) {
+            Warn(@"%@ read bogus frame header",self);
+            gotError(BLIPMakeError(kBLIPError_BadData, @"Invalid frame header"), outError);
+            return -1;
+        }
+        rescan = NO;
+        size_t base = pos;
+        for( ssize_t i=0; i<nFrames; i++ ) {
+            if( ! [self _receivedFrame: &frames[i] in: start + base error: outError] )
+                return -1;
+            pos = base + frames[i].bodyOffset + frames[i].bodySize;
+            if( _disconnected )
+                return pos;     // a handler closed the connection
+            if( _readFramingVersion != version ) {
+                // The frame format changed, so the rest of the batch was decoded wrongly:
+                rescan = YES;
+                break;
+            }
+        }
+    } while( rescan || nFrames == kMaxFramesPerScan );
+    return pos;
+}
+
+
+- (BOOL) _receivedFrame: (const BLIPFrameDescriptor*)frame
+                     in: (const UInt8*)buffer
+                  error: (NSError**)outError
+{
+    static const char* kTypeStrs[16] = {"MSG","RPY","ERR","CNCL","4??","5??","6??","7??"};
+    BLIPMessageType type = frame->flags & kBLIP_TypeMask;
+    LogTo(BLIPVerbose,@"%@ rcvd frame of %s #%u, length %u",self,kTypeStrs[type],(unsigned int)frame->number,(unsigned)frame->bodySize);
+
+    // Messages copy what they need out of the frame, so it doesn't need its own buffer:
+    NSData *body = [[NSData alloc] initWithBytesNoCopy: (void*)(buffer + frame->bodyOffset)
+                                                length: frame->bodySize
+                                          freeWhenDone: NO];
+    id key = $object(frame->number);
+    BOOL complete = ! (frame->flags & kBLIP_MoreComing);
+    switch(type) {
+        case kBLIP_MSG: {
+            // Incoming request:
+            BLIPRequest *request = _pendingRequests[key];
+            if( request ) {
+                // Continuation frame of a request:
+                if( complete ) {
+                    [_pendingRequests removeObjectForKey: key];
+                }
+            } else if( frame->number == _numRequestsReceived+1 ) {
+                // Next new request:
+                request = [[_requestClass alloc] _initWithConnection: _delegate
+                                                              isMine: NO
+                                                               flags: frame->flags | kBLIP_MoreComing
+                                                              number: frame->number
+                                                                body: nil];
+                if( ! complete )
+                    _pendingRequests[key] = request;
+                _numRequestsReceived++;
+            } else
+                return gotError(BLIPMakeError(kBLIPError_BadFrame,
+                                              @"Received bad request frame #%u (next is #%u)",
+                                              (unsigned int)frame->number,
+                                              (unsigned)_numRequestsReceived+1), outError);
+
+            if( ! [request _receivedFrameWithFlags: frame->flags body: body] )
+                return gotError(BLIPMakeError(kBLIPError_BadFrame,
+                                              @"Couldn't parse message frame"), outError);
+
+            if( complete )
+                [self _dispatchRequest: request];
+            break;
+        }
+
+        case kBLIP_RPY:
+        case kBLIP_ERR: {
+            BLIPResponse *response = _pendingResponses[key];
+            if( response ) {
+                if( complete ) {
+                    [_pendingResponses removeObjectForKey: key];
+                }
+
+                if( ! [response _receivedFrameWithFlags: frame->flags body: body] ) {
+                    return gotError(BLIPMakeError(kBLIPError_BadFrame,
+                                                  @"Couldn't parse response frame"), outError);
+                } else if( complete )
+                    [self _dispatchResponse: response];
+
+            } else {
+                if( frame->number <= _numRequestsSent )
+                    LogTo(BLIP,@"??? %@ got unexpected response frame to my msg #%u",
+                          self,(unsigned int)frame->number); //benign
+                else
+                    return gotError(BLIPMakeError(kBLIPError_BadFrame,
+                                                  @"Bogus message number %u in response",
+                                                  (unsigned int)frame->number), outError);
+            }
+            break;
+        }
+
+        case kBLIP_CNCL: {
+            // Peer canceled one of its requests; free whatever's been buffered of it,
+            // and stop sending my response if it's underway:
+            BLIPRequest *request = _pendingRequests[key];
+            if( request ) {
+                LogTo(BLIP,@"%@: peer canceled incoming %@",self,request);
+                [_pendingRequests removeObjectForKey: key];
+            }
+            [self _cancelResponseNumber: frame->number];
+            break;
+        }
+
+        default:
+            // To leave room for future expansion, undefined message types are just ignored.
+            Log(@"??? %@ received header with unknown message type %i", self,type);
+            break;
+    }
+    return YES;
+}
+
+
+#pragma mark -
+#pragma mark DISPATCHING:
+
+
+- (BOOL) _dispatchMetaRequest: (BLIPRequest*)request
+{
+    NSString* profile = request.profile;
+    if( [profile isEqualToString: kBLIPProfile_Bye] ) {
+        [self _handleCloseRequest: request];
+        return YES;
+    } else if( [profile isEqualToString: kBLIPProfile_Cancel] ) {
+        return YES;     // Placeholder for a request the peer canceled before sending; ignore it
+    } else if( [profile isEqualToString: kBLIPProfile_Hi] ) {
+        [self _handleHello: request];
+        return YES;
+    } else if( [profile isEqualToString: kBLIPProfile_Ping] ) {
+        return YES;     // The default empty reply is all a ping needs
+    }
+    return NO;
+}
+
+
+- (void) _dispatchRequest: (BLIPRequest*)request
+{
+    LogTo(BLIP,@"Received all of %@",request.descriptionWithProperties);
+    @try{
+        BOOL handled;
+        if( request._flags & kBLIP_Meta )
+            handled =[self _dispatchMetaRequest: request];
+        else {
+            handled = [_dispatcher dispatchMessage: request];
+            if( ! handled )
+                handled = [_delegate blipEngine: self receivedRequest: request];
+        }
+
+        if (!handled) {
+            LogTo(BLIP,@"No handler found for incoming %@",request);
+            [request respondWithErrorCode: kBLIPError_NotFound message: @"No handler was found"];
+        } else if( ! request.noReply && ! request.repliedTo ) {
+            LogTo(BLIP,@"Returning default empty response to %@",request);
+            [request respondWithData: nil contentType: nil];
+        }
+    }@catch( NSException *x ) {
+        MYReportException(x,@"Dispatching BLIP request");
+        [request respondWithException: x];
+    }
+}
+
+- (void) _dispatchResponse: (BLIPResponse*)response
+{
+    if( response == _helloResponse ) {
+        _helloResponse = nil;
+        [self _receivedHelloResponse: response];
+        return;
+    } else if( response == _closeResponse ) {
+        _closeResponse = nil;
+        [self _receivedCloseResponse: response];
+        return;
+    } else if( response == _pingResponse ) {
+        _pingResponse = nil;
+        [self _receivedPingResponse: response];
+        return;
+    }
+    LogTo(BLIP,@"Received all of %@",response);
+    [_delegate blipEngine: self receivedResponse: response];
+}
+
+
+#pragma mark -
+#pragma mark FRAMING NEGOTIATION:
+
+
+/* Each peer opens with an urgent "Hi" meta-request listing the frame formats it can read. A peer
+   that can write one of the newer ones says so in its reply, and switches to it right after
+   the reply, so the greeter's reader knows exactly which frame is the first in the new format.
+   The two directions are negotiated separately. A peer that predates this replies to "Hi" with
+   a NotFound error, and both directions stay with v1. */
+- (void) sendHello
+{
+    BLIPRequest *hello = [self _newRequest];
+    [hello _setFlag: kBLIP_Meta value: YES];
+    hello.urgent = YES;
+    hello.profile = kBLIPProfile_Hi;
+    [hello setValue: @"1,2" ofProperty: kBLIPHelloVersionsProperty];
+    _helloResponse = [hello send];
+    _opened = YES;
+    _lastReceived = CFAbsoluteTimeGetCurrent();
+    [self _schedulePing];
+}
+
+- (void) _handleHello: (BLIPRequest*)request
+{
+    NSArray *versions = [[request valueOfProperty: kBLIPHelloVersionsProperty]
+                                componentsSeparatedByString: @","];
+    BLIPResponse *response = request.response;
+    if( [versions containsObject: @"2"] ) {
+        LogTo(BLIP,@"%@: peer reads v2 frames; switching after replying",self);
+        [response setValue: @"2" ofProperty: kBLIPHelloVersionProperty];
+        // (Has to be set up before sending, since the reply may be written immediately.)
+        _nextFramingVersion = kBLIPFraming_v2;
+        _framingSwitchMessage = response;
+    }
+    [response send];
+}
+
+- (void) _receivedHelloResponse: (BLIPResponse*)response
+{
+    if( response.error ) {
+        LogTo(BLIP,@"%@: no answer to Hi (%@); staying with v1 frames",self,response.error);
+    } else if( [[response valueOfProperty: kBLIPHelloVersionProperty] isEqualToString: @"2"] ) {
+        // The peer's frames after this one will be in the v2 format:
+        LogTo(BLIP,@"%@: peer is switching to v2 frames",self);
+        _readFramingVersion = kBLIPFraming_v2;
+    }
+}
+
+
+#pragma mark -
+#pragma mark KEEPALIVE:
+
+
+- (NSTimeInterval) pingInterval
+{
+    return _pingInterval;
+}
+
+- (void) setPingInterval: (NSTimeInterval)interval
+{
+    _pingInterval = interval;
+    if( _opened )
+        [self _schedulePing];
+}
+
+
+// The ping timer isn't re-armed as data arrives; when it fires it checks how long it's been,
+// so an active connection costs nothing but reading the clock.
+- (void) _schedulePing
+{
+    if( _pingInterval <= 0 || _disconnected ) {
+        MYTimerCancel(&_pingTimer);
+        return;
+    }
+    // (If it's already been idle longer than the interval, ping as soon as possible.)
+    NSTimeInterval idle = CFAbsoluteTimeGetCurrent() - _lastReceived;
+    _pingTimer.target = self;
+    _pingTimer.action = @selector(_pingTimerFired:);
+    [[MYTimerWheel sharedWheel] arm: &_pingTimer after: MAX(0.0, _pingInterval - idle)];
+}
+
+- (void) _pingTimerFired: (MYTimer*)timer
+{
+    NSTimeInterval idle = CFAbsoluteTimeGetCurrent() - _lastReceived;
+    if( idle >= _pingInterval && !_pingResponse && !_closing && !_disconnected ) {
+        LogTo(BLIP,@"%@: nothing received for %.1f sec; pinging",self,idle);
+        BLIPRequest *ping = [self _newRequest];
+        [ping _setFlag: kBLIP_Meta value: YES];
+        ping.urgent = YES;
+        ping.profile = kBLIPProfile_Ping;
+        ping.timeout = (_pingTimeout > 0) ? _pingTimeout : _pingInterval;
+        _pingResponse = [ping send];
+        _lastReceived = CFAbsoluteTimeGetCurrent();     // (so the next ping waits a full interval)
+    }
+    [self _schedulePing];
+}
+
+- (void) _receivedPingResponse: (BLIPResponse*)response
+{
+    // Any reply shows the peer's alive, even an error from one that doesn't know about pings:
+    NSError *error = response.error;
+    if( error.code == kBLIPError_Timeout && [error.domain isEqualToString: BLIPErrorDomain]
+            && !_disconnected ) {
+        LogTo(BLIP,@"%@: peer didn't answer ping",self);
+        [_delegate blipEngine: self pingFailedWithError: error];
+    }
+}
+
+
+#pragma mark -
+#pragma mark CLOSING:
+
+
+- (void) sendCloseRequest
+{
+    if( _closing || _disconnected )
+        return;
+    LogTo(BLIPVerbose,@"Sending close request...");
+    BLIPRequest *r = [self _newRequest];
+    [r _setFlag: kBLIP_Meta value: YES];
+    r.profile = kBLIPProfile_Bye;
+    _closeResponse = [r send];
+    // Prevent the client from sending any more requests:
+    _closing = YES;
+}
+
+- (void) _receivedCloseResponse: (BLIPResponse*)response
+{
+    NSError *error = response.error;
+    LogTo(BLIPVerbose,@"Received close response: error=%@",error);
+    if( error ) {
+        _closing = NO;
+        [_delegate blipEngine: self closeRequestFailedWithError: error];
+    } else {
+        [_delegate blipEngineReadyToClose: self];
+    }
+}
+
+
+- (void) _handleCloseRequest: (BLIPRequest*)request
+{
+    LogTo(BLIPVerbose,@"Received a close request");
+    if( ! [_delegate blipEngineShouldAcceptCloseRequest: self] ) {
+        LogTo(BLIPVerbose,@"Responding with denial of close request");
+        [request respondWithErrorCode: kBLIPError_Forbidden message: @"Close request denied"];
+        return;
+    }
+    LogTo(BLIPVerbose,@"Close request accepted");
+    // Queue the reply first, so the transport sends it before closing:
+    [request respondWithData: nil contentType: nil];
+    _closing = YES;
+    [_delegate blipEngineReadyToClose: self];
+}
+
+
+- (void) disconnect
+{
+    if( _disconnected )
+        return;
+    _disconnected = YES;
+    MYTimerCancel(&_pingTimer);
+    [_outBox makeObjectsPerformSelector: @selector(_connectionClosed) withObject: nil];
+    _outBox = nil;
+    _cancelNumbers = nil;
+    _queuedByteCount = 0;
+    [_pendingRequests removeAllObjects];
+    NSArray *responses = _pendingResponses.allValues;
+    [_pendingResponses removeAllObjects];
+    for( BLIPResponse *response in responses ) {
+        [response _connectionClosed];
+        [self _dispatchResponse: response];
+    }
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+/* The BLIP conformance suite: two engines talking to each other through an in-memory transport,
+   run once for each transport type. A stream transport delivers bytes in random-sized pieces, like
+   TCP; a message transport delivers each buffer the engine wrote as a unit, like WebSocket. */
+
+@interface BLIPTestPeer : NSObject <BLIPEngineDelegate>
+{
+    @public
+    BLIPEngine *engine;
+    __weak BLIPTestPeer *peer;
+    NSMutableData *inBuffer;                // received but not yet consumed (stream transport)
+    NSMutableArray *responses;
+    NSUInteger requestsReceived, writes, bytesWritten;
+    BOOL acceptClose, readyToClose;
+    NSError *closeError, *pingError, *error;
+}
+@end
+
+@implementation BLIPTestPeer
+
+- (id) initWithTransport: (BLIPTransportType)transport {
+    self = [super init];
+    if (self) {
+        engine = [[BLIPEngine alloc] initWithDelegate: self transport: transport];
+        inBuffer = [NSMutableData data];
+        responses = [NSMutableArray array];
+        acceptClose = YES;
+    }
+    return self;
+}
+
+- (NSError*) error                                          {return error;}
+- (BOOL) _sendRequest: (BLIPRequest*)q response: (BLIPResponse*)response {
+    return [engine sendRequest: q response: response];
+}
+- (BOOL) _sendResponse: (BLIPResponse*)response             {return [engine sendResponse: response];}
+- (void) _cancelRequest: (BLIPRequest*)q                    {[engine cancelRequest: q];}
+
+- (void) blipEngineHasFramesToSend: (BLIPEngine*)e          { }
+- (BOOL) blipEngine: (BLIPEngine*)e receivedRequest: (BLIPRequest*)request {
+    requestsReceived++;
+    if( [request.profile isEqualToString: @"Echo"] ) {
+        [request respondWithData: request.body contentType: request.contentType];
+        return YES;
+    }
+    return [request.profile isEqualToString: @"Sink"];
+}
+- (void) blipEngine: (BLIPEngine*)e receivedResponse: (BLIPResponse*)response {
+    [responses addObject: response];
+}
+- (BOOL) blipEngineShouldAcceptCloseRequest: (BLIPEngine*)e {return acceptClose;}
+- (void) blipEngineReadyToClose: (BLIPEngine*)e             {readyToClose = YES;}
+- (void) blipEngine: (BLIPEngine*)e closeRequestFailedWithError: (NSError*)err {closeError = err;}
+- (void) blipEngine: (BLIPEngine*)e pingFailedWithError: (NSError*)err {pingError = err;}
+
+- (BLIPResponse*) send: (NSString*)profile body: (NSData*)body {
+    BLIPRequest *q = [BLIPRequest requestWithBody: body properties: @{@"Profile": profile}];
+    q.connection = self;
+    return [q send];
+}
+
+// Writes one buffer of frames and delivers it to the peer. Returns NO if there was nothing to send.
+- (BOOL) writeOnce {
+    UInt8 buffer[kBLIPEngineWriteBufferSize];
+    size_t length = [engine writeFramesTo: buffer maxSize: sizeof(buffer)];
+    if( length == 0 )
+        return NO;
+    writes++;
+    bytesWritten += length;
+    BLIPTestPeer *to = peer;
+    NSError *err;
+    if( engine.transport == kBLIPTransport_Messages ) {
+        ssize_t consumed = [to->engine receiveBytes: buffer length: length error: &err];
+        Assert(consumed == (ssize_t)length, @"Message not fully consumed: %@", err);
+    } else {
+        // Deliver it in random pieces, the way a socket might:
+        size_t pos = 0;
+        while( pos < length ) {
+            size_t n = MIN(length - pos, 1 + (size_t)random() % 3000);
+            [to->inBuffer appendBytes: buffer + pos length: n];
+            pos += n;
+            ssize_t consumed = [to->engine receiveBytes: to->inBuffer.bytes
+                                                 length: to->inBuffer.length error: &err];
+            Assert(consumed >= 0, @"Stream rejected: %@", err);
+            [to->inBuffer replaceBytesInRange: NSMakeRange(0, consumed) withBytes: NULL length: 0];
+        }
+    }
+    return YES;
+}
+
+@end
+
+
+// Runs both directions until neither peer has anything left to send.
+static void pump( BLIPTestPeer *a, BLIPTestPeer *b ) {
+    BOOL a_wrote, b_wrote;
+    do {
+        a_wrote = [a writeOnce];
+        b_wrote = [b writeOnce];
+    } while( a_wrote || b_wrote );
+}
+
+static void makePeers( BLIPTransportType transport, BOOL hello,
+                       BLIPTestPeer **outA, BLIPTestPeer **outB ) {
+    BLIPTestPeer *a = [[BLIPTestPeer alloc] initWithTransport: transport];
+    BLIPTestPeer *b = [[BLIPTestPeer alloc] initWithTransport: transport];
+    a->peer = b;
+    b->peer = a;
+    if( hello ) {
+        [a->engine sendHello];
+        [b->engine sendHello];
+        pump(a, b);
+    }
+    *outA = a;
+    *outB = b;
+}
+
+static NSData* testBody( size_t size ) {
+    NSMutableData *body = [NSMutableData dataWithLength: size];
+    for( size_t i=0; i<size; i++ )
+        ((UInt8*)body.mutableBytes)[i] = (UInt8)(i*7 % 253);
+    return body;
+}
+
+
+static void runConformance( BLIPTransportType transport ) {
+    const char *name = (transport == kBLIPTransport_Stream) ?"stream" :"messages";
+    Log(@"---- BLIP conformance over %s transport", name);
+    srandom(42);
+    BLIPTestPeer *a, *b;
+
+    // Framing negotiation: both directions switch to v2, and nothing leaks to the delegates.
+    makePeers(transport, YES, &a, &b);
+    CAssertEq(a->engine.writeFramingVersion, kBLIPFraming_v2);
+    CAssertEq(a->engine.readFramingVersion, kBLIPFraming_v2);
+    CAssertEq(b->engine.writeFramingVersion, kBLIPFraming_v2);
+    CAssertEq(b->engine.readFramingVersion, kBLIPFraming_v2);
+    CAssertEq(a->requestsReceived, 0u);
+    CAssertEq(a->responses.count, 0u);
+
+    // Echo, with sizes from empty to many frames, some urgent and some compressed:
+    const size_t kSizes[] = {0, 1, 100, 4000, 20000, 150000};
+    NSMutableArray *sent = [NSMutableArray array];
+    for( int i=0; i<36; i++ ) {
+        NSData *body = testBody(kSizes[i % 6]);
+        BLIPRequest *q = [BLIPRequest requestWithBody: body properties: @{@"Profile": @"Echo"}];
+        q.connection = a;
+        q.urgent = (i % 4 == 0);
+        q.compressed = (i % 5 == 0);
+        [sent addObject: @[[q send], body]];
+    }
+    pump(a, b);
+    CAssertEq(b->requestsReceived, 36u);
+    CAssertEq(a->responses.count, 36u);
+    for( NSArray *pair in sent ) {
+        BLIPResponse *response = pair[0];
+        CAssert(response.complete);
+        CAssert(response.error == nil);
+        CAssertEqual(response.body, pair[1]);
+    }
+    CAssertEq(a->engine.pendingResponseCount, 0u);
+    CAssertEq(a->engine.queuedByteCount, 0u);
+
+    // A request nobody handles gets a 404; a no-reply request gets nothing back:
+    [a->responses removeAllObjects];
+    BLIPResponse *r404 = [a send: @"Nonexistent" body: nil];
+    BLIPRequest *noReply = [BLIPRequest requestWithBody: testBody(10) properties: @{@"Profile": @"Sink"}];
+    noReply.connection = a;
+    noReply.noReply = YES;
+    CAssert([noReply send] == nil);
+    pump(a, b);
+    CAssertEq(r404.error.code, kBLIPError_NotFound);
+    CAssertEq(a->responses.count, 1u);
+    CAssertEq(b->requestsReceived, 38u);
+
+    // Canceling a request partway through: the peer drops it, and later requests still work.
+    [a->responses removeAllObjects];
+    BLIPResponse *big = [a send: @"Echo" body: testBody(200000)];
+    [a writeOnce];
+    [big.request cancel];
+    CAssertEq(big.error.code, kBLIPError_Cancelled);
+    BLIPResponse *after = [a send: @"Echo" body: testBody(50)];
+    pump(a, b);
+    CAssertEq(b->requestsReceived, 39u);                    // only the one after
+    CAssertEqual(after.body, testBody(50));
+    CAssertEq(a->responses.count, 2u);
+
+    // Close handshake, refused and then accepted:
+    b->acceptClose = NO;
+    [a->engine sendCloseRequest];
+    CAssert(a->engine.closing);
+    pump(a, b);
+    CAssertEq(a->closeError.code, kBLIPError_Forbidden);
+    CAssert(!a->engine.closing && !a->readyToClose);
+    b->acceptClose = YES;
+    [a->engine sendCloseRequest];
+    CAssert([a send: @"Echo" body: nil] == nil);            // can't send while closing
+    pump(a, b);
+    CAssert(a->readyToClose && b->readyToClose);
+    CAssert(b->engine.closing);
+
+    // Disconnecting fails responses that are still pending:
+    makePeers(transport, YES, &a, &b);
+    BLIPResponse *orphan = [a send: @"Echo" body: testBody(100)];
+    [a->engine disconnect];
+    CAssertEq(orphan.error.code, kBLIPError_Disconnected);
+
+    // Without the Hi exchange, both directions stay with v1 and still work:
+    makePeers(transport, NO, &a, &b);
+    BLIPResponse *v1 = [a send: @"Echo" body: testBody(30000)];
+    pump(a, b);
+    CAssertEq(a->engine.writeFramingVersion, kBLIPFraming_v1);
+    CAssertEqual(v1.body, testBody(30000));
+
+    // Garbage is rejected:
+    makePeers(transport, NO, &a, &b);
+    const UInt8 kGarbage[16] = {0xDE, 0xAD, 0xBE, 0xEF, 0, 0, 0, 9, 0, 0, 0, 3};
+    NSError *error;
+    CAssertEq([b->engine receiveBytes: kGarbage length: sizeof(kGarbage) error: &error], -1);
+    CAssertEqual(error.domain, BLIPErrorDomain);
+}
+
+TestCase(BLIPEngineConformance) {
+    runConformance(kBLIPTransport_Stream);
+    runConformance(kBLIPTransport_Messages);
+}
+
+
+// Runs the run loop for a while, moving frames between the peers if `deliver` is set. Returns early
+// if `a` decides its peer is unresponsive.
+static void runPeers( BLIPTestPeer *a, BLIPTestPeer *b, NSTimeInterval duration, BOOL deliver ) {
+    NSDate *end = [NSDate dateWithTimeIntervalSinceNow: duration];
+    while( !a->pingError && [end timeIntervalSinceNow] > 0 ) {
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+        if( deliver )
+            pump(a, b);
+    }
+}
+
+TestCase(BLIPEnginePing) {
+    BLIPTestPeer *a, *b;
+    makePeers(kBLIPTransport_Stream, YES, &a, &b);
+    a->engine.pingInterval = 0.5;
+
+    // While the peer answers, pings go back and forth without reaching the delegates:
+    NSUInteger writesBefore = a->writes;
+    runPeers(a, b, 2.5, YES);
+    CAssert(a->pingError == nil);
+    CAssert(a->writes > writesBefore, @"No pings were sent");
+    CAssertEq(b->requestsReceived, 0u);
+    CAssertEq(a->responses.count, 0u);
+
+    // Once the peer stops reading, a ping goes unanswered:
+    CFAbsoluteTime stalledAt = CFAbsoluteTimeGetCurrent();
+    runPeers(a, b, 5.0, NO);
+    CAssertEq(a->pingError.code, kBLIPError_Timeout);
+    CAssert(CFAbsoluteTimeGetCurrent() - stalledAt < 2.5);
+    [a->engine disconnect];
+    [b->engine disconnect];
+}
+
+
+@interface BLIPFileRequest (Testing)
+- (void) _setBodyStream: (NSInputStream*)stream;
+@end
+
+/** An input stream that returns `length` bytes, then fails with EIO. */
+@interface BLIPFailingStream : NSInputStream
+{
+    @public
+    NSUInteger length;
+    NSStreamStatus status;
+    NSError *error;
+}
+@end
+
+@implementation BLIPFailingStream
+- (void) open                                   {status = NSStreamStatusOpen;}
+- (void) close                                  {status = NSStreamStatusClosed;}
+- (NSStreamStatus) streamStatus                 {return status;}
+- (NSError*) streamError                        {return error;}
+- (BOOL) hasBytesAvailable                      {return YES;}
+- (BOOL) getBuffer: (uint8_t**)b length: (NSUInteger*)n {return NO;}
+- (id) propertyForKey: (NSString*)key           {return nil;}
+- (BOOL) setProperty: (id)p forKey: (NSString*)key {return NO;}
+- (void) scheduleInRunLoop: (NSRunLoop*)r forMode: (NSString*)m { }
+- (void) removeFromRunLoop: (NSRunLoop*)r forMode: (NSString*)m { }
+- (NSInteger) read: (uint8_t*)buffer maxLength: (NSUInteger)maxLength {
+    if( length == 0 ) {
+        status = NSStreamStatusError;
+        error = [NSError errorWithDomain: NSPOSIXErrorDomain code: EIO userInfo: nil];
+        return -1;
+    }
+    NSUInteger n = MIN(maxLength, length);
+    memset(buffer, 'x', n);
+    length -= n;
+    return n;
+}
+@end
+
+
+static BLIPFileRequest* fileRequest( NSString *path, BLIPTestPeer *sender,
+                                     void (^completion)(BLIPResponse*) ) {
+    BLIPFileRequest *q = [BLIPFileRequest
+                            pushRequestWithBodyFilePath: [NSURL fileURLWithPath: path].absoluteString
+                                             properties: @{@"Profile": @"Echo", @"BodyIsFile": @"true"}
+                                        completionBlock: completion];
+    q.connection = sender;
+    return q;
+}
+
+TestCase(BLIPFileRequest) {
+    BLIPTestPeer *a, *b;
+    makePeers(kBLIPTransport_Stream, YES, &a, &b);
+    NSString *dir = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                                    $sprintf(@"BLIPFileRequest-%d", getpid())];
+    [[NSFileManager defaultManager] createDirectoryAtPath: dir withIntermediateDirectories: YES
+                                               attributes: nil error: NULL];
+    __block int completions = 0;
+    void (^completion)(BLIPResponse*) = ^(BLIPResponse *r) {completions++;};
+
+    // A regular file is sent whole:
+    NSData *contents = testBody(300000);
+    NSString *path = [dir stringByAppendingPathComponent: @"file"];
+    CAssert([contents writeToFile: path atomically: NO]);
+    BLIPResponse *response = [fileRequest(path, a, completion) send];
+    pump(a, b);
+    CAssertEq(completions, 1);
+    CAssert(response.error == nil);
+    CAssertEqual(response.body, contents);
+
+    // A file that can't be opened fails the request at once, and nothing is sent:
+    completions = 0;
+    NSUInteger receivedBefore = b->requestsReceived;
+    response = [fileRequest([dir stringByAppendingPathComponent: @"missing"], a, completion) send];
+    CAssert(response.complete);
+    CAssert(response.error != nil);
+    CAssertEq(completions, 1);
+    CAssertEq(a->engine.queuedByteCount, 0u);
+    pump(a, b);
+    CAssertEq(b->requestsReceived, receivedBefore);
+
+    // A pipe has no size, so it's read until EOF instead of being sent as an empty body:
+    completions = 0;
+    NSString *fifo = [dir stringByAppendingPathComponent: @"fifo"];
+    CAssertEq(mkfifo(fifo.fileSystemRepresentation, 0600), 0);
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        int fd = open(fifo.fileSystemRepresentation, O_WRONLY);   // blocks till the reader opens
+        CAssert(fd >= 0);
+        CAssertEq(write(fd, contents.bytes, contents.length), (ssize_t)contents.length);
+        close(fd);
+    });
+    response = [fileRequest(fifo, a, completion) send];
+    pump(a, b);
+    CAssertEq(completions, 1);
+    CAssert(response.error == nil);
+    CAssertEqual(response.body, contents);
+
+    // A read error partway through aborts the request, so the peer never sees a truncated body
+    // as a complete one. (The first time, the error comes before any frames have been sent.)
+    for( NSUInteger failAfter = 0; failAfter <= 200000; failAfter += 200000 ) {
+        completions = 0;
+        receivedBefore = b->requestsReceived;
+        BLIPFailingStream *stream = [[BLIPFailingStream alloc] init];
+        stream->length = failAfter;
+        [stream open];
+        BLIPFileRequest *q = fileRequest(path, a, completion);
+        [q _setBodyStream: stream];
+        response = [q send];
+        pump(a, b);
+        CAssertEq(completions, 1);
+        CAssertEqual(response.error.domain, NSPOSIXErrorDomain);
+        CAssertEq(response.error.code, (NSInteger)EIO);
+        CAssertEq(b->requestsReceived, receivedBefore);
+        CAssertEq(a->engine.queuedByteCount, 0u);
+
+        // ...and the connection still works afterwards:
+        response = [a send: @"Echo" body: contents];
+        pump(a, b);
+        CAssertEqual(response.body, contents);
+    }
+
+    [[NSFileManager defaultManager] removeItemAtPath: dir error: NULL];
+}
+
+
+// Round-trips many small JSON-ish requests through a pair of engines, measuring CPU time per
+// round trip (framing, parsing and dispatching on both sides) and what goes over the transport.
+static void benchmark( BLIPTransportType transport, BOOL hello ) {
+    const int kN = 20000;
+    NSData *body = [@"{\"op\":\"get\",\"key\":\"user/1234\"}" dataUsingEncoding: NSUTF8StringEncoding];
+    BLIPTestPeer *a, *b;
+    makePeers(transport, hello, &a, &b);
+    NSUInteger writesBefore = a->writes + b->writes, bytesBefore = a->bytesWritten + b->bytesWritten;
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for( int i=0; i<kN; i++ ) {
+        BLIPRequest *q = [BLIPRequest requestWithBody: body
+                                           properties: @{@"Profile": @"Echo",
+                                                         @"Content-Type": @"application/json"}];
+        q.connection = a;
+        [q send];
+        if( i % 100 == 99 )
+            pump(a, b);         // keep 100 requests in flight
+    }
+    pump(a, b);
+    CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+    CAssertEq(b->requestsReceived, (NSUInteger)kN);
+    Log(@"%-8s %s: %6.0f ns/round trip, %6lu transport writes, %8lu bytes",
+        (transport == kBLIPTransport_Stream ?"stream" :"messages"), (hello ?"v2" :"v1"),
+        elapsed/kN*1e9, (unsigned long)(a->writes + b->writes - writesBefore),
+        (unsigned long)(a->bytesWritten + b->bytesWritten - bytesBefore));
+}
+
+TestCase(BLIPEngineSpeed) {
+    RequireTestCase(BLIPEngineConformance);
+    for( int hello=0; hello<=1; hello++ ) {
+        benchmark(kBLIPTransport_Stream, hello);
+        benchmark(kBLIPTransport_Messages, hello);
+    }
+}
+
+#endif
@@ -7,13 +7,18 @@
 
 #import "BLIPFileRequest.h"
 #import "BLIPFileResponse.h"
-#import "BLIPWriter.h"
+#import "BLIPFrameScanner.h"
 #import "Logging.h"
 #import "BLIP_Internal.h"
 
+// _fileBytesRemaining when the file's size isn't known (e.g. it's a pipe); it's read until EOF.
+#define kUnknownFileSize UINT64_MAX
+
 @interface BLIPFileRequest ()
 {
     NSInputStream* _stream;
+    unsigned long long _fileBytesRemaining;
+    NSError* _writeError;
     
     // BLIPMessage (Friend)
     
@@ -78,8 +83,51 @@
     return copy;
 }
 
+- (BOOL)_bodyIsFile
+{
+    return self.propertiesAvailable && [self.properties[@"BodyIsFile"] boolValue];
+}
+
+// Opens the file to be sent, if it isn't already open, and finds out how long it is.
+- (NSError*)_openFile
+{
+    if (self->_stream)
+        return nil;
+    NSURL* fileURL = [NSURL URLWithString:self->_outFilePath];
+    if (!fileURL)
+        return BLIPMakeError(kBLIPError_BadRequest, @"Invalid file URL %@", self->_outFilePath);
+    NSInputStream* stream = [NSInputStream inputStreamWithURL:fileURL];
+    [stream open];
+    if (!stream || stream.streamStatus == NSStreamStatusError)
+        return stream.streamError ?: BLIPMakeError(kBLIPError_BadRequest, @"Can't read %@", fileURL);
+    self->_stream = stream;
+
+    // Only a regular file's size can be trusted; anything else is read until it runs out:
+    NSDictionary* info = [fileURL resourceValuesForKeys:@[NSURLIsRegularFileKey, NSURLFileSizeKey]
+                                                  error:NULL];
+    if ([info[NSURLIsRegularFileKey] boolValue] && info[NSURLFileSizeKey])
+        _fileBytesRemaining = [info[NSURLFileSizeKey] unsignedLongLongValue];
+    else
+        _fileBytesRemaining = kUnknownFileSize;
+    return nil;
+}
+
 - (BLIPResponse*)send
 {
+    if ([self _bodyIsFile])
+    {
+        NSError* error = [self _openFile];
+        if (error)
+        {
+            // Fail right away, without sending anything:
+            Warn(@"%@: can't send file: %@", self, error);
+            BLIPResponse* response = self.response;
+            if (self.completionBlock && [response isKindOfClass:[BLIPFileResponse class]])
+                ((BLIPFileResponse*)response).completionBlock = self.completionBlock;
+            [response _failWithError: error];
+            return response;
+        }
+    }
     BLIPResponse* response = [super send];
     if (self.completionBlock && [response isKindOfClass:[BLIPFileResponse class]])
     {
@@ -113,7 +161,7 @@
 
 - (void) _encode
 {
-    if (!(self.propertiesAvailable && [self.properties[@"BodyIsFile"] boolValue]))
+    if (![self _bodyIsFile])
     {
         [super _encode];
         return;
@@ -121,13 +169,12 @@
     
     _isMutable = NO;
     
-    BLIPProperties *oldProps = _properties;
-    _properties = [oldProps copy];
-    
-    _encodedProperties = [_properties.encodedData mutableCopy];
+    _encodedProperties = [[NSMutableData alloc] init];
+    [_properties _appendEncodedTo: _encodedProperties];
+    _properties = [BLIPProperties _propertiesWithEncodedData: [_encodedProperties copy]];
     
-    [self->_stream close];
-    self->_stream = [NSInputStream inputStreamWithURL:[NSURL URLWithString:self->_outFilePath]];
+    // (-send has already opened the file, and failed the request if it couldn't.)
+    [self _openFile];
     
     if (self.compressed)
     {
@@ -172,89 +219,114 @@
     return self;
 }
 
-- (BOOL) _writeFrameTo: (BLIPWriter*)writer maxSize: (UInt16)maxSize
+- (size_t) _writeFrameTo: (UInt8*)dst
+                 maxSize: (size_t)maxSize
+          framingVersion: (int)version
+              moreComing: (BOOL*)outMoreComing
 {
     // use the file implementation only if the body is a file
-    if (!(self.propertiesAvailable && [self.properties[@"BodyIsFile"] boolValue]))
+    if (![self _bodyIsFile])
     {
-        return [super _writeFrameTo:writer maxSize:maxSize];
+        return [super _writeFrameTo:dst maxSize:maxSize framingVersion:version moreComing:outMoreComing];
     }
 
+    *outMoreComing = NO;
     if( _bytesWritten==0 )
         LogTo(BLIP,@"Now sending %@",self);
-    if (![_stream hasBytesAvailable])
+    if (!_stream)
+        return 0;   // done
+    if (_encodedProperties.length + kBLIPMaxFrameHeaderSize >= maxSize)
     {
+        // Not enough room left in this buffer for the properties; go again in the next one
+        *outMoreComing = YES;
+        return 0;
+    }
+
+    // The body goes after room for the largest header, since the header's size depends on the
+    // body's length. The file is read straight into the frame, with no intermediate buffers.
+    UInt8* body = dst + kBLIPMaxFrameHeaderSize;
+    size_t room = MIN(maxSize, UINT16_MAX) - kBLIPMaxFrameHeaderSize;
+    size_t lengthToWrite = 0;
+    if (_encodedProperties)
+    {
+        lengthToWrite = _encodedProperties.length;
+        memcpy(body, _encodedProperties.bytes, lengthToWrite);
+        _encodedProperties = nil;
+    }
+    BOOL sizeKnown = (_fileBytesRemaining != kUnknownFileSize);
+    size_t maxRead = room - lengthToWrite;
+    if (sizeKnown)
+        maxRead = (size_t)MIN(maxRead, _fileBytesRemaining);
+    NSInteger readResult = maxRead > 0 ? [_stream read:body + lengthToWrite maxLength:maxRead] : 0;
+    if (readResult < 0)
+    {
+        // Don't end the message here, or the peer would take the truncated file for the whole
+        // thing; the engine sees the error and aborts the message instead.
+        Warn(@"%@ failed reading file after %ld bytes: %@", self, (long)_bytesWritten, _stream.streamError);
+        _writeError = _stream.streamError ?: BLIPMakeError(kBLIPError_BadRequest,
+                                                           @"Couldn't read %@", _outFilePath);
         [_stream close];
         _stream = nil;
-        return NO;
+        return 0;
     }
-    
-    ssize_t lengthToWrite = 0; //_encodedBody.length - _bytesWritten;
-                               //    if( lengthToWrite <= 0 && _bytesWritten > 0 )
-                               //        return NO; // done
-    maxSize -= sizeof(BLIPFrameHeader);
-    UInt16 flags = _flags;
-    lengthToWrite += sizeof(BLIPFrameHeader);
+    lengthToWrite += readResult;
+    if (sizeKnown)
+        _fileBytesRemaining -= MIN(_fileBytesRemaining, (unsigned long long)readResult);
 
-    @autoreleasepool {
-        NSMutableData* dataToWrite;
-        if (_encodedProperties)
-        {
-            dataToWrite = [_encodedProperties mutableCopy];
-            _encodedProperties = nil;
-        }
-        else
-        {
-            dataToWrite = [NSMutableData data];
-        }
-        
-        lengthToWrite += [dataToWrite length];
-        maxSize -= [dataToWrite length];
-        
-        uint8_t buf[maxSize];
-        NSInteger readResult = [_stream read:buf maxLength:maxSize];
-        if (readResult == 0)
-        {
-            // at this point, maxSize has been subtracted from twice - once the frame header size, and once the property size (if needed)
-            [dataToWrite appendBytes:buf length:maxSize];
-            lengthToWrite += maxSize;
-            flags |= kBLIP_MoreComing;
-            LogTo(BLIPVerbose,@"%@ pushing frame", self);
-        }
-        else if (readResult > 0)
-        {
-            // Job's done! http://www.youtube.com/watch?v=5r06heQ5HsI
-            [_stream close];
-            _stream = nil;
-            [dataToWrite appendBytes:buf length:readResult];
-            lengthToWrite += readResult; // if readResult > 0, readResult is the number of bytes that were actually read
-            flags &= ~kBLIP_MoreComing;
-            LogTo(BLIPVerbose,@"%@ pushing frame (finished)", self);
-        }
-        else if (readResult < 0)
-        {
-            LogTo(BLIPVerbose,@"%@ failed pushing frame. [NSInputStream read:maxLength] returned %ld: %@", self, (long)readResult, _stream.streamError);
-            [_stream close];
-            return NO;
-        }
-        
-        // First write the frame header:
-        BLIPFrameHeader header = {  NSSwapHostIntToBig(kBLIPFrameHeaderMagicNumber),
-            NSSwapHostIntToBig(_number),
-            NSSwapHostShortToBig(flags),
-            NSSwapHostShortToBig(sizeof(BLIPFrameHeader) + lengthToWrite) };
-        
-        [writer writeData: [NSData dataWithBytes: &header length: sizeof(header)]];
-        
-        // Then write the body:
-        if( lengthToWrite > 0 ) {
-            [writer writeData: dataToWrite];
-            //        [writer writeData: [NSData dataWithBytes: (UInt8*)_encodedBody.bytes + _bytesWritten
-            //                                          length: lengthToWrite]];
-            _bytesWritten += lengthToWrite;
-        }
+    UInt16 flags = _flags;
+    if (_fileBytesRemaining > 0 && readResult > 0)
+    {
+        flags |= kBLIP_MoreComing;
+        LogTo(BLIPVerbose,@"%@ pushing frame", self);
+    }
+    else
+    {
+        // Job's done! http://www.youtube.com/watch?v=5r06heQ5HsI
+        [_stream close];
+        _stream = nil;
+        flags &= ~kBLIP_MoreComing;
+        LogTo(BLIPVerbose,@"%@ pushing frame (finished)", self);
     }
-    return (flags & kBLIP_MoreComing) != 0;
+
+    // Write the frame header, and slide the body down to meet it if it's shorter than the maximum:
+    size_t headerSize = BLIPEncodeFrameHeader(dst, version, _number, flags, (UInt16)lengthToWrite);
+    if (headerSize < kBLIPMaxFrameHeaderSize && lengthToWrite > 0)
+        memmove(dst + headerSize, body, lengthToWrite);
+    _bytesWritten += lengthToWrite;
+    *outMoreComing = (flags & kBLIP_MoreComing) != 0;
+    return headerSize + lengthToWrite;
+}
+
+- (NSError*) _writeError
+{
+    return _writeError;
+}
+
+- (void) _cancelBeforeSending
+{
+    // The placeholder that replaces me has an in-memory body, so forget about the file:
+    [_stream close];
+    _stream = nil;
+    _writeError = nil;
+    [super _cancelBeforeSending];
+}
+
+- (NSUInteger) _bytesRemaining
+{
+    if (![self _bodyIsFile])
+        return [super _bytesRemaining];
+    if (_fileBytesRemaining == kUnknownFileSize)
+        return _encodedProperties.length;
+    return _encodedProperties.length + (NSUInteger)_fileBytesRemaining;
+}
+
+#if DEBUG
+// Sends the body from a stream instead of a file, of unknown length.
+- (void) _setBodyStream: (NSInputStream*)stream
+{
+    _stream = stream;
+    _fileBytesRemaining = kUnknownFileSize;
 }
+#endif
 
 @end
@@ -0,0 +1,53 @@
+//
+//  BLIPFrameScanner.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "BLIPMessage.h"
+
+
+/** Frame formats. A connection starts out using v1, and each direction switches to v2 once
+    the "Hi" exchange shows that the peer can read it (see BLIPEngine.) */
+enum {
+    kBLIPFraming_v1Message = 0,     // v1 in a WebSocket message of its own; see BLIPWebSocketFrameHeader
+    kBLIPFraming_v1 = 1,            // 12-byte header; see BLIPFrameHeader
+    kBLIPFraming_v2 = 2,            // varint number, flags and body size; no magic number
+};
+
+/** The largest frame header either format produces. */
+#define kBLIPMaxFrameHeaderSize 12
+
+
+/** A decoded BLIP frame header, as produced by BLIPScanFrames. Fields are in native byte order. */
+typedef struct {
+    UInt32           number;        // serial number of MSG
+    BLIPMessageFlags flags;         // frame type, "more" flag, and other delivery options
+    UInt16           bodySize;      // size of the frame's body (NOT including the header)
+    UInt32           bodyOffset;    // offset of the frame's body from the start of the buffer
+} BLIPFrameDescriptor;
+
+
+/** Scans a buffer holding consecutive BLIP frames, and decodes the headers of as many complete
+    frames as it can (up to maxFrames) into `frames`. A partial frame at the end is left alone.
+    Returns the number of frames decoded, and sets *outConsumed to the number of bytes they took up;
+    or returns -1 if a frame header is invalid (wrong magic number or impossible size.)
+    Headers are validated and byte-swapped several at a time using SIMD where it's available. */
+ssize_t BLIPScanFrames(const void *buffer, size_t length,
+                       BLIPFrameDescriptor frames[], size_t maxFrames,
+                       size_t *outConsumed);
+
+/** Same as BLIPScanFrames, but for v2 frames. A v2 header is three unsigned LEB128 varints
+    (message number, flags, body size), so it's usually only 3 bytes long. Returns -1 if a varint
+    is overlong or out of range, or if the frame would be larger than 65535 bytes. */
+ssize_t BLIPScanFramesV2(const void *buffer, size_t length,
+                         BLIPFrameDescriptor frames[], size_t maxFrames,
+                         size_t *outConsumed);
+
+/** Writes a frame header in the given format (including kBLIPFraming_v1Message) to `dst`, which
+    must have room for kBLIPMaxFrameHeaderSize bytes. Returns the number of bytes written. */
+size_t BLIPEncodeFrameHeader(void *dst, int version,
+                             UInt32 number, BLIPMessageFlags flags, UInt16 bodySize);
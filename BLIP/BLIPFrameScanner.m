@@ -0,0 +1,385 @@
+//
+//  BLIPFrameScanner.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "BLIPFrameScanner.h"
+#import "BLIP_Internal.h"
+
+#import "Logging.h"
+#import "Test.h"
+
+#if defined(__SSSE3__) && defined(__LITTLE_ENDIAN__)
+#include <tmmintrin.h>
+#define SCAN_SSSE3 1
+#elif defined(__ARM_NEON) && defined(__aarch64__) && defined(__LITTLE_ENDIAN__)
+#include <arm_neon.h>
+#define SCAN_NEON 1
+#endif
+
+
+// Big-endian 16-bit load from an unaligned address.
+static inline UInt16 loadBig16( const UInt8 *p ) {
+    return (UInt16)((p[0] << 8) | p[1]);
+}
+
+
+// Finds where each complete frame starts. This part is inherently serial, since each frame's
+// position depends on the previous one's size, but it only touches two bytes per frame.
+// Temporarily stores each frame's header offset in its bodyOffset field.
+static ssize_t findFrames( const UInt8 *bytes, size_t length,
+                           BLIPFrameDescriptor frames[], size_t maxFrames, size_t *outConsumed )
+{
+    size_t pos = 0, n = 0;
+    while( n < maxFrames && length - pos >= sizeof(BLIPFrameHeader) ) {
+        UInt16 size = loadBig16(bytes + pos + offsetof(BLIPFrameHeader,size));
+        if( size < sizeof(BLIPFrameHeader) )
+            return -1;
+        if( size > length - pos )
+            break;
+        frames[n].bodyOffset = (UInt32)pos;
+        frames[n].bodySize = size - sizeof(BLIPFrameHeader);
+        n++;
+        pos += size;
+    }
+    *outConsumed = pos;
+    return n;
+}
+
+
+// Validates and byte-swaps the headers of frames[start..n), one at a time.
+static BOOL decodeHeadersScalar( const UInt8 *bytes, BLIPFrameDescriptor frames[],
+                                 size_t start, size_t n )
+{
+    for( size_t i=start; i<n; i++ ) {
+        BLIPFrameHeader header;
+        memcpy(&header, bytes + frames[i].bodyOffset, sizeof(header));
+        if( NSSwapBigIntToHost(header.magic) != kBLIPFrameHeaderMagicNumber )
+            return NO;
+        frames[i].number = NSSwapBigIntToHost(header.number);
+        frames[i].flags = NSSwapBigShortToHost(header.flags);
+        frames[i].bodyOffset += sizeof(BLIPFrameHeader);
+    }
+    return YES;
+}
+
+
+// Validates and byte-swaps all the headers, four at a time where SIMD is available.
+static BOOL decodeHeaders( const UInt8 *bytes, BLIPFrameDescriptor frames[], size_t n ) {
+    size_t i = 0;
+#if SCAN_SSSE3 || SCAN_NEON
+    for( ; i + 4 <= n; i += 4 ) {
+        // Gather each header field of four frames into one vector (as 32-bit lanes; the flags
+        // and size fields share one lane):
+        UInt32 magic[4], number[4], flagsAndSize[4];
+        for( int k=0; k<4; k++ ) {
+            const UInt8 *header = bytes + frames[i+k].bodyOffset;
+            memcpy(&magic[k],        header + offsetof(BLIPFrameHeader,magic),  4);
+            memcpy(&number[k],       header + offsetof(BLIPFrameHeader,number), 4);
+            memcpy(&flagsAndSize[k], header + offsetof(BLIPFrameHeader,flags),  4);
+        }
+#if SCAN_SSSE3
+        const __m128i swap32 = _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+        const __m128i swap16 = _mm_setr_epi8(1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+        __m128i m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)magic), swap32);
+        __m128i ok = _mm_cmpeq_epi32(m, _mm_set1_epi32((int)kBLIPFrameHeaderMagicNumber));
+        if( _mm_movemask_epi8(ok) != 0xFFFF )
+            return NO;
+        _mm_storeu_si128((__m128i*)number,
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)number), swap32));
+        _mm_storeu_si128((__m128i*)flagsAndSize,
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)flagsAndSize), swap16));
+#else
+        uint32x4_t m = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8((const uint8_t*)magic)));
+        if( vminvq_u32(vceqq_u32(m, vdupq_n_u32(kBLIPFrameHeaderMagicNumber))) == 0 )
+            return NO;
+        vst1q_u8((uint8_t*)number, vrev32q_u8(vld1q_u8((const uint8_t*)number)));
+        vst1q_u8((uint8_t*)flagsAndSize, vrev16q_u8(vld1q_u8((const uint8_t*)flagsAndSize)));
+#endif
+        for( int k=0; k<4; k++ ) {
+            frames[i+k].number = number[k];
+            frames[i+k].flags = (BLIPMessageFlags)(flagsAndSize[k] & 0xFFFF);  // little-endian lane
+            frames[i+k].bodyOffset += sizeof(BLIPFrameHeader);
+        }
+    }
+#endif
+    return decodeHeadersScalar(bytes, frames, i, n);
+}
+
+
+ssize_t BLIPScanFrames(const void *buffer, size_t length,
+                       BLIPFrameDescriptor frames[], size_t maxFrames,
+                       size_t *outConsumed)
+{
+    const UInt8 *bytes = buffer;
+    ssize_t n = findFrames(bytes, length, frames, maxFrames, outConsumed);
+    if( n > 0 && ! decodeHeaders(bytes, frames, n) )
+        return -1;
+    return n;
+}
+
+
+#pragma mark - V2 FRAMES:
+
+
+// Reads an unsigned LEB128 varint of at most `maxBytes` bytes whose value can't exceed `maxValue`.
+// Returns its length, or 0 if the buffer ends first, or -1 if it's overlong or out of range.
+static int readVarint( const UInt8 *p, size_t avail, int maxBytes, UInt32 maxValue, UInt32 *out ) {
+    UInt64 value = 0;
+    for( int i=0; i<maxBytes; i++ ) {
+        if( (size_t)i >= avail )
+            return 0;
+        value |= (UInt64)(p[i] & 0x7F) << (7*i);
+        if( ! (p[i] & 0x80) ) {
+            if( value > maxValue )
+                return -1;
+            *out = (UInt32)value;
+            return i+1;
+        }
+    }
+    return -1;
+}
+
+static size_t writeVarint( UInt8 *dst, UInt32 value ) {
+    size_t n = 0;
+    while( value >= 0x80 ) {
+        dst[n++] = (UInt8)(value | 0x80);
+        value >>= 7;
+    }
+    dst[n++] = (UInt8)value;
+    return n;
+}
+
+
+ssize_t BLIPScanFramesV2(const void *buffer, size_t length,
+                         BLIPFrameDescriptor frames[], size_t maxFrames,
+                         size_t *outConsumed)
+{
+    // Each header's position depends on the previous frame's varints, so this is purely serial;
+    // but small numbers are a single byte, so there's very little to decode.
+    const UInt8 *bytes = buffer;
+    size_t pos = 0, n = 0;
+    while( n < maxFrames && pos < length ) {
+        UInt32 number, flags, bodySize;
+        size_t p = pos;
+        int len = readVarint(bytes+p, length-p, 5, UINT32_MAX, &number);
+        if( len > 0 ) {
+            p += len;
+            len = readVarint(bytes+p, length-p, 3, UINT16_MAX, &flags);
+            if( len > 0 ) {
+                p += len;
+                len = readVarint(bytes+p, length-p, 3, UINT16_MAX, &bodySize);
+            }
+        }
+        if( len < 0 )
+            return -1;
+        else if( len == 0 )
+            break;                                  // header is incomplete
+        p += len;
+        if( p - pos + bodySize > UINT16_MAX )
+            return -1;
+        if( bodySize > length - p )
+            break;                                  // body is incomplete
+        frames[n].number = number;
+        frames[n].flags = (BLIPMessageFlags)flags;
+        frames[n].bodySize = (UInt16)bodySize;
+        frames[n].bodyOffset = (UInt32)p;
+        n++;
+        pos = p + bodySize;
+    }
+    *outConsumed = pos;
+    return n;
+}
+
+
+size_t BLIPEncodeFrameHeader(void *dst, int version,
+                             UInt32 number, BLIPMessageFlags flags, UInt16 bodySize)
+{
+    if( version >= kBLIPFraming_v2 ) {
+        UInt8 *out = dst;
+        size_t n = writeVarint(out, number);
+        n += writeVarint(out + n, flags);
+        n += writeVarint(out + n, bodySize);
+        return n;
+    } else if( version == kBLIPFraming_v1Message ) {
+        // The WebSocket message delimits the frame, so there's no magic number or size:
+        BLIPWebSocketFrameHeader header = {NSSwapHostIntToBig(number), NSSwapHostShortToBig(flags)};
+        memcpy(dst, &header, kBLIPWebSocketFrameHeaderSize);
+        return kBLIPWebSocketFrameHeaderSize;
+    } else {
+        Assert(bodySize <= UINT16_MAX - sizeof(BLIPFrameHeader));
+        BLIPFrameHeader header = {  NSSwapHostIntToBig(kBLIPFrameHeaderMagicNumber),
+                                    NSSwapHostIntToBig(number),
+                                    NSSwapHostShortToBig(flags),
+                                    NSSwapHostShortToBig(sizeof(BLIPFrameHeader) + bodySize) };
+        memcpy(dst, &header, sizeof(header));
+        return sizeof(header);
+    }
+}
+
+
+
+#if DEBUG
+
+// Builds a stream of `nFrames` frames with pseudo-random small bodies.
+static NSMutableData* syntheticFrames( int nFrames ) {
+    NSMutableData *stream = [NSMutableData data];
+    srandom(42);
+    for( int i=0; i<nFrames; i++ ) {
+        UInt16 bodySize = (UInt16)(random() % 200);
+        BLIPFrameHeader header = {  NSSwapHostIntToBig(kBLIPFrameHeaderMagicNumber),
+                                    NSSwapHostIntToBig(i+1),
+                                    NSSwapHostShortToBig((UInt16)(i & 0x3F)),
+                                    NSSwapHostShortToBig(sizeof(BLIPFrameHeader) + bodySize) };
+        [stream appendBytes: &header length: sizeof(header)];
+        [stream increaseLengthBy: bodySize];
+    }
+    return stream;
+}
+
+TestCase(BLIPFrameScanner) {
+    NSMutableData *stream = syntheticFrames(11);
+    BLIPFrameDescriptor frames[16];
+    size_t consumed;
+    CAssertEq(BLIPScanFrames(stream.bytes, stream.length, frames, 16, &consumed), 11);
+    CAssertEq(consumed, stream.length);
+    size_t pos = 0;
+    for( int i=0; i<11; i++ ) {
+        CAssertEq(frames[i].number, (UInt32)(i+1));
+        CAssertEq(frames[i].flags, (BLIPMessageFlags)(i & 0x3F));
+        CAssertEq((size_t)frames[i].bodyOffset, pos + sizeof(BLIPFrameHeader));
+        pos = frames[i].bodyOffset + frames[i].bodySize;
+    }
+
+    // Limited by maxFrames:
+    CAssertEq(BLIPScanFrames(stream.bytes, stream.length, frames, 5, &consumed), 5);
+    CAssertEq(consumed, (size_t)frames[4].bodyOffset + frames[4].bodySize);
+
+    // A partial frame at the end is left for later:
+    CAssertEq(BLIPScanFrames(stream.bytes, stream.length - 1, frames, 16, &consumed), 10);
+    CAssertEq(consumed, (size_t)frames[9].bodyOffset + frames[9].bodySize);
+    CAssertEq(BLIPScanFrames(stream.bytes, 5, frames, 16, &consumed), 0);
+    CAssertEq(consumed, 0u);
+
+    // Bad magic number in a frame decoded by the SIMD path, and in the scalar tail:
+    for( int bad=2; bad<=10; bad+=8 ) {
+        BLIPScanFrames(stream.bytes, stream.length, frames, 16, &consumed);
+        NSMutableData *corrupt = [stream mutableCopy];
+        ((UInt8*)corrupt.mutableBytes)[frames[bad].bodyOffset - sizeof(BLIPFrameHeader)] ^= 0x01;
+        CAssertEq(BLIPScanFrames(corrupt.bytes, corrupt.length, frames, 16, &consumed), -1);
+    }
+
+    // Impossibly short frame size:
+    BLIPFrameHeader header = {NSSwapHostIntToBig(kBLIPFrameHeaderMagicNumber), 0, 0,
+                              NSSwapHostShortToBig(4)};
+    CAssertEq(BLIPScanFrames(&header, sizeof(header), frames, 16, &consumed), -1);
+}
+
+TestCase(BLIPFrameScannerV2) {
+    // Encode frames whose varints are of various lengths:
+    static const UInt32 kNumbers[] = {1, 127, 128, 16383, 16384, 0x0FFFFFFF, UINT32_MAX};
+    NSMutableData *stream = [NSMutableData data];
+    for( int i=0; i<7; i++ ) {
+        UInt8 header[kBLIPMaxFrameHeaderSize];
+        BLIPMessageFlags flags = (BLIPMessageFlags)(i==6 ?0xFFFF :(i << 5));
+        UInt16 bodySize = (UInt16)(i * 50);
+        size_t headerSize = BLIPEncodeFrameHeader(header, kBLIPFraming_v2, kNumbers[i], flags, bodySize);
+        CAssert(headerSize >= 3 && headerSize <= 11);
+        [stream appendBytes: header length: headerSize];
+        [stream increaseLengthBy: bodySize];
+    }
+    UInt8 small[kBLIPMaxFrameHeaderSize];
+    CAssertEq(BLIPEncodeFrameHeader(small, kBLIPFraming_v2, 1, kBLIP_RPY, 100), 3u);
+    CAssertEq(BLIPEncodeFrameHeader(small, kBLIPFraming_v1, 1, kBLIP_RPY, 100), sizeof(BLIPFrameHeader));
+    CAssertEq(BLIPEncodeFrameHeader(small, kBLIPFraming_v1Message, 1, kBLIP_RPY, 100),
+              (size_t)kBLIPWebSocketFrameHeaderSize);
+
+    BLIPFrameDescriptor frames[16];
+    size_t consumed;
+    CAssertEq(BLIPScanFramesV2(stream.bytes, stream.length, frames, 16, &consumed), 7);
+    CAssertEq(consumed, stream.length);
+    for( int i=0; i<7; i++ ) {
+        CAssertEq(frames[i].number, kNumbers[i]);
+        CAssertEq(frames[i].flags, (BLIPMessageFlags)(i==6 ?0xFFFF :(i << 5)));
+        CAssertEq(frames[i].bodySize, (UInt16)(i * 50));
+    }
+
+    // Every truncation is just a partial frame, never an error:
+    for( size_t len=0; len<stream.length; len++ ) {
+        ssize_t n = BLIPScanFramesV2(stream.bytes, len, frames, 16, &consumed);
+        CAssert(n >= 0 && n < 7);
+        CAssert(consumed <= len);
+    }
+
+    // Overlong varints, out-of-range values, and oversized frames are errors:
+    const UInt8 kOverlong[] = {0x81, 0x81, 0x81, 0x81, 0x81, 0x01, 0x00, 0x00};
+    CAssertEq(BLIPScanFramesV2(kOverlong, sizeof(kOverlong), frames, 16, &consumed), -1);
+    const UInt8 kBigFlags[] = {0x01, 0x80, 0x80, 0x04, 0x00};
+    CAssertEq(BLIPScanFramesV2(kBigFlags, sizeof(kBigFlags), frames, 16, &consumed), -1);
+    const UInt8 kBigFrame[] = {0x01, 0x00, 0xFF, 0xFF, 0x03};
+    CAssertEq(BLIPScanFramesV2(kBigFrame, sizeof(kBigFrame), frames, 16, &consumed), -1);
+}
+
+TestCase(BLIPFramingOverhead) {
+    // Bytes on the wire for a run of small RPCs, in each frame format:
+    const int kNRequests = 1000;
+    NSData *body = [@"{\"op\":\"get\",\"key\":\"user/1234\"}" dataUsingEncoding: NSUTF8StringEncoding];
+    size_t wire[3] = {0, 0, 0}, payload = 0;
+    for( int i=1; i<=kNRequests; i++ ) {
+        BLIPRequest *q = [BLIPRequest requestWithBody: body
+                                           properties: @{@"Profile": @"Store/Get",
+                                                         @"Content-Type": @"application/json"}];
+        [q _encode];
+        // (A reply has the same encoding as a request with the same contents.)
+        BLIPRequest *r = [BLIPRequest requestWithBody: body
+                                           properties: @{@"Content-Type": @"application/json"}];
+        [r _encode];
+        for( int version=kBLIPFraming_v1; version<=kBLIPFraming_v2; version++ ) {
+            UInt8 header[kBLIPMaxFrameHeaderSize];
+            wire[version] += BLIPEncodeFrameHeader(header, version, i, kBLIP_MSG, (UInt16)q._bytesRemaining)
+                           + BLIPEncodeFrameHeader(header, version, i, kBLIP_RPY, (UInt16)r._bytesRemaining);
+        }
+        payload += q._bytesRemaining + r._bytesRemaining;
+    }
+    wire[1] += payload;
+    wire[2] += payload;
+    CAssert(wire[2] < wire[1]);
+    Log(@"%d request/response pairs: %zu bytes with v1 framing, %zu with v2 (%.1f%% smaller); "
+        "headers average %.2f vs %.2f bytes",
+        kNRequests, wire[1], wire[2], 100.0*(wire[1] - wire[2])/wire[1],
+        (double)(wire[1]-payload)/(2*kNRequests), (double)(wire[2]-payload)/(2*kNRequests));
+}
+
+TestCase(BLIPFrameScannerSpeed) {
+    const int kNFrames = 100000, kBatch = 64, kPasses = 10;
+    NSMutableData *stream = syntheticFrames(kNFrames);
+    const UInt8 *bytes = stream.bytes;
+    BLIPFrameDescriptor frames[kBatch];
+
+    for( int simd=1; simd>=0; simd-- ) {
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        size_t total = 0;
+        for( int pass=0; pass<kPasses; pass++ ) {
+            size_t pos = 0, consumed;
+            ssize_t n;
+            do {
+                n = findFrames(bytes + pos, stream.length - pos, frames, kBatch, &consumed);
+                BOOL ok = simd ?decodeHeaders(bytes + pos, frames, n)
+                               :decodeHeadersScalar(bytes + pos, frames, 0, n);
+                CAssert(ok);
+                pos += consumed;
+                total += n;
+            } while( n == kBatch );
+            CAssertEq(pos, stream.length);
+        }
+        CAssertEq(total, (size_t)kNFrames*kPasses);
+        CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+        Log(@"Scanned %d frames %s: %.1f ns per frame", kNFrames*kPasses,
+            (simd ?"with SIMD" :"with scalar code"), elapsed/total*1e9);
+    }
+}
+
+#endif
@@ -13,6 +13,7 @@
 @protocol BLIPMessageSender <NSObject>
 - (BOOL) _sendRequest: (BLIPRequest*)q response: (BLIPResponse*)response;
 - (BOOL) _sendResponse: (BLIPResponse*)response;
+- (void) _cancelRequest: (BLIPRequest*)q;
 @property (readonly) NSError* error;
 @end
 
@@ -24,13 +25,16 @@ enum {
     kBLIPError_BadFrame,
     kBLIPError_Disconnected,
     kBLIPError_PeerNotAllowed,
+    kBLIPError_Cancelled,                   // request was canceled by the sender
     
     kBLIPError_Misc = 99,
     
     // errors returned in responses:
+    kBLIPError_NotModified = 304,           // request's If-None-Match property matches (see BLIPResponseCache)
     kBLIPError_BadRequest = 400,
     kBLIPError_Forbidden = 403,
     kBLIPError_NotFound = 404,
+    kBLIPError_Timeout = 408,               // no response arrived before the request's timeout
     kBLIPError_BadRange = 416,
     
     kBLIPError_HandlerFailed = 501,
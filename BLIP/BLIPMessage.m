@@ -8,7 +8,7 @@
 
 #import "BLIPMessage.h"
 #import "BLIP_Internal.h"
-#import "BLIPWriter.h"
+#import "BLIPFrameScanner.h"
 
 #import "Logging.h"
 #import "Test.h"
@@ -73,8 +73,9 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... )
     NSMutableString *desc = [NSMutableString stringWithFormat: @"%@[#%u, %lu bytes",
                              self.class,(unsigned int)_number, (unsigned long)length];
     if( _flags & kBLIP_Compressed ) {
-        if( _encodedBody && _encodedBody.length != length )
-            [desc appendFormat: @" (%lu gzipped)", (unsigned long)_encodedBody.length];
+        NSData *encoded = _isMine ?_outgoingBody :_encodedBody;
+        if( encoded && encoded.length != length )
+            [desc appendFormat: @" (%lu gzipped)", (unsigned long)encoded.length];
         else
             [desc appendString: @", gzipped"];
     }
@@ -133,19 +134,18 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... )
 - (void) setBody: (NSData*)body
 {
     Assert(_isMine && _isMutable);
-    if( _mutableBody )
-        [_mutableBody setData: body];
-    else
-        _mutableBody = [body mutableCopy];
+    // Copying an immutable NSData just retains it, so the bytes aren't copied until (unless)
+    // something is appended via -addToBody:.
+    _body = [body copy];
+    _mutableBody = nil;
 }
 
 - (void) _addToBody: (NSData*)data
 {
     if( data.length ) {
-        if( _mutableBody )
-            [_mutableBody appendData: data];
-        else
-            _mutableBody = [data mutableCopy];
+        if( ! _mutableBody )
+            _mutableBody = _body ?[_body mutableCopy] :[[NSMutableData alloc] init];
+        [_mutableBody appendData: data];
         _body = nil;
     }
 }
@@ -220,22 +220,54 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... )
     Assert(_isMine && _isMutable);
     _isMutable = NO;
 
-    BLIPProperties *oldProps = _properties;
-    _properties = [oldProps copy];
-    
-    _encodedBody = [_properties.encodedData mutableCopy];
-    Assert(_encodedBody.length>=2);
-
     NSData *body = _body ?: _mutableBody;
     NSUInteger length = body.length;
-    if( length > 0 ) {
-        if( self.compressed ) {
-            body = [NSData gtm_dataByGzippingData: body compressionLevel: 5];
-            LogTo(BLIPVerbose,@"Compressed %@ to %lu bytes (%.0f%%)", self,(unsigned long)body.length,
-                  body.length*100.0/length);
-        }
-        [_encodedBody appendData: body];
+    if( length > 0 && self.compressed ) {
+        body = [NSData gtm_dataByGzippingData: body compressionLevel: 5];
+        LogTo(BLIPVerbose,@"Compressed %@ to %lu bytes (%.0f%%)", self,(unsigned long)body.length,
+              body.length*100.0/length);
+    }
+
+    // The encoded properties and the body are sent back to back, straight from their own
+    // buffers; the body isn't copied into a combined buffer.
+    _encodedBody = [[NSMutableData alloc] init];
+    BOOL ok = [_properties _appendEncodedTo: _encodedBody];
+    Assert(ok, @"%@'s properties are too large to encode", self);
+    _outgoingBody = body;
+
+    // Freeze the properties. Rather than copying them (which would encode them all over again),
+    // wrap the bytes that were just written.
+    if( [_properties isKindOfClass: [BLIPMutableProperties class]] )
+        _properties = [BLIPProperties _propertiesWithEncodedData: _encodedBody];
+}
+
+
+- (NSUInteger) _encodedLength
+{
+    return _encodedBody.length + _outgoingBody.length;
+}
+
+
+// Copies the next `length` bytes of the outgoing message (the properties, then the body) to `dst`.
+- (void) _readEncodedBytes: (void*)dst length: (NSUInteger)length
+{
+    NSUInteger pos = _bytesWritten, propertiesLength = _encodedBody.length;
+    if( pos < propertiesLength ) {
+        NSUInteger n = MIN(length, propertiesLength - pos);
+        memcpy(dst, (const UInt8*)_encodedBody.bytes + pos, n);
+        dst = (UInt8*)dst + n;
+        pos += n;
+        length -= n;
     }
+    if( length > 0 )
+        memcpy(dst, (const UInt8*)_outgoingBody.bytes + (pos - propertiesLength), length);
+}
+
+
+- (NSUInteger) _bytesRemaining
+{
+    NSInteger remaining = (NSInteger)[self _encodedLength] - _bytesWritten;
+    return remaining > 0 ? remaining : 0;
 }
 
 
@@ -247,59 +279,49 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... )
 }
 
 
-- (BOOL) _writeFrameTo: (BLIPWriter*)writer maxSize: (UInt16)maxSize
+- (NSError*) _writeError
 {
-    Assert(_number!=0);
-    Assert(_isMine);
-    Assert(_encodedBody);
-    if( _bytesWritten==0 )
-        LogTo(BLIP,@"Now sending %@",self);
-    ssize_t lengthToWrite = _encodedBody.length - _bytesWritten;
-    if( lengthToWrite <= 0 && _bytesWritten > 0 )
-        return NO; // done
-    Assert(maxSize > sizeof(BLIPFrameHeader));
-    maxSize -= sizeof(BLIPFrameHeader);
-    UInt16 flags = _flags;
-    if( lengthToWrite > maxSize ) {
-        lengthToWrite = maxSize;
-        flags |= kBLIP_MoreComing;
-        LogTo(BLIPVerbose,@"%@ pushing frame, bytes %lu-%lu", self, (long)_bytesWritten, _bytesWritten+lengthToWrite);
-    } else {
-        flags &= ~kBLIP_MoreComing;
-        LogTo(BLIPVerbose,@"%@ pushing frame, bytes %lu-%lu (finished)", self, (long)_bytesWritten, _bytesWritten+lengthToWrite);
-    }
-        
-    // First write the frame header:
-    BLIPFrameHeader header = {  NSSwapHostIntToBig(kBLIPFrameHeaderMagicNumber),
-                                NSSwapHostIntToBig(_number),
-                                NSSwapHostShortToBig(flags),
-                                NSSwapHostShortToBig(sizeof(BLIPFrameHeader) + lengthToWrite) };
-    
-    [writer writeData: [NSData dataWithBytes: &header length: sizeof(header)]];
-    
-    // Then write the body:
-    if( lengthToWrite > 0 ) {
-        [writer writeData: [NSData dataWithBytes: (UInt8*)_encodedBody.bytes + _bytesWritten
-                                          length: lengthToWrite]];
-        _bytesWritten += lengthToWrite;
-    }
-    return (flags & kBLIP_MoreComing) != 0;
+    return nil;     // an in-memory body can always be written
+}
+
+
+// Turns a queued message that hasn't started sending into an empty no-reply meta request.
+// Its number has already been assigned, so the peer has to receive _something_ or it'll see a
+// gap in the sequence; this placeholder is ignored by peers old and new.
+- (void) _cancelBeforeSending
+{
+    Assert(_isMine && _bytesWritten==0);
+    _flags = (_flags & kBLIP_Urgent) | kBLIP_MSG | kBLIP_Meta | kBLIP_NoReply;
+    BLIPMutableProperties *props = [[BLIPMutableProperties alloc] init];
+    [props setValue: kBLIPProfile_Cancel ofProperty: @"Profile"];
+    _properties = [props copy];
+    _encodedBody = [_properties.encodedData mutableCopy];
+    _outgoingBody = nil;
+    _body = nil;
+    _mutableBody = nil;
 }
 
 
-- (NSData*) nextWebSocketFrameWithMaxSize: (UInt16)maxSize moreComing: (BOOL*)outMoreComing {
+// Writes the message's next frame, header and all, directly into an output buffer at `dst`,
+// which has room for `maxSize` bytes. `version` is the frame header format (see BLIPFrameScanner.h.)
+// Returns the frame's length, or 0 if the message has been completely written.
+- (size_t) _writeFrameTo: (UInt8*)dst
+                 maxSize: (size_t)maxSize
+          framingVersion: (int)version
+              moreComing: (BOOL*)outMoreComing
+{
     Assert(_number!=0);
     Assert(_isMine);
     Assert(_encodedBody);
     if( _bytesWritten==0 )
         LogTo(BLIP,@"Now sending %@",self);
-    ssize_t lengthToWrite = _encodedBody.length - _bytesWritten;
+    ssize_t lengthToWrite = [self _encodedLength] - _bytesWritten;
     if( lengthToWrite <= 0 && _bytesWritten > 0 )
-        return NULL; // done
-    Assert(maxSize > kBLIPWebSocketFrameHeaderSize);
-    maxSize -= kBLIPWebSocketFrameHeaderSize;
+        return 0; // done
+    Assert(maxSize > kBLIPMaxFrameHeaderSize);
+    maxSize = MIN(maxSize - kBLIPMaxFrameHeaderSize, UINT16_MAX - kBLIPMaxFrameHeaderSize);
     UInt16 flags = _flags;
-    if( lengthToWrite > maxSize ) {
+    if( lengthToWrite > (ssize_t)maxSize ) {
         lengthToWrite = maxSize;
         flags |= kBLIP_MoreComing;
         LogTo(BLIPVerbose,@"%@ pushing frame, bytes %lu-%lu", self, (long)_bytesWritten, _bytesWritten+lengthToWrite);
@@ -308,20 +330,15 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... )
         LogTo(BLIPVerbose,@"%@ pushing frame, bytes %lu-%lu (finished)", self, (long)_bytesWritten, _bytesWritten+lengthToWrite);
     }
 
-    NSMutableData* frame = [NSMutableData dataWithLength: kBLIPWebSocketFrameHeaderSize + lengthToWrite];
-    BLIPWebSocketFrameHeader* header = frame.mutableBytes;
-    header->number = NSSwapHostIntToBig(_number);
-    header->flags = NSSwapHostShortToBig(flags);
+    size_t headerSize = BLIPEncodeFrameHeader(dst, version, _number, flags, (UInt16)lengthToWrite);
 
     // Then write the body:
     if( lengthToWrite > 0 ) {
-        memcpy((char*)frame.mutableBytes + kBLIPWebSocketFrameHeaderSize,
-               (UInt8*)_encodedBody.bytes + _bytesWritten,
-               lengthToWrite);
+        [self _readEncodedBytes: dst + headerSize length: lengthToWrite];
         _bytesWritten += lengthToWrite;
     }
     *outMoreComing = (flags & kBLIP_MoreComing) != 0;
-    return frame;
+    return headerSize + lengthToWrite;
 }
 
 
@@ -337,26 +354,36 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... )
         _flags = (_flags & ~kBLIP_TypeMask) | frameType;
     }
 
-    if( _encodedBody )
-        [_encodedBody appendData: body];
-    else
-        _encodedBody = [body mutableCopy];
-    LogTo(BLIPVerbose,@"%@ rcvd bytes %lu-%lu",
-          self, (unsigned long)_encodedBody.length-body.length, (unsigned long)_encodedBody.length);
-    
-    if( ! _properties ) {
-        // Try to extract the properties:
+    if( _properties ) {
+        // Everything after the properties is body:
+        if( _encodedBody )
+            [_encodedBody appendData: body];
+        else
+            _encodedBody = [body mutableCopy];
+    } else {
+        // Try to extract the properties, which may span frames. They're parsed in place, and only
+        // the bytes that follow them go into _encodedBody, so the body never has to be shifted.
+        NSData *received = body;
+        if( _encodedBody ) {
+            [_encodedBody appendData: body];
+            received = _encodedBody;
+        }
         ssize_t usedLength;
-         _properties = [BLIPProperties propertiesWithEncodedData: _encodedBody usedLength: &usedLength];
+        _properties = [BLIPProperties propertiesWithEncodedData: received usedLength: &usedLength];
         if( _properties ) {
-            [_encodedBody replaceBytesInRange: NSMakeRange(0,usedLength)
-                                    withBytes: NULL length: 0];
+            _encodedBody = [[NSMutableData alloc] initWithBytes: (const UInt8*)received.bytes + usedLength
+                                                         length: received.length - usedLength];
             self.propertiesAvailable = YES;
             if (self.onPropertiesAvailable)
                 self.onPropertiesAvailable(self.properties);
-        } else if( usedLength < 0 )
+        } else if( usedLength < 0 ) {
             return NO;
+        } else if( ! _encodedBody ) {
+            _encodedBody = [body mutableCopy];
+        }
     }
+    LogTo(BLIPVerbose,@"%@ rcvd %lu bytes; %lu bytes of body so far",
+          self, (unsigned long)body.length, (unsigned long)_encodedBody.length);
     
     if( ! (flags & kBLIP_MoreComing) ) {
         // After last frame, decode the data:
@@ -371,7 +398,8 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... )
             LogTo(BLIPVerbose,@"Uncompressed %@ from %lu bytes (%.1fx)", self, (unsigned long)encodedLength,
                   _body.length/(double)encodedLength);
         } else {
-            _body = [_encodedBody copy];
+            // The message owns the receive buffer outright, so it becomes the body as-is:
+            _body = _encodedBody;
         }
         _encodedBody = nil;
         self.complete = YES;
@@ -398,6 +426,77 @@ NSError *BLIPMakeError( int errorCode, NSString *message, ... )
 @end
 
 
+
+#if DEBUG
+
+// Sends a message through the given frame format into an incoming message, and checks it arrives intact.
+static void roundTrip( NSDictionary *properties, NSData *body, BOOL compressed, UInt16 frameSize,
+                       int version ) {
+    BLIPRequest *q = [BLIPRequest requestWithBody: body properties: properties];
+    q.compressed = compressed;
+    [q _encode];
+    [q _assignedNumber: 1];
+
+    BLIPRequest *incoming = nil;
+    BOOL moreComing;
+    int nFrames = 0;
+    UInt8 *frame = malloc(frameSize);
+    do {
+        size_t frameLength = [q _writeFrameTo: frame maxSize: frameSize
+                               framingVersion: version moreComing: &moreComing];
+        CAssert(frameLength > 0 && frameLength <= frameSize);
+        BLIPFrameDescriptor desc;
+        if( version >= kBLIPFraming_v1 ) {
+            size_t consumed;
+            if( version >= kBLIPFraming_v2 )
+                CAssertEq(BLIPScanFramesV2(frame, frameLength, &desc, 1, &consumed), 1);
+            else
+                CAssertEq(BLIPScanFrames(frame, frameLength, &desc, 1, &consumed), 1);
+            CAssertEq(consumed, frameLength);
+        } else {
+            const BLIPWebSocketFrameHeader *header = (const void*)frame;
+            desc.number = NSSwapBigIntToHost(header->number);
+            desc.flags = NSSwapBigShortToHost(header->flags);
+            desc.bodyOffset = kBLIPWebSocketFrameHeaderSize;
+            desc.bodySize = (UInt16)(frameLength - kBLIPWebSocketFrameHeaderSize);
+        }
+        CAssertEq(desc.number, 1u);
+        NSData *frameBody = [[NSData alloc] initWithBytesNoCopy: frame + desc.bodyOffset
+                                                         length: desc.bodySize
+                                                   freeWhenDone: NO];
+        if( ! incoming )
+            incoming = [[BLIPRequest alloc] _initWithConnection: nil isMine: NO
+                                                          flags: desc.flags | kBLIP_MoreComing
+                                                         number: 1 body: nil];
+        CAssert([incoming _receivedFrameWithFlags: desc.flags body: frameBody]);
+        nFrames++;
+    } while( moreComing );
+    free(frame);
+    CAssertEq(q._bytesRemaining, 0u);
+    CAssert(incoming.complete);
+    CAssertEqual(incoming.properties.allProperties, properties);
+    CAssertEqual(incoming.body, body);
+    Log(@"Round-tripped %@ in %d v%d frames", incoming, nFrames, version);
+}
+
+TestCase(BLIPMessageFraming) {
+    NSMutableData *body = [NSMutableData dataWithLength: 1000];
+    for( NSUInteger i=0; i<body.length; i++ )
+        ((UInt8*)body.mutableBytes)[i] = (UInt8)(i % 251);
+    NSString *longValue = [@"" stringByPaddingToLength: 300 withString: @"0123456789" startingAtIndex: 0];
+
+    for( int version=kBLIPFraming_v1Message; version<=kBLIPFraming_v2; version++ ) {
+        roundTrip(@{@"Profile": @"Test"}, body, NO, 4096, version);     // single frame
+        roundTrip(@{@"Profile": @"Test"}, body, NO, 100, version);      // body spans frames
+        roundTrip(@{@"Long": longValue}, body, NO, 100, version);       // properties span frames too
+        roundTrip(@{@"Long": longValue}, body, YES, 100, version);
+        roundTrip(@{}, [NSData data], NO, 100, version);                // nothing at all
+    }
+}
+
+#endif
+
+
 /*
  Copyright (c) 2008, Jens Alfke <jens@mooseyard.com>. All rights reserved.
  
@@ -7,9 +7,20 @@
 //
 
 #import "BLIPProperties.h"
+#import "BLIP_Internal.h"
 #import "Logging.h"
 #import "Test.h"
 
+#include <stdatomic.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PROPS_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PROPS_NEON 1
+#endif
+
 
 /** Common strings are abbreviated as single-byte strings in the packed form.
     The ascii value of the single character minus one is the index into this table. */
@@ -27,17 +38,153 @@ static const char* kAbbreviations[] = {
 #define kNAbbreviations ((sizeof(kAbbreviations)/sizeof(const char*)))  // cannot exceed 31!
 
 
+// The abbreviations as NSStrings, and a bitmap of their lengths, for quick matching while encoding.
+static NSString* sAbbreviationStrings[kNAbbreviations];
+static UInt32 sAbbreviationLengths;
+
+static void initAbbreviations( void ) {
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        for( unsigned i=0; i<kNAbbreviations; i++ ) {
+            sAbbreviationStrings[i] = @(kAbbreviations[i]);
+            sAbbreviationLengths |= 1u << strlen(kAbbreviations[i]);
+        }
+    });
+}
+
+// Returns the one-byte abbreviation of a string, or 0 if it doesn't have one.
+static UInt8 abbreviationCode( NSString *str ) {
+    initAbbreviations();
+    NSUInteger length = str.length;
+    if( length >= 32 || !(sAbbreviationLengths & (1u << length)) )
+        return 0;
+    for( unsigned i=0; i<kNAbbreviations; i++ )
+        if( sAbbreviationStrings[i].length == length && [str isEqualToString: sAbbreviationStrings[i]] )
+            return (UInt8)(i+1);
+    return 0;
+}
+
+
+
+// Finds the NUL bytes in a buffer, 16 bytes at a time where SIMD is available. Returns the count;
+// if `positions` is non-NULL, also stores their offsets in it.
+static size_t findNULs( const UInt8 *bytes, size_t length, UInt32 *positions ) {
+    size_t count = 0, i = 0;
+#if PROPS_SSE2
+    for( ; i + 16 <= length; i += 16 ) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(bytes + i));
+        UInt32 mask = (UInt32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_setzero_si128()));
+        if( positions ) {
+            for( ; mask; mask &= mask - 1 )
+                positions[count++] = (UInt32)(i + __builtin_ctz(mask));
+        } else
+            count += __builtin_popcount(mask);
+    }
+#elif PROPS_NEON
+    for( ; i + 16 <= length; i += 16 ) {
+        // Narrow the comparison result to a 64-bit mask with four bits per byte:
+        uint8x16_t eq = vceqq_u8(vld1q_u8(bytes + i), vdupq_n_u8(0));
+        UInt64 mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if( positions ) {
+            while( mask ) {
+                int bit = __builtin_ctzll(mask);
+                positions[count++] = (UInt32)(i + (bit >> 2));
+                mask &= ~(0xFULL << bit);
+            }
+        } else
+            count += __builtin_popcountll(mask) >> 2;
+    }
+#endif
+    for( ; i < length; i++ ) {
+        if( bytes[i] == 0 ) {
+            if( positions )
+                positions[count] = (UInt32)i;
+            count++;
+        }
+    }
+    return count;
+}
+
+
+// Returns YES if 16 bytes are all ASCII.
+static inline BOOL isASCII16( const UInt8 *bytes ) {
+#if PROPS_SSE2
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)bytes)) == 0;
+#elif PROPS_NEON
+    return vmaxvq_u8(vld1q_u8(bytes)) < 0x80;
+#else
+    UInt64 a, b;
+    memcpy(&a, bytes, 8);
+    memcpy(&b, bytes + 8, 8);
+    return ((a | b) & 0x8080808080808080ULL) == 0;
+#endif
+}
+
+// Checks that a buffer is valid UTF-8: no overlong forms, surrogates or code points past U+10FFFF.
+// Runs of ASCII (nearly all property data) are skipped 16 bytes at a time.
+static BOOL isValidUTF8( const UInt8 *bytes, size_t length, BOOL *outASCII ) {
+    BOOL ascii = YES;
+    size_t i = 0;
+    while( i < length ) {
+        if( i + 16 <= length && isASCII16(bytes + i) ) {
+            i += 16;
+            continue;
+        }
+        UInt8 c = bytes[i];
+        if( c < 0x80 ) {
+            i++;
+            continue;
+        }
+        ascii = NO;
+        size_t nTrail;
+        UInt32 cp, minCP;
+        if( (c & 0xE0) == 0xC0 )      {nTrail = 1; cp = c & 0x1F; minCP = 0x80;}
+        else if( (c & 0xF0) == 0xE0 ) {nTrail = 2; cp = c & 0x0F; minCP = 0x800;}
+        else if( (c & 0xF8) == 0xF0 ) {nTrail = 3; cp = c & 0x07; minCP = 0x10000;}
+        else
+            return NO;
+        if( nTrail >= length - i )
+            return NO;
+        for( size_t k=1; k<=nTrail; k++ ) {
+            UInt8 trail = bytes[i+k];
+            if( (trail & 0xC0) != 0x80 )
+                return NO;
+            cp = (cp << 6) | (trail & 0x3F);
+        }
+        if( cp < minCP || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF) )
+            return NO;
+        i += 1 + nTrail;
+    }
+    *outASCII = ascii;
+    return YES;
+}
+
+
+
+// An entry in BLIPPackedProperties's string table.
+typedef struct {
+    const char *bytes;          // points into the packed data, or into kAbbreviations
+    UInt32 length;              // not including the NUL
+    UInt8 abbreviation;         // nonzero if the string was abbreviated
+} PackedString;
+
+// Number of strings (keys plus values) a BLIPPackedProperties can index without calling malloc.
+#define kNInlineStrings 8
+
 
 // Concrete implementation that stores properties in a packed binary form.
 @interface BLIPPackedProperties : BLIPProperties
 {
     NSData *_data;
-    int _count;
-    const char **_strings;
+    PackedString *_strings;
     int _nStrings;
+    BOOL _isASCII;
+    atomic_bool _parsed;
+    PackedString _inlineStrings[kNInlineStrings];   // used as _strings for small property sets
 }
 
 - (id) initWithBytes: (const char*)bytes length: (size_t)length;
+- (id) _initWithEncodedData: (NSData*)data;
 
 @end
 
@@ -77,6 +224,14 @@ static const char* kAbbreviations[] = {
 }
 
 
++ (BLIPProperties*) _propertiesWithEncodedData: (NSData*)data
+{
+    if( data.length <= sizeof(UInt16) )
+        return [BLIPProperties properties];
+    return [[BLIPPackedProperties alloc] _initWithEncodedData: data];
+}
+
+
 - (id) copyWithZone: (NSZone*)zone
 {
     return self;
@@ -105,6 +260,12 @@ static const char* kAbbreviations[] = {
     return [NSData dataWithBytes: &len length: sizeof(len)];
 }
 
+- (BOOL) _appendEncodedTo: (NSMutableData*)data
+{
+    [data increaseLengthBy: sizeof(UInt16)];
+    return YES;
+}
+
 
 + (BLIPProperties*) properties
 {
@@ -127,49 +288,95 @@ static const char* kAbbreviations[] = {
 {
     self = [super init];
     if (self != nil) {
-        // Copy data, then skip the length field:
         _data = [[NSData alloc] initWithBytes: bytes length: length];
-        bytes = (const char*)_data.bytes + sizeof(UInt16);
-        length -= sizeof(UInt16);
-        
-        if( bytes[length-1]!='\0' )
-            goto fail;
-
-        // The data consists of consecutive NUL-terminated strings, alternating key/value:
-        int capacity = 0;
-        const char *end = bytes+length;
-        for( const char *str=bytes; str < end; str += strlen(str)+1, _nStrings++ ) {
-            if( _nStrings >= capacity ) {
-                capacity = capacity ?(2*capacity) :4;
-                _strings = realloc(_strings, capacity*sizeof(const char*));
-            }
-            UInt8 first = (UInt8)str[0];
-            if( first>'\0' && first<' ' && str[1]=='\0' ) {
-                // Single-control-character property string is an abbreviation:
-                if( first > kNAbbreviations )
-                    goto fail;
-                _strings[_nStrings] = kAbbreviations[first-1];
-            } else
-                _strings[_nStrings] = str;
+        if( ! [self _parseAndValidate: YES] ) {
+            Warn(@"BLIPProperties: invalid data");
+            return nil;
         }
-        
-        // It's illegal for the data to end with a non-NUL or for there to be an odd number of strings:
-        if( (_nStrings & 1) )
-            goto fail;
-        
-        return self;
-            
-    fail:
-        Warn(@"BLIPProperties: invalid data");
-        return nil;
+        atomic_init(&_parsed, true);
     }
     return self;
 }
 
 
+// Wraps data produced by -_appendEncodedTo:. Since it's known to be valid, the string table
+// isn't built until the properties are first read (which outgoing messages rarely are.)
+- (id) _initWithEncodedData: (NSData*)data
+{
+    self = [super init];
+    if (self != nil) {
+        _data = [data copy];
+        atomic_init(&_parsed, false);
+    }
+    return self;
+}
+
+
+// Builds the _strings table, pointing into _data. Returns NO if the data is invalid.
+- (BOOL) _parseAndValidate: (BOOL)validate
+{
+    // Skip the length field:
+    const UInt8 *bytes = (const UInt8*)_data.bytes + sizeof(UInt16);
+    size_t length = _data.length - sizeof(UInt16);
+    if( length == 0 || bytes[length-1]!='\0' )
+        return NO;
+    if( validate && ! isValidUTF8(bytes, length, &_isASCII) )
+        return NO;
+
+    // The data consists of consecutive NUL-terminated strings, alternating key/value.
+    // Count the NULs first, so the table can be allocated at exactly the right size:
+    size_t nStrings = findNULs(bytes, length, NULL);
+    if( (nStrings & 1) || nStrings > INT_MAX )
+        return NO;      // It's illegal for there to be an odd number of strings
+    UInt32 stackEnds[64];
+    UInt32 *ends = (nStrings <= 64) ?stackEnds :malloc(nStrings*sizeof(UInt32));
+    findNULs(bytes, length, ends);
+    _strings = (nStrings <= kNInlineStrings) ?_inlineStrings :malloc(nStrings*sizeof(PackedString));
+
+    BOOL ok = YES;
+    UInt32 start = 0;
+    for( size_t i=0; i<nStrings; i++ ) {
+        PackedString *entry = &_strings[i];
+        entry->bytes = (const char*)bytes + start;
+        entry->length = ends[i] - start;
+        entry->abbreviation = 0;
+        UInt8 first = bytes[start];
+        if( entry->length == 1 && first < ' ' ) {
+            // Single-control-character property string is an abbreviation:
+            if( first > kNAbbreviations ) {
+                ok = NO;
+                break;
+            }
+            entry->abbreviation = first;
+            entry->bytes = kAbbreviations[first-1];
+            entry->length = (UInt32)strlen(entry->bytes);
+        }
+        start = ends[i] + 1;
+    }
+    _nStrings = ok ?(int)nStrings :0;
+    if( ends != stackEnds )
+        free(ends);
+    return ok;
+}
+
+- (void) _parseIfNeeded
+{
+    if( atomic_load_explicit(&_parsed, memory_order_acquire) )
+        return;
+    @synchronized(self) {
+        if( ! atomic_load_explicit(&_parsed, memory_order_relaxed) ) {
+            BOOL ok = [self _parseAndValidate: NO];
+            Assert(ok, @"Invalid encoded properties %@", _data);
+            atomic_store_explicit(&_parsed, true, memory_order_release);
+        }
+    }
+}
+
+
 - (void) dealloc
 {
-    if( _strings ) free(_strings);
+    if( _strings != _inlineStrings )
+        free(_strings);
 }
 
 - (id) copyWithZone: (NSZone*)zone
@@ -183,14 +390,32 @@ static const char* kAbbreviations[] = {
 }
 
 
+// Creates an NSString from a string table entry. The data has already been validated,
+// and its length is known, so there's no need for strlen or -initWithUTF8String:.
+static NSString* stringForEntry( const PackedString *entry, BOOL ascii ) {
+    if( entry->abbreviation ) {
+        initAbbreviations();
+        return sAbbreviationStrings[entry->abbreviation - 1];
+    }
+    CFStringRef str = CFStringCreateWithBytes(NULL, (const UInt8*)entry->bytes, entry->length,
+                                              (ascii ?kCFStringEncodingASCII :kCFStringEncodingUTF8),
+                                              false);
+    return CFBridgingRelease(str);
+}
+
+
 - (NSString*) valueOfProperty: (NSString*)prop
 {
-    const char *propStr = [prop UTF8String];
+    [self _parseIfNeeded];
+    const char *propStr = CFStringGetCStringPtr((__bridge CFStringRef)prop, kCFStringEncodingUTF8);
+    if( ! propStr )
+        propStr = [prop UTF8String];
     Assert(propStr);
+    size_t propLength = strlen(propStr);
     // Search in reverse order so that later values will take precedence over earlier ones.
     for( int i=_nStrings-2; i>=0; i-=2 ) {
-        if( strcmp(propStr, _strings[i]) == 0 )
-            return @(_strings[i+1]);
+        if( _strings[i].length == propLength && memcmp(propStr, _strings[i].bytes, propLength) == 0 )
+            return stringForEntry(&_strings[i+1], _isASCII);
     }
     return nil;
 }
@@ -203,12 +428,13 @@ static const char* kAbbreviations[] = {
 
 - (NSDictionary*) allProperties
 {
+    [self _parseIfNeeded];
     NSMutableDictionary *props = [NSMutableDictionary dictionaryWithCapacity: _nStrings/2];
     // Add values in forward order so that later ones will overwrite (take precedence over)
     // earlier ones, which matches the behavior of -valueOfProperty.
     for( int i=0; i<_nStrings; i+=2 ) {
-        NSString *key = [[NSString alloc] initWithUTF8String: _strings[i]];
-        NSString *value = [[NSString alloc] initWithUTF8String: _strings[i+1]];
+        NSString *key = stringForEntry(&_strings[i], _isASCII);
+        NSString *value = stringForEntry(&_strings[i+1], _isASCII);
         if( key && value )
             props[key] = value;
     }
@@ -216,10 +442,16 @@ static const char* kAbbreviations[] = {
 }
 
 
-- (NSUInteger) count        {return _nStrings/2;}
+- (NSUInteger) count        {[self _parseIfNeeded]; return _nStrings/2;}
 - (NSData*) encodedData     {return _data;}
 - (NSUInteger) dataLength   {return _data.length;}
 
+- (BOOL) _appendEncodedTo: (NSMutableData*)data
+{
+    [data appendData: _data];
+    return YES;
+}
+
 
 @end
 
@@ -263,10 +495,9 @@ static const char* kAbbreviations[] = {
 
 - (id) copyWithZone: (NSZone*)zone
 {
-    ssize_t usedLength;
-    BLIPProperties *copy = [BLIPProperties propertiesWithEncodedData: self.encodedData usedLength: &usedLength];
-    Assert(copy);
-    return copy;
+    NSData *data = self.encodedData;
+    Assert(data, @"Properties are too large to encode");
+    return [BLIPProperties _propertiesWithEncodedData: data];
 }
 
 
@@ -288,32 +519,73 @@ static const char* kAbbreviations[] = {
 - (NSUInteger) count        {return _properties.count;}
 
 
-static void appendStr( NSMutableData *data, NSString *str ) {
-    const char *utf8 = [str UTF8String];
-    size_t size = strlen(utf8)+1;
-    for( unsigned i=0; i<kNAbbreviations; i++ )
-        if( memcmp(utf8,kAbbreviations[i],size)==0 ) {
-            const UInt8 abbrev[2] = {i+1,0};
-            [data appendBytes: &abbrev length: 2];
-            return;
-        }
-    [data appendBytes: utf8 length: size];
+// Describes how one key or value string will be written by -_appendEncodedTo:.
+typedef struct {
+    __unsafe_unretained NSString *str;
+    const char *utf8;           // UTF-8 bytes, if CF can provide them without copying; else NULL
+    size_t length;              // encoded length, not counting the trailing NUL
+    UInt8 abbreviation;         // nonzero if the string is written as its abbreviation
+} EncodedString;
+
+static size_t measureString( NSString *str, EncodedString *e ) {
+    e->str = str;
+    e->utf8 = NULL;
+    e->abbreviation = abbreviationCode(str);
+    if( e->abbreviation )
+        e->length = 1;
+    else {
+        e->utf8 = CFStringGetCStringPtr((__bridge CFStringRef)str, kCFStringEncodingUTF8);
+        e->length = e->utf8 ?strlen(e->utf8) :[str lengthOfBytesUsingEncoding: NSUTF8StringEncoding];
+    }
+    return e->length + 1;
 }
 
-- (NSData*) encodedData
+static UInt8* writeString( const EncodedString *e, UInt8 *dst ) {
+    if( e->abbreviation )
+        *dst = e->abbreviation;
+    else if( e->utf8 )
+        memcpy(dst, e->utf8, e->length);
+    else
+        [e->str getBytes: dst maxLength: e->length usedLength: NULL encoding: NSUTF8StringEncoding
+                 options: 0 range: NSMakeRange(0,e->str.length) remainingRange: NULL];
+    dst[e->length] = '\0';
+    return dst + e->length + 1;
+}
+
+- (BOOL) _appendEncodedTo: (NSMutableData*)data
 {
-    NSMutableData *data = [NSMutableData dataWithCapacity: 16*_properties.count];
-    [data setLength: sizeof(UInt16)]; // leave room for length
+    // Measure all the strings first, so the output grows exactly once and no temporary C strings
+    // are created. Nearly every message has few enough properties to measure them on the stack.
+    NSUInteger nStrings = 2*_properties.count;
+    EncodedString stackStrings[32];
+    EncodedString *strings = (nStrings <= 32) ?stackStrings :malloc(nStrings*sizeof(EncodedString));
+    size_t length = 0;
+    EncodedString *e = strings;
     for( NSString *name in _properties ) {
-        appendStr(data,name);
-        appendStr(data,_properties[name]);
+        length += measureString(name, e++);
+        length += measureString(_properties[name], e++);
     }
-    
-    NSUInteger length = data.length - sizeof(UInt16);
-    if( length > 0xFFFF )
-        return nil;
-    *(UInt16*)[data mutableBytes] = NSSwapHostShortToBig((UInt16)length);
-    return data;
+
+    BOOL ok = (length <= 0xFFFF);
+    if( ok ) {
+        NSUInteger start = data.length;
+        [data increaseLengthBy: sizeof(UInt16) + length];
+        UInt8 *dst = (UInt8*)data.mutableBytes + start;
+        UInt16 bigLength = NSSwapHostShortToBig((UInt16)length);
+        memcpy(dst, &bigLength, sizeof(bigLength));
+        dst += sizeof(bigLength);
+        for( e=strings; e < strings+nStrings; e++ )
+            dst = writeString(e, dst);
+    }
+    if( strings != stackStrings )
+        free(strings);
+    return ok;
+}
+
+- (NSData*) encodedData
+{
+    NSMutableData *data = [NSMutableData data];
+    return [self _appendEncodedTo: data] ?data :nil;
 }
 
     
@@ -395,7 +667,138 @@ TestCase(BLIPProperties) {
     NSDictionary *all = mprops.allProperties;
     for( NSString *prop in all )
         CAssertEqual([props valueOfProperty: prop],all[prop]);
-	
+
+    // Abbreviations and non-ASCII strings:
+    [mprops setValue: @"text/plain; charset=UTF-8" ofProperty: @"Content-Type"];
+    [mprops setValue: @"Jëns Ålfke ☃" ofProperty: @"Name"];
+    data = mprops.encodedData;
+    props = [BLIPProperties propertiesWithEncodedData: data usedLength: &used];
+    CAssertEq(used,(ssize_t)data.length);
+    CAssertEqual(props,mprops);
+
+    // Copying wraps the encoded form without re-parsing it until it's read:
+    props = [mprops copy];
+    CAssertEqual(props.encodedData,data);
+    CAssertEqual([props valueOfProperty: @"Name"],@"Jëns Ålfke ☃");
+    CAssertEqual(props,mprops);
+}
+
+
+TestCase(BLIPPropertiesValidation) {
+    // UTF-8 validation:
+    const char* kValid[] = {"", "plain ASCII that is longer than sixteen bytes", "caf\xC3\xA9",
+                            "\xE2\x98\x83 snowman", "\xF0\x9F\x98\x80"};
+    const char* kInvalid[] = {"\x80", "\xC3", "\xC0\xAF", "\xE0\x80\xAF", "\xED\xA0\x80",
+                              "\xF4\x90\x80\x80", "\xFF", "0123456789abcdef\xC3"};
+    BOOL ascii;
+    for( unsigned i=0; i<sizeof(kValid)/sizeof(kValid[0]); i++ )
+        CAssert(isValidUTF8((const UInt8*)kValid[i], strlen(kValid[i]), &ascii), @"#%u", i);
+    for( unsigned i=0; i<sizeof(kInvalid)/sizeof(kInvalid[0]); i++ )
+        CAssert(!isValidUTF8((const UInt8*)kInvalid[i], strlen(kInvalid[i]), &ascii), @"#%u", i);
+
+    // Invalid UTF-8 in the packed data is rejected:
+    const char kBad[] = "\0\x08Name\0\xC0\xAF\0";
+    ssize_t used;
+    NSData *badData = [NSData dataWithBytes: kBad length: sizeof(kBad)-1];
+    CAssertEq([BLIPProperties propertiesWithEncodedData: badData usedLength: &used], (id)nil);
+    CAssertEq(used, -1);
+
+    // NUL scanning across SIMD chunks, and more strings than fit in the inline table:
+    BLIPMutableProperties *mprops = [[BLIPMutableProperties alloc] init];
+    for( int i=0; i<40; i++ )
+        [mprops setValue: [@"" stringByPaddingToLength: i withString: @"v" startingAtIndex: 0]
+              ofProperty: $sprintf(@"Header-%d", i)];
+    [mprops setValue: @"application/octet-stream" ofProperty: @"Content-Type"];
+    NSData *data = mprops.encodedData;
+    const UInt8 *bytes = (const UInt8*)data.bytes + 2;
+    size_t length = data.length - 2;
+    size_t nNULs = findNULs(bytes, length, NULL);
+    CAssertEq(nNULs, (size_t)82);
+    UInt32 positions[82];
+    findNULs(bytes, length, positions);
+    for( size_t i=0; i<nNULs; i++ ) {
+        CAssertEq(bytes[positions[i]], 0);
+        if( i > 0 )
+            CAssert(positions[i] > positions[i-1]);
+    }
+    BLIPProperties *props = [BLIPProperties propertiesWithEncodedData: data usedLength: &used];
+    CAssertEq(props.count, 41u);
+    CAssertEqual(props, mprops);
+    CAssertEqual([props valueOfProperty: @"Header-39"], [mprops valueOfProperty: @"Header-39"]);
+    CAssertEqual(props[@"Content-Type"], @"application/octet-stream");
+}
+
+
+TestCase(BLIPPropertiesParseSpeed) {
+    // A message with lots of headers:
+    BLIPMutableProperties *mprops = [[BLIPMutableProperties alloc] init];
+    for( int i=0; i<40; i++ )
+        [mprops setValue: $sprintf(@"value number %d", i) ofProperty: $sprintf(@"X-Header-%d", i)];
+    [mprops setValue: @"text/plain; charset=UTF-8" ofProperty: @"Content-Type"];
+    NSData *data = mprops.encodedData;
+    const int kIterations = 20000;
+    NSUInteger total = 0;
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for( int i=0; i<kIterations; i++ ) {
+        @autoreleasepool {
+            ssize_t used;
+            BLIPProperties *props = [BLIPProperties propertiesWithEncodedData: data usedLength: &used];
+            total += props.count;
+        }
+    }
+    CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+    Log(@"Parsing %lu properties (%lu bytes): %.0f ns each",
+        (unsigned long)mprops.count, (unsigned long)data.length, elapsed/kIterations*1e9);
+
+    start = CFAbsoluteTimeGetCurrent();
+    for( int i=0; i<kIterations; i++ ) {
+        @autoreleasepool {
+            ssize_t used;
+            BLIPProperties *props = [BLIPProperties propertiesWithEncodedData: data usedLength: &used];
+            total += props.allProperties.count;
+        }
+    }
+    elapsed = CFAbsoluteTimeGetCurrent() - start;
+    Log(@"Parsing %lu properties into an NSDictionary: %.0f ns each",
+        (unsigned long)mprops.count, elapsed/kIterations*1e9);
+    CAssertEq(total, (NSUInteger)(2*kIterations*mprops.count));
+}
+
+
+TestCase(BLIPPropertiesEncodeSpeed) {
+    // A typical small request: two abbreviated strings and a couple of short custom properties.
+    NSDictionary *dict = @{@"Profile": @"BLIPTest/EchoData",
+                           @"Content-Type": @"application/octet-stream",
+                           @"User-Agent": @"BLIPTest",
+                           @"Sequence": @"12345"};
+    BLIPMutableProperties *mprops = [[BLIPMutableProperties alloc] initWithDictionary: dict];
+    NSData *body = [NSMutableData dataWithLength: 64];
+    const int kIterations = 100000;
+    NSUInteger total = 0;
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for( int i=0; i<kIterations; i++ ) {
+        @autoreleasepool {
+            total += mprops.encodedData.length;
+        }
+    }
+    CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+    Log(@"Encoding %lu properties: %.0f ns each",
+        (unsigned long)dict.count, elapsed/kIterations*1e9);
+
+    start = CFAbsoluteTimeGetCurrent();
+    for( int i=0; i<kIterations; i++ ) {
+        @autoreleasepool {
+            BLIPRequest *q = [BLIPRequest requestWithBody: body properties: dict];
+            [q _encode];
+            total += q._bytesRemaining;
+        }
+    }
+    elapsed = CFAbsoluteTimeGetCurrent() - start;
+    Log(@"Encoding a request with %lu properties and %lu-byte body: %.0f ns each",
+        (unsigned long)dict.count, (unsigned long)body.length, elapsed/kIterations*1e9);
+    CAssert(total > 0);
 }
 
 
@@ -6,12 +6,8 @@
 //  Copyright 2008 Jens Alfke. All rights reserved.
 //
 
-@class BLIPResponse;
 
-
-/** INTERNAL class that reads BLIP frames from the socket. */
+/** INTERNAL class that reads from the socket and passes the bytes to the connection's BLIPEngine. */
 @interface BLIPReader : TCPReader
 
-- (void) _addPendingResponse: (BLIPResponse*)response;
-
 @end
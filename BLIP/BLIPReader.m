@@ -8,229 +8,71 @@
 
 #import "BLIPReader.h"
 #import "BLIP_Internal.h"
-#import "BLIPWriter.h"
-#import "BLIPDispatcher.h"
+#import "BLIPEngine.h"
 #import "TCP_Internal.h"
+#import "MYBufferPool.h"
 
 #import "Logging.h"
 #import "Test.h"
-#import "CollectionUtils.h"
-
-
-@interface BLIPReader ()
-- (BOOL) _receivedFrameWithHeader: (const BLIPFrameHeader*)header body: (NSData*)body;
-@end
 
 
 @implementation BLIPReader
 {
-    BLIPFrameHeader _curHeader;
-    NSUInteger _curBytesRead;
-    NSMutableData *_curBody;
-
-    UInt32 _numRequestsReceived;
-    NSMutableDictionary *_pendingRequests, *_pendingResponses;
+    NSMutableData *_readBuffer;
+    NSUInteger _readLength;
 }
 
 
 #define _blipConn ((BLIPConnection*)_conn)
 
 
-- (id) initWithConnection: (BLIPConnection*)conn stream: (NSStream*)stream
-{
-    self = [super initWithConnection: conn stream: stream];
-    if (self != nil) {
-        _pendingRequests = [[NSMutableDictionary alloc] init];
-        _pendingResponses = [[NSMutableDictionary alloc] init];
-    }
-    return self;
-}
-
-
 - (void) disconnect
 {
-    for( BLIPResponse *response in [_pendingResponses allValues] ) {
-        [response _connectionClosed];
-        [_conn tellDelegate: @selector(connection:receivedResponse:) withObject: response];
-    }
-    _pendingResponses = nil;
+    [_blipConn._engine disconnect];
+    [_bufferPool recycle: _readBuffer];
+    _readBuffer = nil;
+    _readLength = 0;
     [super disconnect];
 }
 
 
-#pragma mark -
-#pragma mark READING FRAMES:
-
-
-- (NSString*) _validateHeader
-{
-    // Convert header to native byte order:
-    _curHeader.magic = NSSwapBigIntToHost(_curHeader.magic);
-    _curHeader.number= NSSwapBigIntToHost(_curHeader.number);
-    _curHeader.flags = NSSwapBigShortToHost(_curHeader.flags);
-    _curHeader.size  = NSSwapBigShortToHost(_curHeader.size);
-    
-    if( _curHeader.magic != kBLIPFrameHeaderMagicNumber )
-        return $sprintf(@"Incorrect magic number (%08X not %08X)",
-                        (unsigned int)_curHeader.magic,kBLIPFrameHeaderMagicNumber);
-    size_t bodyLength = _curHeader.size;
-    if( bodyLength < sizeof(BLIPFrameHeader) )
-        return @"Length is impossibly short";
-    bodyLength -= sizeof(BLIPFrameHeader);
-    _curBody = [[NSMutableData alloc] initWithLength: bodyLength];
-    return nil;
-}
-    
-
-- (void) _endCurFrame
-{
-    [self _receivedFrameWithHeader: &_curHeader body: _curBody];
-    memset(&_curHeader,0,sizeof(_curHeader));
-    _curBody = nil;
-    _curBytesRead = 0;
-}
+// The read buffer can hold the largest possible frame, so a frame never has to be read in pieces.
+#define kReadBufferSize 65536
 
 
 - (BOOL) isBusy
 {
-    return _curBytesRead > 0 || _pendingRequests.count > 0 || _pendingResponses.count > 0;
+    return _readLength > 0 || _blipConn._engine.isAwaitingFrames;
 }
 
 
 - (void) _canRead
 {
-    ssize_t headerLeft = sizeof(BLIPFrameHeader) - _curBytesRead;
-    if( headerLeft > 0 ) {
-        // Read (more of) the header:
-        NSInteger bytesRead = [self read: (uint8_t*)&_curHeader +_curBytesRead
-                               maxLength: headerLeft];
-        if( bytesRead > 0 ) {
-            _curBytesRead += bytesRead;
-            if( _curBytesRead < sizeof(BLIPFrameHeader) ) {
-                // Incomplete header:
-                LogTo(BLIPVerbose,@"%@ read %luuu bytes of header (%lu left)",
-                      self,(long)bytesRead,sizeof(BLIPFrameHeader)-_curBytesRead);
-            } else {
-                // Finished reading the header!
-                NSString *err = [self _validateHeader];
-                if( err ) {
-                    Warn(@"%@ read bogus frame header: %@",self,err);
-                    return (void)[self _gotError: BLIPMakeError(kBLIPError_BadData, @"%@", err)];
-                }
-                LogTo(BLIPVerbose,@"%@: Read header; next is %lu-byte body",self,(unsigned long)_curBody.length);
-                
-                if( _curBody.length == 0 ) {
-                    // Zero-byte body, so no need to wait for another read
-                    [self _endCurFrame];
-                }
-            }
-        }
-        
-    } else {
-        // Read (more of) the current frame's body:
-        ssize_t bodyRemaining = (SInt32)_curBody.length + headerLeft;
-        if( bodyRemaining > 0 ) {
-            uint8_t *dst = _curBody.mutableBytes;
-            dst += _curBody.length - bodyRemaining;
-            NSInteger bytesRead = [self read: dst maxLength: bodyRemaining];
-            if( bytesRead > 0 ) {
-                _curBytesRead += bytesRead;
-                bodyRemaining -= bytesRead;
-                LogTo(BLIPVerbose,@"%@: Read %lu bytes of frame body (%zu left)",self,(long)bytesRead,bodyRemaining);
-            }
-        }
-        if( bodyRemaining==0 ) {
-            // Done reading this frame: give it to the Connection and reset my state
-            [self _endCurFrame];
-        }
+    // Read as much as will fit after any partial frame left over from last time:
+    if( ! _readBuffer )
+        _readBuffer = [_bufferPool dataWithLength: kReadBufferSize];
+    NSMutableData *buffer = _readBuffer;    // in case a frame handler disconnects me
+    UInt8 *bytes = buffer.mutableBytes;
+    NSInteger bytesRead = [self read: bytes + _readLength maxLength: kReadBufferSize - _readLength];
+    if( bytesRead <= 0 )
+        return;
+    _readLength += bytesRead;
+    LogTo(BLIPVerbose,@"%@ read %ld bytes (%lu buffered)",self,(long)bytesRead,(unsigned long)_readLength);
+
+    // Let the engine handle all the complete frames in the buffer:
+    NSError *error;
+    ssize_t consumed = [_blipConn._engine receiveBytes: bytes length: _readLength error: &error];
+    if( _readBuffer != buffer )
+        return;
+    if( consumed < 0 ) {
+        _readLength = 0;
+        return (void)[self _gotError: error];
     }
-}
-
-
-#pragma mark -
-#pragma mark PROCESSING FRAMES:
-
 
-- (void) _addPendingResponse: (BLIPResponse*)response
-{
-    _pendingResponses[$object(response.number)] = response;
-}
-
-
-- (BOOL) _receivedFrameWithHeader: (const BLIPFrameHeader*)header body: (NSData*)body
-{
-    static const char* kTypeStrs[16] = {"MSG","RPY","ERR","3??","4??","5??","6??","7??"};
-    BLIPMessageType type = header->flags & kBLIP_TypeMask;
-    LogTo(BLIPVerbose,@"%@ rcvd frame of %s #%u, length %lu",self,kTypeStrs[type],(unsigned int)header->number,(unsigned long)body.length);
-
-    id key = $object(header->number);
-    BOOL complete = ! (header->flags & kBLIP_MoreComing);
-    switch(type) {
-        case kBLIP_MSG: {
-            // Incoming request:
-            BLIPRequest *request = _pendingRequests[key];
-            if( request ) {
-                // Continuation frame of a request:
-                if( complete ) {
-                    [_pendingRequests removeObjectForKey: key];
-                }
-            } else if( header->number == _numRequestsReceived+1 ) {
-                // Next new request:
-                request = [[[_blipConn requestClass] alloc] _initWithConnection: _blipConn
-                                                         isMine: NO
-                                                          flags: header->flags | kBLIP_MoreComing
-                                                         number: header->number
-                                                           body: nil];
-                if( ! complete )
-                    _pendingRequests[key] = request;
-                _numRequestsReceived++;
-            } else
-                return [self _gotError: BLIPMakeError(kBLIPError_BadFrame, 
-                                               @"Received bad request frame #%u (next is #%u)",
-                                               (unsigned int)header->number,
-                                               (unsigned)_numRequestsReceived+1)];
-            
-            if( ! [request _receivedFrameWithFlags: header->flags body: body] )
-                return [self _gotError: BLIPMakeError(kBLIPError_BadFrame, 
-                                               @"Couldn't parse message frame")];
-            
-            if( complete )
-                [_blipConn _dispatchRequest: request];
-            break;
-        }
-            
-        case kBLIP_RPY:
-        case kBLIP_ERR: {
-            BLIPResponse *response = _pendingResponses[key];
-            if( response ) {
-                if( complete ) {
-                    [_pendingResponses removeObjectForKey: key];
-                }
-                
-                if( ! [response _receivedFrameWithFlags: header->flags body: body] ) {
-                    return [self _gotError: BLIPMakeError(kBLIPError_BadFrame, 
-                                                          @"Couldn't parse response frame")];
-                } else if( complete ) 
-                    [_blipConn _dispatchResponse: response];
-                
-            } else {
-                if( header->number <= ((BLIPWriter*)self.writer).numRequestsSent )
-                    LogTo(BLIP,@"??? %@ got unexpected response frame to my msg #%u",
-                          self,(unsigned int)header->number); //benign
-                else
-                    return [self _gotError: BLIPMakeError(kBLIPError_BadFrame, 
-                                                          @"Bogus message number %u in response",
-                                                          (unsigned int)header->number)];
-            }
-            break;
-        }
-            
-        default:
-            // To leave room for future expansion, undefined message types are just ignored.
-            Log(@"??? %@ received header with unknown message type %i", self,type);
-            break;
-    }
-    return YES;
+    // Move any partial frame to the start of the buffer:
+    _readLength -= consumed;
+    if( _readLength > 0 && consumed > 0 )
+        memmove(bytes, bytes + consumed, _readLength);
 }
 
 
@@ -42,10 +42,25 @@
     If this request has not been assigned to a connection, an exception will be raised. */
 - (BLIPResponse*) send;
 
+/** Cancels a request that's been sent.
+    Any of it that hasn't been transmitted yet is discarded, the peer is told to drop what it
+    has received and not to reply, and the response completes with a kBLIPError_Cancelled error.
+    Does nothing if the response has already arrived. */
+- (void) cancel;
+
+/** Returns YES if -cancel has been called. */
+@property (readonly) BOOL cancelled;
+
 /** Does this request not need a response?
     This property can only be set before sending the request. */
 @property BOOL noReply;
 
+/** The maximum time to wait for the response, measured from when the request is sent.
+    If it expires first, the response completes with a kBLIPError_Timeout error (and any
+    response frames that arrive later are ignored.) Defaults to zero, meaning no timeout.
+    This property can only be set before sending the request. */
+@property NSTimeInterval timeout;
+
 /** Returns YES if you've replied to this request (by accessing its -response property.) */
 @property (readonly) BOOL repliedTo;
 
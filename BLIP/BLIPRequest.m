@@ -18,6 +18,8 @@
 @implementation BLIPRequest
 {
     BLIPResponse *_response;
+    NSTimeInterval _timeout;
+    BOOL _cancelled, _responseDeferred;
 }
 
 
@@ -63,6 +65,7 @@
     copy.compressed = self.compressed;
     copy.urgent = self.urgent;
     copy.noReply = self.noReply;
+    copy.timeout = self.timeout;
     return copy;
 }
 
@@ -72,6 +75,13 @@
 - (BOOL) noReply                            {return (_flags & kBLIP_NoReply) != 0;}
 - (void) setNoReply: (BOOL)noReply          {[self _setFlag: kBLIP_NoReply value: noReply];}
 - (BLIPConnection*) connection              {return _connection;}
+- (NSTimeInterval) timeout                  {return _timeout;}
+
+- (void) setTimeout: (NSTimeInterval)timeout
+{
+    Assert(_isMine && _isMutable);
+    _timeout = timeout;
+}
 
 - (void) setConnection: (BLIPConnection*)conn
 {
@@ -80,6 +90,17 @@
 }
 
 
+// Adds a property to a request that's been encoded but not yet sent. (Used by BLIPResponseCache.)
+- (void) _setEncodedValue: (NSString*)value ofProperty: (NSString*)property
+{
+    Assert(_isMine && !_sent && _number==0);
+    _properties = [_properties mutableCopy];
+    _isMutable = YES;
+    [self setValue: value ofProperty: property];
+    [self _encode];
+}
+
+
 - (BLIPResponse*) send
 {
     Assert(_connection,@"%@ has no connection to send over",self);
@@ -94,6 +115,18 @@
 }
 
 
+- (void) cancel
+{
+    Assert(_isMine,@"Only outgoing requests can be canceled");
+    if( !_sent || _cancelled )
+        return;
+    _cancelled = YES;
+    [_connection _cancelRequest: self];
+}
+
+@synthesize cancelled=_cancelled;
+
+
 - (BLIPResponse*) response
 {
     if( ! _response && ! self.noReply )
@@ -111,9 +144,12 @@
     // This will allocate _response, causing -repliedTo to become YES, so BLIPConnection won't
     // send an automatic empty response after the current request handler returns.
     LogTo(BLIP,@"Deferring response to %@",self);
+    _responseDeferred = YES;
     [self response];
 }
 
+@synthesize _responseDeferred=_responseDeferred;
+
 - (BOOL) repliedTo
 {
     return _response != nil;
@@ -159,6 +195,9 @@
 @implementation BLIPResponse
 {
     MYTarget *_onComplete;
+    MYTimer _timeoutTimer;
+    __weak BLIPResponseCache *_responseCache;
+    NSData *_responseCacheKey;
 }
 
 - (id) _initWithRequest: (BLIPRequest*)request
@@ -182,6 +221,18 @@
 }
 
 
+- (void) dealloc
+{
+    MYTimerCancel(&_timeoutTimer);
+}
+
+
+- (MYTimer*) _timeoutTimer
+{
+    return &_timeoutTimer;
+}
+
+
 #if DEBUG
 // For testing only
 - (id) _initIncomingWithProperties: (BLIPProperties*)properties body: (NSData*)body {
@@ -265,11 +316,16 @@
 }
 
 
-@synthesize onComplete=_onComplete;
+@synthesize onComplete=_onComplete, _responseCache=_responseCache,
+            _responseCacheKey=_responseCacheKey;
 
 
 - (void) setComplete: (BOOL)complete
 {
+    if( complete ) {
+        MYTimerCancel(&_timeoutTimer);
+        [_responseCache _responseCompleted: self];
+    }
     [super setComplete: complete];
     if( complete && _onComplete ) {
         @try{
@@ -279,6 +335,51 @@
 }
 
 
+// Completes an incoming response with an error, without waiting for it to arrive.
+- (void) _failWithError: (NSError*)error
+{
+    Assert(!_isMine);
+    if( _complete )
+        return;
+    // Change incoming response to an error:
+    _isMutable = YES;
+    _properties = [_properties mutableCopy];
+    [self _setError: error];
+    _isMutable = NO;
+    _flags &= ~kBLIP_MoreComing;
+
+    self.complete = YES;    // Calls onComplete target
+}
+
+
+// Fills in an incoming response with contents from a BLIPResponseCache.
+- (void) _setFlags: (BLIPMessageFlags)flags
+        properties: (BLIPProperties*)properties
+              body: (NSData*)body
+{
+    Assert(!_isMine);
+    if( _complete )
+        return;
+    _flags = (_flags & ~kBLIP_TypeMask) | (flags & kBLIP_TypeMask);
+    _properties = properties;
+    _body = body;
+    _encodedBody = nil;
+    if( ! self.propertiesAvailable ) {
+        self.propertiesAvailable = YES;
+        if (self.onPropertiesAvailable)
+            self.onPropertiesAvailable(self.properties);
+    }
+}
+
+- (void) _completeFromCache
+{
+    if( _complete )
+        return;
+    _flags &= ~kBLIP_MoreComing;
+    self.complete = YES;    // Calls onComplete target
+}
+
+
 - (void) _connectionClosed
 {
     [super _connectionClosed];
@@ -287,13 +388,7 @@
         if (!error)
             error = BLIPMakeError(kBLIPError_Disconnected,
                                   @"Connection closed before response was received");
-        // Change incoming response to an error:
-        _isMutable = YES;
-        _properties = [_properties mutableCopy];
-        [self _setError: error];
-        _isMutable = NO;
-        
-        self.complete = YES;    // Calls onComplete target
+        [self _failWithError: error];
     }
 }
 
@@ -0,0 +1,65 @@
+//
+//  BLIPResponseCache.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+@class BLIPRequest;
+
+
+/** An opt-in, client-side cache of responses to idempotent requests.
+    Attach one to a BLIPConnection (or several connections to the same service) via the
+    connection's responseCache property, and register the request profiles that are safe to cache.
+
+    Requests are identified by a hash of their properties (in canonical order) and body.
+    - If a fresh response to an identical request is cached, no request is sent; the response
+      is filled in right away and completes on the next run-loop cycle.
+    - If an identical request is already in flight, no request is sent either; the response
+      completes when the in-flight one does, with the same contents.
+    - Otherwise the request goes over the wire, and its response is cached if it succeeded.
+
+    A response stays fresh for the number of seconds in its "Max-Age" property, or for
+    defaultMaxAge if it has none. A response with an "ETag" property is kept after it goes stale;
+    the next identical request is sent with an "If-None-Match" property holding the ETag, and if
+    the peer replies with a kBLIPError_NotModified error, the cached response is used instead.
+
+    Responses served from the cache invoke their onComplete target, but are not passed to the
+    connection delegate's -connection:receivedResponse: method. If an in-flight request is
+    canceled, the identical requests waiting on it complete with the same cancellation error. */
+@interface BLIPResponseCache : NSObject
+
+/** Initializes a cache that holds up to `maxSize` bytes of response properties and bodies. */
+- (id) initWithMaxSize: (NSUInteger)maxSize;
+
+/** The maximum total size of the cached responses. The least recently used ones are evicted
+    to stay under this limit. */
+@property (readonly) NSUInteger maxSize;
+
+/** The current total size of the cached responses. */
+@property (readonly) NSUInteger size;
+
+/** The number of cached responses. */
+@property (readonly) NSUInteger count;
+
+/** How long a response without a "Max-Age" property stays fresh. Defaults to zero, meaning that
+    such responses aren't cached at all unless they have an "ETag". */
+@property NSTimeInterval defaultMaxAge;
+
+/** Allows requests with the given "Profile" property to be cached.
+    Requests with no profile, NoReply requests and meta requests are never cached. */
+- (void) addProfile: (NSString*)profile;
+
+/** Returns YES if responses to this request can be cached. */
+- (BOOL) canCacheRequest: (BLIPRequest*)request;
+
+/** Discards all cached responses. Requests in flight are unaffected. */
+- (void) removeAllResponses;
+
+/** Statistics: requests answered from the cache, requests sent to the peer, and requests
+    that were merged with an identical in-flight request. */
+@property (readonly) NSUInteger hits, misses, coalesced;
+
+@end
@@ -0,0 +1,383 @@
+//
+//  BLIPResponseCache.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "BLIPResponseCache.h"
+#import "BLIP_Internal.h"
+
+#import "Logging.h"
+#import "Test.h"
+
+#import <CommonCrypto/CommonDigest.h>
+
+
+/** A cached response. Entries form a doubly-linked list in order of use, for LRU eviction;
+    the links are unretained since the cache's dictionary owns the entries. */
+@interface BLIPCacheEntry : NSObject
+{
+    @public
+    NSData *_key;
+    BLIPMessageFlags _flags;
+    BLIPProperties *_properties;
+    NSData *_body;
+    NSString *_etag;
+    CFAbsoluteTime _expires;
+    NSUInteger _size;
+    __unsafe_unretained BLIPCacheEntry *_newer, *_older;
+}
+@end
+
+@implementation BLIPCacheEntry
+@end
+
+
+/** A request in flight, and the responses of identical requests waiting on it. */
+@interface BLIPCachePending : NSObject
+{
+    @public
+    BLIPResponse *_leader;
+    NSMutableArray *_followers;
+}
+@end
+
+@implementation BLIPCachePending
+@end
+
+
+
+@implementation BLIPResponseCache
+{
+    NSUInteger _maxSize, _size;
+    NSTimeInterval _defaultMaxAge;
+    NSMutableSet *_profiles;
+    NSMutableDictionary *_entries;              // key -> BLIPCacheEntry
+    NSMutableDictionary *_inFlight;             // key -> BLIPCachePending
+    BLIPCacheEntry *_newest, *_oldest;
+    NSUInteger _hits, _misses, _coalesced;
+}
+
+
+- (id) initWithMaxSize: (NSUInteger)maxSize
+{
+    self = [super init];
+    if (self != nil) {
+        _maxSize = maxSize;
+        _profiles = [[NSMutableSet alloc] init];
+        _entries = [[NSMutableDictionary alloc] init];
+        _inFlight = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+
+@synthesize maxSize=_maxSize, size=_size, defaultMaxAge=_defaultMaxAge,
+            hits=_hits, misses=_misses, coalesced=_coalesced;
+
+
+- (NSUInteger) count
+{
+    return _entries.count;
+}
+
+
+- (void) addProfile: (NSString*)profile
+{
+    [_profiles addObject: profile];
+}
+
+
+- (BOOL) canCacheRequest: (BLIPRequest*)request
+{
+    if( request.noReply || (request._flags & kBLIP_Meta) )
+        return NO;
+    NSString *profile = request.profile;
+    return profile && [_profiles containsObject: profile];
+}
+
+
+// The key is a SHA-1 digest of the properties, sorted by name, followed by the body.
+// (The encoded properties themselves aren't canonical, since their order is arbitrary.)
+static NSData* keyForRequest( BLIPRequest *request )
+{
+    CC_SHA1_CTX ctx;
+    CC_SHA1_Init(&ctx);
+    NSDictionary *properties = request.properties.allProperties;
+    NSArray *names = [properties.allKeys sortedArrayUsingSelector: @selector(compare:)];
+    for( NSString *name in names ) {
+        const char *str = name.UTF8String;
+        CC_SHA1_Update(&ctx, str, (CC_LONG)strlen(str)+1);
+        str = [properties[name] UTF8String];
+        CC_SHA1_Update(&ctx, str, (CC_LONG)strlen(str)+1);
+    }
+    const UInt8 separator = 0xFF;       // can't occur in UTF-8, so it can't be confused with a string
+    CC_SHA1_Update(&ctx, &separator, 1);
+    NSData *body = request.body;
+    CC_SHA1_Update(&ctx, body.bytes, (CC_LONG)body.length);
+    UInt8 digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1_Final(digest, &ctx);
+    return [NSData dataWithBytes: digest length: sizeof(digest)];
+}
+
+
+#pragma mark -
+#pragma mark LRU LIST:
+
+
+- (void) _unlinkEntry: (BLIPCacheEntry*)entry
+{
+    if( entry->_newer )
+        entry->_newer->_older = entry->_older;
+    else
+        _newest = entry->_older;
+    if( entry->_older )
+        entry->_older->_newer = entry->_newer;
+    else
+        _oldest = entry->_newer;
+    entry->_newer = entry->_older = nil;
+}
+
+- (void) _linkEntry: (BLIPCacheEntry*)entry
+{
+    entry->_older = _newest;
+    entry->_newer = nil;
+    if( _newest )
+        _newest->_newer = entry;
+    else
+        _oldest = entry;
+    _newest = entry;
+}
+
+- (void) _removeEntry: (BLIPCacheEntry*)entry
+{
+    [self _unlinkEntry: entry];
+    _size -= entry->_size;
+    [_entries removeObjectForKey: entry->_key];
+}
+
+
+- (void) removeAllResponses
+{
+    [_entries removeAllObjects];
+    _newest = _oldest = nil;
+    _size = 0;
+}
+
+
+#pragma mark -
+#pragma mark REQUESTS & RESPONSES:
+
+
+/* Called by a BLIPConnection before sending a request. Returns YES if the cache has taken care
+   of the response, in which case the request must not be sent. */
+- (BOOL) _handleRequest: (BLIPRequest*)request response: (BLIPResponse*)response
+{
+    if( ! [self canCacheRequest: request] )
+        return NO;
+    NSData *key = keyForRequest(request);
+    response._responseCacheKey = key;
+    response._responseCache = self;
+
+    BLIPCacheEntry *entry = _entries[key];
+    if( entry ) {
+        if( entry->_expires > CFAbsoluteTimeGetCurrent() ) {
+            LogTo(BLIP,@"%@: cache hit for %@",self,request);
+            _hits++;
+            [self _unlinkEntry: entry];
+            [self _linkEntry: entry];
+            [response _setFlags: entry->_flags properties: entry->_properties body: entry->_body];
+            [response performSelector: @selector(_completeFromCache) withObject: nil afterDelay: 0];
+            return YES;
+        } else if( ! entry->_etag ) {
+            [self _removeEntry: entry];
+            entry = nil;
+        }
+    }
+
+    BLIPCachePending *pending = _inFlight[key];
+    if( pending ) {
+        LogTo(BLIP,@"%@: coalescing %@ with in-flight request",self,request);
+        _coalesced++;
+        [pending->_followers addObject: response];
+        return YES;
+    }
+
+    _misses++;
+    if( entry )
+        [request _setEncodedValue: entry->_etag ofProperty: @"If-None-Match"];
+    return NO;
+}
+
+
+/* Called by a BLIPConnection after it's sent a request that -_handleRequest:response: didn't
+   take care of. */
+- (void) _sentRequest: (BLIPRequest*)request response: (BLIPResponse*)response
+{
+    NSData *key = response._responseCacheKey;
+    if( ! key )
+        return;
+    BLIPCachePending *pending = [[BLIPCachePending alloc] init];
+    pending->_leader = response;
+    pending->_followers = [[NSMutableArray alloc] init];
+    _inFlight[key] = pending;
+}
+
+
+/* Called by a BLIPConnection when a request that the cache had taken care of is canceled. */
+- (void) _removeResponse: (BLIPResponse*)response
+{
+    BLIPCachePending *pending = _inFlight[response._responseCacheKey];
+    if( pending )
+        [pending->_followers removeObjectIdenticalTo: response];
+}
+
+
+- (NSTimeInterval) _maxAgeOfResponse: (BLIPResponse*)response
+{
+    NSString *maxAge = response[@"Max-Age"];
+    return maxAge ? maxAge.doubleValue : _defaultMaxAge;
+}
+
+
+/* Called by a BLIPResponse that has a responseCache, just before it completes. */
+- (void) _responseCompleted: (BLIPResponse*)response
+{
+    NSData *key = response._responseCacheKey;
+    BLIPCachePending *pending = _inFlight[key];
+    if( ! pending || pending->_leader != response )
+        return;
+    [_inFlight removeObjectForKey: key];
+
+    BLIPCacheEntry *entry = _entries[key];
+    NSError *error = response.error;
+    if( ! error ) {
+        [self _storeResponse: response forKey: key];
+    } else if( entry && error.code == kBLIPError_NotModified
+                     && [error.domain isEqualToString: BLIPErrorDomain] ) {
+        // Peer says the cached copy is still good:
+        LogTo(BLIP,@"%@: revalidated cached response for %@",self,response);
+        entry->_expires = CFAbsoluteTimeGetCurrent() + [self _maxAgeOfResponse: response];
+        [self _unlinkEntry: entry];
+        [self _linkEntry: entry];
+        [response _setFlags: entry->_flags properties: entry->_properties body: entry->_body];
+    }
+
+    for( BLIPResponse *follower in pending->_followers ) {
+        [follower _setFlags: response._flags properties: response.properties body: response.body];
+        [follower _completeFromCache];
+    }
+}
+
+
+- (void) _storeResponse: (BLIPResponse*)response forKey: (NSData*)key
+{
+    NSTimeInterval maxAge = [self _maxAgeOfResponse: response];
+    NSString *etag = response[@"ETag"];
+    if( maxAge <= 0 && ! etag )
+        return;
+    BLIPProperties *properties = response.properties;
+    NSData *body = response.body;
+    NSUInteger size = properties.encodedData.length + body.length;
+    BLIPCacheEntry *entry = _entries[key];
+    if( entry )
+        [self _removeEntry: entry];
+    if( size > _maxSize )
+        return;
+
+    entry = [[BLIPCacheEntry alloc] init];
+    entry->_key = key;
+    entry->_flags = response._flags;
+    entry->_properties = properties;
+    entry->_body = body;
+    entry->_etag = etag;
+    entry->_expires = CFAbsoluteTimeGetCurrent() + maxAge;
+    entry->_size = size;
+    _entries[key] = entry;
+    [self _linkEntry: entry];
+    _size += size;
+
+    while( _size > _maxSize )
+        [self _removeEntry: _oldest];
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+static BLIPResponse* sendThroughCache( BLIPResponseCache *cache, NSDictionary *properties,
+                                       BOOL *outSent ) {
+    BLIPRequest *q = [BLIPRequest requestWithBody: nil properties: properties];
+    [q _encode];
+    BLIPResponse *response = q.response;
+    *outSent = ! [cache _handleRequest: q response: response];
+    if( *outSent )
+        [cache _sentRequest: q response: response];
+    return response;
+}
+
+static void receiveResponse( BLIPResponse *response, BLIPMessageFlags flags,
+                             NSDictionary *properties, NSString *body ) {
+    NSMutableData *frame = [[[[BLIPMutableProperties alloc] initWithDictionary: properties]
+                                    encodedData] mutableCopy];
+    [frame appendData: [body dataUsingEncoding: NSUTF8StringEncoding]];
+    CAssert([response _receivedFrameWithFlags: flags body: frame]);
+    CAssert(response.complete);
+}
+
+TestCase(BLIPResponseCache) {
+    BLIPResponseCache *cache = [[BLIPResponseCache alloc] initWithMaxSize: 100];
+    [cache addProfile: @"get"];
+    BOOL sent;
+
+    // Non-cacheable profile goes straight through:
+    sendThroughCache(cache, @{@"Profile": @"put"}, &sent);
+    CAssert(sent);
+    CAssertEq(cache.misses, 0u);
+
+    // Two identical requests (properties in different order) share one request:
+    BLIPResponse *r1 = sendThroughCache(cache, @{@"Profile": @"get", @"A": @"1", @"B": @"2"}, &sent);
+    CAssert(sent);
+    NSMutableDictionary *props = [NSMutableDictionary dictionary];
+    props[@"B"] = @"2";
+    props[@"A"] = @"1";
+    props[@"Profile"] = @"get";
+    BLIPResponse *r2 = sendThroughCache(cache, props, &sent);
+    CAssert(!sent);
+    CAssertEq(cache.coalesced, 1u);
+    receiveResponse(r1, kBLIP_RPY, @{@"Max-Age": @"60"}, @"hello");
+    CAssert(r2.complete);
+    CAssertEqual(r2.bodyString, @"hello");
+    CAssertEq(cache.count, 1u);
+
+    // Now it's a cache hit:
+    BLIPResponse *r3 = sendThroughCache(cache, props, &sent);
+    CAssert(!sent);
+    CAssertEq(cache.hits, 1u);
+    CAssertEqual(r3.bodyString, @"hello");
+
+    // Different properties make a different request; errors aren't cached:
+    BLIPResponse *r4 = sendThroughCache(cache, @{@"Profile": @"get", @"A": @"2"}, &sent);
+    CAssert(sent);
+    receiveResponse(r4, kBLIP_ERR, @{@"Error-Code": @"404"}, @"");
+    CAssertEq(r4.error.code, 404);
+    CAssertEq(cache.count, 1u);
+
+    // Filling the cache past its size evicts the least recently used response:
+    for( int i=0; i<10; i++ ) {
+        BLIPResponse *r = sendThroughCache(cache, @{@"Profile": @"get", @"N": $sprintf(@"%i",i)}, &sent);
+        CAssert(sent);
+        receiveResponse(r, kBLIP_RPY, @{@"Max-Age": @"60"}, @"0123456789");
+        CAssert(cache.size <= cache.maxSize);
+    }
+    CAssert(cache.count < 10);
+    sendThroughCache(cache, props, &sent);
+    CAssert(sent);
+}
+
+#endif
@@ -10,8 +10,12 @@
 
 
 #import "BLIPRequest.h"
+#import "BLIPFileRequest.h"
 #import "BLIPProperties.h"
 #import "BLIPConnection.h"
+#import "BLIPDispatcher.h"
+#import "BLIP_Internal.h"
+#import "TCPSessionCache.h"
 
 #import "IPAddress.h"
 #import "Target.h"
@@ -21,6 +25,8 @@
 
 #import <Security/Security.h>
 #import <SecurityInterface/SFChooseIdentityPanel.h>
+#import <sys/socket.h>
+#import <netinet/in.h>
 
 @interface TCPEndpoint ()
 + (NSString*) describeCert: (SecCertificateRef)cert;
@@ -256,6 +262,333 @@ TestCase(BLIPConnection) {
 
 
 
+#pragma mark CONCURRENT SEND TEST:
+
+
+#define kNStressProducers           8
+#define kNStressRequestsEach        500
+
+
+/* Sends requests to the BLIPTestListener from many threads at once, and checks that every request
+   gets a distinct number and that every response matches its request. */
+@interface BLIPConcurrentSendTester : NSObject <BLIPConnectionDelegate>
+{
+    BLIPConnection *_conn;
+    NSMutableIndexSet *_numbers;
+    NSUInteger _nResponses;
+}
+@end
+
+
+@implementation BLIPConcurrentSendTester
+
+- (id) init
+{
+    self = [super init];
+    if (self != nil) {
+        _numbers = [[NSMutableIndexSet alloc] init];
+        IPAddress *addr = [[IPAddress alloc] initWithHostname: kListenerHost port: kListenerPort];
+        _conn = [[BLIPConnection alloc] initToAddress: addr];
+        if( ! _conn )
+            return nil;
+        if( kClientUsesSSLCert ) {
+            [_conn setPeerToPeerIdentity: GetClientIdentity()];
+        } else if( kClientRequiresSSL ) {
+            _conn.SSLProperties = $mdict({kTCPPropertySSLAllowsAnyRoot, $true},
+                                        {(id)kCFStreamSSLPeerName, [NSNull null]});
+        }
+        _conn.delegate = self;
+        [_conn open];
+    }
+    return self;
+}
+
+- (void) connectionDidOpen: (TCPConnection*)connection
+{
+    Log(@"** Sending %i requests from each of %i threads...",
+        kNStressRequestsEach, kNStressProducers);
+    BLIPConnection *conn = _conn;
+    for( int p=0; p<kNStressProducers; p++ ) {
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            for( int i=0; i<kNStressRequestsEach; i++ ) {
+                NSString *tag = $sprintf(@"%i/%i", p, i);
+                BLIPRequest *q = [conn requestWithBody: [tag dataUsingEncoding: NSUTF8StringEncoding]
+                                            properties: $dict({@"Profile", @"BLIPTest/Stress"},
+                                                              {@"Tag", tag})];
+                q.urgent = (i % kUrgentEvery == 0);
+                q.response.representedObject = tag;     // set it before the response can arrive
+                CAssert([q send]);
+            }
+        });
+    }
+}
+
+- (BOOL) connection: (TCPConnection*)connection authorizeSSLPeer: (SecCertificateRef)peerCert
+{
+    return peerCert != nil;
+}
+
+- (void) connection: (TCPConnection*)connection failedToOpen: (NSError*)error
+{
+    Warn(@"** %@ failedToOpen: %@",connection,error);
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+- (void) connectionDidClose: (TCPConnection*)connection
+{
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+- (void) connection: (BLIPConnection*)connection receivedResponse: (BLIPResponse*)response
+{
+    CAssert(!response.error, @"Got error response: %@", response.error);
+    CAssert(response.number > 0);
+    CAssert(![_numbers containsIndex: response.number], @"Duplicate response #%u",
+            (unsigned)response.number);
+    [_numbers addIndex: response.number];
+    CAssertEqual(response.bodyString, response.representedObject);
+
+    if( ++_nResponses == kNStressProducers * kNStressRequestsEach ) {
+        // Every number from 2 to N+1 should have been used exactly once (#1 is the "Hi" greeting):
+        CAssertEq(_numbers.count, _nResponses);
+        CAssertEq(_numbers.firstIndex, 2u);
+        CAssertEq(_numbers.lastIndex, _nResponses + 1);
+        Log(@"** All %lu responses arrived and matched their requests", (unsigned long)_nResponses);
+        [_conn close];
+    }
+}
+
+@end
+
+
+TestCase(BLIPConcurrentSend) {
+    SecKeychainSetUserInteractionAllowed(true);
+    BLIPConcurrentSendTester *tester = [[BLIPConcurrentSendTester alloc] init];
+    CAssert(tester);
+    [[NSRunLoop currentRunLoop] run];
+}
+
+
+
+
+#pragma mark RECONNECT BENCHMARK:
+
+
+#define kNReconnects                50
+
+
+/* Connects to the BLIPTestListener over and over, timing how long each connection takes to get a
+   response to its first request (which includes the TLS handshake), first with every connection
+   doing a full handshake and then with TLS sessions resumed through a TCPSessionCache. */
+@interface BLIPReconnectTester : NSObject <BLIPConnectionDelegate>
+{
+    id _identity;
+    TCPSessionCache *_cache;
+    BLIPConnection *_conn;
+    int _nConnections;
+    CFAbsoluteTime _openedAt, _totalTime;
+}
+- (id) initWithIdentity: (SecIdentityRef)identity sessionCache: (TCPSessionCache*)cache;
+@property (readonly) CFAbsoluteTime averageTime;
+@end
+
+
+@implementation BLIPReconnectTester
+
+- (id) initWithIdentity: (SecIdentityRef)identity sessionCache: (TCPSessionCache*)cache
+{
+    self = [super init];
+    if (self != nil) {
+        _identity = (__bridge id)identity;
+        _cache = cache;
+        [self connect];
+    }
+    return self;
+}
+
+- (void) connect
+{
+    IPAddress *addr = [[IPAddress alloc] initWithHostname: kListenerHost port: kListenerPort];
+    _conn = [[BLIPConnection alloc] initToAddress: addr];
+    [_conn setPeerToPeerIdentity: (__bridge SecIdentityRef)_identity];
+    _conn.sessionCache = _cache;
+    _conn.delegate = self;
+    _openedAt = CFAbsoluteTimeGetCurrent();
+    [_conn open];
+}
+
+- (CFAbsoluteTime) averageTime
+{
+    return _totalTime / _nConnections;
+}
+
+- (void) connectionDidOpen: (TCPConnection*)connection
+{
+    BLIPRequest *q = [_conn requestWithBody: [@"hi" dataUsingEncoding: NSUTF8StringEncoding]
+                                 properties: $dict({@"Profile", @"BLIPTest/Stress"})];
+    CAssert([q send]);
+}
+
+- (BOOL) connection: (TCPConnection*)connection authorizeSSLPeer: (SecCertificateRef)peerCert
+{
+    return peerCert != nil;
+}
+
+- (void) connection: (TCPConnection*)connection failedToOpen: (NSError*)error
+{
+    Warn(@"** %@ failedToOpen: %@",connection,error);
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+- (void) connection: (BLIPConnection*)connection receivedResponse: (BLIPResponse*)response
+{
+    CAssert(!response.error, @"Got error response: %@", response.error);
+    _totalTime += CFAbsoluteTimeGetCurrent() - _openedAt;
+    ++_nConnections;
+    [_conn close];
+}
+
+- (void) connectionDidClose: (TCPConnection*)connection
+{
+    if( _nConnections < kNReconnects )
+        [self connect];
+    else
+        CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+@end
+
+
+TestCase(BLIPReconnectSpeed) {
+    SecKeychainSetUserInteractionAllowed(true);
+    SecIdentityRef identity = GetClientIdentity();
+    CAssert(identity);
+
+    BLIPReconnectTester *tester = [[BLIPReconnectTester alloc] initWithIdentity: identity
+                                                                   sessionCache: nil];
+    [[NSRunLoop currentRunLoop] run];
+    Log(@"** Without session cache: %.2f ms per connection", tester.averageTime * 1000);
+
+    TCPSessionCache *cache = [[TCPSessionCache alloc] init];
+    tester = [[BLIPReconnectTester alloc] initWithIdentity: identity sessionCache: cache];
+    [[NSRunLoop currentRunLoop] run];
+    Log(@"** With session cache:    %.2f ms per connection (%lu handshakes resumed, %lu full)",
+        tester.averageTime * 1000,
+        (unsigned long)cache.resumedHandshakes, (unsigned long)cache.fullHandshakes);
+}
+
+
+
+
+#pragma mark BULK TRANSFER BENCHMARK:
+
+
+#define kBulkTransferSize           (32*1024*1024)
+
+
+/* Measures the throughput of a large encrypted transfer to the BLIPTestListener, first pushing a
+   file with a BLIPFileRequest and then sending the same bytes as an in-memory request body. */
+@interface BLIPBulkTransferTester : NSObject <BLIPConnectionDelegate>
+{
+    BLIPConnection *_conn;
+    NSData *_data;
+    NSURL *_fileURL;
+    BOOL _sentFile;
+    CFAbsoluteTime _startTime;
+}
+@end
+
+
+@implementation BLIPBulkTransferTester
+
+- (id) init
+{
+    self = [super init];
+    if (self != nil) {
+        NSMutableData *data = [NSMutableData dataWithLength: kBulkTransferSize];
+        UInt8 *bytes = data.mutableBytes;
+        for( size_t i=0; i<kBulkTransferSize; i++ )
+            bytes[i] = (UInt8)(i * 7 + (i >> 12));     // not trivially compressible
+        _data = data;
+        _fileURL = [NSURL fileURLWithPath: [NSTemporaryDirectory()
+                                        stringByAppendingPathComponent: @"BLIPBulkTransfer.bin"]];
+        CAssert([_data writeToURL: _fileURL atomically: NO]);
+
+        IPAddress *addr = [[IPAddress alloc] initWithHostname: kListenerHost port: kListenerPort];
+        _conn = [[BLIPConnection alloc] initToAddress: addr];
+        if( ! _conn )
+            return nil;
+        [_conn setPeerToPeerIdentity: GetClientIdentity()];
+        _conn.delegate = self;
+        [_conn open];
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    [[NSFileManager defaultManager] removeItemAtURL: _fileURL error: NULL];
+}
+
+- (void) connectionDidOpen: (TCPConnection*)connection
+{
+    Log(@"** Connected [SSL=%@]; pushing a %u-byte file...",
+        _conn.actualSecurityLevel, kBulkTransferSize);
+    BLIPFileRequest *q = [BLIPFileRequest pushRequestWithBodyFilePath: _fileURL.absoluteString
+                                                           properties: @{@"Profile": @"BLIPTest/Bulk",
+                                                                         @"BodyIsFile": @"true"}
+                                                      completionBlock: nil];
+    _startTime = CFAbsoluteTimeGetCurrent();
+    CAssert([_conn sendRequest: q]);
+}
+
+- (BOOL) connection: (TCPConnection*)connection authorizeSSLPeer: (SecCertificateRef)peerCert
+{
+    return peerCert != nil;
+}
+
+- (void) connection: (TCPConnection*)connection failedToOpen: (NSError*)error
+{
+    Warn(@"** %@ failedToOpen: %@",connection,error);
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+- (void) connectionDidClose: (TCPConnection*)connection
+{
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+- (void) connection: (BLIPConnection*)connection receivedResponse: (BLIPResponse*)response
+{
+    CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - _startTime;
+    CAssert(!response.error, @"Got error response: %@", response.error);
+    CAssertEq(response.bodyString.integerValue, (NSInteger)kBulkTransferSize);
+    Log(@"** %@: %.1f MB/sec", (_sentFile ? @"In-memory body" : @"File push     "),
+        kBulkTransferSize / elapsed / 1.0e6);
+    if( ! _sentFile ) {
+        _sentFile = YES;
+        BLIPRequest *q = [_conn requestWithBody: _data
+                                     properties: $dict({@"Profile", @"BLIPTest/Bulk"})];
+        _startTime = CFAbsoluteTimeGetCurrent();
+        CAssert([q send]);
+    } else {
+        [_conn close];
+    }
+}
+
+@end
+
+
+TestCase(BLIPBulkTransferSpeed) {
+    SecKeychainSetUserInteractionAllowed(true);
+    BLIPBulkTransferTester *tester = [[BLIPBulkTransferTester alloc] init];
+    CAssert(tester);
+    [[NSRunLoop currentRunLoop] run];
+}
+
+
+
+
 #pragma mark LISTENER TEST:
 
 
@@ -342,7 +675,15 @@ TestCase(BLIPConnection) {
 {
     Log(@"***** %@ received %@",connection,request);
     
-    if ([request.profile isEqualToString: @"BLIPTest/EchoData"]) {
+    if ([request.profile isEqualToString: @"BLIPTest/Stress"]) {
+        // From BLIPConcurrentSendTester; doesn't count towards kListenerCloseAfter.
+        [request respondWithData: request.body contentType: nil];
+        return YES;
+    } else if ([request.profile isEqualToString: @"BLIPTest/Bulk"]) {
+        // From BLIPBulkTransferTester; replies with the body's length.
+        [request respondWithString: $sprintf(@"%lu", (unsigned long)request.body.length)];
+        return YES;
+    } else if ([request.profile isEqualToString: @"BLIPTest/EchoData"]) {
         NSData *body = request.body;
         size_t size = body.length;
         Assert(size<32768);
@@ -396,6 +737,258 @@ TestCase(BLIPListener) {
 }
 
 
+
+#pragma mark -
+#pragma mark DISPATCH POLICY TEST:
+
+
+/** Handles requests off the connection's thread, keeping track of how many run at once. */
+@interface BLIPDispatchTester : NSObject
+{
+    @public
+    int running, maxRunning;
+    BOOL ranOnConnectionThread;
+}
+@end
+
+@implementation BLIPDispatchTester
+
+- (void) handle: (BLIPRequest*)request
+{
+    @synchronized(self) {
+        if( [NSThread isMainThread] )
+            ranOnConnectionThread = YES;
+        maxRunning = MAX(maxRunning, ++running);
+    }
+    usleep(100000);
+    @synchronized(self) {
+        --running;
+    }
+    [request respondWithString: @"ok"];
+}
+
+- (void) handleAndThrow: (BLIPRequest*)request
+{
+    [request respondWithString: @"ok"];
+    [NSException raise: NSInternalInconsistencyException format: @"Thrown after responding"];
+}
+
+@end
+
+
+@class BLIPEngine;
+
+@interface BLIPConnection (Testing)
+- (void) blipEngineHasFramesToSend: (BLIPEngine*)engine;
+@end
+
+static BOOL sFramesQueuedOffConnectionThread;
+
+/** Notes whether its engine is ever given frames to send on any thread but the main one, which
+    is the thread the test's connections run on. */
+@interface BLIPDispatchTestConnection : BLIPConnection
+@end
+
+@implementation BLIPDispatchTestConnection
+- (void) blipEngineHasFramesToSend: (BLIPEngine*)engine
+{
+    if( ! [NSThread isMainThread] )
+        sFramesQueuedOffConnectionThread = YES;
+    [super blipEngineHasFramesToSend: engine];
+}
+@end
+
+
+// Sends `count` requests with the given profile at once, and waits for all of them to succeed.
+static void sendBatch( BLIPConnection *conn, NSString *profile, int count ) {
+    NSMutableArray *responses = [NSMutableArray array];
+    for( int i=0; i<count; i++ )
+        [responses addObject: [[conn requestWithBody: nil properties: @{@"Profile": profile}] send]];
+    NSDate *giveUp = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    BOOL done;
+    do {
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+        done = YES;
+        for( BLIPResponse *response in responses )
+            done = done && response.complete;
+    } while( ! done && [giveUp timeIntervalSinceNow] > 0 );
+    CAssert(done, @"Timed out waiting for %@ responses", profile);
+    for( BLIPResponse *response in responses ) {
+        CAssert(response.error == nil, @"%@ failed: %@", profile, response.error);
+        CAssertEqual(response.bodyString, @"ok");
+    }
+}
+
+TestCase(BLIPDispatchPolicies) {
+    BLIPDispatchTester *tester = [[BLIPDispatchTester alloc] init];
+    BLIPListener *listener = [[BLIPListener alloc] initWithPort: 0];
+    listener.connectionClass = [BLIPDispatchTestConnection class];
+    BLIPDispatcher *dispatcher = listener.dispatcher;
+    [dispatcher addTarget: $target(tester, handle:)
+       forValueOfProperty: @"Serial" forKey: @"Profile" policy: kBLIPDispatchSerial];
+    [dispatcher addTarget: $target(tester, handle:)
+       forValueOfProperty: @"Concurrent" forKey: @"Profile" policy: kBLIPDispatchConcurrent];
+    [dispatcher addTarget: $target(tester, handleAndThrow:)
+       forValueOfProperty: @"Throw" forKey: @"Profile" policy: kBLIPDispatchConcurrent];
+    NSError *error;
+    CAssert([listener open: &error], @"Listener failed to open: %@", error);
+    IPAddress *addr = [[IPAddress alloc] initWithHostname: @"127.0.0.1" port: listener.port];
+    BLIPConnection *conn = [[BLIPConnection alloc] initToAddress: addr];
+    [conn open];
+
+    // Serial handlers run one at a time:
+    sendBatch(conn, @"Serial", 4);
+    CAssertEq(tester->maxRunning, 1);
+
+    // Concurrent ones overlap:
+    tester->maxRunning = 0;
+    sendBatch(conn, @"Concurrent", 4);
+    CAssert(tester->maxRunning > 1, @"Concurrent handlers didn't overlap");
+
+    // None of them ran on the connection's thread, but their responses were all handed back to it:
+    CAssert(!tester->ranOnConnectionThread);
+    CAssert(!sFramesQueuedOffConnectionThread);
+
+    // A handler that throws after responding doesn't respond twice, and the connection carries on:
+    sendBatch(conn, @"Throw", 1);
+    sendBatch(conn, @"Serial", 1);
+    CAssertEq(conn.status, kTCP_Open);
+
+    [conn close];
+    [listener close];
+}
+
+
+#pragma mark -
+#pragma mark STALLED PEER TEST:
+
+
+#define kStallListenerPort 46354
+
+
+/** Accepts a connection, and as soon as it opens sends the peer a request far bigger than the
+    socket buffers can hold. Records when and how the connection ends. */
+@interface BLIPStallTester : NSObject <TCPListenerDelegate, BLIPConnectionDelegate>
+{
+    @public
+    BLIPConnection *conn;
+    BLIPRequest *request;
+    int clientReceiveBuffer;
+    BOOL closed;
+    NSError *closeError;
+    NSInteger bytesSent, bodySize;
+    CFAbsoluteTime openedAt, closedAt;
+}
+@end
+
+@implementation BLIPStallTester
+
+- (void) listener: (TCPListener*)listener didAcceptConnection: (TCPConnection*)connection
+{
+    conn = (BLIPConnection*)connection;
+    conn.delegate = self;
+    openedAt = CFAbsoluteTimeGetCurrent();
+}
+
+- (void) connectionDidOpen: (TCPConnection*)connection
+{
+    // Make the body much bigger than everything the kernel can buffer between us and the peer,
+    // so the writer ends up blocked once the peer stops reading:
+    int sendBuffer = 0;
+    socklen_t size = sizeof(sendBuffer);
+    NSData *handle = [connection.writer propertyForKey: (id)kCFStreamPropertySocketNativeHandle];
+    if( handle.length == sizeof(CFSocketNativeHandle) )
+        getsockopt(*(const CFSocketNativeHandle*)handle.bytes, SOL_SOCKET, SO_SNDBUF,
+                   &sendBuffer, &size);
+    bodySize = MAX(8 * (sendBuffer + clientReceiveBuffer), 4*1024*1024);
+    request = [conn requestWithBody: [NSMutableData dataWithLength: bodySize]
+                         properties: @{@"Profile": @"BLIPTest/Stall"}];
+    CAssert([request send]);
+}
+
+- (void) connection: (TCPConnection*)connection failedToOpen: (NSError*)error
+{
+    closed = YES;
+    closeError = error;
+    closedAt = CFAbsoluteTimeGetCurrent();
+}
+
+- (void) connectionDidClose: (TCPConnection*)connection
+{
+    closed = YES;
+    closeError = connection.error;
+    closedAt = CFAbsoluteTimeGetCurrent();
+}
+
+@end
+
+
+// Connects to a BLIPListener from a raw socket that never reads or writes anything, while the
+// listener's connection tries to send it a huge request. Returns the error that the listener's
+// connection ends with.
+static NSError* stallListener( NSTimeInterval idleTimeout, NSTimeInterval pingInterval,
+                               CFAbsoluteTime *outDuration )
+{
+    BLIPStallTester *tester = [[BLIPStallTester alloc] init];
+    BLIPListener *listener = [[BLIPListener alloc] initWithPort: kStallListenerPort];
+    listener.delegate = tester;
+    listener.idleTimeout = idleTimeout;
+    listener.pingInterval = pingInterval;
+    NSError *error;
+    CAssert([listener open: &error], @"Listener failed to open: %@", error);
+
+    int client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    socklen_t size = sizeof(tester->clientReceiveBuffer);
+    getsockopt(client, SOL_SOCKET, SO_RCVBUF, &tester->clientReceiveBuffer, &size);
+    struct sockaddr_in addr = {.sin_len = sizeof(addr), .sin_family = AF_INET,
+                               .sin_port = htons(kStallListenerPort),
+                               .sin_addr = {htonl(INADDR_LOOPBACK)}};
+    CAssert(connect(client, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+
+    // Keep track of how much of the request gets out. (This has to be sampled while the
+    // connection is open, since closing it resets the request's byte count.)
+    NSDate *giveUp = [NSDate dateWithTimeIntervalSinceNow: 15.0];
+    while( ! tester->closed && [giveUp timeIntervalSinceNow] > 0 ) {
+        tester->bytesSent = MAX(tester->bytesSent, tester->request._bytesWritten);
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+    }
+    close(client);
+    [listener close];
+    CAssert(tester->closed, @"Listener's connection didn't close");
+
+    // The writer really was stuck: only part of the request got out, and the writer has been
+    // released rather than left waiting for the socket to drain:
+    CAssert(tester->request != nil);
+    CAssert(tester->bytesSent > 0, @"Didn't send any of the request");
+    CAssert(tester->bytesSent < tester->bodySize, @"Sent all %ld bytes", (long)tester->bytesSent);
+    CAssert(tester->conn.writer == nil);
+    CAssert(tester->conn.reader == nil);
+    *outDuration = tester->closedAt - tester->openedAt;
+    Log(@"Stalled connection closed after %.2f sec, having sent %ld of %ld bytes: %@",
+        *outDuration, (long)tester->bytesSent, (long)tester->bodySize, tester->closeError);
+    return tester->closeError;
+}
+
+TestCase(BLIPStalledPeer) {
+    CFAbsoluteTime duration;
+
+    // The peer stops reading, so the writer is stuck partway through a message when the idle
+    // timeout expires:
+    NSError *error = stallListener(1.0, 0.0, &duration);
+    CAssertEqual(error.domain, NSPOSIXErrorDomain);
+    CAssertEq(error.code, (NSInteger)ETIMEDOUT);
+    CAssert(duration >= 1.0 && duration < 3.0);
+
+    // With pings, the unanswered ping gives up well before the idle timeout:
+    error = stallListener(10.0, 0.5, &duration);
+    CAssertEqual(error.domain, BLIPErrorDomain);
+    CAssertEq(error.code, (NSInteger)kBLIPError_Timeout);
+    CAssert(duration < 3.0);
+}
+
+
 int main( int argc, const char **argv )
 {
     @autoreleasepool {
@@ -25,7 +25,30 @@
 
 @property (nonatomic, weak) id<BLIPWebSocketDelegate> delegate;
 
+/** The subprotocol the server chose, if any.
+    Along with each of the given protocols, a variant with "+deflate" appended is offered first
+    (or "BLIP+deflate" if no protocols are given.) If the server picks one of those, every
+    WebSocket message in both directions is compressed with one shared DEFLATE stream per
+    direction, which works much better than compressing small messages one at a time. This
+    property returns the protocol name without the suffix. */
+@property (readonly) NSString* protocol;
+
+/** YES if the server agreed to compressed WebSocket messages. Valid once the socket is open. */
+@property (readonly) BOOL compressing;
+
+/** The dispatcher for incoming requests. Requests it doesn't handle go to the delegate. */
+@property (readonly) BLIPDispatcher* dispatcher;
+
+/** If nonzero, whenever nothing has been received for this many seconds a BLIP "Ping" is sent;
+    if the peer doesn't answer within the same interval, the socket is closed with an error.
+    Defaults to zero (off). */
+@property NSTimeInterval pingInterval;
+
 - (void)open;
+
+/** Asks the peer to close, by sending it a close request; the WebSocket closes once the peer
+    agrees. If the peer refuses, the delegate's -blipWebSocket:closeRequestFailedWithError:
+    is called and the connection stays open. */
 - (void)close;
 
 /** Creates a new, empty outgoing request.
@@ -79,4 +102,12 @@
     This is called <i>after</i> the response object's onComplete target, if any, is invoked.*/
 - (void) blipWebSocket: (BLIPWebSocket*)webSocket receivedResponse: (BLIPResponse*)response;
 
+/** Called when the peer wants to close the connection. Return YES to allow, NO to prevent.
+    Defaults to YES if not implemented. */
+- (BOOL) blipWebSocketReceivedCloseRequest: (BLIPWebSocket*)webSocket;
+
+/** Called if the peer refuses a close request.
+    The typical error is kBLIPError_Forbidden. */
+- (void) blipWebSocket: (BLIPWebSocket*)webSocket closeRequestFailedWithError: (NSError*)error;
+
 @end
@@ -8,36 +8,35 @@
 
 #import "BLIPWebSocket.h"
 #import "BLIPRequest.h"
-#import "BLIPDispatcher.h"
 #import "BLIP_Internal.h"
+#import "BLIPEngine.h"
+#import "BLIPDeflateStream.h"
 #import "SRWebSocket.h"
 
-#import "ExceptionUtils.h"
 #import "Logging.h"
 #import "Test.h"
 
 
-#define kDefaultFrameSize 4096
+// Appended to each WebSocket subprotocol name offered, to offer the same protocol with every
+// WebSocket message compressed by a shared BLIPDeflateStream.
+#define kDeflateProtocolSuffix @"+deflate"
+#define kDefaultDeflateProtocol @"BLIP+deflate"
 
 
-@interface BLIPWebSocket () <SRWebSocketDelegate>
+@interface BLIPWebSocket () <SRWebSocketDelegate, BLIPEngineDelegate>
 @end
 
 
 @implementation BLIPWebSocket
 {
     SRWebSocket* _webSocket;
-    bool _webSocketIsOpen;
+    NSThread* _ioThread;
+    MYSubmissionQueue* _submissions;
+    bool _webSocketIsOpen, _closeWhenFlushed;
     NSError* _error;
     __weak id<BLIPWebSocketDelegate> _delegate;
-    
-    NSMutableArray *_outBox;
-    UInt32 _numRequestsSent;
-
-    UInt32 _numRequestsReceived;
-    NSMutableDictionary *_pendingRequests, *_pendingResponses;
-
-    BLIPDispatcher* _dispatcher;
+    BLIPEngine* _engine;
+    BLIPDeflateStream *_deflater, *_inflater;
 }
 
 
@@ -51,28 +50,61 @@
             return nil;
         _webSocket = webSocket;
         _webSocket.delegate = self;
-        [_webSocket setDelegateThread: [NSThread currentThread]];
-        _pendingRequests = [[NSMutableDictionary alloc] init];
-        _pendingResponses = [[NSMutableDictionary alloc] init];
+        _ioThread = [NSThread currentThread];
+        [_webSocket setDelegateThread: _ioThread];
+        _engine = [[BLIPEngine alloc] initWithDelegate: self transport: kBLIPTransport_Messages];
+        // Other threads hand their responses to the I/O thread through the submission queue:
+        _submissions = [[MYSubmissionQueue alloc] initWithHandler: ^(id block) {
+            ((void(^)(void))block)();
+        }];
+        [_submissions scheduleOnCurrentRunLoop];
     }
     return self;
 }
 
+- (void) dealloc {
+    [_submissions unschedule];
+}
+
+// Offers a compressed variant of each protocol first, so the server will pick it if it can.
+static NSArray* offerCompression( NSArray *protocols ) {
+    if( protocols.count == 0 )
+        return @[kDefaultDeflateProtocol];
+    NSMutableArray *offered = [NSMutableArray arrayWithCapacity: 2*protocols.count];
+    for( NSString *protocol in protocols )
+        [offered addObject: [protocol stringByAppendingString: kDeflateProtocolSuffix]];
+    [offered addObjectsFromArray: protocols];
+    return offered;
+}
+
 - (id)initWithURLRequest:(NSURLRequest *)request protocols:(NSArray *)protocols {
     return [self initWithWebSocket: [[SRWebSocket alloc] initWithURLRequest: request
-                                                                  protocols: protocols]];
+                                                                  protocols: offerCompression(protocols)]];
 }
 
 - (id)initWithURLRequest:(NSURLRequest *)request {
-    return [self initWithWebSocket: [[SRWebSocket alloc] initWithURLRequest: request]];
+    return [self initWithURLRequest: request protocols: nil];
 }
 
 - (id)initWithURL:(NSURL *)url protocols:(NSArray *)protocols {
-    return [self initWithWebSocket: [[SRWebSocket alloc] initWithURL: url protocols: protocols]];
+    return [self initWithWebSocket: [[SRWebSocket alloc] initWithURL: url
+                                                          protocols: offerCompression(protocols)]];
 }
 
 - (id)initWithURL:(NSURL *)url {
-    return [self initWithWebSocket: [[SRWebSocket alloc] initWithURL: url]];
+    return [self initWithURL: url protocols: nil];
+}
+
+
+- (NSString*) protocol {
+    NSString *protocol = _webSocket.protocol;
+    if( [protocol hasSuffix: kDeflateProtocolSuffix] )
+        protocol = [protocol substringToIndex: protocol.length - kDeflateProtocolSuffix.length];
+    return protocol.length ? protocol : nil;
+}
+
+- (BOOL) compressing {
+    return _deflater != nil;
 }
 
 
@@ -81,6 +113,20 @@
 }
 
 
+- (BLIPDispatcher*) dispatcher {
+    return _engine.dispatcher;
+}
+
+
+- (NSTimeInterval) pingInterval {
+    return _engine.pingInterval;
+}
+
+- (void) setPingInterval: (NSTimeInterval)interval {
+    _engine.pingInterval = interval;
+}
+
+
 - (void) _gotError: (NSError*)error {
     _error = error;
 }
@@ -95,7 +141,12 @@
 }
 
 - (void)close {
-    [_webSocket close];
+    if (!_webSocketIsOpen) {
+        [_webSocket close];
+    } else if (!_engine.closing) {
+        // Ask the peer first; the socket closes once it agrees (see -blipEngineReadyToClose:)
+        [_engine sendCloseRequest];
+    }
 }
 
 - (void)closeWithCode:(NSInteger)code reason:(NSString *)reason {
@@ -106,9 +157,15 @@
 - (void)webSocketDidOpen:(SRWebSocket *)webSocket {
     LogTo(BLIP, @"%@ is open!", self);
     _webSocketIsOpen = true;
+    if( [_webSocket.protocol hasSuffix: kDeflateProtocolSuffix] ) {
+        LogTo(BLIP, @"%@ compressing WebSocket messages", self);
+        _deflater = [[BLIPDeflateStream alloc] initForCompression: YES];
+        _inflater = [[BLIPDeflateStream alloc] initForCompression: NO];
+    }
+    [_engine sendHello];
     if ([_delegate respondsToSelector: @selector(blipWebSocketDidOpen:)])
         [_delegate blipWebSocketDidOpen: self];
-    if (_outBox.count > 0)
+    if (_engine.hasFramesToSend)
         [self webSocketReadyForData: _webSocket];
 }
 
@@ -117,6 +174,7 @@
     LogTo(BLIP, @"%@ closed with error %@", self, error);
     if (error && !_error)
         [self _gotError: error];
+    [_engine disconnect];
     if ([_delegate respondsToSelector: @selector(blipWebSocket:didFailWithError:)])
         [_delegate blipWebSocket: self didFailWithError: error];
 }
@@ -128,11 +186,43 @@
          wasClean:(BOOL)wasClean
 {
     LogTo(BLIP, @"%@ closed with code %d", self, (int)code);
+    [_engine disconnect];
     if ([_delegate respondsToSelector: @selector(blipWebSocket:didCloseWithCode:reason:wasClean:)])
         [_delegate blipWebSocket: self didCloseWithCode: code reason: reason wasClean: wasClean];
 }
 
 
+- (BOOL) blipEngineShouldAcceptCloseRequest: (BLIPEngine*)engine {
+    if ([_delegate respondsToSelector: @selector(blipWebSocketReceivedCloseRequest:)])
+        return [_delegate blipWebSocketReceivedCloseRequest: self];
+    return YES;
+}
+
+- (void) blipEngineReadyToClose: (BLIPEngine*)engine {
+    // Close the socket once the engine's last frames (like the reply to a close request) are sent:
+    _closeWhenFlushed = true;
+    if (!_engine.hasFramesToSend)
+        [_webSocket close];
+}
+
+- (void) blipEngine: (BLIPEngine*)engine closeRequestFailedWithError: (NSError*)error {
+    if ([error.domain isEqualToString: BLIPErrorDomain] && error.code == kBLIPError_NotFound) {
+        // The peer predates the close handshake, so just close:
+        LogTo(BLIP, @"%@: peer doesn't understand close requests; closing anyway", self);
+        [_webSocket close];
+        return;
+    }
+    if ([_delegate respondsToSelector: @selector(blipWebSocket:closeRequestFailedWithError:)])
+        [_delegate blipWebSocket: self closeRequestFailedWithError: error];
+}
+
+- (void) blipEngine: (BLIPEngine*)engine pingFailedWithError: (NSError*)error {
+    LogTo(BLIP, @"%@: peer isn't answering pings; closing", self);
+    [self _gotError: error];
+    [_webSocket closeWithCode: SRStatusCodeGoingAway reason: @"Peer not responding"];
+}
+
+
 #pragma mark - SENDING:
 
 
@@ -164,260 +254,112 @@
 }
 
 
-- (void) _queueMessage: (BLIPMessage*)msg isNew: (BOOL)isNew
-{
-    NSInteger n = _outBox.count, index;
-    if( msg.urgent && n > 1 ) {
-        // High-priority gets queued after the last existing high-priority message,
-        // leaving one regular-priority message in between if possible.
-        for( index=n-1; index>0; index-- ) {
-            BLIPMessage *otherMsg = _outBox[index];
-            if( [otherMsg urgent] ) {
-                index = MIN(index+2, n);
-                break;
-            } else if( isNew && otherMsg._bytesWritten==0 ) {
-                // But have to keep message starts in order
-                index = index+1;
-                break;
-            }
-        }
-        if( index==0 )
-            index = 1;
-    } else {
-        // Regular priority goes at the end of the queue:
-        index = n;
-    }
-    if( ! _outBox )
-        _outBox = [[NSMutableArray alloc] init];
-    [_outBox insertObject: msg atIndex: index];
-    
-    if( isNew ) {
-        LogTo(BLIP,@"%@ queuing outgoing %@ at index %li",self,msg,(long)index);
-        if( n==0 && _webSocketIsOpen )
-            [self webSocketReadyForData: _webSocket];  // queue the first message now
-    }
-}
-
-
-- (BOOL) _sendMessage: (BLIPMessage*)message
-{
-    Assert(!message.sent,@"message has already been sent");
-    [self _queueMessage: message isNew: YES];
-    return YES;
-}
-
-
 - (BOOL) _sendRequest: (BLIPRequest*)q response: (BLIPResponse*)response
 {
     if( _webSocketIsOpen && _webSocket.readyState >= SR_CLOSING ) {
         Warn(@"%@: Attempt to send a request after the connection has started closing: %@",self,q);
         return NO;
     }
-    [q _assignedNumber: ++_numRequestsSent];
-    if( response ) {
-        [response _assignedNumber: _numRequestsSent];
-        [self _addPendingResponse: response];
-    }
-    return [self _sendMessage: q];
+    return [_engine sendRequest: q response: response];
 }
 
 
 - (BOOL) _sendResponse: (BLIPResponse*)response {
-    return [self _sendMessage: response];
-}
-
-
-- (void) webSocketReadyForData:(SRWebSocket *)webSocket {
-    if( _outBox.count > 0 ) {
-        // Pop first message in queue:
-        BLIPMessage *msg = _outBox[0];
-        [_outBox removeObjectAtIndex: 0];
-        
-        // As an optimization, allow message to send a big frame unless there's a higher-priority
-        // message right behind it:
-        size_t frameSize = kDefaultFrameSize;
-        if( msg.urgent || _outBox.count==0 || ! [_outBox[0] urgent] )
-            frameSize *= 4;
-
-        BOOL moreComing;
-        NSData* frame = [msg nextWebSocketFrameWithMaxSize: frameSize moreComing: &moreComing];
-        LogTo(BLIPVerbose,@"%@: Sending frame of %@",self, msg);
-        [_webSocket send: frame];
-        if (moreComing) {
-            // add it back so it can send its next frame later:
-            [self _queueMessage: msg isNew: NO];
-        }
-    } else {
-        LogTo(BLIPVerbose,@"%@: no more work for writer",self);
+    if( ! _submissions.isOnConsumerThread ) {
+        // Response from a handler running on another thread (see BLIPDispatchPolicy). It's
+        // handed to the I/O thread without waiting, and counts as sent once it's queued.
+        [_submissions push: [^{
+            [_engine sendResponse: response];
+        } copy]];
+        return YES;
     }
+    return [_engine sendResponse: response];
 }
 
 
-#pragma mark - RECEIVING FRAMES:
-
-
-- (BOOL) isBusy
+- (void) _cancelRequest: (BLIPRequest*)q
 {
-    return _pendingRequests.count > 0 || _pendingResponses.count > 0;
+    [_engine cancelRequest: q];
 }
 
 
-- (void) _addPendingResponse: (BLIPResponse*)response
-{
-    _pendingResponses[$object(response.number)] = response;
+- (void) blipEngineHasFramesToSend: (BLIPEngine*)engine {
+    if (_webSocketIsOpen)
+        [self webSocketReadyForData: _webSocket];
 }
 
 
-- (void)webSocket:(SRWebSocket *)webSocket didReceiveMessage:(id)message {
-    if (![message isKindOfClass: [NSData class]])
+- (void) webSocketReadyForData:(SRWebSocket *)webSocket {
+    if( ! _engine.hasFramesToSend ) {
+        if( _closeWhenFlushed )
+            [_webSocket close];
+        return;
+    }
+    // Frames are written straight into a malloced buffer that the NSData then takes over. Since
+    // it's immutable, SRWebSocket retains it instead of copying it again.
+    UInt8 *buffer = malloc(kBLIPEngineWriteBufferSize);
+    if( ! buffer )
         return;
-    size_t frameSize = [message length];
-    if (frameSize < kBLIPWebSocketFrameHeaderSize) {
+    size_t length = [_engine writeFramesTo: buffer maxSize: kBLIPEngineWriteBufferSize];
+    if( length == 0 ) {
+        free(buffer);
         return;
     }
-    
-    const BLIPWebSocketFrameHeader* header = [message bytes];
-    NSData* body = [message subdataWithRange: NSMakeRange(kBLIPWebSocketFrameHeaderSize,
-                                                  frameSize - kBLIPWebSocketFrameHeaderSize)];
-
-    [self receivedFrameWithNumber: NSSwapBigIntToHost(header->number)
-                            flags: NSSwapBigShortToHost(header->flags)
-                             body: body];
-}
 
-
-- (void) receivedFrameWithNumber: (UInt32)requestNumber
-                           flags: (BLIPMessageFlags)flags
-                            body: (NSData*)body
-{
-    static const char* kTypeStrs[16] = {"MSG","RPY","ERR","3??","4??","5??","6??","7??"};
-    BLIPMessageType type = flags & kBLIP_TypeMask;
-    LogTo(BLIPVerbose,@"%@ rcvd frame of %s #%u, length %lu",self,kTypeStrs[type],(unsigned int)requestNumber,(unsigned long)body.length);
-
-    id key = $object(requestNumber);
-    BOOL complete = ! (flags & kBLIP_MoreComing);
-    switch(type) {
-        case kBLIP_MSG: {
-            // Incoming request:
-            BLIPRequest *request = _pendingRequests[key];
-            if( request ) {
-                // Continuation frame of a request:
-                if( complete ) {
-                    [_pendingRequests removeObjectForKey: key];
-                }
-            } else if( requestNumber == _numRequestsReceived+1 ) {
-                // Next new request:
-                request = [[BLIPRequest alloc] _initWithConnection: self
-                                                            isMine: NO
-                                                             flags: flags | kBLIP_MoreComing
-                                                            number: requestNumber
-                                                              body: nil];
-                if( ! complete )
-                    _pendingRequests[key] = request;
-                _numRequestsReceived++;
-            } else
-                return [self _gotError: BLIPMakeError(kBLIPError_BadFrame, 
-                                               @"Received bad request frame #%u (next is #%u)",
-                                               (unsigned int)requestNumber,
-                                               (unsigned)_numRequestsReceived+1)];
-            
-            if( ! [request _receivedFrameWithFlags: flags body: body] )
-                return [self _gotError: BLIPMakeError(kBLIPError_BadFrame, 
-                                               @"Couldn't parse message frame")];
-            
-            if( complete )
-                [self _dispatchRequest: request];
-            break;
-        }
-            
-        case kBLIP_RPY:
-        case kBLIP_ERR: {
-            BLIPResponse *response = _pendingResponses[key];
-            if( response ) {
-                if( complete ) {
-                    [_pendingResponses removeObjectForKey: key];
-                }
-                
-                if( ! [response _receivedFrameWithFlags: flags body: body] ) {
-                    return [self _gotError: BLIPMakeError(kBLIPError_BadFrame, 
-                                                          @"Couldn't parse response frame")];
-                } else if( complete ) 
-                    [self _dispatchResponse: response];
-                
-            } else {
-                if( requestNumber <= _numRequestsSent )
-                    LogTo(BLIP,@"??? %@ got unexpected response frame to my msg #%u",
-                          self,(unsigned int)requestNumber); //benign
-                else
-                    return [self _gotError: BLIPMakeError(kBLIPError_BadFrame, 
-                                                          @"Bogus message number %u in response",
-                                                          (unsigned int)requestNumber)];
-            }
-            break;
-        }
-            
-        default:
-            // To leave room for future expansion, undefined message types are just ignored.
-            Log(@"??? %@ received header with unknown message type %i", self,type);
-            break;
+    NSData *data;
+    if( _deflater ) {
+        data = [_deflater processBytes: buffer length: length];
+        free(buffer);
+        if( ! data )
+            return [self closeWithCode: SRStatusCodeInternalError reason: @"Compression failed"];
+    } else {
+        if( length < kBLIPEngineWriteBufferSize / 2 )
+            buffer = reallocf(buffer, length);
+        data = [[NSData alloc] initWithBytesNoCopy: buffer length: length freeWhenDone: YES];
     }
+    [_webSocket send: data];
 }
 
 
-#pragma mark - DISPATCHING:
+#pragma mark - RECEIVING:
 
 
-- (BLIPDispatcher*) dispatcher
+- (BOOL) isBusy
 {
-    if( ! _dispatcher ) {
-        _dispatcher = [[BLIPDispatcher alloc] init];
-    }
-    return _dispatcher;
+    return _engine.isAwaitingFrames;
 }
 
 
-- (BOOL) _dispatchMetaRequest: (BLIPRequest*)request
-{
-#if 0
-    NSString* profile = request.profile;
-    if( [profile isEqualToString: kBLIPProfile_Bye] ) {
-        [self _handleCloseRequest: request];
-        return YES;
+- (void)webSocket:(SRWebSocket *)webSocket didReceiveMessage:(id)message {
+    if (![message isKindOfClass: [NSData class]])
+        return;
+    if (_inflater) {
+        message = [_inflater processBytes: [message bytes] length: [message length]];
+        if (!message) {
+            [self _gotError: BLIPMakeError(kBLIPError_BadData, @"Couldn't decompress message")];
+            return [self closeWithCode: SRStatusCodeProtocolError reason: @"Couldn't decompress message"];
+        }
+    }
+    // A WebSocket message holds only whole frames. Frame bodies point into the message rather
+    // than being copied out of it; messages copy what they need.
+    NSError *error;
+    ssize_t consumed = [_engine receiveBytes: [message bytes] length: [message length] error: &error];
+    if (consumed < 0) {
+        [self _gotError: error];
+    } else if ((size_t)consumed < [message length] && _webSocket.readyState == SR_OPEN) {
+        Warn(@"%@ received WebSocket message with a partial frame", self);
+        [self _gotError: BLIPMakeError(kBLIPError_BadData, @"Invalid frame header")];
     }
-#endif
-    return NO;
 }
 
 
-- (void) _dispatchRequest: (BLIPRequest*)request
-{
-    LogTo(BLIP,@"Received all of %@",request.descriptionWithProperties);
-    @try{
-        BOOL handled;
-        if( request._flags & kBLIP_Meta )
-            handled =[self _dispatchMetaRequest: request];
-        else {
-            handled = [self.dispatcher dispatchMessage: request];
-            if (!handled && [_delegate respondsToSelector: @selector(connection:receivedRequest:)])
-                handled = [_delegate blipWebSocket: self receivedRequest: request];
-        }
-        
-        if (!handled) {
-            LogTo(BLIP,@"No handler found for incoming %@",request);
-            [request respondWithErrorCode: kBLIPError_NotFound message: @"No handler was found"];
-        } else if( ! request.noReply && ! request.repliedTo ) {
-            LogTo(BLIP,@"Returning default empty response to %@",request);
-            [request respondWithData: nil contentType: nil];
-        }
-    }@catch( NSException *x ) {
-        MYReportException(x,@"Dispatching BLIP request");
-        [request respondWithException: x];
-    }
+- (BOOL) blipEngine: (BLIPEngine*)engine receivedRequest: (BLIPRequest*)request {
+    if ([_delegate respondsToSelector: @selector(blipWebSocket:receivedRequest:)])
+        return [_delegate blipWebSocket: self receivedRequest: request];
+    return NO;
 }
 
-- (void) _dispatchResponse: (BLIPResponse*)response
-{
-    LogTo(BLIP,@"Received all of %@",response);
+- (void) blipEngine: (BLIPEngine*)engine receivedResponse: (BLIPResponse*)response {
     if ([_delegate respondsToSelector: @selector(blipWebSocket:receivedResponse:)])
         [_delegate blipWebSocket: self receivedResponse: response];
 }
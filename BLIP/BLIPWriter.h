@@ -6,15 +6,11 @@
 //  Copyright 2008 Jens Alfke. All rights reserved.
 //
 
-@class BLIPRequest, BLIPResponse, BLIPMessage;
 
-
-/** INTERNAL class that sends BLIP frames over the socket. */
+/** INTERNAL class that writes the frames produced by the connection's BLIPEngine to the socket. */
 @interface BLIPWriter : TCPWriter
 
-- (BOOL) sendRequest: (BLIPRequest*)request response: (BLIPResponse*)response;
-- (BOOL) sendMessage: (BLIPMessage*)message;
-
-@property (readonly) UInt32 numRequestsSent;
+/** Called when the engine has frames to send after having none. */
+- (void) framesAvailable;
 
 @end
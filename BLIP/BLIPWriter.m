@@ -6,123 +6,58 @@
 //  Copyright 2008 Jens Alfke. All rights reserved.
 //
 
-#import "BLIPReader.h"
 #import "BLIPWriter.h"
 #import "BLIP_Internal.h"
+#import "BLIPEngine.h"
 #import "TCP_Internal.h"
+#import "MYBufferPool.h"
 
 #import "Logging.h"
 #import "Test.h"
 
 
-#define kDefaultFrameSize 4096
+@implementation BLIPWriter
 
 
-@implementation BLIPWriter
-{
-    NSMutableArray *_outBox;
-    UInt32 _numRequestsSent;
-}
+#define _blipConn ((BLIPConnection*)_conn)
 
 
 - (void) disconnect
 {
-    [_outBox makeObjectsPerformSelector: @selector(_connectionClosed) withObject: nil];
-    _outBox = nil;
+    [_blipConn._engine disconnect];
     [super disconnect];
 }
 
-@synthesize numRequestsSent=_numRequestsSent;
-
 
 - (BOOL) isBusy
 {
-    return _outBox.count>0 || [super isBusy];
-}
-
-
-- (void) _queueMessage: (BLIPMessage*)msg isNew: (BOOL)isNew
-{
-    NSInteger n = _outBox.count, index;
-    if( msg.urgent && n > 1 ) {
-        // High-priority gets queued after the last existing high-priority message,
-        // leaving one regular-priority message in between if possible.
-        for( index=n-1; index>0; index-- ) {
-            BLIPMessage *otherMsg = _outBox[index];
-            if( [otherMsg urgent] ) {
-                index = MIN(index+2, n);
-                break;
-            } else if( isNew && otherMsg._bytesWritten==0 ) {
-                // But have to keep message starts in order
-                index = index+1;
-                break;
-            }
-        }
-        if( index==0 )
-            index = 1;
-    } else {
-        // Regular priority goes at the end of the queue:
-        index = n;
-    }
-    if( ! _outBox )
-        _outBox = [[NSMutableArray alloc] init];
-    [_outBox insertObject: msg atIndex: index];
-    
-    if( isNew ) {
-        LogTo(BLIP,@"%@ queuing outgoing %@ at index %li",self,msg,(long)index);
-        if( n==0 )
-            [self queueIsEmpty];
-    }
+    return _blipConn._engine.hasFramesToSend || [super isBusy];
 }
 
 
-- (BOOL) sendMessage: (BLIPMessage*)message
+- (void) framesAvailable
 {
-    Assert(!message.sent,@"message has already been sent");
-    [self _queueMessage: message isNew: YES];
-    return YES;
-}
-
-
-- (BOOL) sendRequest: (BLIPRequest*)q response: (BLIPResponse*)response
-{
-    if( _shouldClose ) {
-        Warn(@"%@: Attempt to send a request after the connection has started closing: %@",self,q);
-        return NO;
-    }
-    [q _assignedNumber: ++_numRequestsSent];
-    if( response ) {
-        [response _assignedNumber: _numRequestsSent];
-        [(BLIPReader*)self.reader _addPendingResponse: response];
-    }
-    return [self sendMessage: q];
+    [self queueIsEmpty];
 }
 
 
 - (void) queueIsEmpty
 {
-    if( _outBox.count > 0 ) {
-        // Pop first message in queue:
-        BLIPMessage *msg = _outBox[0];
-        [_outBox removeObjectAtIndex: 0];
-        
-        // As an optimization, allow message to send a big frame unless there's a higher-priority
-        // message right behind it:
-        size_t frameSize = kDefaultFrameSize;
-        if( msg.urgent || _outBox.count==0 || ! [_outBox[0] urgent] )
-            frameSize *= 4;
-        
-        if( [msg _writeFrameTo: self maxSize: frameSize] ) {
-            // add it back so it can send its next frame later:
-            [self _queueMessage: msg isNew: NO];
-        }
-    } else {
-        LogTo(BLIPVerbose,@"%@: no more work for writer",self);
+    BLIPEngine *engine = _blipConn._engine;
+    if( ! engine.hasFramesToSend )
+        return;
+    // The engine packs frames straight into a pooled buffer, which is recycled once it's written:
+    NSMutableData *buffer = [_bufferPool dataWithLength: kBLIPEngineWriteBufferSize];
+    size_t length = [engine writeFramesTo: buffer.mutableBytes maxSize: buffer.length];
+    if( length == 0 ) {
+        [_bufferPool recycle: buffer];
+        return;
     }
+    buffer.length = length;
+    [self writeData: buffer];
 }
 
 
-
 @end
 
 
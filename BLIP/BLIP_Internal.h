@@ -9,7 +9,10 @@
 #import "BLIPConnection.h"
 #import "BLIPRequest.h"
 #import "BLIPProperties.h"
-@class BLIPWriter;
+#import "BLIPResponseCache.h"
+#import "MYTimerWheel.h"
+#import "MYSubmissionQueue.h"
+@class BLIPEngine;
 
 
 /* Private declarations and APIs for BLIP implementation. Not for use by clients! */
@@ -19,7 +22,8 @@
 typedef enum {
     kBLIP_MSG,                      // initiating message
     kBLIP_RPY,                      // response to a MSG
-    kBLIP_ERR                       // error response to a MSG
+    kBLIP_ERR,                      // error response to a MSG
+    kBLIP_CNCL                      // cancels a partly-sent MSG (and its RPY); has no body
 } BLIPMessageType;
 
 /* Flag bits in a BLIP frame header */
@@ -55,11 +59,24 @@ typedef struct {
 
 #define kBLIPProfile_Hi  @"Hi"      // Used for Profile header in meta greeting message
 #define kBLIPProfile_Bye @"Bye"     // Used for Profile header in meta close-request message
+#define kBLIPProfile_Cancel @"Cancel" // Used for Profile header of a request canceled before sending
+#define kBLIPProfile_Ping @"Ping"   // Used for Profile header in meta keepalive message
+
+#define kBLIPHelloVersionsProperty @"BLIP-Versions" // In "Hi": the frame formats the sender can read
+#define kBLIPHelloVersionProperty  @"BLIP-Version"  // In reply to "Hi": the format it'll send next
+
+
+@interface BLIPProperties ()
+/** Wraps data produced by -_appendEncodedTo:, without copying or validating it. */
++ (BLIPProperties*) _propertiesWithEncodedData: (NSData*)data;
+/** Appends the encoded form to the data in a single pass. Returns NO if it's too large. */
+- (BOOL) _appendEncodedTo: (NSMutableData*)data;
+@end
 
 
 @interface BLIPConnection () <BLIPMessageSender>
-- (void) _dispatchRequest: (BLIPRequest*)request;
-- (void) _dispatchResponse: (BLIPResponse*)response;
+/** The protocol engine that the connection's reader and writer feed. */
+@property (readonly) BLIPEngine *_engine;
 @end
 
 
@@ -71,7 +88,8 @@ typedef struct {
     UInt32 _number;
     BLIPProperties *_properties;
     NSData *_body;
-    NSMutableData *_encodedBody;
+    NSMutableData *_encodedBody;    // outgoing: encoded properties; incoming: body received so far
+    NSData *_outgoingBody;          // outgoing body as sent (gzipped if compressed)
     NSMutableData *_mutableBody;
     BOOL _isMine, _isMutable, _sent, _propertiesAvailable, _complete;
     NSInteger _bytesWritten;
@@ -90,10 +108,17 @@ typedef struct {
                      flags: (BLIPMessageFlags)flags
                     number: (UInt32)msgNo
                       body: (NSData*)body;
-- (BOOL) _writeFrameTo: (BLIPWriter*)writer maxSize: (UInt16)maxSize;
-- (NSData*) nextWebSocketFrameWithMaxSize: (UInt16)maxSize moreComing: (BOOL*)outMoreComing;
+- (size_t) _writeFrameTo: (UInt8*)dst
+                 maxSize: (size_t)maxSize
+          framingVersion: (int)version
+              moreComing: (BOOL*)outMoreComing;
 @property (readonly) NSInteger _bytesWritten;
+@property (readonly) NSUInteger _bytesRemaining;
+/** Set when an outgoing message can't produce the rest of its body (e.g. its file failed to
+    read); the engine then aborts it instead of sending more frames. */
+@property (readonly) NSError *_writeError;
 - (void) _assignedNumber: (UInt32)number;
+- (void) _cancelBeforeSending;
 - (BOOL) _receivedFrameWithFlags: (BLIPMessageFlags)flags body: (NSData*)body;
 - (void) _connectionClosed;
 @end
@@ -103,12 +128,30 @@ typedef struct {
 - (id) _initWithConnection: (id<BLIPMessageSender>)connection
                       body: (NSData*)body 
                 properties: (NSDictionary*)properties;
+- (void) _setEncodedValue: (NSString*)value ofProperty: (NSString*)property;
+@property (readonly) BOOL _responseDeferred;
 @end
 
 
 @interface BLIPResponse ()
 - (id) _initWithRequest: (BLIPRequest*)request;
+@property (readonly) MYTimer *_timeoutTimer;
+- (void) _failWithError: (NSError*)error;
+@property (weak) BLIPResponseCache *_responseCache;
+@property (copy) NSData *_responseCacheKey;
+- (void) _setFlags: (BLIPMessageFlags)flags
+        properties: (BLIPProperties*)properties
+              body: (NSData*)body;
+- (void) _completeFromCache;
 #if DEBUG
 - (id) _initIncomingWithProperties: (BLIPProperties*)properties body: (NSData*)body;
 #endif
 @end
+
+
+@interface BLIPResponseCache ()
+- (BOOL) _handleRequest: (BLIPRequest*)request response: (BLIPResponse*)response;
+- (void) _sentRequest: (BLIPRequest*)request response: (BLIPResponse*)response;
+- (void) _removeResponse: (BLIPResponse*)response;
+- (void) _responseCompleted: (BLIPResponse*)response;
+@end
@@ -37,6 +37,12 @@
     query will continue to update them. */
 @property (readonly) NSTimeInterval timeToLive;
 
+/** Starts the lookup, and calls the block on this thread's run loop when the first result or
+    error arrives, with the addresses found so far (HostAddress objects) or nil and the error.
+    Unlike -waitForReply this doesn't block. Returns NO, without calling the block, if the lookup
+    couldn't be started. */
+- (BOOL) lookUpWithCompletion: (void(^)(NSSet *addresses, int32_t/*DNSServiceErrorType*/ error))completion;
+
 
 //internal:
 - (id) _initWithBonjourService: (MYBonjourService*)service;
@@ -9,6 +9,7 @@
 #import "MYAddressLookup.h"
 #import "MYBonjourService.h"
 #import "IPAddress.h"
+#import "MYResolverCache.h"
 #import "ExceptionUtils.h"
 #import "Test.h"
 #import "Logging.h"
@@ -26,6 +27,7 @@
     NSString *_hostname;
     uint32_t _interfaceIndex;
     NSMutableSet *_addresses;
+    NSMutableArray *_sockaddrs;     // raw addresses, for the MYResolverCache
     UInt16 _port;
     CFAbsoluteTime _expires;
 }
@@ -40,6 +42,7 @@
         }
         _hostname = [hostname copy];
         _addresses = [[NSMutableSet alloc] init];
+        _sockaddrs = [[NSMutableArray alloc] init];
     }
     return self;
 }
@@ -50,6 +53,7 @@
     if (self) {
         _service = service;
         _addresses = [[NSMutableSet alloc] init];
+        _sockaddrs = [[NSMutableArray alloc] init];
     }
     return self;
 }
@@ -72,23 +76,63 @@
 
 - (BOOL) start {
     if (_hostname) {
+        if (!self.continuous && [self _startFromCache])
+            return YES;
         return [super start];
     } else {
         // Service doesn't know its hostname yet; wait till it does:
         LogTo(DNS,@"MYAddressLookup requesting hostname of %@ ...", _service);
         Assert(_service);
+        if (self.error)
+            self.error = 0;
         return [_service start];
     }
 }
 
 
+- (BOOL) lookUpWithCompletion: (void(^)(NSSet*, DNSServiceErrorType))completion {
+    return [self startWithCompletion: ^(MYDNSService *service, DNSServiceErrorType error) {
+        MYAddressLookup *lookup = (MYAddressLookup*)service;
+        completion(error ? nil : [lookup.addresses copy], error);
+    }];
+}
+
+
+// Answers a one-shot lookup from the shared MYResolverCache, if it knows the hostname.
+// (The addresses are set, and KV observers notified, before -start returns.)
+- (BOOL) _startFromCache {
+    MYResolverCache *cache = [MYResolverCache sharedCache];
+    NSArray *sockaddrs = [cache cachedAddressesForHostname: _hostname];
+    NSTimeInterval ttl = [cache timeToLiveForHostname: _hostname];
+    if (sockaddrs.count == 0 || ttl <= 0)
+        return NO;
+    NSMutableSet *addresses = [NSMutableSet set];
+    for (NSData *sockaddr in sockaddrs) {
+        HostAddress *address = [[HostAddress alloc] initWithHostname: _hostname
+                                                            sockaddr: sockaddr.bytes
+                                                                port: _port];
+        if (address)
+            [addresses addObject: address];
+    }
+    if (addresses.count == 0)
+        return NO;
+    LogTo(DNS,@"%@ found %u cached addresses [TTL = %.0f]", self, (unsigned)addresses.count, ttl);
+    if (self.error)
+        self.error = 0;
+    kvSetSet(self, @"addresses", _addresses, addresses);
+    _expires = CFAbsoluteTimeGetCurrent() + ttl;
+    [self gotResponse: 0];
+    return YES;
+}
+
+
 // Called by my _service's gotResponse method:
 - (void) _serviceGotResponse {
     Assert(_service);
     DNSServiceErrorType err = _service.error;
     if (err) {
         [self cancel];
-        self.error = err;
+        [self gotResponse: err];
     } else {
         NSString *hostname = _service.hostname;
         UInt16 port = _service.port;
@@ -110,16 +154,24 @@
                                                         sockaddr: sockaddr
                                                             port: _port];
     if (address) {
+        NSData *sockaddrData = [NSData dataWithBytes: sockaddr length: sockaddr->sa_len];
         if (flags & kDNSServiceFlagsAdd) {
             LogTo(DNS,@"%@ got %@ [TTL = %u]", self, address, ttl);
             kvAddToSet(self, @"addresses", _addresses, address);
+            if (![_sockaddrs containsObject: sockaddrData])
+                [_sockaddrs addObject: sockaddrData];
         } else {
             LogTo(DNS,@"%@ lost %@ [TTL = %u]", self, address, ttl);
             kvRemoveFromSet(self, @"addresses", _addresses, address);
+            [_sockaddrs removeObject: sockaddrData];
         }
     }
     
     _expires = CFAbsoluteTimeGetCurrent() + ttl;
+    if (_sockaddrs.count > 0 && !(flags & kDNSServiceFlagsMoreComing)) {
+        // Share the results, so connections to this host don't have to look it up again:
+        [[MYResolverCache sharedCache] addAddresses: _sockaddrs forHostname: _hostname ttl: ttl];
+    }
 }
 
 
@@ -147,10 +199,11 @@ static void lookupCallback(DNSServiceRef                    sdRef,
 - (DNSServiceErrorType) createServiceRef: (DNSServiceRef*)sdRefPtr {
     Assert(_hostname);
     kvSetSet(self, @"addresses", _addresses, nil);
+    [_sockaddrs removeAllObjects];
     return DNSServiceGetAddrInfo(sdRefPtr,
                                  kDNSServiceFlagsShareConnection,
                                  _interfaceIndex, 
-                                 kDNSServiceProtocol_IPv4,
+                                 kDNSServiceProtocol_IPv4 | kDNSServiceProtocol_IPv6,
                                  _hostname.UTF8String,
                                  &lookupCallback, (__bridge void *)(self));
 }
@@ -8,23 +8,27 @@
 
 #import <Foundation/Foundation.h>
 #import <sys/socket.h>
+#import <netinet/in.h>
 
 
-/** Represents an Internet Protocol address and port number (similar to a sockaddr_in).
-    IPAddress itself only remembers the raw 32-bit IPv4 address; the subclass HostAddress
-    also remembers the DNS host-name. */
+/** Represents an Internet Protocol address, IPv4 or IPv6, and port number (similar to a
+    sockaddr_in or sockaddr_in6). The address is stored inline in 16 bytes, with IPv4 addresses in
+    IPv4-mapped form (::ffff:a.b.c.d), so comparing and hashing are cheap and IPAddresses make good
+    dictionary keys.
+    IPAddress itself only remembers the raw address; the subclass HostAddress also remembers the
+    DNS host-name. */
 @interface IPAddress : NSObject <NSCoding, NSCopying>
 
-/** Initializes an IPAddress from a host name (which may be a DNS name or dotted-quad numeric form)
-    and port number.
-    If the hostname is not in dotted-quad form, an instance of the subclass HostAddress will
-    be returned instead. */
+/** Initializes an IPAddress from a host name (which may be a DNS name, or a numeric IPv4 or IPv6
+    address like "10.0.1.1" or "fe80::1") and port number.
+    If the hostname is not numeric, an instance of the subclass HostAddress will be returned
+    instead. */
 - (id) initWithHostname: (NSString*)hostname port: (UInt16)port;
 
-/** Creates an IPAddress from a host name (which may be a DNS name or dotted-quad numeric form)
-    and port number.
-    If the hostname is not in dotted-quad form, an instance of the subclass HostAddress will
-    be returned instead. */
+/** Creates an IPAddress from a host name (which may be a DNS name, or a numeric IPv4 or IPv6
+    address like "10.0.1.1" or "fe80::1") and port number.
+    If the hostname is not numeric, an instance of the subclass HostAddress will be returned
+    instead. */
 + (IPAddress*) addressWithHostname: (NSString*)hostname port: (UInt16)port;
 
 /** Initializes an IPAddress from a raw IPv4 address (in network byte order, i.e. big-endian)
@@ -35,14 +39,24 @@
     The port number defaults to zero. */
 - (id) initWithIPv4: (UInt32)ipv4;
 
-/** Initializes an IPAddress from a BSD struct sockaddr. */
+/** Initializes an IPAddress from a raw IPv6 address and port number (in native byte order.)
+    An IPv4-mapped address (::ffff:a.b.c.d) is treated as the IPv4 address it contains. */
+- (id) initWithIPv6: (const struct in6_addr*)ipv6 port: (UInt16)port;
+
+/** Initializes an IPAddress from a BSD struct sockaddr (sockaddr_in or sockaddr_in6.) */
 - (id) initWithSockAddr: (const struct sockaddr*)sockaddr;
 
 /** Initializes an IPAddress from NSData containing a BSD struct sockaddr. */
 - (id) initWithData: (NSData*)data;
 
+/** Parses an address range in CIDR notation, like "10.0.0.0/8" or "fe80::/10", returning the
+    network address and storing the prefix length in *outPrefixLength. A plain address counts as
+    a range of just that address. Returns nil if the string isn't valid. */
++ (IPAddress*) addressWithCIDR: (NSString*)cidr prefixLength: (unsigned*)outPrefixLength;
+
 /** Returns the IP address of this host (plus the specified port number).
-    If multiple network interfaces are active, the main one's address is returned. */
+    If multiple network interfaces are active, the main one's address is returned; IPv4 is
+    preferred, but if there's none, a global IPv6 address is returned. */
 + (IPAddress*) localAddressWithPort: (UInt16)port;
 
 /** Returns the IP address of this host (with a port number of zero).
@@ -56,24 +70,40 @@
 /** Returns YES if the two objects have the same IP address, ignoring port numbers. */
 - (BOOL) isSameHost: (IPAddress*)addr;
 
-/** The raw IPv4 address, in network (big-endian) byte order. */
+/** Returns YES if the address is in the network with the given address and prefix length
+    (CIDR notation); e.g. 10.0.1.254 is in 10.0.0.0/8. The prefix length counts the bits of
+    the network's own kind of address: up to 32 for IPv4 and 128 for IPv6. */
+- (BOOL) isInNetwork: (IPAddress*)network prefixLength: (unsigned)prefixLength;
+
+/** Returns an IPAddress with the same numeric address but a different port number. */
+- (IPAddress*) addressWithPort: (UInt16)port;
+
+/** Is this an IPv6 address (and not an IPv4-mapped one)? */
+@property (readonly) BOOL isIPv6;
+
+/** The raw IPv4 address, in network (big-endian) byte order, or zero if this is an IPv6
+    address. */
 @property (readonly) UInt32 ipv4;               // raw address in network byte order
 
-/** The address as a dotted-quad string, e.g. @"10.0.1.1". */
+/** The raw address as IPv6; an IPv4 address is returned in IPv4-mapped form. */
+@property (readonly) struct in6_addr ipv6;
+
+/** The address as a dotted-quad string, e.g. @"10.0.1.1", or nil if it's IPv6. */
 @property (readonly) NSString* ipv4name;
 
-/** The address as a DNS hostname or else a dotted-quad string.
-    (IPAddress itself always returns dotted-quad; HostAddress returns the hostname it was
-    initialized with.) */
-@property (readonly) NSString* hostname;        // dotted-quad string, or DNS name if I am a HostAddress
+/** The address as a DNS hostname or else a numeric string.
+    (IPAddress itself always returns dotted-quad or IPv6 notation; HostAddress returns the
+    hostname it was initialized with.) */
+@property (readonly) NSString* hostname;        // numeric string, or DNS name if I am a HostAddress
 
 /** The port number, or zero if none was specified, in native byte order. */
 @property (readonly) UInt16 port;
 
-/** The address as an NSData object containing a struct sockaddr. */
+/** The address as an NSData object containing a struct sockaddr_in or sockaddr_in6. */
 @property (readonly) NSData* asData;
 
-/** Is this IP address in a designated private/local address range, such as 10.0.1.X?
+/** Is this IP address in a designated private/local address range, such as 10.0.1.X, or an IPv6
+    loopback, link-local or unique-local address?
     If so, the address is not globally meaningful outside of the local subnet. */
 @property (readonly) BOOL isPrivate;            // In a private/local addr range like 10.0.1.X?
 @end
@@ -81,7 +111,8 @@
 
 
 /** A subclass of IPAddress that remembers the DNS hostname instead of a raw address.
-    An instance of HostAddress looks up its ipv4 address on the fly by calling gethostbyname. */
+    Unless it was initialized with a sockaddr, an instance of HostAddress looks up its ipv4
+    address on the fly by calling gethostbyname. */
 @interface HostAddress : IPAddress
 
 - (id) initWithHostname: (NSString*)hostname port: (UInt16)port;
@@ -105,6 +136,11 @@
     any inherited initializer method.) */
 - (id) initWithIPAddress: (IPAddress*)addr;
 
+/** Initializes a RecentAddress from an IPAddress and previously recorded statistics. */
+- (id) initWithIPAddress: (IPAddress*)addr
+             lastSuccess: (CFAbsoluteTime)lastSuccess
+               successes: (UInt32)successes;
+
 /** The absolute time that -noteSuccess or -noteSeen was last called. */
 @property (readonly) CFAbsoluteTime lastSuccess;
 
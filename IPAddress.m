@@ -7,6 +7,7 @@
 //
 
 #import "IPAddress.h"
+#import "IPAddressSet.h"
 
 #import "Logging.h"
 #import "Test.h"
@@ -15,33 +16,97 @@
 #import <sys/socket.h>
 #import <net/if.h>
 #import <netinet/in.h>
+#import <arpa/inet.h>
 #import <ifaddrs.h>
 #import <netdb.h>
 
 
+// An IPv6 address, viewable as bytes or as two words for fast comparison and hashing.
+typedef union {
+    UInt8 bytes[16];
+    UInt64 words[2];
+    struct in6_addr in6;
+} IPAddressBits;
+
+// The first 12 bytes of an IPv4-mapped IPv6 address (RFC 4291, 2.5.5.2.)
+static const UInt8 kIPv4MappedPrefix[12] = {0,0,0,0, 0,0,0,0, 0,0,0xFF,0xFF};
+
+static inline BOOL isIPv4Mapped( const IPAddressBits *addr ) {
+    return memcmp(addr->bytes, kIPv4MappedPrefix, sizeof(kIPv4MappedPrefix)) == 0;
+}
+
+static inline void setIPv4Mapped( IPAddressBits *addr, UInt32 ipv4 ) {
+    memcpy(addr->bytes, kIPv4MappedPrefix, sizeof(kIPv4MappedPrefix));
+    memcpy(&addr->bytes[12], &ipv4, sizeof(ipv4));
+}
+
+// Do the first `bits` bits of two addresses match?
+static BOOL prefixMatches( const UInt8 *a, const UInt8 *b, unsigned bits ) {
+    unsigned bytes = bits / 8;
+    if( memcmp(a, b, bytes) != 0 )
+        return NO;
+    unsigned rest = bits % 8;
+    if( rest == 0 )
+        return YES;
+    UInt8 mask = (UInt8)(0xFF << (8 - rest));
+    return ((a[bytes] ^ b[bytes]) & mask) == 0;
+}
+
+
+@interface IPAddress ()
+- (UInt32) _storedIPv4;
+- (BOOL) _hasStoredAddress;
+@end
+
+
 @implementation IPAddress
 {
-    UInt32 _ipv4;       // In network byte order (big-endian), just like struct in_addr
-    UInt16 _port;       // native byte order
+    IPAddressBits _addr;    // In network byte order; IPv4 addresses are IPv4-mapped
+    UInt32 _scopeID;        // Interface index of a link-local IPv6 address (not part of equality)
+    UInt16 _port;           // native byte order
 }
 
 
-+ (UInt32) IPv4FromDottedQuadString: (NSString*)str
-{
-    Assert(str);
+// Parses a dotted-quad string, returning NO if it isn't one.
+static BOOL parseIPv4( NSString *str, UInt32 *outIPv4 ) {
     UInt32 ipv4 = 0;
     NSScanner *scanner = [NSScanner scannerWithString: str];
     for( int i=0; i<4; i++ ) {
         if( i>0 && ! [scanner scanString: @"." intoString: nil] )
-            return 0;
+            return NO;
         NSInteger octet;
         if( ! [scanner scanInteger: &octet] || octet<0 || octet>255 )
-            return 0;
+            return NO;
         ipv4 = (ipv4<<8) | (UInt8)octet;
     }
     if( ! [scanner isAtEnd] )
-        return 0;
-    return htonl(ipv4);
+        return NO;
+    *outIPv4 = htonl(ipv4);
+    return YES;
+}
+
+// Parses an IPv6 address, optionally in brackets and with a "%interface" scope suffix.
+static BOOL parseIPv6( NSString *str, IPAddressBits *outAddr, UInt32 *outScopeID ) {
+    if( [str hasPrefix: @"["] && [str hasSuffix: @"]"] )
+        str = [str substringWithRange: NSMakeRange(1, str.length - 2)];
+    *outScopeID = 0;
+    NSRange percent = [str rangeOfString: @"%"];
+    if( percent.length > 0 ) {
+        NSString *scope = [str substringFromIndex: NSMaxRange(percent)];
+        *outScopeID = if_nametoindex(scope.UTF8String) ?: (UInt32)scope.intValue;
+        if( *outScopeID == 0 )
+            return NO;
+        str = [str substringToIndex: percent.location];
+    }
+    return inet_pton(AF_INET6, str.UTF8String, &outAddr->in6) == 1;
+}
+
+
++ (UInt32) IPv4FromDottedQuadString: (NSString*)str
+{
+    Assert(str);
+    UInt32 ipv4;
+    return parseIPv4(str, &ipv4) ? ipv4 : 0;
 }
          
          
@@ -50,8 +115,10 @@
     Assert(hostname);
     self = [super init];
     if (self != nil) {
-        _ipv4 = [[self class] IPv4FromDottedQuadString: hostname];
-        if( ! _ipv4 ) {
+        UInt32 ipv4;
+        if( parseIPv4(hostname, &ipv4) ) {
+            setIPv4Mapped(&_addr, ipv4);
+        } else if( ! parseIPv6(hostname, &_addr, &_scopeID) ) {
             return [[HostAddress alloc] initWithHostname: hostname port: port];
         }
         _port = port;
@@ -69,7 +136,7 @@
 {
     self = [super init];
     if (self != nil) {
-        _ipv4 = ipv4;
+        setIPv4Mapped(&_addr, ipv4);
         _port = port;
     }
     return self;
@@ -80,11 +147,28 @@
     return [self initWithIPv4: ipv4 port: 0];
 }
 
+- (id) initWithIPv6: (const struct in6_addr*)ipv6 port: (UInt16)port
+{
+    Assert(ipv6);
+    self = [super init];
+    if (self != nil) {
+        _addr.in6 = *ipv6;
+        _port = port;
+    }
+    return self;
+}
+
 - (id) initWithSockAddr: (const struct sockaddr*)sockaddr
 {
     if (sockaddr && sockaddr->sa_family == AF_INET) {
         const struct sockaddr_in *addr_in = (const struct sockaddr_in*)sockaddr;
         return [self initWithIPv4: addr_in->sin_addr.s_addr port: ntohs(addr_in->sin_port)];
+    } else if (sockaddr && sockaddr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6*)sockaddr;
+        self = [self initWithIPv6: &addr_in6->sin6_addr port: ntohs(addr_in6->sin6_port)];
+        if (self)
+            _scopeID = addr_in6->sin6_scope_id;
+        return self;
     } else {
         return nil;
     }
@@ -107,6 +191,8 @@
     const struct sockaddr* addr = data.bytes;
     if (data.length < sizeof(struct sockaddr_in))
         addr = nil;
+    else if (addr->sa_family == AF_INET6 && data.length < sizeof(struct sockaddr_in6))
+        addr = nil;
     return [self initWithSockAddr: addr];
 }
 
@@ -122,6 +208,26 @@
         return nil;
 }    
 
+
++ (IPAddress*) addressWithCIDR: (NSString*)cidr prefixLength: (unsigned*)outPrefixLength
+{
+    NSRange slash = [cidr rangeOfString: @"/"];
+    NSString *host = slash.length ? [cidr substringToIndex: slash.location] : cidr;
+    IPAddress *addr = [[IPAddress alloc] initWithHostname: host port: 0];
+    if( ! addr || [addr isKindOfClass: [HostAddress class]] )
+        return nil;
+    NSInteger maxLength = addr.isIPv6 ? 128 : 32, length = maxLength;
+    if( slash.length ) {
+        NSScanner *scanner = [NSScanner scannerWithString: [cidr substringFromIndex: NSMaxRange(slash)]];
+        if( ! [scanner scanInteger: &length] || ! scanner.isAtEnd || length < 0 || length > maxLength )
+            return nil;
+    }
+    if( outPrefixLength )
+        *outPrefixLength = (unsigned)length;
+    return addr;
+}
+
+
 - (id) copyWithZone: (NSZone*)zone
 {
     return self;
@@ -129,8 +235,12 @@
 
 - (void)encodeWithCoder:(NSCoder *)coder
 {
-    if( _ipv4 )
-        [coder encodeInt32: _ipv4 forKey: @"ipv4"];
+    if( ! isIPv4Mapped(&_addr) )
+        [coder encodeBytes: _addr.bytes length: sizeof(_addr) forKey: @"ipv6"];
+    else if( [self _storedIPv4] )
+        [coder encodeInt32: [self _storedIPv4] forKey: @"ipv4"];
+    if( _scopeID )
+        [coder encodeInt32: _scopeID forKey: @"scope"];
     if( _port )
         [coder encodeInt: _port forKey: @"port"];
 }
@@ -139,14 +249,39 @@
 {
     self = [super init];
     if( self ) {
-        _ipv4 = [decoder decodeInt32ForKey: @"ipv4"];
+        NSUInteger length = 0;
+        const uint8_t *ipv6 = [decoder decodeBytesForKey: @"ipv6" returnedLength: &length];
+        if( ipv6 && length == sizeof(_addr) )
+            memcpy(_addr.bytes, ipv6, sizeof(_addr));
+        else
+            setIPv4Mapped(&_addr, [decoder decodeInt32ForKey: @"ipv4"]);
+        _scopeID = [decoder decodeInt32ForKey: @"scope"];
         _port = [decoder decodeIntForKey: @"port"];
     }
     return self;
 }
 
 
-@synthesize ipv4=_ipv4, port=_port;
+@synthesize port=_port;
+
+// The stored IPv4 address (without HostAddress's lookup), or zero.
+- (UInt32) _storedIPv4
+{
+    UInt32 ipv4 = 0;
+    if( isIPv4Mapped(&_addr) )
+        memcpy(&ipv4, &_addr.bytes[12], sizeof(ipv4));
+    return ipv4;
+}
+
+// Does this object hold an actual address? (A HostAddress may not, until it's looked up.)
+- (BOOL) _hasStoredAddress
+{
+    return ! isIPv4Mapped(&_addr) || [self _storedIPv4] != 0;
+}
+
+- (UInt32) ipv4                 {return [self _storedIPv4];}
+- (struct in6_addr) ipv6        {return _addr.in6;}
+- (BOOL) isIPv6                 {return ! isIPv4Mapped(&_addr);}
 
 - (BOOL) isEqual: (IPAddress*)addr
 {
@@ -155,12 +290,36 @@
 
 - (BOOL) isSameHost: (IPAddress*)addr
 {
-    return addr && _ipv4==addr->_ipv4;
+    return addr && _addr.words[0]==addr->_addr.words[0] && _addr.words[1]==addr->_addr.words[1];
 }
 
 - (NSUInteger) hash
 {
-    return _ipv4 ^ _port;
+    UInt64 h = (_addr.words[0] * 0x9E3779B97F4A7C15ull) ^ _addr.words[1];
+    h ^= h >> 29;
+    return (NSUInteger)h ^ _port;
+}
+
+- (BOOL) isInNetwork: (IPAddress*)network prefixLength: (unsigned)prefixLength
+{
+    if( network.isIPv6 ) {
+        Assert(prefixLength <= 128);
+    } else {
+        Assert(prefixLength <= 32);
+        prefixLength += 96;     // skip the IPv4-mapped prefix
+    }
+    struct in6_addr mine = self.ipv6, theirs = network.ipv6;
+    return prefixMatches(mine.s6_addr, theirs.s6_addr, prefixLength);
+}
+
+- (IPAddress*) addressWithPort: (UInt16)port
+{
+    if( port == _port && [self class] == [IPAddress class] )
+        return self;
+    struct in6_addr ipv6 = self.ipv6;
+    IPAddress *addr = [[IPAddress alloc] initWithIPv6: &ipv6 port: port];
+    addr->_scopeID = _scopeID;
+    return addr;
 }
 
 - (NSString*) ipv4name
@@ -176,24 +335,43 @@
 
 - (NSString*) hostname
 {
+    if( ! isIPv4Mapped(&_addr) ) {
+        char str[INET6_ADDRSTRLEN];
+        if( ! inet_ntop(AF_INET6, &_addr.in6, str, sizeof(str)) )
+            return nil;
+        return @(str);
+    }
     return [self ipv4name];
 }
 
 - (NSData*) asData
 {
+    if( ! isIPv4Mapped(&_addr) ) {
+        struct sockaddr_in6 addr = {
+            .sin6_len       = sizeof(struct sockaddr_in6),
+            .sin6_family    = AF_INET6,
+            .sin6_port      = htons(_port),
+            .sin6_addr      = _addr.in6,
+            .sin6_scope_id  = _scopeID };
+        return [NSData dataWithBytes: &addr length: sizeof(addr)];
+    }
     struct sockaddr_in addr = {
         .sin_len    = sizeof(struct sockaddr_in),
         .sin_family = AF_INET,
         .sin_port   = htons(_port),
-        .sin_addr   = {htonl(_ipv4)} };
+        .sin_addr   = {[self _storedIPv4]} };     // already in network byte order
     return [NSData dataWithBytes: &addr length: sizeof(addr)];
 }
 
 - (NSString*) description
 {
     NSString *name = self.hostname ?: @"0.0.0.0";
-    if( _port )
-        name = [name stringByAppendingFormat: @":%hu",_port];
+    if( _port ) {
+        if( self.isIPv6 && ![self isKindOfClass: [HostAddress class]] )
+            name = [NSString stringWithFormat: @"[%@]:%hu", name, _port];
+        else
+            name = [name stringByAppendingFormat: @":%hu",_port];
+    }
     return name;
 }
 
@@ -201,22 +379,32 @@
 + (IPAddress*) localAddressWithPort: (UInt16)port
 {
     // getifaddrs returns a linked list of interface entries;
-    // find the first active non-loopback interface with IPv4:
+    // find the first active non-loopback interface with IPv4, else one with global IPv6:
     UInt32 address = 0;
+    struct in6_addr address6;
+    BOOL haveIPv6 = NO;
     struct ifaddrs *interfaces;
     if( getifaddrs(&interfaces) == 0 ) {
         struct ifaddrs *interface;
         for( interface=interfaces; interface; interface=interface->ifa_next ) {
             if( (interface->ifa_flags & IFF_UP) && ! (interface->ifa_flags & IFF_LOOPBACK) ) {
-                const struct sockaddr_in *addr = (const struct sockaddr_in*) interface->ifa_addr;
-                if( addr && addr->sin_family==AF_INET ) {
-                    address = addr->sin_addr.s_addr;
+                const struct sockaddr *addr = interface->ifa_addr;
+                if( addr && addr->sa_family==AF_INET ) {
+                    address = ((const struct sockaddr_in*)addr)->sin_addr.s_addr;
                     break;
+                } else if( addr && addr->sa_family==AF_INET6 && ! haveIPv6 ) {
+                    const struct in6_addr *a6 = &((const struct sockaddr_in6*)addr)->sin6_addr;
+                    if( ! IN6_IS_ADDR_LINKLOCAL(a6) ) {
+                        address6 = *a6;
+                        haveIPv6 = YES;
+                    }
                 }
             }
         }
         freeifaddrs(interfaces);
     }
+    if( ! address && haveIPv6 )
+        return [[self alloc] initWithIPv6: &address6 port: port];
     return [[self alloc] initWithIPv4: address port: port];
 }
 
@@ -226,26 +414,31 @@
 }
 
 
-// Private IP address ranges. See RFC 3330.
-static struct {UInt32 mask, value;} const kPrivateRanges[] = {
-    {0xFF000000, 0x00000000},       //   0.x.x.x (hosts on "this" network)
-    {0xFF000000, 0x0A000000},       //  10.x.x.x (private address range)
-    {0xFF000000, 0x7F000000},       // 127.x.x.x (loopback)
-    {0xFFFF0000, 0xA9FE0000},       // 169.254.x.x (link-local self-configured addresses)
-    {0xFFF00000, 0xAC100000},       // 172.(16-31).x.x (private address range)
-    {0xFFFF0000, 0xC0A80000},       // 192.168.x.x (private address range)
-    {0,0}
+// Private and local address ranges. See RFC 6890.
+static NSString* const kPrivateRanges[] = {
+    @"0.0.0.0/8",           // hosts on "this" network
+    @"10.0.0.0/8",          // private address range
+    @"127.0.0.0/8",         // loopback
+    @"169.254.0.0/16",      // link-local self-configured addresses
+    @"172.16.0.0/12",       // 172.(16-31).x.x (private address range)
+    @"192.168.0.0/16",      // private address range
+    @"::/128",              // unspecified
+    @"::1/128",             // loopback
+    @"fc00::/7",            // unique local addresses
+    @"fe80::/10",           // link-local
 };
 
 
 - (BOOL) isPrivate
 {
-    UInt32 address = ntohl(self.ipv4);
-    int i;
-    for( i=0; kPrivateRanges[i].mask; i++ )
-        if( (address & kPrivateRanges[i].mask) == kPrivateRanges[i].value )
-            return YES;
-    return NO;
+    static IPAddressSet *sPrivateRanges;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sPrivateRanges = [[IPAddressSet alloc] initWithCIDRs:
+                            [NSArray arrayWithObjects: kPrivateRanges
+                                                count: sizeof(kPrivateRanges)/sizeof(kPrivateRanges[0])]];
+    });
+    return [sPrivateRanges containsAddress: self];
 }
 
 
@@ -308,7 +501,7 @@ static struct {UInt32 mask, value;} const kPrivateRanges[] = {
 - (NSString*) description
 {
     NSMutableString *desc = [_hostname mutableCopy];
-    NSString *addr = self.ipv4name;
+    NSString *addr = self.isIPv6 ? [super hostname] : self.ipv4name;
     if (addr)
         [desc appendFormat: @"(%@)", addr];
     if( self.port )
@@ -328,6 +521,8 @@ static struct {UInt32 mask, value;} const kPrivateRanges[] = {
 
 - (UInt32) ipv4
 {
+    if( [self _hasStoredAddress] )
+        return [super ipv4];      // initialized with a sockaddr, so no need to look it up
     struct hostent *ent = gethostbyname(_hostname.UTF8String);
     if( ! ent ) {
         Log(@"HostAddress: DNS lookup failed for <%@>: %s", _hostname, hstrerror(h_errno));
@@ -336,6 +531,15 @@ static struct {UInt32 mask, value;} const kPrivateRanges[] = {
     return * (const in_addr_t*) ent->h_addr_list[0];
 }
 
+- (struct in6_addr) ipv6
+{
+    if( [self _hasStoredAddress] )
+        return [super ipv6];
+    IPAddressBits addr;
+    setIPv4Mapped(&addr, self.ipv4);
+    return addr.in6;
+}
+
 
 - (BOOL) isSameHost: (IPAddress*)addr
 {
@@ -360,9 +564,25 @@ static struct {UInt32 mask, value;} const kPrivateRanges[] = {
 
 - (id) initWithIPAddress: (IPAddress*)addr
 {
+    if( addr.isIPv6 ) {
+        struct in6_addr ipv6 = addr.ipv6;
+        return [super initWithIPv6: &ipv6 port: addr.port];
+    }
     return [super initWithIPv4: addr.ipv4 port: addr.port];
 }
 
+- (id) initWithIPAddress: (IPAddress*)addr
+             lastSuccess: (CFAbsoluteTime)lastSuccess
+               successes: (UInt32)successes
+{
+    self = [self initWithIPAddress: addr];
+    if( self ) {
+        _lastSuccess = lastSuccess;
+        _successes = successes;
+    }
+    return self;
+}
+
 
 @synthesize lastSuccess=_lastSuccess, successes=_successes;
 
@@ -436,6 +656,65 @@ TestCase(IPAddress) {
     CAssert(!addr.isPrivate);
 }
 
+TestCase(IPAddressIPv6) {
+    IPAddress *addr = [[IPAddress alloc] initWithHostname: @"2001:db8::1" port: 443];
+    CAssertEq(addr.class,[IPAddress class]);
+    CAssert(addr.isIPv6);
+    CAssertEq(addr.ipv4,0u);
+    CAssertEq(addr.ipv4name,nil);
+    CAssertEqual(addr.hostname,@"2001:db8::1");
+    CAssertEqual(addr.description,@"[2001:db8::1]:443");
+    CAssert(!addr.isPrivate);
+
+    // Round trip through a sockaddr_in6:
+    NSData *data = addr.asData;
+    CAssertEq(data.length,sizeof(struct sockaddr_in6));
+    CAssertEq(((const struct sockaddr*)data.bytes)->sa_family,AF_INET6);
+    IPAddress *addr2 = [[IPAddress alloc] initWithData: data];
+    CAssertEqual(addr2,addr);
+    CAssertEq(addr2.hash,addr.hash);
+    CAssert(![addr2 isEqual: [addr addressWithPort: 80]]);
+    CAssert([addr2 isSameHost: [addr addressWithPort: 80]]);
+
+    // IPv4 addresses are stored IPv4-mapped, and round-trip through a sockaddr_in:
+    IPAddress *v4 = [[IPAddress alloc] initWithHostname: @"10.0.1.254" port: 8080];
+    CAssert(!v4.isIPv6);
+    CAssertEq(v4.ipv6.s6_addr[10],0xFF);
+    data = v4.asData;
+    CAssertEq(data.length,sizeof(struct sockaddr_in));
+    CAssertEq(((const struct sockaddr_in*)data.bytes)->sin_addr.s_addr,(UInt32)htonl(0x0A0001FE));
+    CAssertEqual([[IPAddress alloc] initWithData: data],v4);
+    struct in6_addr mapped = v4.ipv6;
+    CAssertEqual([[IPAddress alloc] initWithIPv6: &mapped port: 8080],v4);
+    CAssertEqual([[IPAddress alloc] initWithHostname: @"::ffff:10.0.1.254" port: 8080],v4);
+    CAssert(![v4 isSameHost: addr]);
+
+    // Archiving:
+    NSData *archive = [NSKeyedArchiver archivedDataWithRootObject: @[addr, v4]];
+    CAssertEqual([NSKeyedUnarchiver unarchiveObjectWithData: archive],(@[addr, v4]));
+
+    // CIDR networks:
+    unsigned length;
+    IPAddress *net = [IPAddress addressWithCIDR: @"10.0.0.0/8" prefixLength: &length];
+    CAssertEq(length,8u);
+    CAssert([v4 isInNetwork: net prefixLength: length]);
+    CAssert(![addr isInNetwork: net prefixLength: length]);
+    net = [IPAddress addressWithCIDR: @"2001:db8::/32" prefixLength: &length];
+    CAssertEq(length,32u);
+    CAssert([addr isInNetwork: net prefixLength: length]);
+    CAssert(![v4 isInNetwork: net prefixLength: length]);
+    CAssert([IPAddress addressWithCIDR: @"0.0.0.0/0" prefixLength: &length] != nil);
+    CAssertEq(length,0u);
+    CAssertEq([IPAddress addressWithCIDR: @"10.0.0.0/33" prefixLength: &length],nil);
+    CAssertEq([IPAddress addressWithCIDR: @"example.com/8" prefixLength: &length],nil);
+
+    CAssert([[IPAddress alloc] initWithHostname: @"::1" port: 0].isPrivate);
+    CAssert([[IPAddress alloc] initWithHostname: @"fe80::1:2" port: 0].isPrivate);
+    CAssert([[IPAddress alloc] initWithHostname: @"fd12:3456::1" port: 0].isPrivate);
+    CAssert([[IPAddress alloc] initWithHostname: @"172.31.0.1" port: 0].isPrivate);
+    CAssert(![[IPAddress alloc] initWithHostname: @"172.32.0.1" port: 0].isPrivate);
+}
+
 
 /*
  Copyright (c) 2008, Jens Alfke <jens@mooseyard.com>. All rights reserved.
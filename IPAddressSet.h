@@ -0,0 +1,49 @@
+//
+//  IPAddressSet.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+@class IPAddress;
+
+
+/** A set of IP address ranges, i.e. CIDR networks like "10.0.0.0/8" or "fe80::/10", such as an
+    allowlist of peers. IPv4 and IPv6 ranges can be mixed.
+    The ranges are stored in a radix tree keyed by the address bits, so testing whether an
+    address is in the set takes time proportional to the prefix length, however many ranges
+    it contains.
+    An IPAddressSet can be read from multiple threads at once, but not while it's being
+    changed. */
+@interface IPAddressSet : NSObject
+
+/** Initializes an empty set. */
+- (id) init;
+
+/** Initializes a set from an array of CIDR strings (see -addCIDR:). Returns nil if any of them
+    are invalid. */
+- (id) initWithCIDRs: (NSArray*)cidrs;
+
+/** Adds the network with the given address and prefix length. The prefix length counts the bits
+    of the address's own kind: up to 32 for IPv4 and 128 for IPv6. */
+- (void) addAddress: (IPAddress*)address prefixLength: (unsigned)prefixLength;
+
+/** Adds a single address. */
+- (void) addAddress: (IPAddress*)address;
+
+/** Adds a network in CIDR notation, like "192.168.0.0/16", or a plain address.
+    Returns NO if the string isn't valid. */
+- (BOOL) addCIDR: (NSString*)cidr;
+
+/** Removes all the ranges. */
+- (void) removeAllAddresses;
+
+/** Returns YES if the address is in any of the ranges. Port numbers are ignored. */
+- (BOOL) containsAddress: (IPAddress*)address;
+
+/** The number of distinct ranges that have been added. */
+@property (readonly) NSUInteger count;
+
+@end
@@ -0,0 +1,252 @@
+//
+//  IPAddressSet.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "IPAddressSet.h"
+#import "IPAddress.h"
+
+#import "Logging.h"
+#import "Test.h"
+
+
+// A node of the radix tree. Each node holds a prefix that its children extend; a chain of nodes
+// with only one child is collapsed into its last node, so a lookup visits at most one node per
+// bit in which the stored prefixes differ.
+typedef struct IPSetNode {
+    struct in6_addr prefix;         // bits past `length` are zero
+    unsigned length;                // number of bits in the prefix, 0...128
+    BOOL inSet;                     // Is this prefix itself in the set, or just a branch point?
+    struct IPSetNode *child[2];     // subtrees whose next bit (at index `length`) is 0 or 1
+} IPSetNode;
+
+
+static inline unsigned bitAt( const UInt8 *addr, unsigned i ) {
+    return (addr[i/8] >> (7 - i%8)) & 1;
+}
+
+// The number of leading bits, up to maxBits, that two addresses have in common.
+static unsigned commonPrefixLength( const UInt8 *a, const UInt8 *b, unsigned maxBits ) {
+    unsigned bits = 0;
+    for( unsigned i=0; i<16 && bits<maxBits; i++ ) {
+        UInt8 diff = a[i] ^ b[i];
+        if( diff ) {
+            bits += __builtin_clz(diff) - 24;
+            break;
+        }
+        bits += 8;
+    }
+    return MIN(bits, maxBits);
+}
+
+static IPSetNode* newNode( const UInt8 *prefix, unsigned length, BOOL inSet ) {
+    IPSetNode *node = calloc(1, sizeof(IPSetNode));
+    if( ! node )
+        return NULL;
+    memcpy(node->prefix.s6_addr, prefix, length/8);
+    if( length % 8 )
+        node->prefix.s6_addr[length/8] = prefix[length/8] & (UInt8)(0xFF << (8 - length%8));
+    node->length = length;
+    node->inSet = inSet;
+    return node;
+}
+
+static void freeTree( IPSetNode *node ) {
+    if( node ) {
+        freeTree(node->child[0]);
+        freeTree(node->child[1]);
+        free(node);
+    }
+}
+
+// Adds a prefix to the tree rooted at *slot; returns YES if it wasn't already there.
+static BOOL insertPrefix( IPSetNode **slot, const UInt8 *key, unsigned length ) {
+    for(;;) {
+        IPSetNode *node = *slot;
+        if( ! node ) {
+            *slot = newNode(key, length, YES);
+            return YES;
+        }
+        unsigned common = commonPrefixLength(key, node->prefix.s6_addr, MIN(length, node->length));
+        if( common < node->length ) {
+            // The key diverges from (or ends within) this node's prefix: insert a parent node
+            // holding the common part, with the existing node and the new key below it.
+            IPSetNode *parent = newNode(key, common, common == length);
+            parent->child[bitAt(node->prefix.s6_addr, common)] = node;
+            if( common < length )
+                parent->child[bitAt(key, common)] = newNode(key, length, YES);
+            *slot = parent;
+            return YES;
+        } else if( length == node->length ) {
+            BOOL added = ! node->inSet;
+            node->inSet = YES;
+            return added;
+        }
+        slot = &node->child[bitAt(key, node->length)];
+    }
+}
+
+
+@implementation IPAddressSet
+{
+    IPSetNode *_root;
+    NSUInteger _count;
+}
+
+
+- (id) init
+{
+    return [super init];
+}
+
+- (id) initWithCIDRs: (NSArray*)cidrs
+{
+    self = [super init];
+    if (self) {
+        for( NSString *cidr in cidrs ) {
+            if( ! [self addCIDR: cidr] ) {
+                Warn(@"IPAddressSet: Invalid CIDR address range '%@'", cidr);
+                return nil;
+            }
+        }
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    freeTree(_root);
+}
+
+
+@synthesize count=_count;
+
+
+- (void) addAddress: (IPAddress*)address prefixLength: (unsigned)prefixLength
+{
+    Assert(address);
+    if( address.isIPv6 ) {
+        Assert(prefixLength <= 128);
+    } else {
+        Assert(prefixLength <= 32);
+        prefixLength += 96;     // skip the IPv4-mapped prefix
+    }
+    struct in6_addr key = address.ipv6;
+    if( insertPrefix(&_root, key.s6_addr, prefixLength) )
+        _count++;
+}
+
+- (void) addAddress: (IPAddress*)address
+{
+    [self addAddress: address prefixLength: (address.isIPv6 ? 128 : 32)];
+}
+
+- (BOOL) addCIDR: (NSString*)cidr
+{
+    unsigned length;
+    IPAddress *address = [IPAddress addressWithCIDR: cidr prefixLength: &length];
+    if( ! address )
+        return NO;
+    [self addAddress: address prefixLength: length];
+    return YES;
+}
+
+- (void) removeAllAddresses
+{
+    freeTree(_root);
+    _root = NULL;
+    _count = 0;
+}
+
+
+- (BOOL) containsAddress: (IPAddress*)address
+{
+    if( ! address )
+        return NO;
+    struct in6_addr key = address.ipv6;
+    for( const IPSetNode *node = _root; node; ) {
+        if( commonPrefixLength(key.s6_addr, node->prefix.s6_addr, node->length) < node->length )
+            return NO;
+        if( node->inSet )
+            return YES;
+        if( node->length >= 128 )
+            return NO;
+        node = node->child[bitAt(key.s6_addr, node->length)];
+    }
+    return NO;
+}
+
+
+- (NSString*) description
+{
+    return $sprintf(@"%@[%lu ranges]", self.class, (unsigned long)_count);
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+static IPAddress* addr( NSString *str ) {
+    return [[IPAddress alloc] initWithHostname: str port: 0];
+}
+
+TestCase(IPAddressSet) {
+    RequireTestCase(IPAddressIPv6);
+    IPAddressSet *set = [[IPAddressSet alloc] initWithCIDRs: @[@"10.0.0.0/8", @"192.168.1.0/24",
+                                                               @"10.1.0.0/16", @"2001:db8::/32",
+                                                               @"fe80::/10", @"8.8.8.8"]];
+    CAssert(set);
+    CAssertEq(set.count, 6u);
+    CAssert([set containsAddress: addr(@"10.0.1.254")]);
+    CAssert([set containsAddress: addr(@"10.1.2.3")]);
+    CAssert([set containsAddress: addr(@"192.168.1.77")]);
+    CAssert(![set containsAddress: addr(@"192.168.2.77")]);
+    CAssert([set containsAddress: addr(@"8.8.8.8")]);
+    CAssert(![set containsAddress: addr(@"8.8.8.9")]);
+    CAssert(![set containsAddress: addr(@"11.0.0.1")]);
+    CAssert([set containsAddress: addr(@"2001:db8:1234::5")]);
+    CAssert(![set containsAddress: addr(@"2001:db9::5")]);
+    CAssert([set containsAddress: addr(@"fe80::1")]);
+    CAssert([set containsAddress: addr(@"febf::1")]);
+    CAssert(![set containsAddress: addr(@"fec0::1")]);
+    // An IPv4 range doesn't match IPv6 addresses with the same leading bits, or vice versa:
+    CAssert(![set containsAddress: addr(@"a00::1")]);
+    CAssert(![[[IPAddressSet alloc] initWithCIDRs: @[@"::/8"]] containsAddress: addr(@"0.1.2.3")]);
+
+    CAssert(![set addCIDR: @"10.0.0.0/40"]);
+    CAssert(![set addCIDR: @"example.com"]);
+    [set addAddress: addr(@"10.0.0.0") prefixLength: 8];     // duplicate
+    CAssertEq(set.count, 6u);
+
+    IPAddressSet *everything = [[IPAddressSet alloc] initWithCIDRs: @[@"0.0.0.0/0", @"::/0"]];
+    CAssert([everything containsAddress: addr(@"1.2.3.4")]);
+    CAssert([everything containsAddress: addr(@"::1")]);
+
+    [set removeAllAddresses];
+    CAssertEq(set.count, 0u);
+    CAssert(![set containsAddress: addr(@"10.0.1.254")]);
+
+    // Lookups stay fast however many ranges there are:
+    const unsigned kNRanges = 100000;
+    for( unsigned i=0; i<kNRanges; i++ )
+        [set addAddress: [[IPAddress alloc] initWithIPv4: htonl(0x0B000000 + (i << 8))]
+           prefixLength: 24];
+    CAssertEq(set.count, (NSUInteger)kNRanges);
+    IPAddress *inside = addr(@"11.0.200.7"), *outside = addr(@"12.0.0.1");
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    const unsigned kNLookups = 1000000;
+    for( unsigned i=0; i<kNLookups; i++ ) {
+        if( ! [set containsAddress: (i & 1) ? inside : outside] && (i & 1) )
+            CAssert(NO, @"Lookup failed");
+    }
+    Log(@"IPAddressSet: %.0f ns per lookup among %u ranges",
+        (CFAbsoluteTimeGetCurrent() - start) / kNLookups * 1e9, kNRanges);
+}
+
+#endif
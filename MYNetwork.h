@@ -15,4 +15,6 @@
 #import "TCPConnection.h"
 #import "BLIP.h"
 #import "IPAddress.h"
+#import "IPAddressSet.h"
+#import "RecentAddressStore.h"
 #import "MYPortMapper.h"
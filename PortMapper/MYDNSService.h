@@ -12,7 +12,9 @@
 struct _DNSServiceRef_t;
 
 
-/** Abstract superclass for services based on DNSServiceRefs, such as MYPortMapper. */
+/** Abstract superclass for services based on DNSServiceRefs, such as MYPortMapper.
+    Results arrive on the run loop of the thread that started the service, alongside that
+    thread's TCPConnections, so nothing blocks while waiting for the mDNSResponder daemon. */
 @interface MYDNSService : NSObject
 
 /** If NO (the default), the service will stop after it gets a result.
@@ -26,6 +28,12 @@ struct _DNSServiceRef_t;
     probably means that the mDNSResponder process isn't working. */
 - (BOOL) start;
 
+/** Starts the service, and calls the block on this thread's run loop when the first result or
+    error arrives. By then the service's properties are up to date, and if it's not continuous
+    it's been stopped. The block isn't called if the service fails to start (returning NO), or
+    is stopped before a result arrives. */
+- (BOOL) startWithCompletion: (void(^)(MYDNSService *service, int32_t error))completion;
+
 /** Stops the service. */
 - (void) stop;
 
@@ -79,6 +87,8 @@ struct _DNSServiceRef_t;
 
 /** Block until a message is received from the daemon.
     This will cause the service's callback (defined by the subclass) to be invoked.
+    While waiting, this thread's run loop handles only DNS results (of any service).
+    Prefer -startWithCompletion:, which doesn't block.
     @return  YES if a message is received, NO on error (or if the service isn't started) */
 - (BOOL) waitForReply;
 
@@ -96,6 +106,8 @@ struct _DNSServiceRef_t;
     CFRunLoopSourceRef _runLoopSource;
 }
 
+/** The connection shared by the services started on the current thread. (Each thread has its
+    own, attached to its run loop.) */
 + (MYDNSConnection*) sharedConnection;
 - (id) initWithServiceRef: (struct _DNSServiceRef_t *)serviceRef;
 @property (readonly) struct _DNSServiceRef_t* connectionRef;
@@ -13,6 +13,31 @@
 #import "ExceptionUtils.h"
 
 #import <dns_sd.h>
+#import <sys/socket.h>
+#import <unistd.h>
+
+
+// Private run loop mode in which -waitForReply runs, so only DNS results are handled meanwhile.
+#define kWaitForReplyMode CFSTR("MYDNSServiceWaitForReply")
+
+// Key of the thread's shared MYDNSConnection in its threadDictionary.
+#define kSharedConnectionKey @"MYDNSConnection"
+
+
+// The dns_sd functions that the connection machinery calls. (Tests substitute a mock daemon.)
+typedef struct {
+    DNSServiceErrorType (*createConnection)(DNSServiceRef *sdRef);
+    dnssd_sock_t (*refSockFD)(DNSServiceRef sdRef);
+    DNSServiceErrorType (*processResult)(DNSServiceRef sdRef);
+    void (*refDeallocate)(DNSServiceRef sdRef);
+} MYDNSFunctions;
+
+static const MYDNSFunctions kDNSSDFunctions = {
+    &DNSServiceCreateConnection, &DNSServiceRefSockFD,
+    &DNSServiceProcessResult, &DNSServiceRefDeallocate
+};
+
+static const MYDNSFunctions *sDNS = &kDNSSDFunctions;
 
 
 static void serviceCallback(CFSocketRef s, 
@@ -29,6 +54,7 @@ static void serviceCallback(CFSocketRef s,
     struct _DNSServiceRef_t *_serviceRef;
     SInt32 _error;
     BOOL _continuous, _gotResponse;
+    void (^_completion)(MYDNSService*, DNSServiceErrorType);
 }
 
 
@@ -68,6 +94,16 @@ static void serviceCallback(CFSocketRef s,
         LogTo(DNS, @"%@ got error %i", self,errorCode);
         self.error = errorCode;
     }
+    if (_completion) {
+        // Call the completion after the subclass's callback has finished updating its state:
+        void (^completion)(MYDNSService*, DNSServiceErrorType) = _completion;
+        _completion = nil;
+        CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+        CFRunLoopPerformBlock(runLoop, kCFRunLoopCommonModes, ^{
+            completion(self, errorCode);
+        });
+        CFRunLoopWakeUp(runLoop);
+    }
 }
 
 
@@ -108,18 +144,38 @@ static void serviceCallback(CFSocketRef s,
 }
 
 
+- (BOOL) startWithCompletion: (void(^)(MYDNSService *service, DNSServiceErrorType error))completion
+{
+    _completion = [completion copy];
+    _gotResponse = NO;      // (subclasses' -start may not call mine)
+    if (![self start]) {
+        _completion = nil;
+        return NO;
+    }
+    return YES;
+}
+
+
 - (BOOL) waitForReply {
-    if( ! _serviceRef )
+    _gotResponse = NO;      // (subclasses' -start may not call mine)
+    if( ! _serviceRef ) {
         if( ! [self start] )
             return NO;
-    // Run the runloop until there's either an error or a result:
-    _gotResponse = NO;
+    }
+    // Run the runloop, in a mode that only handles DNS results, until there's either an error or
+    // a result. A service that's waiting on another one (like an MYAddressLookup resolving a
+    // Bonjour service) has no DNSServiceRef of its own yet, so go by the connection instead:
     LogTo(DNS,@"Waiting for reply to %@...", self);
-    while( !_gotResponse )
-        if( ! [_connection processResult] )
-            break;
+    while( !_gotResponse ) {
+        MYDNSConnection *connection = _connection
+                                   ?: [NSThread currentThread].threadDictionary[kSharedConnectionKey];
+        if( connection && !connection.connectionRef )
+            break;      // connection closed
+        if( CFRunLoopRunInMode(kWaitForReplyMode, 3600.0, true) == kCFRunLoopRunFinished )
+            break;      // no connections left
+    }
     LogTo(DNS,@"    ...got reply");
-    return (self.error==0);
+    return _gotResponse && (self.error==0);
 }
 
 
@@ -128,7 +184,7 @@ static void serviceCallback(CFSocketRef s,
     if( _serviceRef ) {
         LogTo(DNS,@"Stopped %@",self);
         if (_serviceRef != [_connection connectionRef])
-            DNSServiceRefDeallocate(_serviceRef);
+            sDNS->refDeallocate(_serviceRef);
         _serviceRef = NULL;
         _connection = nil;
     }
@@ -137,6 +193,7 @@ static void serviceCallback(CFSocketRef s,
 
 - (void) stop
 {
+    _completion = nil;
     [self cancel];
     if (_error)
         self.error = 0;
@@ -178,13 +235,10 @@ static void serviceCallback(CFSocketRef s,
 @implementation MYDNSConnection
 
 
-MYDNSConnection *sSharedConnection;
-
-
 - (id) init
 {
     DNSServiceRef connectionRef = NULL;
-    DNSServiceErrorType err = DNSServiceCreateConnection(&connectionRef);
+    DNSServiceErrorType err = sDNS->createConnection(&connectionRef);
     if (err || !connectionRef) {
         Warn(@"MYDNSConnection: DNSServiceCreateConnection failed, err=%i", err);
         return nil;
@@ -209,11 +263,16 @@ MYDNSConnection *sSharedConnection;
 
 
 + (MYDNSConnection*) sharedConnection {
-    @synchronized(self) {
-        if (!sSharedConnection)
-            sSharedConnection = [[self alloc] init];
+    // A DNSServiceRef's results have to be processed on one thread, and the connection is
+    // attached to the current run loop, so each thread gets its own:
+    NSMutableDictionary *threadDict = [NSThread currentThread].threadDictionary;
+    MYDNSConnection *connection = threadDict[kSharedConnectionKey];
+    if (!connection) {
+        connection = [[self alloc] init];
+        if (connection)
+            threadDict[kSharedConnectionKey] = connection;
     }
-    return sSharedConnection;
+    return connection;
 }
 
 
@@ -235,10 +294,11 @@ MYDNSConnection *sSharedConnection;
     if (_runLoopSource)
         return YES;        // Already opened
     
-    // Wrap a CFSocket around the service's socket:
-    CFSocketContext ctxt = { 0, (__bridge void *)(self), CFRetain, CFRelease, NULL };
+    // Wrap a CFSocket around the service's socket. (It doesn't retain me, so that a thread's
+    // shared connection goes away with the thread; I invalidate it when I close.)
+    CFSocketContext ctxt = { 0, (__bridge void *)(self), NULL, NULL, NULL };
     _socket = CFSocketCreateWithNative(NULL, 
-                                                       DNSServiceRefSockFD(_connectionRef), 
+                                                       sDNS->refSockFD(_connectionRef), 
                                                        kCFSocketReadCallBack, 
                                                        &serviceCallback, &ctxt);
     if( _socket ) {
@@ -248,6 +308,7 @@ MYDNSConnection *sSharedConnection;
         _runLoopSource = CFSocketCreateRunLoopSource(NULL, _socket, 0);
         if( _runLoopSource ) {
             CFRunLoopAddSource(CFRunLoopGetCurrent(), _runLoopSource, kCFRunLoopCommonModes);
+            CFRunLoopAddSource(CFRunLoopGetCurrent(), _runLoopSource, kWaitForReplyMode);
             // Success!
             LogTo(DNS,@"Successfully opened %@", self);
             return YES;
@@ -275,12 +336,13 @@ MYDNSConnection *sSharedConnection;
         }
         if( _connectionRef ) {
             LogTo(DNS,@"Closed %@",self);
-            DNSServiceRefDeallocate(_connectionRef);
+            sDNS->refDeallocate(_connectionRef);
             _connectionRef = NULL;
         }
         
-        if (self==sSharedConnection)
-            sSharedConnection = nil;
+        NSMutableDictionary *threadDict = [NSThread currentThread].threadDictionary;
+        if (threadDict[kSharedConnectionKey] == self)
+            [threadDict removeObjectForKey: kSharedConnectionKey];
     }
 }
 
@@ -288,7 +350,7 @@ MYDNSConnection *sSharedConnection;
 - (BOOL) processResult {
     @autoreleasepool {
         LogTo(DNS,@"---serviceCallback----");
-        DNSServiceErrorType err = DNSServiceProcessResult(_connectionRef);
+        DNSServiceErrorType err = sDNS->processResult(_connectionRef);
         if (err) {
             Warn(@"%@: DNSServiceProcessResult failed, err=%i !!!", self,err);
             //FIX: Are errors here fatal, meaning I should close the connection?
@@ -318,6 +380,213 @@ static void serviceCallback(CFSocketRef s,
 @end
 
 
+
+#pragma mark -
+#pragma mark TESTS:
+
+#if DEBUG
+
+// A stand-in for the mDNSResponder daemon. A connection's socket is one end of a socketpair;
+// mockReply() queues a reply for a service and writes a byte to the other end, which makes the
+// run loop call -processResult, which delivers the reply.
+
+typedef struct {
+    BOOL isConnection;
+    int fds[2];
+} MockDNSRef;
+
+static MockDNSRef *sMockConnection;
+static NSMutableArray *sMockReplies;       // of [service, error code]
+
+@interface MYDNSMockService : MYDNSService
+{
+    @public
+    unsigned replies;
+    __weak MYDNSService *owner;     // gets the response too
+}
+@end
+
+// Starts by starting another service, and gets its response from that one, the way an
+// MYAddressLookup does while it resolves a Bonjour service.
+@interface MYDNSIndirectMockService : MYDNSService
+{
+    @public
+    MYDNSMockService *inner;
+}
+@end
+
+static DNSServiceErrorType mockCreateConnection( DNSServiceRef *sdRef ) {
+    MockDNSRef *ref = calloc(1, sizeof(MockDNSRef));
+    ref->isConnection = YES;
+    if( socketpair(AF_UNIX, SOCK_STREAM, 0, ref->fds) < 0 ) {
+        free(ref);
+        return kDNSServiceErr_ServiceNotRunning;
+    }
+    sMockConnection = ref;
+    *sdRef = (DNSServiceRef)ref;
+    return kDNSServiceErr_NoError;
+}
+
+static dnssd_sock_t mockRefSockFD( DNSServiceRef sdRef ) {
+    return ((MockDNSRef*)sdRef)->fds[0];
+}
+
+static DNSServiceErrorType mockProcessResult( DNSServiceRef sdRef ) {
+    MockDNSRef *ref = (MockDNSRef*)sdRef;
+    char byte;
+    if( read(ref->fds[0], &byte, 1) != 1 || sMockReplies.count == 0 )
+        return kDNSServiceErr_ServiceNotRunning;
+    NSArray *reply = sMockReplies[0];
+    [sMockReplies removeObjectAtIndex: 0];
+    MYDNSMockService *service = reply[0];
+    service->replies++;
+    [service gotResponse: [reply[1] intValue]];
+    return kDNSServiceErr_NoError;
+}
+
+static void mockRefDeallocate( DNSServiceRef sdRef ) {
+    MockDNSRef *ref = (MockDNSRef*)sdRef;
+    if( ref->isConnection ) {
+        close(ref->fds[0]);
+        close(ref->fds[1]);
+        if( ref == sMockConnection )
+            sMockConnection = NULL;
+    }
+    free(ref);
+}
+
+static const MYDNSFunctions kMockFunctions = {
+    &mockCreateConnection, &mockRefSockFD, &mockProcessResult, &mockRefDeallocate
+};
+
+static void mockReply( MYDNSService *service, DNSServiceErrorType error ) {
+    [sMockReplies addObject: @[service, @(error)]];
+    CAssertEq(write(sMockConnection->fds[1], "!", 1), 1);
+}
+
+
+@implementation MYDNSMockService
+
+- (DNSServiceErrorType) createServiceRef: (DNSServiceRef*)sdRefPtr {
+    // Like the real dns_sd functions, the new ref shares the connection ref it's given:
+    CAssert(*sdRefPtr == (DNSServiceRef)sMockConnection);
+    *sdRefPtr = (DNSServiceRef)calloc(1, sizeof(MockDNSRef));
+    return kDNSServiceErr_NoError;
+}
+
+- (void) gotResponse: (DNSServiceErrorType)errorCode {
+    [super gotResponse: errorCode];
+    [owner gotResponse: errorCode];
+}
+
+@end
+
+
+@implementation MYDNSIndirectMockService
+
+- (BOOL) start {
+    return [inner start];
+}
+
+@end
+
+
+// Runs the run loop until `done` returns YES. There are no timers involved; each pass returns as
+// soon as a pending event has been handled. (The timeout is only a backstop against hanging.)
+static void runUntil( BOOL (^done)(void) ) {
+    for( int i=0; i<10 && !done(); i++ )
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 10.0, true);
+    CAssert(done(), @"Timed out waiting for DNS result");
+}
+
+
+TestCase(MYDNSServiceCompletion) {
+    // Close this thread's connection to the real daemon, if any, and use the mock one:
+    [[NSThread currentThread].threadDictionary[kSharedConnectionKey] close];
+    sDNS = &kMockFunctions;
+    sMockReplies = [NSMutableArray array];
+
+    // The completion is called asynchronously, on this thread, after the reply arrives:
+    MYDNSMockService *service = [[MYDNSMockService alloc] init];
+    __block int calls = 0;
+    __block DNSServiceErrorType gotError = -1;
+    NSThread *thread = [NSThread currentThread];
+    CAssert([service startWithCompletion: ^(MYDNSService *s, DNSServiceErrorType error) {
+        CAssertEq(s, service);
+        CAssertEq([NSThread currentThread], thread);
+        calls++;
+        gotError = error;
+    }]);
+    CAssert(service.isRunning);
+    CAssert(sMockConnection != NULL);
+    mockReply(service, kDNSServiceErr_NoError);
+    CAssertEq(calls, 0);
+    runUntil(^BOOL{ return calls > 0; });
+    CAssertEq(calls, 1);
+    CAssertEq(gotError, kDNSServiceErr_NoError);
+    CAssert(!service.isRunning);                    // not continuous, so it stopped
+
+    // Errors are reported, and a continuous service's completion is only called once:
+    MYDNSMockService *service2 = [[MYDNSMockService alloc] init];
+    service2.continuous = YES;
+    calls = 0;
+    [service2 startWithCompletion: ^(MYDNSService *s, DNSServiceErrorType error) {
+        calls++;
+        gotError = error;
+    }];
+    mockReply(service2, kDNSServiceErr_NoSuchRecord);
+    mockReply(service2, kDNSServiceErr_NoError);
+    runUntil(^BOOL{ return service2->replies == 2; });
+    CAssertEq(calls, 1);
+    CAssertEq(gotError, kDNSServiceErr_NoSuchRecord);
+    CAssert(service2.isRunning);
+
+    // A service that's stopped first never calls its completion:
+    MYDNSMockService *service3 = [[MYDNSMockService alloc] init];
+    calls = 0;
+    [service3 startWithCompletion: ^(MYDNSService *s, DNSServiceErrorType error) {
+        calls++;
+    }];
+    [service3 stop];
+    mockReply(service2, kDNSServiceErr_NoError);
+    runUntil(^BOOL{ return service2->replies == 3; });
+    CAssertEq(calls, 0);
+
+    // -waitForReply handles the reply without running the rest of the run loop:
+    MYDNSMockService *service4 = [[MYDNSMockService alloc] init];
+    CAssert([service4 start]);
+    __block BOOL otherSourceRan = NO;
+    CFRunLoopPerformBlock(CFRunLoopGetCurrent(), kCFRunLoopDefaultMode, ^{ otherSourceRan = YES; });
+    mockReply(service4, kDNSServiceErr_NoError);
+    CAssert([service4 waitForReply]);
+    CAssertEq(service4->replies, 1u);
+    CAssert(!otherSourceRan);
+    runUntil(^BOOL{ return otherSourceRan; });
+
+    // -waitForReply works for a service with no DNSServiceRef of its own, every time it's called:
+    MYDNSIndirectMockService *indirect = [[MYDNSIndirectMockService alloc] init];
+    indirect->inner = [[MYDNSMockService alloc] init];
+    indirect->inner->owner = indirect;
+    for( unsigned i=1; i<=2; i++ ) {
+        mockReply(indirect->inner, kDNSServiceErr_NoError);
+        CAssert([indirect waitForReply]);
+        CAssertEq(indirect->inner->replies, i);
+        CAssert(!indirect.isRunning);
+    }
+    mockReply(indirect->inner, kDNSServiceErr_NoSuchRecord);
+    CAssert(![indirect waitForReply]);
+    CAssertEq(indirect.error, kDNSServiceErr_NoSuchRecord);
+
+    [service2 stop];
+    [[NSThread currentThread].threadDictionary[kSharedConnectionKey] close];
+    CAssert(sMockConnection == NULL);
+    sDNS = &kDNSSDFunctions;
+    sMockReplies = nil;
+}
+
+#endif
+
+
 /*
  Copyright (c) 2008-2009, Jens Alfke <jens@mooseyard.com>. All rights reserved.
  
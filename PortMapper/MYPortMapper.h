@@ -41,8 +41,8 @@
 
 /** Initializes a PortMapper that will not map any ports.
     This is useful if you just want to find out your public IP address.
-    (For a simplified, but synchronous, convenience method for this, see
-    +findPublicAddress.) */
+    (For a simplified convenience method for this, see
+    +findPublicAddressWithCompletion:.) */
 - (id) initWithNullMapping;
 
 /** Should the TCP or UDP port, or both, be mapped? By default, TCP only.
@@ -54,9 +54,15 @@
     This property has no effect if changed while the PortMapper is open. */
 @property UInt16 desiredPublicPort;
 
+/** Opens the PortMapper, and calls the block on this thread's run loop when the NAT first
+    responds, with the public address or nil and an error. This doesn't block; the PortMapper
+    stays open afterwards (if it's continuous) and keeps reporting changes as usual.
+    Returns NO, without calling the block, if it couldn't be opened. */
+- (BOOL) openWithCompletion: (void(^)(IPAddress *publicAddress, int32_t/*DNSServiceErrorType*/ error))completion;
+
 /** Blocks till the PortMapper finishes opening. Returns YES if it opened, NO on error.
-    It's not usually a good idea to use this, as it will lock up your application
-    until a response arrives from the NAT. Listen for asynchronous notifications instead.
+    It's not usually a good idea to use this, as it will lock up your thread
+    until a response arrives from the NAT. Use -openWithCompletion: instead.
     If called when the PortMapper is closed, it will call -open for you.
     If called when it's already open, it just returns YES. */
 - (BOOL) waitTillOpened;
@@ -77,11 +83,13 @@
 
 // UTILITY CLASS METHOD:
 
+/** Determines the main interface's public IP address, without mapping any ports, and calls the
+    block on this thread's run loop with it, or with nil and an error. */
++ (void) findPublicAddressWithCompletion: (void(^)(IPAddress *publicAddress, int32_t error))completion;
+
 /** Determine the main interface's public IP address, without mapping any ports.
-    This method internally calls -waitTillOpened, so it may take a nontrivial amount
-    of time (and will crank the runloop while it waits.)
-    If you want to do this asynchronously, you should instead create a new
-    MYPortMapper instance using -initWithNullMapping. */
+    This method internally calls -waitTillOpened, so it blocks until the NAT responds, which
+    may take a nontrivial amount of time. Prefer +findPublicAddressWithCompletion:. */
 + (IPAddress*) findPublicAddress;
 
 @end
@@ -151,6 +151,14 @@ static void portMapCallback (
 }
 
 
+- (BOOL) openWithCompletion: (void(^)(IPAddress*, DNSServiceErrorType))completion
+{
+    return [self startWithCompletion: ^(MYDNSService *service, DNSServiceErrorType error) {
+        completion(error ? nil : ((MYPortMapper*)service).publicAddress, error);
+    }];
+}
+
+
 - (BOOL) waitTillOpened
 {
     if( ! self.serviceRef )
@@ -173,6 +181,25 @@ static void portMapCallback (
 }
 
 
++ (void) findPublicAddressWithCompletion: (void(^)(IPAddress*, DNSServiceErrorType))completion
+{
+    MYPortMapper *mapper = [[self alloc] initWithNullMapping];
+    mapper.continuous = NO;
+    // The block keeps the mapper alive until the NAT responds:
+    BOOL started = [mapper openWithCompletion: ^(IPAddress *addr, DNSServiceErrorType error) {
+        [mapper stop];
+        completion(addr, error);
+    }];
+    if (!started) {
+        DNSServiceErrorType error = mapper.error ?: kDNSServiceErr_Unknown;
+        CFRunLoopPerformBlock(CFRunLoopGetCurrent(), kCFRunLoopCommonModes, ^{
+            completion(nil, error);
+        });
+        CFRunLoopWakeUp(CFRunLoopGetCurrent());
+    }
+}
+
+
 @end
 
 
@@ -94,8 +94,9 @@ TestCase(MYPortMapper) {
     IPAddress *addr = [IPAddress localAddress];
     Log(@"** Local address is %@%@ ...getting public addr...", 
         addr, (addr.isPrivate ?@" (private)" :@""));
-    addr = [MYPortMapper findPublicAddress];
-    Log(@"** Public address is %@", addr);
+    [MYPortMapper findPublicAddressWithCompletion: ^(IPAddress *publicAddr, int32_t error) {
+        Log(@"** Public address is %@ (error %i)", publicAddr, error);
+    }];
 
     // Start up the test class to create a mapping:
     __unused MYPortMapperTest *test = [[MYPortMapperTest alloc] init];
@@ -31,6 +31,9 @@ kFrameMagicNumber   = 0x9B34F206
 kFrameHeaderFormat  = '!LLHH'
 kFrameHeaderSize    = 12
 
+kFramingV1          = 1     # 12-byte header: magic, number, flags, size
+kFramingV2          = 2     # varint number, flags, body size; negotiated by the "Hi" exchange
+
 kMsgFlag_TypeMask   = 0x000F
 kMsgFlag_Compressed = 0x0010
 kMsgFlag_Urgent     = 0x0020
@@ -41,9 +44,14 @@ kMsgFlag_Meta       = 0x0100
 kMsgType_Request    = 0
 kMsgType_Response   = 1
 kMsgType_Error      = 2
+kMsgType_Cancel     = 3
 
 kMsgProfile_Hi      = "Hi"
 kMsgProfile_Bye     = "Bye"
+kMsgProfile_Cancel  = "Cancel"
+
+kHelloVersionsProperty = "BLIP-Versions"    # in "Hi": the frame formats the sender can read
+kHelloVersionProperty  = "BLIP-Version"     # in reply to "Hi": the format the replier sends next
 
 # Logging Setup
 class NullLoggingHandler(logging.Handler):
@@ -63,6 +71,42 @@ class ConnectionException(Exception):
     pass
 
 
+def _encodeVarint(n):
+    "Encodes a non-negative integer as an unsigned LEB128 varint."
+    out = ''
+    while n >= 0x80:
+        out += chr((n & 0x7F) | 0x80)
+        n >>= 7
+    return out + chr(n)
+
+def _encodeFrameHeader(version, requestNo, flags, bodySize):
+    if version >= kFramingV2:
+        return _encodeVarint(requestNo) + _encodeVarint(flags) + _encodeVarint(bodySize)
+    return struct.pack(kFrameHeaderFormat, kFrameMagicNumber, requestNo, flags,
+                       kFrameHeaderSize+bodySize)
+
+def _decodeVarintHeader(data):
+    """Decodes a v2 frame header (three varints) from the start of data. Returns a tuple of
+       (requestNo, flags, bodySize), or None if data doesn't contain the whole header yet."""
+    values = []
+    value = shift = 0
+    for c in data:
+        b = ord(c)
+        value |= (b & 0x7F) << shift
+        shift += 7
+        if b & 0x80:
+            if shift >= 35: raise ConnectionException, "Overlong varint in frame header"
+        else:
+            values.append(value)
+            if len(values) == 3: break
+            value = shift = 0
+    if len(values) < 3:
+        return None
+    if values[0] > 0xFFFFFFFF or values[1] > 0xFFFF or len(data) + values[2] > 0xFFFF:
+        raise ConnectionException, "Frame header value out of range"
+    return tuple(values)
+
+
 ### LISTENER AND CONNECTION CLASSES:
 
 
@@ -120,9 +164,12 @@ class Connection (asynchat.async_chat):
         self.outBox = []
         self.inMessage = None
         self.inNumRequests = self.outNumRequests = 0
+        self.inFramingVersion = self.outFramingVersion = kFramingV1
+        self._framingSwitchMessage = None
         self.sending = False
         self._endOfFrame()
         self._closeWhenPossible = False
+        self._sendHello()
     
     def handle_connect(self):
         log.info("Connection open!")
@@ -199,11 +246,15 @@ class Connection (asynchat.async_chat):
             frameSize = 4096
             if msg.urgent or n==1 or not self.outBox[0].urgent:
                 frameSize *= 4
-            data = msg._sendNextFrame(frameSize)
+            data = msg._sendNextFrame(frameSize, self.outFramingVersion)
             if msg._moreComing:
                 self._outQueueMessage(msg,isNew=False)
             else:
                 log.info("Finished sending %s",msg)
+                if msg is self._framingSwitchMessage:
+                    log.info("Switching to v2 framing")
+                    self.outFramingVersion = kFramingV2
+                    self._framingSwitchMessage = None
             return data
         else:
             log.debug("Nothing more to send")
@@ -225,11 +276,18 @@ class Connection (asynchat.async_chat):
     def found_terminator(self):
         if self.expectingHeader:
             # Got a header:
-            (magic, requestNo, flags, frameLen) = struct.unpack(kFrameHeaderFormat,self.inHeader)
+            if self.inFramingVersion >= kFramingV2:
+                header = _decodeVarintHeader(self.inHeader)
+                if header == None:
+                    self.set_terminator(1)  # varints aren't complete yet; read another byte
+                    return
+                (requestNo, flags, frameLen) = header
+            else:
+                (magic, requestNo, flags, frameLen) = struct.unpack(kFrameHeaderFormat,self.inHeader)
+                if magic!=kFrameMagicNumber: raise ConnectionException, "Incorrect frame magic number %x" %magic
+                if frameLen < kFrameHeaderSize: raise ConnectionException,"Invalid frame length %u" %frameLen
+                frameLen -= kFrameHeaderSize
             self.inHeader = None
-            if magic!=kFrameMagicNumber: raise ConnectionException, "Incorrect frame magic number %x" %magic
-            if frameLen < kFrameHeaderSize: raise ConnectionException,"Invalid frame length %u" %frameLen
-            frameLen -= kFrameHeaderSize
             log.debug("Incoming frame: type=%i, number=%i, flags=%x, length=%i",
                         (flags&kMsgFlag_TypeMask),requestNo,flags,frameLen)
             self.inMessage = self._inMessageForFrame(requestNo,flags)
@@ -247,7 +305,10 @@ class Connection (asynchat.async_chat):
     def _inMessageForFrame(self, requestNo,flags):
         message = None
         msgType = flags & kMsgFlag_TypeMask
-        if msgType==kMsgType_Request:
+        if msgType==kMsgType_Cancel:
+            self._receivedCancel(requestNo)
+            return None
+        elif msgType==kMsgType_Request:
             message = self.pendingRequests.get(requestNo)
             if message==None and requestNo == self.inNumRequests+1:
                 message = IncomingRequest(self,requestNo,flags)
@@ -267,13 +328,27 @@ class Connection (asynchat.async_chat):
     def _endOfFrame(self):
         msg = self.inMessage
         self.inMessage = None
-        self.expectingHeader = True
-        self.inHeader = None
-        self.set_terminator(kFrameHeaderSize) # wait for binary header
         if msg:
             log.debug("End of frame of %s",msg)
             if not msg._moreComing:
                 self._receivedMessage(msg)
+        # (Handling the message may have changed the frame format, so do this last.)
+        self.expectingHeader = True
+        self.inHeader = None
+        if self.inFramingVersion >= kFramingV2:
+            self.set_terminator(1)      # varint header; read it a byte at a time
+        else:
+            self.set_terminator(kFrameHeaderSize) # wait for binary header
+    
+    def _receivedCancel(self, requestNo):
+        """Handles the peer canceling one of its requests: drops whatever has been received
+           of it, and any unsent remainder of the response to it."""
+        log.info("Peer canceled request #%u", requestNo)
+        self.pendingRequests.pop(requestNo, None)
+        for msg in self.outBox:
+            if msg.isResponse and msg.requestNo == requestNo:
+                self.outBox.remove(msg)
+                break
     
     def _receivedMessage(self, msg):
         log.info("Received: %s",msg)
@@ -302,6 +377,10 @@ class Connection (asynchat.async_chat):
         """Handles dispatching internal meta requests."""
         if request['Profile'] == kMsgProfile_Bye:
             self._handleCloseRequest(request)
+        elif request['Profile'] == kMsgProfile_Cancel:
+            pass    # placeholder for a request the peer canceled before sending it
+        elif request['Profile'] == kMsgProfile_Hi:
+            self._handleHello(request)
         else:
             response = request.response
             response.isError = True
@@ -310,6 +389,31 @@ class Connection (asynchat.async_chat):
             response.body = "Unknown meta profile"
             response.send()
     
+    ### FRAMING NEGOTIATION:
+    
+    def _sendHello(self):
+        """Tells the peer which frame formats I can read. If it replies that it'll send v2, its
+           frames after that reply are in the v2 format."""
+        req = OutgoingRequest(self, None, {'Profile': kMsgProfile_Hi, kHelloVersionsProperty: '1,2'})
+        req._meta = True
+        req.urgent = True
+        req.response.onComplete = self._handleHelloResponse
+        req.send()
+    
+    def _handleHello(self, request):
+        """Handles the peer's greeting: if it can read v2 frames, switch to them after replying."""
+        response = request.response
+        versions = (request[kHelloVersionsProperty] or '').split(',')
+        if '2' in versions:
+            response[kHelloVersionProperty] = '2'
+            self._framingSwitchMessage = response
+        response.send()
+    
+    def _handleHelloResponse(self, response):
+        if not response.isError and response[kHelloVersionProperty] == '2':
+            log.info("Peer is switching to v2 framing")
+            self.inFramingVersion = kFramingV2
+    
     ### CLOSING:
     
     def _handleCloseRequest(self, request):
@@ -546,7 +650,7 @@ class OutgoingMessage (Message):
         log.debug("Encoded %s into %u bytes", self,len(self.encoded))
         self.bytesSent = 0
     
-    def _sendNextFrame(self, maxLen):
+    def _sendNextFrame(self, maxLen, framingVersion=kFramingV1):
         pos = self.bytesSent
         payload = self.encoded[pos:pos+maxLen]
         pos += len(payload)
@@ -555,10 +659,7 @@ class OutgoingMessage (Message):
             self.encoded = None
         log.debug("Sending frame of %s; bytes %i--%i", self,pos-len(payload),pos)
         
-        header = struct.pack(kFrameHeaderFormat, kFrameMagicNumber,
-                                                   self.requestNo,
-                                                   self.flags,
-                                                   kFrameHeaderSize+len(payload))
+        header = _encodeFrameHeader(framingVersion, self.requestNo, self.flags, len(payload))
         self.bytesSent = pos
         return header + payload
 
@@ -0,0 +1,55 @@
+//
+//  RecentAddressStore.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+@class IPAddress, RecentAddress;
+
+
+/** A persistent table of RecentAddress statistics, keyed by address and port, that can hold the
+    connection history of hundreds of thousands of peers.
+    The file is a hash table of fixed-size records that's memory-mapped, so opening it doesn't
+    read or decode anything, a lookup touches only the record (or few) it probes, and an update
+    rewrites its record in place. -flush writes back just the pages that changed.
+    Changes since the last flush may be lost in a crash. The file is in the host's byte order.
+    An instance is thread-safe. */
+@interface RecentAddressStore : NSObject
+
+/** Opens the store at the given path, creating it if it doesn't exist. Returns nil if the file
+    can't be opened or isn't a valid store. */
+- (id) initWithPath: (NSString*)path error: (NSError**)outError;
+
+@property (readonly) NSString *path;
+
+/** The number of addresses in the store. */
+@property (readonly) NSUInteger count;
+
+/** Returns the history of an address (with the same port number), or nil if there is none.
+    The returned object is a snapshot; changing it doesn't affect the store. */
+- (RecentAddress*) historyForAddress: (IPAddress*)address;
+
+/** Records a successful connection to an address, adding it if necessary; returns its updated
+    history. (This is the equivalent of -[RecentAddress noteSuccess].) */
+- (RecentAddress*) noteSuccess: (IPAddress*)address;
+
+/** Stores a RecentAddress's statistics, replacing any previous history of its address. */
+- (void) setHistory: (RecentAddress*)history;
+
+/** Removes an address's history. */
+- (void) removeAddress: (IPAddress*)address;
+
+/** Calls the block with the history of every address, in no particular order. The store is locked
+    meanwhile, so the block mustn't use it. */
+- (void) enumerateHistoryUsingBlock: (void(^)(RecentAddress *history, BOOL *stop))block;
+
+/** Writes the changed parts of the store to disk, and waits for them to be written. */
+- (BOOL) flush: (NSError**)outError;
+
+/** Flushes and closes the store. It can't be used afterwards. (Called automatically on dealloc.) */
+- (void) close;
+
+@end
@@ -0,0 +1,557 @@
+//
+//  RecentAddressStore.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "RecentAddressStore.h"
+#import "IPAddress.h"
+
+#import "Logging.h"
+#import "Test.h"
+
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <fcntl.h>
+#import <unistd.h>
+
+
+#define kStoreMagic         0x4D595241      // 'MYRA'
+#define kStoreVersion       1
+#define kInitialCapacity    1024            // must be a power of 2
+#define kMaxLoadFactor      0.75
+
+
+// The file starts with a header, followed by `capacity` records forming an open-addressing
+// hash table (with linear probing) keyed by address and port.
+typedef struct {
+    UInt32 magic;
+    UInt16 version;
+    UInt16 recordSize;
+    UInt32 capacity;                // number of records; a power of 2
+    UInt32 count;                   // number of records in use
+    UInt8  reserved[48];
+} StoreHeader;
+
+typedef struct {
+    struct in6_addr address;        // IPv6, or IPv4-mapped (as in IPAddress)
+    UInt16 port;
+    UInt8  inUse;
+    UInt8  reserved;
+    UInt32 successes;
+    CFAbsoluteTime lastSuccess;
+} StoreRecord;
+
+
+// FNV-1a. This is part of the file format, so it mustn't change.
+static UInt32 hashKey( const struct in6_addr *address, UInt16 port ) {
+    UInt32 h = 2166136261u;
+    for( int i=0; i<16; i++ )
+        h = (h ^ address->s6_addr[i]) * 16777619u;
+    h = (h ^ (port & 0xFF)) * 16777619u;
+    h = (h ^ (port >> 8)) * 16777619u;
+    return h;
+}
+
+static inline BOOL recordHasKey( const StoreRecord *rec, const struct in6_addr *address, UInt16 port ) {
+    return rec->port == port && memcmp(&rec->address, address, sizeof(*address)) == 0;
+}
+
+// Returns the index of the record with the given key, or else of the empty slot where it belongs.
+static UInt32 findSlot( const StoreRecord *records, UInt32 capacity,
+                        const struct in6_addr *address, UInt16 port ) {
+    UInt32 mask = capacity - 1;
+    UInt32 i = hashKey(address, port) & mask;
+    while( records[i].inUse && ! recordHasKey(&records[i], address, port) )
+        i = (i + 1) & mask;
+    return i;
+}
+
+static size_t fileSizeForCapacity( UInt32 capacity ) {
+    return sizeof(StoreHeader) + (size_t)capacity * sizeof(StoreRecord);
+}
+
+static NSError* posixError( int code, NSString *path ) {
+    return [NSError errorWithDomain: NSPOSIXErrorDomain code: code
+                           userInfo: @{NSFilePathErrorKey: path}];
+}
+
+
+@implementation RecentAddressStore
+{
+    NSString *_path;
+    int _fd;
+    void *_map;
+    size_t _mapSize;
+    StoreHeader *_header;
+    StoreRecord *_records;
+    size_t _pageSize;
+    UInt64 *_dirtyPages;            // bitmap of the pages changed since the last flush
+    size_t _dirtyPageCount;
+}
+
+
+- (id) initWithPath: (NSString*)path error: (NSError**)outError
+{
+    Assert(path);
+    self = [super init];
+    if (self) {
+        _path = [path copy];
+        _fd = -1;
+        NSError *error;
+        if( ! [self _open: &error] ) {
+            LogTo(TCP,@"RecentAddressStore: Couldn't open %@: %@", path, error);
+            if( outError ) *outError = error;
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    [self close];
+}
+
+
+@synthesize path=_path;
+
+
+- (NSString*) description
+{
+    return $sprintf(@"%@[%@]", self.class, _path.lastPathComponent);
+}
+
+
+#pragma mark - FILE:
+
+
+// Creates an empty store file of the given capacity at `path`, mapped at *outMap.
+static BOOL createFile( NSString *path, UInt32 capacity, int *outFD, void **outMap,
+                        NSError **outError ) {
+    int fd = open(path.fileSystemRepresentation, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if( fd < 0 || ftruncate(fd, fileSizeForCapacity(capacity)) < 0 ) {
+        if( outError ) *outError = posixError(errno, path);
+        if( fd >= 0 ) close(fd);
+        return NO;
+    }
+    void *map = mmap(NULL, fileSizeForCapacity(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if( map == MAP_FAILED ) {
+        if( outError ) *outError = posixError(errno, path);
+        close(fd);
+        return NO;
+    }
+    StoreHeader *header = map;
+    header->magic = kStoreMagic;
+    header->version = kStoreVersion;
+    header->recordSize = sizeof(StoreRecord);
+    header->capacity = capacity;
+    header->count = 0;
+    *outFD = fd;
+    *outMap = map;
+    return YES;
+}
+
+
+- (BOOL) _open: (NSError**)outError
+{
+    struct stat info;
+    int fd = open(_path.fileSystemRepresentation, O_RDWR | O_CREAT, 0644);
+    if( fd < 0 || fstat(fd, &info) < 0 ) {
+        *outError = posixError(errno, _path);
+        if( fd >= 0 ) close(fd);
+        return NO;
+    }
+
+    if( info.st_size == 0 ) {
+        close(fd);
+        void *map;
+        if( ! createFile(_path, kInitialCapacity, &fd, &map, outError) )
+            return NO;
+        [self _useFile: fd map: map size: fileSizeForCapacity(kInitialCapacity)];
+        [self _markDirty: 0 length: sizeof(StoreHeader)];
+        return YES;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void *map = MAP_FAILED;
+    if( size >= sizeof(StoreHeader) )
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const StoreHeader *header = map;
+    if( map == MAP_FAILED || header->magic != kStoreMagic || header->version != kStoreVersion
+            || header->recordSize != sizeof(StoreRecord)
+            || header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0
+            || header->count >= header->capacity
+            || size != fileSizeForCapacity(header->capacity) ) {
+        *outError = posixError(map == MAP_FAILED && size >= sizeof(StoreHeader) ? errno : EFTYPE,
+                               _path);
+        if( map != MAP_FAILED ) munmap(map, size);
+        close(fd);
+        return NO;
+    }
+    [self _useFile: fd map: map size: size];
+    return YES;
+}
+
+- (void) _useFile: (int)fd map: (void*)map size: (size_t)size
+{
+    _fd = fd;
+    _map = map;
+    _mapSize = size;
+    _header = map;
+    _records = (StoreRecord*)((UInt8*)map + sizeof(StoreHeader));
+    _pageSize = (size_t)getpagesize();
+    size_t nPages = (size + _pageSize - 1) / _pageSize;
+    _dirtyPages = calloc((nPages + 63) / 64, sizeof(UInt64));
+    _dirtyPageCount = 0;
+}
+
+- (void) _unmap
+{
+    if( _map ) {
+        munmap(_map, _mapSize);
+        _map = NULL;
+        _header = NULL;
+        _records = NULL;
+        free(_dirtyPages);
+        _dirtyPages = NULL;
+        _dirtyPageCount = 0;
+    }
+    if( _fd >= 0 ) {
+        close(_fd);
+        _fd = -1;
+    }
+}
+
+
+// Records are scattered all over the file, so dirtiness is tracked per page; a flush then writes
+// only the pages that changed, not everything between the first and last of them.
+- (void) _markDirty: (size_t)offset length: (size_t)length
+{
+    for( size_t page = offset / _pageSize; page <= (offset + length - 1) / _pageSize; page++ ) {
+        UInt64 bit = 1ull << (page % 64);
+        if( ! (_dirtyPages[page / 64] & bit) ) {
+            _dirtyPages[page / 64] |= bit;
+            ++_dirtyPageCount;
+        }
+    }
+}
+
+static inline BOOL isPageDirty( const UInt64 *dirtyPages, size_t page ) {
+    return (dirtyPages[page / 64] >> (page % 64)) & 1;
+}
+
+- (void) _markRecordDirty: (UInt32)index
+{
+    [self _markDirty: (UInt8*)&_records[index] - (UInt8*)_map length: sizeof(StoreRecord)];
+}
+
+
+- (size_t) _dirtyPageCount     // for testing
+{
+    @synchronized(self) {
+        return _dirtyPageCount;
+    }
+}
+
+- (BOOL) flush: (NSError**)outError
+{
+    @synchronized(self) {
+        return [self _flush: outError];
+    }
+}
+
+- (BOOL) _flush: (NSError**)outError
+{
+    if( ! _map || _dirtyPageCount == 0 )
+        return YES;
+    // Sync each run of consecutive dirty pages with one msync call:
+    size_t nPages = (_mapSize + _pageSize - 1) / _pageSize;
+    size_t flushed = _dirtyPageCount;
+    for( size_t page = 0; page < nPages; ) {
+        if( _dirtyPages[page / 64] == 0 ) {
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+        if( ! isPageDirty(_dirtyPages, page) ) {
+            ++page;
+            continue;
+        }
+        size_t first = page;
+        while( page < nPages && isPageDirty(_dirtyPages, page) )
+            ++page;
+        size_t start = first * _pageSize, end = MIN(page * _pageSize, _mapSize);
+        if( msync((UInt8*)_map + start, end - start, MS_SYNC) < 0 ) {
+            if( outError ) *outError = posixError(errno, _path);
+            return NO;
+        }
+    }
+    memset(_dirtyPages, 0, (nPages + 63) / 64 * sizeof(UInt64));
+    _dirtyPageCount = 0;
+    LogTo(TCPVerbose,@"%@ flushed %lu pages", self, (unsigned long)flushed);
+    return YES;
+}
+
+- (void) close
+{
+    @synchronized(self) {
+        NSError *error;
+        if( ! [self _flush: &error] )
+            Warn(@"%@: Couldn't flush: %@", self, error);
+        [self _unmap];
+    }
+}
+
+
+// Rehashes the records into a new file with twice the capacity, which then replaces the old one.
+// (The new file is written separately, so a crash midway leaves the old file intact.)
+- (BOOL) _grow
+{
+    UInt32 capacity = _header->capacity * 2;
+    NSString *tempPath = [_path stringByAppendingString: @"~"];
+    int fd;
+    void *map;
+    NSError *error;
+    if( ! createFile(tempPath, capacity, &fd, &map, &error) ) {
+        Warn(@"%@: Couldn't grow: %@", self, error);
+        return NO;
+    }
+    StoreHeader *header = map;
+    StoreRecord *records = (StoreRecord*)((UInt8*)map + sizeof(StoreHeader));
+    for( UInt32 i=0; i<_header->capacity; i++ ) {
+        if( _records[i].inUse )
+            records[findSlot(records, capacity, &_records[i].address, _records[i].port)] = _records[i];
+    }
+    header->count = _header->count;
+
+    size_t size = fileSizeForCapacity(capacity);
+    if( msync(map, size, MS_SYNC) < 0
+            || rename(tempPath.fileSystemRepresentation, _path.fileSystemRepresentation) < 0 ) {
+        Warn(@"%@: Couldn't grow: %@", self, posixError(errno, tempPath));
+        munmap(map, size);
+        close(fd);
+        unlink(tempPath.fileSystemRepresentation);
+        return NO;
+    }
+    LogTo(TCP,@"%@ grew to %u records", self, (unsigned)capacity);
+    [self _unmap];
+    [self _useFile: fd map: map size: size];
+    return YES;
+}
+
+
+#pragma mark - RECORDS:
+
+
+- (NSUInteger) count
+{
+    @synchronized(self) {
+        return _header ? _header->count : 0;
+    }
+}
+
+
+static RecentAddress* historyFromRecord( const StoreRecord *rec ) {
+    IPAddress *address = [[IPAddress alloc] initWithIPv6: &rec->address port: rec->port];
+    return [[RecentAddress alloc] initWithIPAddress: address
+                                        lastSuccess: rec->lastSuccess
+                                          successes: rec->successes];
+}
+
+
+// Returns the index of the address's record, creating it if `create` is set; or UINT32_MAX.
+- (UInt32) _recordFor: (IPAddress*)address create: (BOOL)create
+{
+    if( ! _map || ! address )
+        return UINT32_MAX;
+    struct in6_addr key = address.ipv6;
+    UInt16 port = address.port;
+    UInt32 i = findSlot(_records, _header->capacity, &key, port);
+    if( _records[i].inUse )
+        return i;
+    if( ! create )
+        return UINT32_MAX;
+
+    if( _header->count + 1 > _header->capacity * kMaxLoadFactor ) {
+        if( [self _grow] )
+            i = findSlot(_records, _header->capacity, &key, port);
+        else if( _header->count + 1 >= _header->capacity )
+            return UINT32_MAX;      // completely full (there must always be an empty slot)
+    }
+    _records[i] = (StoreRecord){.address = key, .port = port, .inUse = 1};
+    _header->count++;
+    [self _markRecordDirty: i];
+    [self _markDirty: 0 length: sizeof(StoreHeader)];
+    return i;
+}
+
+
+- (RecentAddress*) historyForAddress: (IPAddress*)address
+{
+    @synchronized(self) {
+        UInt32 i = [self _recordFor: address create: NO];
+        return i != UINT32_MAX ? historyFromRecord(&_records[i]) : nil;
+    }
+}
+
+
+- (RecentAddress*) noteSuccess: (IPAddress*)address
+{
+    @synchronized(self) {
+        UInt32 i = [self _recordFor: address create: YES];
+        if( i == UINT32_MAX )
+            return nil;
+        StoreRecord *rec = &_records[i];
+        if( rec->successes < 0xFFFF )
+            rec->successes++;
+        rec->lastSuccess = CFAbsoluteTimeGetCurrent();
+        [self _markRecordDirty: i];
+        return historyFromRecord(rec);
+    }
+}
+
+
+- (void) setHistory: (RecentAddress*)history
+{
+    @synchronized(self) {
+        UInt32 i = [self _recordFor: history create: YES];
+        if( i == UINT32_MAX )
+            return;
+        _records[i].successes = history.successes;
+        _records[i].lastSuccess = history.lastSuccess;
+        [self _markRecordDirty: i];
+    }
+}
+
+
+- (void) removeAddress: (IPAddress*)address
+{
+    @synchronized(self) {
+        UInt32 i = [self _recordFor: address create: NO];
+        if( i == UINT32_MAX )
+            return;
+        // Backward-shift deletion: move later records of the probe sequence up into the hole,
+        // so lookups never need tombstones.
+        UInt32 mask = _header->capacity - 1;
+        for( UInt32 j = (i + 1) & mask; _records[j].inUse; j = (j + 1) & mask ) {
+            UInt32 home = hashKey(&_records[j].address, _records[j].port) & mask;
+            BOOL stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if( ! stays ) {
+                _records[i] = _records[j];
+                [self _markRecordDirty: i];
+                i = j;
+            }
+        }
+        _records[i].inUse = 0;
+        [self _markRecordDirty: i];
+        _header->count--;
+        [self _markDirty: 0 length: sizeof(StoreHeader)];
+    }
+}
+
+
+- (void) enumerateHistoryUsingBlock: (void(^)(RecentAddress *history, BOOL *stop))block
+{
+    @synchronized(self) {
+        BOOL stop = NO;
+        for( UInt32 i=0; _map && i<_header->capacity && !stop; i++ ) {
+            if( _records[i].inUse )
+                block(historyFromRecord(&_records[i]), &stop);
+        }
+    }
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+@interface RecentAddressStore (Testing)
+@property (readonly) size_t _dirtyPageCount;
+@end
+
+static IPAddress* testAddress( unsigned i ) {
+    if( i % 2 == 0 )
+        return [[IPAddress alloc] initWithIPv4: htonl(0x0A000000 + i) port: 80];
+    struct in6_addr ipv6 = {.s6_addr = {0x20,0x01,0x0d,0xb8}};
+    memcpy(&ipv6.s6_addr[12], &i, sizeof(i));
+    return [[IPAddress alloc] initWithIPv6: &ipv6 port: 443];
+}
+
+TestCase(RecentAddressStore) {
+    RequireTestCase(IPAddressIPv6);
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"RecentAddressStoreTest"];
+    [[NSFileManager defaultManager] removeItemAtPath: path error: NULL];
+    NSError *error;
+    RecentAddressStore *store = [[RecentAddressStore alloc] initWithPath: path error: &error];
+    CAssert(store, @"Couldn't create store: %@", error);
+    CAssertEq(store.count, 0u);
+    CAssertEq([store historyForAddress: testAddress(0)], nil);
+
+    const unsigned kN = 200000;
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for( unsigned i=0; i<kN; i++ )
+        [store noteSuccess: testAddress(i)];
+    Log(@"RecentAddressStore: added %u addresses in %.3f sec",
+        kN, CFAbsoluteTimeGetCurrent() - start);
+    CAssertEq(store.count, (NSUInteger)kN);
+
+    RecentAddress *recent = [store noteSuccess: testAddress(7)];
+    CAssertEqual(recent, testAddress(7));
+    CAssertEq(recent.successes, 2u);
+    CAssertEq([store historyForAddress: [testAddress(7) addressWithPort: 444]], nil);
+    [store setHistory: [[RecentAddress alloc] initWithIPAddress: testAddress(8)
+                                                    lastSuccess: 1234.5 successes: 99]];
+    for( unsigned i=0; i<kN; i+=10 )
+        [store removeAddress: testAddress(i)];
+    CAssertEq(store.count, kN - kN/10);
+    CAssert([store flush: &error], @"Flush failed: %@", error);
+    CAssertEq(store._dirtyPageCount, 0u);
+
+    // Rewriting a couple of records dirties only their own pages, wherever they are in the file:
+    [store setHistory: [store historyForAddress: testAddress(1)]];
+    [store setHistory: [store historyForAddress: testAddress(kN - 1)]];
+    CAssert(store._dirtyPageCount >= 1 && store._dirtyPageCount <= 2);
+    CAssert([store flush: &error], @"Flush failed: %@", error);
+    CAssertEq(store._dirtyPageCount, 0u);
+    [store close];
+
+    // Reopening doesn't read the records, and every lookup still works:
+    start = CFAbsoluteTimeGetCurrent();
+    store = [[RecentAddressStore alloc] initWithPath: path error: &error];
+    CAssert(store, @"Couldn't reopen store: %@", error);
+    Log(@"RecentAddressStore: reopened in %.6f sec", CFAbsoluteTimeGetCurrent() - start);
+    CAssertEq(store.count, kN - kN/10);
+    start = CFAbsoluteTimeGetCurrent();
+    for( unsigned i=0; i<kN; i++ ) {
+        RecentAddress *history = [store historyForAddress: testAddress(i)];
+        if( i % 10 == 0 )
+            CAssertEq(history, nil);
+        else
+            CAssertEq(history.successes, (i == 7 ? 2u : (i == 8 ? 99u : 1u)));
+    }
+    Log(@"RecentAddressStore: looked up %u addresses in %.3f sec",
+        kN, CFAbsoluteTimeGetCurrent() - start);
+    recent = [store historyForAddress: testAddress(8)];
+    CAssertEq(recent.successes, 99u);
+    CAssertEq(recent.lastSuccess, 1234.5);
+    __block NSUInteger enumerated = 0;
+    [store enumerateHistoryUsingBlock: ^(RecentAddress *history, BOOL *stop) {
+        enumerated++;
+    }];
+    CAssertEq(enumerated, store.count);
+    [store close];
+
+    // A file that isn't a store is rejected:
+    [@"not a store" writeToFile: path atomically: NO encoding: NSUTF8StringEncoding error: NULL];
+    CAssertEq([[RecentAddressStore alloc] initWithPath: path error: &error], nil);
+    CAssertEqual(error.domain, NSPOSIXErrorDomain);
+    CAssertEq(error.code, (NSInteger)EFTYPE);
+    [[NSFileManager defaultManager] removeItemAtPath: path error: NULL];
+}
+
+#endif
@@ -0,0 +1,33 @@
+//
+//  MYBufferPool.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/** A pool of reusable NSMutableData buffers, grouped into power-of-two size classes from 64 bytes
+    to 64KB. Recycling a buffer when you're done with it lets a later request of the same size
+    class reuse both the object and its memory, so steady-state traffic doesn't touch malloc.
+    A pool isn't thread-safe; use it from one thread only, like a connection's I/O thread. */
+@interface MYBufferPool : NSObject
+
+/** Initializes a pool that keeps up to `maxPerClass` idle buffers of each size. */
+- (id) initWithMaxBuffersPerClass: (NSUInteger)maxPerClass;
+
+/** Returns a buffer of the given length. Unlike +[NSMutableData dataWithLength:], the contents
+    are NOT zeroed. Requests over 64KB are not pooled, but still work. */
+- (NSMutableData*) dataWithLength: (NSUInteger)length;
+
+/** Returns a buffer to the pool for reuse. Nothing else may still be using it!
+    Data that didn't come from this pool is ignored, so it's safe to pass in any NSData. */
+- (void) recycle: (NSData*)data;
+
+/** Instrumentation: the number of buffers the pool has had to allocate, and the number of
+    requests satisfied by reusing a recycled buffer. */
+@property (readonly) NSUInteger allocations, reuses;
+
+@end
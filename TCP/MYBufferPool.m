@@ -0,0 +1,197 @@
+//
+//  MYBufferPool.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MYBufferPool.h"
+
+#import "Logging.h"
+#import "Test.h"
+
+
+#define kMinClassShift  6                                       // smallest class is 64 bytes
+#define kMaxClassShift  16                                      // largest class is 64KB
+#define kNSizeClasses   (kMaxClassShift - kMinClassShift + 1)
+
+
+// Returns the size class a buffer of `length` bytes needs, or -1 if it's too big to pool.
+static int sizeClassForLength( NSUInteger length ) {
+    if( length <= (1u << kMinClassShift) )
+        return 0;
+    if( length > (1u << kMaxClassShift) )
+        return -1;
+    return (int)(64 - __builtin_clzll((unsigned long long)length - 1)) - kMinClassShift;
+}
+
+
+// A concrete NSMutableData that knows which pool and size class it belongs to.
+// Idle buffers are kept in singly-linked free lists threaded through _nextFree.
+@interface MYPooledData : NSMutableData
+{
+    @public
+    __unsafe_unretained MYBufferPool *_pool;    // only compared, never messaged
+    int _sizeClass;
+    MYPooledData *_nextFree;
+    void *_bytes;
+    NSUInteger _length, _capacity;
+}
+@end
+
+
+@implementation MYPooledData
+
+- (id) initWithPool: (MYBufferPool*)pool sizeClass: (int)sizeClass
+{
+    self = [super init];
+    if (self != nil) {
+        _pool = pool;
+        _sizeClass = sizeClass;
+        _capacity = (NSUInteger)1 << (sizeClass + kMinClassShift);
+        _bytes = malloc(_capacity);
+        if( ! _bytes )
+            return nil;
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    free(_bytes);
+}
+
+- (NSUInteger) length               {return _length;}
+- (const void*) bytes               {return _bytes;}
+- (void*) mutableBytes              {return _bytes;}
+
+- (void) setLength: (NSUInteger)length
+{
+    if( length > _capacity ) {
+        // Outgrew its size class; it won't be pooled again.
+        void *bytes = realloc(_bytes, length);
+        if( ! bytes )
+            [NSException raise: NSMallocException format: @"Couldn't grow buffer to %lu bytes",
+                                                          (unsigned long)length];
+        _bytes = bytes;
+        _capacity = length;
+        _sizeClass = -1;
+    }
+    if( length > _length )
+        memset((UInt8*)_bytes + _length, 0, length - _length);
+    _length = length;
+}
+
+@end
+
+
+
+@implementation MYBufferPool
+{
+    NSUInteger _maxPerClass;
+    MYPooledData *_free[kNSizeClasses];
+    NSUInteger _nFree[kNSizeClasses];
+    NSUInteger _allocations, _reuses;
+}
+
+
+@synthesize allocations=_allocations, reuses=_reuses;
+
+
+- (id) initWithMaxBuffersPerClass: (NSUInteger)maxPerClass
+{
+    self = [super init];
+    if (self != nil) {
+        _maxPerClass = maxPerClass;
+    }
+    return self;
+}
+
+
+- (NSMutableData*) dataWithLength: (NSUInteger)length
+{
+    int sizeClass = sizeClassForLength(length);
+    if( sizeClass < 0 ) {
+        _allocations++;
+        return [[NSMutableData alloc] initWithLength: length];
+    }
+    MYPooledData *data = _free[sizeClass];
+    if( data ) {
+        _free[sizeClass] = data->_nextFree;
+        data->_nextFree = nil;
+        _nFree[sizeClass]--;
+        _reuses++;
+    } else {
+        data = [[MYPooledData alloc] initWithPool: self sizeClass: sizeClass];
+        _allocations++;
+    }
+    data->_length = length;
+    return data;
+}
+
+
+- (void) recycle: (NSData*)data
+{
+    if( ! [data isKindOfClass: [MYPooledData class]] )
+        return;
+    MYPooledData *buf = (MYPooledData*)data;
+    int sizeClass = buf->_sizeClass;
+    if( buf->_pool != self || sizeClass < 0 || _nFree[sizeClass] >= _maxPerClass )
+        return;
+    Assert(buf != _free[sizeClass] && buf->_nextFree == nil, @"%@ recycled twice", buf);
+    buf->_nextFree = _free[sizeClass];
+    _free[sizeClass] = buf;
+    _nFree[sizeClass]++;
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+TestCase(MYBufferPool) {
+    CAssertEq(sizeClassForLength(0), 0);
+    CAssertEq(sizeClassForLength(64), 0);
+    CAssertEq(sizeClassForLength(65), 1);
+    CAssertEq(sizeClassForLength(65536), kNSizeClasses-1);
+    CAssertEq(sizeClassForLength(65537), -1);
+
+    MYBufferPool *pool = [[MYBufferPool alloc] initWithMaxBuffersPerClass: 2];
+    NSMutableData *a = [pool dataWithLength: 100];
+    CAssertEq(a.length, 100u);
+    memset(a.mutableBytes, 'x', a.length);
+    CAssertEq(pool.allocations, 1u);
+
+    // A recycled buffer is reused for any length in its size class:
+    [pool recycle: a];
+    NSMutableData *b = [pool dataWithLength: 128];
+    CAssertEq(b, a);
+    CAssertEq(b.length, 128u);
+    CAssertEq(pool.reuses, 1u);
+
+    // ...but not for other size classes:
+    NSMutableData *c = [pool dataWithLength: 20];
+    CAssert(c != a);
+    CAssertEq(pool.allocations, 2u);
+
+    // Growing past its class makes a buffer unpoolable; foreign data is ignored:
+    [b setLength: 1000];
+    CAssertEq(((const char*)b.bytes)[0], 'x');
+    CAssertEq(((const char*)b.bytes)[999], 0);
+    [pool recycle: b];
+    [pool recycle: [NSMutableData dataWithLength: 20]];
+    CAssert([pool dataWithLength: 100] != b);
+    CAssertEq(pool.allocations, 3u);
+
+    // Steady state: a request/recycle loop allocates nothing.
+    for( int i=0; i<1000; i++ ) {
+        NSMutableData *buf = [pool dataWithLength: 40 + i % 20];
+        [pool recycle: buf];
+    }
+    CAssertEq(pool.allocations, 3u);
+}
+
+#endif
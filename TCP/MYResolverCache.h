@@ -0,0 +1,83 @@
+//
+//  MYResolverCache.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/** A function that looks up a DNS name, returning an array of NSData objects containing struct
+    sockaddrs, or nil and an error. If it knows the records' TTL it stores it in *outTTL, which
+    otherwise is left at the cache's defaultTTL. It's called on a background queue, and may block. */
+typedef NSArray* (^MYResolverFunction)(NSString *hostname, NSTimeInterval *outTTL,
+                                       NSError **outError);
+
+
+/** A process-wide, thread-safe cache of DNS lookups, used by TCPConnection (through
+    TCPConnectRace) and MYAddressLookup so that reconnecting to a host doesn't resolve its name
+    again every time.
+    - Results are kept for their TTL; failures are kept for the shorter negativeTTL.
+    - Simultaneous lookups of a name share a single query.
+    - A name that's used within the last part of its TTL is resolved again in the background, so
+      busy names never expire while in use.
+    The cached addresses have a port number of zero. */
+@interface MYResolverCache : NSObject
+
+/** The cache used by TCPConnection and MYAddressLookup. It resolves names with getaddrinfo. */
++ (MYResolverCache*) sharedCache;
+
+/** Initializes a cache that resolves names with getaddrinfo. */
+- (id) init;
+
+/** Initializes a cache that calls the given function to resolve names. (Useful for testing.) */
+- (id) initWithResolver: (MYResolverFunction)resolver;
+
+/** The TTL given to results when the resolver doesn't say. Defaults to 60 seconds, since
+    getaddrinfo doesn't report TTLs. */
+@property NSTimeInterval defaultTTL;
+
+/** How long a failed lookup is remembered. Defaults to 5 seconds. */
+@property NSTimeInterval negativeTTL;
+
+/** The fraction of its TTL after which a lookup that's used gets refreshed. Defaults to 0.75. */
+@property double prefetchThreshold;
+
+/** The maximum number of names cached; the least recently used go first. Defaults to 1024. */
+@property NSUInteger capacity;
+
+/** The time source that TTLs are measured against. Defaults to CFAbsoluteTimeGetCurrent.
+    (Tests use this to advance time explicitly.) */
+@property (copy) CFAbsoluteTime (^clock)(void);
+
+/** Looks up a DNS name, asynchronously. The completion block is called on the current thread's
+    run loop with the addresses (NSData objects containing struct sockaddrs), or nil and an error
+    (in kCFErrorDomainCFNetwork, with a kCFGetAddrInfoFailureKey.) */
+- (void) resolveHostname: (NSString*)hostname
+              completion: (void(^)(NSArray *addresses, NSError *error))completion;
+
+/** Returns the cached, unexpired addresses of a name, or nil. Doesn't resolve it. */
+- (NSArray*) cachedAddressesForHostname: (NSString*)hostname;
+
+/** The number of seconds until a name's cached addresses expire, or zero if they're not cached. */
+- (NSTimeInterval) timeToLiveForHostname: (NSString*)hostname;
+
+/** Adds addresses that were resolved some other way (e.g. by MYAddressLookup) to the cache. */
+- (void) addAddresses: (NSArray*)addresses
+          forHostname: (NSString*)hostname
+                  ttl: (NSTimeInterval)ttl;
+
+/** Forgets a name, e.g. after its addresses stop working. */
+- (void) removeHostname: (NSString*)hostname;
+
+/** Forgets all names. */
+- (void) removeAllHostnames;
+
+/** Statistics: lookups answered from the cache, lookups that had to wait for a query, and
+    queries made (fewer than misses when simultaneous lookups share a query, and more when
+    prefetches happen.) */
+@property (readonly) NSUInteger hits, misses, queries;
+
+@end
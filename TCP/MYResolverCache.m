@@ -0,0 +1,483 @@
+//
+//  MYResolverCache.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MYResolverCache.h"
+
+#import "Logging.h"
+#import "Test.h"
+
+#if TARGET_OS_IPHONE
+#include <CFNetwork/CFNetwork.h>
+#else
+#import <CoreServices/CoreServices.h>
+#endif
+
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <netdb.h>
+#import <unistd.h>
+
+
+#define kDefaultCapacity            1024
+#define kDefaultTTL                 60.0
+#define kDefaultNegativeTTL         5.0
+#define kDefaultPrefetchThreshold   0.75
+
+
+typedef void (^MYResolverDelivery)(NSArray *addresses, NSError *error);
+
+
+/** What's known about one hostname. Only accessed while the cache is locked. */
+@interface MYResolverEntry : NSObject
+{
+    @public
+    NSArray *_addresses;            // nil if the last lookup failed
+    NSError *_error;
+    CFAbsoluteTime _resolvedAt, _expires;
+    BOOL _querying;                 // is a query in progress?
+    NSMutableArray *_waiters;       // MYResolverDeliveries waiting for the query
+}
+@end
+
+@implementation MYResolverEntry
+@end
+
+
+static NSError* resolverError( int gaiError, NSString *reason ) {
+    if( ! reason )
+        reason = @(gai_strerror(gaiError));
+    return [NSError errorWithDomain: (id)kCFErrorDomainCFNetwork
+                               code: kCFHostErrorUnknown
+                           userInfo: @{(id)kCFGetAddrInfoFailureKey: @(gaiError),
+                                       NSLocalizedFailureReasonErrorKey: reason}];
+}
+
+// Looks up a name with getaddrinfo. (Blocks!)
+static NSArray* getaddrinfoResolver( NSString *hostname, NSTimeInterval *outTTL, NSError **outError ) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_protocol = IPPROTO_TCP,
+        .ai_flags = AI_ADDRCONFIG
+    };
+    struct addrinfo *results;
+    int err = getaddrinfo(hostname.UTF8String, NULL, &hints, &results);
+    if( err ) {
+        *outError = resolverError(err, nil);
+        return nil;
+    }
+    NSMutableArray *addresses = [NSMutableArray array];
+    for( struct addrinfo *ai = results; ai; ai = ai->ai_next ) {
+        NSData *address = [NSData dataWithBytes: ai->ai_addr length: ai->ai_addrlen];
+        if( ! [addresses containsObject: address] )
+            [addresses addObject: address];
+    }
+    freeaddrinfo(results);
+    return addresses;
+}
+
+// Returns a copy of the sockaddrs with their port numbers cleared.
+static NSArray* withoutPorts( NSArray *addresses ) {
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity: addresses.count];
+    for( NSData *address in addresses ) {
+        if( address.length < sizeof(struct sockaddr_in) )
+            continue;
+        NSMutableData *copy = [address mutableCopy];
+        struct sockaddr *sa = copy.mutableBytes;
+        if( sa->sa_family == AF_INET )
+            ((struct sockaddr_in*)sa)->sin_port = 0;
+        else if( sa->sa_family == AF_INET6 && copy.length >= sizeof(struct sockaddr_in6) )
+            ((struct sockaddr_in6*)sa)->sin6_port = 0;
+        else
+            continue;
+        [result addObject: copy];
+    }
+    return result;
+}
+
+
+@implementation MYResolverCache
+{
+    MYResolverFunction _resolver;
+    CFAbsoluteTime (^_clock)(void);
+    NSTimeInterval _defaultTTL, _negativeTTL;
+    double _prefetchThreshold;
+    NSUInteger _capacity;
+    NSMutableDictionary *_entries;          // lowercased hostname -> MYResolverEntry
+    NSMutableOrderedSet *_hostnamesByAge;   // least recently used first
+    NSUInteger _hits, _misses, _queries;
+}
+
+
++ (MYResolverCache*) sharedCache
+{
+    static MYResolverCache *sShared;
+    static dispatch_once_t predicate;
+    dispatch_once(&predicate, ^{
+        sShared = [[self alloc] init];
+    });
+    return sShared;
+}
+
+
+- (id) initWithResolver: (MYResolverFunction)resolver
+{
+    Assert(resolver);
+    self = [super init];
+    if (self != nil) {
+        _resolver = [resolver copy];
+        _defaultTTL = kDefaultTTL;
+        _negativeTTL = kDefaultNegativeTTL;
+        _prefetchThreshold = kDefaultPrefetchThreshold;
+        _capacity = kDefaultCapacity;
+        _entries = [[NSMutableDictionary alloc] init];
+        _hostnamesByAge = [[NSMutableOrderedSet alloc] init];
+    }
+    return self;
+}
+
+- (id) init
+{
+    return [self initWithResolver: ^NSArray*(NSString *hostname, NSTimeInterval *outTTL,
+                                             NSError **outError) {
+        return getaddrinfoResolver(hostname, outTTL, outError);
+    }];
+}
+
+
+@synthesize defaultTTL=_defaultTTL, negativeTTL=_negativeTTL, prefetchThreshold=_prefetchThreshold,
+            capacity=_capacity, clock=_clock;
+
+
+- (CFAbsoluteTime) _now
+{
+    CFAbsoluteTime (^clock)(void) = self.clock;
+    return clock ? clock() : CFAbsoluteTimeGetCurrent();
+}
+
+
+- (NSUInteger) hits     {@synchronized(self) {return _hits;}}
+- (NSUInteger) misses   {@synchronized(self) {return _misses;}}
+- (NSUInteger) queries  {@synchronized(self) {return _queries;}}
+
+
+// Must be called while locked.
+- (MYResolverEntry*) _entryForHostname: (NSString*)hostname create: (BOOL)create
+{
+    MYResolverEntry *entry = _entries[hostname];
+    if( entry ) {
+        // (An ordered set finds the name by hashing, instead of searching the whole list.)
+        [_hostnamesByAge removeObject: hostname];
+        [_hostnamesByAge addObject: hostname];
+    } else if( create ) {
+        entry = [[MYResolverEntry alloc] init];
+        _entries[hostname] = entry;
+        [_hostnamesByAge addObject: hostname];
+        // Evict the least recently used names, except any that are being looked up:
+        for( NSUInteger i = 0; _entries.count > _capacity && i < _hostnamesByAge.count; ) {
+            NSString *oldName = _hostnamesByAge[i];
+            if( ((MYResolverEntry*)_entries[oldName])->_querying ) {
+                ++i;
+            } else {
+                LogTo(DNS,@"%@: evicting %@",self,oldName);
+                [_entries removeObjectForKey: oldName];
+                [_hostnamesByAge removeObjectAtIndex: i];
+            }
+        }
+    }
+    return entry;
+}
+
+
+- (void) resolveHostname: (NSString*)hostname
+              completion: (void(^)(NSArray *addresses, NSError *error))completion
+{
+    Assert(hostname);
+    Assert(completion);
+    hostname = hostname.lowercaseString;
+
+    // The completion block gets called on this thread:
+    CFRunLoopRef runLoop = (CFRunLoopRef)CFRetain(CFRunLoopGetCurrent());
+    MYResolverDelivery deliver = ^(NSArray *addresses, NSError *error) {
+        CFRunLoopPerformBlock(runLoop, kCFRunLoopCommonModes, ^{
+            completion(addresses, error);
+        });
+        CFRunLoopWakeUp(runLoop);
+        CFRelease(runLoop);
+    };
+
+    NSArray *addresses = nil;
+    NSError *error = nil;
+    BOOL cached = NO;
+    @synchronized(self) {
+        MYResolverEntry *entry = [self _entryForHostname: hostname create: YES];
+        CFAbsoluteTime now = [self _now];
+        if( now < entry->_expires ) {
+            ++_hits;
+            cached = YES;
+            addresses = entry->_addresses;
+            error = entry->_error;
+            // Refresh a name that's in use before it expires, so it stays in the cache:
+            CFAbsoluteTime refreshAt = entry->_resolvedAt
+                                     + _prefetchThreshold * (entry->_expires - entry->_resolvedAt);
+            if( addresses && !entry->_querying && now >= refreshAt ) {
+                LogTo(DNS,@"%@: prefetching %@",self,hostname);
+                [self _queryEntry: entry hostname: hostname];
+            }
+        } else {
+            ++_misses;
+            if( ! entry->_waiters )
+                entry->_waiters = [[NSMutableArray alloc] init];
+            [entry->_waiters addObject: [deliver copy]];
+            if( ! entry->_querying )
+                [self _queryEntry: entry hostname: hostname];
+        }
+    }
+    if( cached ) {
+        LogTo(DNSVerbose,@"%@: %@ was cached",self,hostname);
+        deliver(addresses, error);
+    }
+}
+
+
+// Must be called while locked.
+- (void) _queryEntry: (MYResolverEntry*)entry hostname: (NSString*)hostname
+{
+    entry->_querying = YES;
+    ++_queries;
+    LogTo(DNS,@"%@: resolving %@",self,hostname);
+    MYResolverFunction resolver = _resolver;
+    NSTimeInterval defaultTTL = _defaultTTL;
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSTimeInterval ttl = defaultTTL;
+        NSError *error = nil;
+        NSArray *addresses = resolver(hostname, &ttl, &error);
+        [self _entry: entry hostname: hostname resolvedTo: addresses ttl: ttl error: error];
+    });
+}
+
+
+- (void) _entry: (MYResolverEntry*)entry
+       hostname: (NSString*)hostname
+     resolvedTo: (NSArray*)addresses
+            ttl: (NSTimeInterval)ttl
+          error: (NSError*)error
+{
+    addresses = withoutPorts(addresses);
+    NSArray *waiters;
+    @synchronized(self) {
+        CFAbsoluteTime now = [self _now];
+        entry->_querying = NO;
+        if( addresses.count > 0 ) {
+            LogTo(DNS,@"%@: %@ has %lu addresses [TTL = %g]",
+                  self,hostname,(unsigned long)addresses.count,ttl);
+            entry->_addresses = addresses;
+            entry->_error = nil;
+            entry->_resolvedAt = now;
+            entry->_expires = now + MAX(ttl, 0.0);
+        } else if( entry->_addresses && now < entry->_expires ) {
+            // A prefetch failed; keep the addresses till they expire:
+            LogTo(DNS,@"%@: couldn't refresh %@: %@",self,hostname,error);
+        } else {
+            LogTo(DNS,@"%@: couldn't resolve %@: %@",self,hostname,error);
+            entry->_addresses = nil;
+            entry->_error = error ?: resolverError(EAI_NONAME, @"Host has no addresses");
+            entry->_resolvedAt = now;
+            entry->_expires = now + _negativeTTL;
+        }
+        waiters = entry->_waiters;
+        entry->_waiters = nil;
+        addresses = entry->_addresses;
+        error = entry->_error;
+    }
+    for( MYResolverDelivery deliver in waiters )
+        deliver(addresses, error);
+}
+
+
+- (NSArray*) cachedAddressesForHostname: (NSString*)hostname
+{
+    @synchronized(self) {
+        MYResolverEntry *entry = _entries[hostname.lowercaseString];
+        if( entry && [self _now] < entry->_expires )
+            return entry->_addresses;
+        return nil;
+    }
+}
+
+
+- (NSTimeInterval) timeToLiveForHostname: (NSString*)hostname
+{
+    @synchronized(self) {
+        MYResolverEntry *entry = _entries[hostname.lowercaseString];
+        if( ! entry || ! entry->_addresses )
+            return 0.0;
+        return MAX(0.0, entry->_expires - [self _now]);
+    }
+}
+
+
+- (void) addAddresses: (NSArray*)addresses
+          forHostname: (NSString*)hostname
+                  ttl: (NSTimeInterval)ttl
+{
+    Assert(hostname);
+    addresses = withoutPorts(addresses);
+    if( addresses.count == 0 )
+        return;
+    @synchronized(self) {
+        MYResolverEntry *entry = [self _entryForHostname: hostname.lowercaseString create: YES];
+        CFAbsoluteTime now = [self _now];
+        entry->_addresses = addresses;
+        entry->_error = nil;
+        entry->_resolvedAt = now;
+        entry->_expires = now + MAX(ttl, 0.0);
+    }
+}
+
+
+- (void) removeHostname: (NSString*)hostname
+{
+    hostname = hostname.lowercaseString;
+    @synchronized(self) {
+        // (A query in progress still answers the lookups waiting for it.)
+        [_entries removeObjectForKey: hostname];
+        [_hostnamesByAge removeObject: hostname];
+    }
+}
+
+
+- (void) removeAllHostnames
+{
+    @synchronized(self) {
+        [_entries removeAllObjects];
+        [_hostnamesByAge removeAllObjects];
+    }
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+static NSData* testAddress( const char *addr, UInt16 port ) {
+    struct sockaddr_in sa = {.sin_len = sizeof(sa), .sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, addr, &sa.sin_addr);
+    return [NSData dataWithBytes: &sa length: sizeof(sa)];
+}
+
+// Resolves names and runs the run loop until all the lookups have finished. If `gate` is given,
+// it's signaled once all the lookups have started.
+static NSArray* testResolve( MYResolverCache *cache, NSArray *hostnames, dispatch_semaphore_t gate ) {
+    NSMutableArray *results = [NSMutableArray array];
+    for( NSString *hostname in hostnames ) {
+        [cache resolveHostname: hostname completion: ^(NSArray *addresses, NSError *error) {
+            [results addObject: (addresses ?: error)];
+        }];
+    }
+    if( gate )
+        dispatch_semaphore_signal(gate);
+    NSDate *giveUp = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    while( results.count < hostnames.count && [giveUp timeIntervalSinceNow] > 0 )
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+    CAssertEq(results.count, hostnames.count);
+    return results;
+}
+
+TestCase(MYResolverCache) {
+    // Time only moves when the test says so:
+    __block CFAbsoluteTime now = 1000.0;
+    // A stub resolver that knows one name. While `gate` is set, it waits for it to be signaled,
+    // so that lookups can be made to overlap.
+    NSData *address = testAddress("192.0.2.7", 0);
+    __block int resolverCalls = 0;
+    __block dispatch_semaphore_t gate = nil;
+    MYResolverCache *cache = [[MYResolverCache alloc] initWithResolver:
+                                ^NSArray*(NSString *hostname, NSTimeInterval *outTTL,
+                                          NSError **outError) {
+        dispatch_semaphore_t waitFor;
+        @synchronized(address) {
+            ++resolverCalls;
+            waitFor = gate;
+        }
+        if( waitFor )
+            dispatch_semaphore_wait(waitFor, DISPATCH_TIME_FOREVER);
+        if( [hostname isEqualToString: @"good.test"] ) {
+            *outTTL = 2.0;
+            return @[testAddress("192.0.2.7", 1234)];
+        }
+        *outError = resolverError(EAI_NONAME, nil);
+        return nil;
+    }];
+    cache.clock = ^CFAbsoluteTime{ return now; };
+    cache.prefetchThreshold = 0.5;
+
+    // Simultaneous lookups share one query, and the port is cleared:
+    gate = dispatch_semaphore_create(0);
+    NSArray *results = testResolve(cache, @[@"good.test", @"GOOD.test", @"good.test"], gate);
+    @synchronized(address) {gate = nil;}
+    CAssertEqual(results, (@[@[address], @[address], @[address]]));
+    CAssertEq(resolverCalls, 1);
+    CAssertEq(cache.misses, 3u);
+
+    // Now it's cached:
+    CAssertEqual(testResolve(cache, @[@"good.test"], nil), @[@[address]]);
+    CAssertEq(resolverCalls, 1);
+    CAssertEq(cache.hits, 1u);
+    CAssertEqual([cache cachedAddressesForHostname: @"good.test"], @[address]);
+    CAssertEq([cache timeToLiveForHostname: @"good.test"], 2.0);
+
+    // Failures are cached too, for the negative TTL:
+    results = testResolve(cache, @[@"bad.test"], nil);
+    CAssert([results[0] isKindOfClass: [NSError class]]);
+    CAssertEq([[results[0] userInfo][(id)kCFGetAddrInfoFailureKey] intValue], EAI_NONAME);
+    results = testResolve(cache, @[@"bad.test"], nil);
+    CAssert([results[0] isKindOfClass: [NSError class]]);
+    CAssertEq(resolverCalls, 2);
+    CAssertEq([cache timeToLiveForHostname: @"bad.test"], 0.0);
+    now += cache.negativeTTL;
+    testResolve(cache, @[@"bad.test"], nil);
+    CAssertEq(resolverCalls, 3);
+    now -= cache.negativeTTL;
+
+    // Before the prefetch threshold, a lookup doesn't refresh:
+    now += 0.9;
+    CAssertEqual(testResolve(cache, @[@"good.test"], nil), @[@[address]]);
+    CAssertEq(cache.queries, 3u);
+
+    // Past it, a lookup is answered from the cache but also refreshes it:
+    now += 0.1;
+    CAssertEq([cache timeToLiveForHostname: @"good.test"], 1.0);
+    CAssertEqual(testResolve(cache, @[@"good.test"], nil), @[@[address]]);
+    CAssertEq(cache.queries, 4u);
+    NSDate *giveUp = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    while( [cache timeToLiveForHostname: @"good.test"] < 2.0 && [giveUp timeIntervalSinceNow] > 0 )
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.01]];
+    CAssertEq([cache timeToLiveForHostname: @"good.test"], 2.0);
+    CAssertEq(resolverCalls, 4);
+
+    // Once the TTL runs out the addresses are gone:
+    now += 2.0;
+    CAssertEqual([cache cachedAddressesForHostname: @"good.test"], nil);
+    CAssertEq([cache timeToLiveForHostname: @"good.test"], 0.0);
+
+    // Least recently used names are evicted:
+    cache.capacity = 2;
+    [cache addAddresses: @[address] forHostname: @"one.test" ttl: 60];
+    [cache addAddresses: @[address] forHostname: @"two.test" ttl: 60];
+    CAssertEqual([cache cachedAddressesForHostname: @"one.test"], @[address]);
+    CAssertEqual([cache cachedAddressesForHostname: @"two.test"], @[address]);
+    CAssertEqual([cache cachedAddressesForHostname: @"good.test"], nil);
+    [cache removeHostname: @"one.test"];
+    CAssertEqual([cache cachedAddressesForHostname: @"one.test"], nil);
+}
+
+#endif
@@ -0,0 +1,39 @@
+//
+//  MYSubmissionQueue.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/** A lock-free queue that lets any number of threads hand objects to one consumer thread.
+    Pushing never blocks or takes a lock: it's one atomic exchange, plus a wakeup of the
+    consumer's run loop if the queue was idle. The consumer's handler is called with each item,
+    in the order they were pushed, from a run loop source on the consumer's run loop.
+    (Items pushed by a single thread are always delivered in order; items from different threads
+    are interleaved in the order their pushes completed.) */
+@interface MYSubmissionQueue : NSObject
+
+/** Initializes a queue whose items will be passed to the handler. */
+- (id) initWithHandler: (void(^)(id item))handler;
+
+/** Attaches the queue to the current thread's run loop, making it the consumer thread. */
+- (void) scheduleOnCurrentRunLoop;
+
+/** Detaches the queue from its run loop. Items still in the queue are discarded. */
+- (void) unschedule;
+
+/** Is the queue attached to the current thread's run loop? */
+@property (readonly) BOOL isOnConsumerThread;
+
+/** Adds an item to the queue. May be called on any thread. */
+- (void) push: (id)item;
+
+/** Calls the handler for every item in the queue. Must be called on the consumer thread
+    (it's called automatically by the run loop source.) */
+- (void) drain;
+
+@end
@@ -0,0 +1,226 @@
+//
+//  MYSubmissionQueue.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MYSubmissionQueue.h"
+
+#import "Logging.h"
+#import "Test.h"
+#import "ExceptionUtils.h"
+
+#include <stdatomic.h>
+
+
+// This is Dmitry Vyukov's intrusive MPSC queue. Producers atomically swap themselves into _head
+// and then link the previous head to themselves; the consumer follows the links from _tail.
+// A permanent stub node keeps the list from ever becoming empty.
+
+typedef struct QueueNode {
+    struct QueueNode *_Atomic next;
+    void *item;                             // retained
+} QueueNode;
+
+
+@implementation MYSubmissionQueue
+{
+    void (^_handler)(id);
+    _Atomic(QueueNode*) _head;              // newest node (shared by producers)
+    QueueNode *_tail;                       // oldest node (consumer only)
+    QueueNode _stub;
+    atomic_bool _signaled;                  // has the consumer been woken since it last drained?
+    CFRunLoopRef _runLoop;
+    CFRunLoopSourceRef _source;
+}
+
+
+static void pushNode( __unsafe_unretained MYSubmissionQueue *self, QueueNode *node ) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    QueueNode *prev = atomic_exchange_explicit(&self->_head, node, memory_order_acq_rel);
+    // Between these two statements the list is briefly disconnected; see popItem().
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Returns the oldest item, or NULL if there's none. If *outBusy is set, the queue isn't really
+// empty but a producer is in the middle of pushing, so the caller should try again shortly.
+static void* popItem( __unsafe_unretained MYSubmissionQueue *self, BOOL *outBusy ) {
+    QueueNode *stub = &self->_stub;
+    QueueNode *tail = self->_tail;
+    QueueNode *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if( tail == stub ) {
+        if( ! next ) {
+            *outBusy = (atomic_load_explicit(&self->_head, memory_order_acquire) != stub);
+            return NULL;
+        }
+        self->_tail = tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if( ! next ) {
+        if( tail != atomic_load_explicit(&self->_head, memory_order_acquire) ) {
+            *outBusy = YES;
+            return NULL;
+        }
+        // The tail is the last node; put the stub behind it so the tail can be removed:
+        pushNode(self, stub);
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+        if( ! next ) {
+            *outBusy = YES;
+            return NULL;
+        }
+    }
+    self->_tail = next;
+    void *item = tail->item;
+    free(tail);
+    return item;
+}
+
+
+static void performSource( void *info ) {
+    [(__bridge MYSubmissionQueue*)info drain];
+}
+
+
+- (id) initWithHandler: (void(^)(id item))handler
+{
+    self = [super init];
+    if (self != nil) {
+        _handler = [handler copy];
+        atomic_init(&_stub.next, NULL);
+        atomic_init(&_head, &_stub);
+        _tail = &_stub;
+        atomic_init(&_signaled, false);
+    }
+    return self;
+}
+
+
+- (void) dealloc
+{
+    [self unschedule];
+    if( _source )
+        CFRelease(_source);
+    BOOL busy;
+    void *item;
+    while( (item = popItem(self, &busy)) != NULL )
+        CFRelease(item);
+}
+
+
+- (void) scheduleOnCurrentRunLoop
+{
+    Assert(!_runLoop, @"%@ is already scheduled", self);
+    if( ! _source ) {
+        CFRunLoopSourceContext context = {.info = (__bridge void*)self, .perform = &performSource};
+        _source = CFRunLoopSourceCreate(NULL, 0, &context);
+    }
+    _runLoop = CFRunLoopGetCurrent();
+    CFRunLoopAddSource(_runLoop, _source, kCFRunLoopCommonModes);
+    // Pick up anything that was pushed before now:
+    atomic_store(&_signaled, true);
+    [self _wakeConsumer];
+}
+
+
+- (void) unschedule
+{
+    if( _runLoop ) {
+        CFRunLoopRemoveSource(_runLoop, _source, kCFRunLoopCommonModes);
+        _runLoop = NULL;
+        BOOL busy;
+        void *item;
+        while( (item = popItem(self, &busy)) != NULL )
+            CFRelease(item);
+    }
+}
+
+
+- (BOOL) isOnConsumerThread
+{
+    return _runLoop != NULL && _runLoop == CFRunLoopGetCurrent();
+}
+
+
+- (void) _wakeConsumer
+{
+    CFRunLoopRef runLoop = _runLoop;
+    if( runLoop ) {
+        CFRunLoopSourceSignal(_source);
+        CFRunLoopWakeUp(runLoop);
+    }
+}
+
+
+- (void) push: (id)item
+{
+    Assert(item);
+    QueueNode *node = malloc(sizeof(QueueNode));
+    node->item = (void*)CFBridgingRetain(item);
+    pushNode(self, node);
+    if( ! atomic_exchange(&_signaled, true) )
+        [self _wakeConsumer];
+}
+
+
+- (void) drain
+{
+    // Clear the flag first, so that a push that arrives during the loop wakes us up again:
+    atomic_store(&_signaled, false);
+    for(;;) {
+        BOOL busy = NO;
+        void *item = popItem(self, &busy);
+        if( ! item ) {
+            if( busy ) {
+                // A producer is mid-push; come back for its item on the next run loop pass.
+                atomic_store(&_signaled, true);
+                [self _wakeConsumer];
+            }
+            break;
+        }
+        id obj = CFBridgingRelease(item);
+        @try{
+            _handler(obj);
+        }catchAndReport(@"MYSubmissionQueue handler");
+    }
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+TestCase(MYSubmissionQueue) {
+    const int kNProducers = 8, kNItemsEach = 20000;
+    __block int received = 0;
+    int *lastSeq = calloc(kNProducers, sizeof(int));
+    MYSubmissionQueue *queue = [[MYSubmissionQueue alloc] initWithHandler: ^(id item) {
+        int value = [item intValue];
+        int producer = value / kNItemsEach, seq = value % kNItemsEach + 1;
+        CAssertEq(seq, lastSeq[producer] + 1);      // each producer's items arrive in order
+        lastSeq[producer] = seq;
+        received++;
+    }];
+
+    dispatch_group_t group = dispatch_group_create();
+    for( int p=0; p<kNProducers; p++ ) {
+        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            for( int i=0; i<kNItemsEach; i++ )
+                [queue push: @(p*kNItemsEach + i)];
+        });
+    }
+    // Consume concurrently with the producers:
+    while( dispatch_group_wait(group, DISPATCH_TIME_NOW) != 0 )
+        [queue drain];
+    while( received < kNProducers*kNItemsEach )
+        [queue drain];
+    CAssertEq(received, kNProducers*kNItemsEach);
+    for( int p=0; p<kNProducers; p++ )
+        CAssertEq(lastSeq[p], kNItemsEach);
+    free(lastSeq);
+}
+
+#endif
@@ -0,0 +1,84 @@
+//
+//  MYTimerWheel.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+@class MYTimerWheel;
+
+
+/** A single timer that can be armed on a MYTimerWheel.
+    The struct is meant to be embedded in the object that owns it (as an instance variable),
+    so that arming and canceling never allocate memory.
+    Only the target, action and context fields should be set by clients; the rest are private.
+    The target and context are NOT retained; the owner must cancel the timer before either
+    of them is deallocated. */
+typedef struct MYTimer {
+    struct MYTimer *_next, *_prev;                  // links in the wheel's slot list (private)
+    UInt64 _expiry;                                 // tick at which it fires (private)
+    __unsafe_unretained MYTimerWheel *_wheel;       // wheel it's armed on, or nil (private)
+
+    __unsafe_unretained id target;                  // object to call when the timer fires
+    SEL action;                                     // called as [target action: timer]
+    __unsafe_unretained id context;                 // arbitrary object for the target's use
+} MYTimer;
+
+
+/** A hashed timing wheel: schedules large numbers of timers with O(1) arming and canceling.
+    Time is divided into ticks of a fixed interval, and each timer is hashed into the slot for
+    the tick at which it expires; on every tick only the timers in that one slot are examined.
+    Timers fire up to one tick later than requested.
+
+    A wheel is driven by a single NSTimer on the run loop it was created on, which only runs
+    while at least one timer is armed. */
+@interface MYTimerWheel : NSObject
+
+/** A wheel shared by everything on the current thread, for coarse timers such as idle timeouts
+    and keepalive pings. Its tick is a quarter of a second. */
++ (MYTimerWheel*) sharedWheel;
+
+/** Initializes a wheel with the given tick interval and number of slots.
+    The slot count is rounded up to a power of two. */
+- (id) initWithTickInterval: (NSTimeInterval)tickInterval slots: (NSUInteger)nSlots;
+
+/** The resolution of the wheel. */
+@property (readonly) NSTimeInterval tickInterval;
+
+/** The time source the wheel measures ticks against. Defaults to CFAbsoluteTimeGetCurrent.
+    Setting it restarts the wheel's tick count, so it can only be set while no timers are armed.
+    (Tests use this to advance time explicitly.) */
+@property (copy) CFAbsoluteTime (^clock)(void);
+
+/** The number of timers currently armed. */
+@property (readonly) NSUInteger count;
+
+/** Arms a timer to fire after the given delay. If the timer is already armed (on this or any
+    other wheel) it's canceled first. The target and action fields must already be set. */
+- (void) arm: (MYTimer*)timer after: (NSTimeInterval)delay;
+
+/** Disarms a timer. Does nothing if the timer isn't armed. */
+- (void) cancel: (MYTimer*)timer;
+
+/** Disarms all timers, without firing them, and stops the wheel's NSTimer. */
+- (void) cancelAll;
+
+/** Fires all timers that have expired by now. This is called automatically by the wheel's
+    NSTimer, but may also be called directly (e.g. by a test.) */
+- (void) fireExpiredTimers;
+
+@end
+
+
+/** Returns YES if the timer is currently armed on a wheel. */
+static inline BOOL MYTimerIsArmed(const MYTimer *timer) {
+    return timer->_wheel != nil;
+}
+
+/** Cancels a timer, if it's armed, without needing a reference to its wheel. */
+static inline void MYTimerCancel(MYTimer *timer) {
+    if( timer->_wheel )
+        [timer->_wheel cancel: timer];
+}
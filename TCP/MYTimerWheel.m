@@ -0,0 +1,281 @@
+//
+//  MYTimerWheel.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MYTimerWheel.h"
+
+#import "Logging.h"
+#import "Test.h"
+#import "ExceptionUtils.h"
+
+#import <objc/message.h>
+
+
+#define kSharedTickInterval 0.25
+#define kSharedSlots        1024
+#define kSharedWheelKey     @"MYTimerWheel"
+
+
+@implementation MYTimerWheel
+{
+    NSTimeInterval _tickInterval;
+    CFAbsoluteTime (^_clock)(void);
+    CFAbsoluteTime _startTime;
+    UInt64 _currentTick;            // last tick whose slot has been processed
+    MYTimer *_slots;                // array of list heads (sentinels); each list is circular
+    NSUInteger _slotMask;
+    NSUInteger _count;
+    NSTimer *_ticker;
+}
+
+
+static inline void removeTimer(MYTimer *timer) {
+    timer->_prev->_next = timer->_next;
+    timer->_next->_prev = timer->_prev;
+    timer->_next = timer->_prev = NULL;
+}
+
+static inline void insertTimer(MYTimer *timer, MYTimer *head) {
+    timer->_prev = head->_prev;
+    timer->_next = head;
+    head->_prev->_next = timer;
+    head->_prev = timer;
+}
+
+
+- (id) initWithTickInterval: (NSTimeInterval)tickInterval slots: (NSUInteger)nSlots
+{
+    Assert(tickInterval > 0);
+    self = [super init];
+    if (self != nil) {
+        NSUInteger size = 1;
+        while( size < nSlots )
+            size <<= 1;
+        _tickInterval = tickInterval;
+        _slotMask = size - 1;
+        _slots = calloc(size, sizeof(MYTimer));
+        for( NSUInteger i=0; i<size; i++ )
+            _slots[i]._next = _slots[i]._prev = &_slots[i];
+        _startTime = CFAbsoluteTimeGetCurrent();
+    }
+    return self;
+}
+
+
++ (MYTimerWheel*) sharedWheel
+{
+    // A wheel ticks on the run loop it was created on, so each thread gets its own:
+    NSMutableDictionary *threadDict = [NSThread currentThread].threadDictionary;
+    MYTimerWheel *wheel = threadDict[kSharedWheelKey];
+    if( ! wheel ) {
+        wheel = [[self alloc] initWithTickInterval: kSharedTickInterval slots: kSharedSlots];
+        threadDict[kSharedWheelKey] = wheel;
+    }
+    return wheel;
+}
+
+
+- (void) dealloc
+{
+    [self cancelAll];
+    free(_slots);
+}
+
+
+@synthesize tickInterval=_tickInterval, count=_count, clock=_clock;
+
+
+- (void) setClock: (CFAbsoluteTime (^)(void))clock
+{
+    Assert(_count == 0, @"Can't change the clock of a %@ with armed timers", self.class);
+    _clock = [clock copy];
+    _startTime = _clock ? _clock() : CFAbsoluteTimeGetCurrent();
+    _currentTick = 0;
+}
+
+
+- (UInt64) _nowTick
+{
+    CFAbsoluteTime now = _clock ? _clock() : CFAbsoluteTimeGetCurrent();
+    return (UInt64)(MAX(now - _startTime, 0.0) / _tickInterval);
+}
+
+
+- (void) arm: (MYTimer*)timer after: (NSTimeInterval)delay
+{
+    Assert(timer->target && timer->action);
+    MYTimerCancel(timer);
+    UInt64 ticks = (UInt64)ceil(MAX(delay,0.0) / _tickInterval);
+    timer->_expiry = MAX([self _nowTick], _currentTick) + MAX(ticks, 1ull);
+    timer->_wheel = self;
+    insertTimer(timer, &_slots[timer->_expiry & _slotMask]);
+    if( _count++ == 0 )
+        [self _startTicker];
+}
+
+
+- (void) cancel: (MYTimer*)timer
+{
+    if( timer->_wheel != self )
+        return;
+    removeTimer(timer);
+    timer->_wheel = nil;
+    if( --_count == 0 )
+        [self _stopTicker];
+}
+
+
+- (void) cancelAll
+{
+    for( NSUInteger i=0; i<=_slotMask; i++ ) {
+        MYTimer *head = &_slots[i];
+        while( head->_next != head ) {
+            MYTimer *timer = head->_next;
+            removeTimer(timer);
+            timer->_wheel = nil;
+        }
+    }
+    _count = 0;
+    [self _stopTicker];
+}
+
+
+- (void) _startTicker
+{
+    if( ! _ticker ) {
+        _ticker = [NSTimer timerWithTimeInterval: _tickInterval
+                                          target: self
+                                        selector: @selector(_tick:)
+                                        userInfo: nil
+                                         repeats: YES];
+        [[NSRunLoop currentRunLoop] addTimer: _ticker forMode: NSRunLoopCommonModes];
+    }
+}
+
+- (void) _stopTicker
+{
+    [_ticker invalidate];
+    _ticker = nil;
+}
+
+- (void) _tick: (NSTimer*)ticker
+{
+    [self fireExpiredTimers];
+}
+
+
+- (void) fireExpiredTimers
+{
+    UInt64 now = [self _nowTick];
+    // If the run loop fell more than one revolution behind, every slot has to be visited anyway:
+    if( now - _currentTick > _slotMask + 1 && now > _slotMask + 1 )
+        _currentTick = now - (_slotMask + 1);
+
+    // Move expired timers into a private list before calling any of them, so that their
+    // actions can safely arm or cancel other timers (including ones on this list.)
+    MYTimer expired;
+    expired._next = expired._prev = &expired;
+    while( _currentTick < now ) {
+        MYTimer *head = &_slots[++_currentTick & _slotMask];
+        for( MYTimer *timer = head->_next; timer != head; ) {
+            MYTimer *next = timer->_next;
+            if( timer->_expiry <= _currentTick ) {
+                removeTimer(timer);
+                insertTimer(timer, &expired);
+            }
+            timer = next;
+        }
+    }
+
+    while( expired._next != &expired ) {
+        MYTimer *timer = expired._next;
+        removeTimer(timer);
+        timer->_wheel = nil;
+        --_count;
+        @try{
+            void (*action)(id, SEL, MYTimer*) = (void (*)(id, SEL, MYTimer*)) objc_msgSend;
+            action(timer->target, timer->action, timer);
+        }catchAndReport(@"MYTimerWheel firing timer");
+    }
+    if( _count == 0 )
+        [self _stopTicker];
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+@interface MYTimerWheelTester : NSObject
+{
+    @public
+    NSUInteger _fired;
+}
+@end
+
+@implementation MYTimerWheelTester
+- (void) fired: (MYTimer*)timer     {_fired++;}
+@end
+
+
+TestCase(MYTimerWheel) {
+    // Time only moves when the test says so. The tick is exactly representable, so the expected
+    // firing tick of each timer is exact too. There are fewer slots than ticks, so later timers
+    // share slots with earlier ones.
+    const NSUInteger kNTimers = 100000, kNDelays = 50;
+    const NSTimeInterval kTick = 0.25;
+    __block CFAbsoluteTime now = 1000.0;
+    MYTimerWheelTester *tester = [[MYTimerWheelTester alloc] init];
+    MYTimerWheel *wheel = [[MYTimerWheel alloc] initWithTickInterval: kTick slots: 16];
+    wheel.clock = ^CFAbsoluteTime{ return now; };
+    MYTimer *timers = calloc(kNTimers, sizeof(MYTimer));
+    for( NSUInteger i=0; i<kNTimers; i++ ) {
+        timers[i].target = tester;
+        timers[i].action = @selector(fired:);
+        [wheel arm: &timers[i] after: kTick * (i % kNDelays)];
+    }
+    CAssertEq(wheel.count, kNTimers);
+
+    // Cancel every other timer:
+    for( NSUInteger i=0; i<kNTimers; i+=2 )
+        MYTimerCancel(&timers[i]);
+    CAssertEq(wheel.count, kNTimers/2);
+    CAssert(!MYTimerIsArmed(&timers[0]) && MYTimerIsArmed(&timers[1]));
+
+    // Step through time one tick at a time. Each timer fires on the tick it was armed for (a zero
+    // delay counts as one tick), never earlier:
+    [wheel fireExpiredTimers];
+    CAssertEq(tester->_fired, 0u);
+    for( NSUInteger tick=1; tick<kNDelays; tick++ ) {
+        now += kTick;
+        [wheel fireExpiredTimers];
+        NSUInteger expected = 0;
+        for( NSUInteger i=1; i<kNTimers; i+=2 )
+            if( MAX(i % kNDelays, (NSUInteger)1) <= tick )
+                expected++;
+        CAssertEq(tester->_fired, expected);
+        CAssertEq(wheel.count, kNTimers/2 - expected);
+    }
+    CAssertEq(tester->_fired, kNTimers/2);
+    CAssertEq(wheel.count, 0u);
+    for( NSUInteger i=0; i<kNTimers; i++ )
+        CAssert(!MYTimerIsArmed(&timers[i]));
+
+    // If the wheel falls more than a revolution behind, overdue timers all fire at once:
+    tester->_fired = 0;
+    [wheel arm: &timers[0] after: 2*kTick];
+    [wheel arm: &timers[1] after: 40*kTick];
+    now += 100*kTick;
+    [wheel fireExpiredTimers];
+    CAssertEq(tester->_fired, 2u);
+    CAssertEq(wheel.count, 0u);
+    free(timers);
+}
+
+#endif
@@ -0,0 +1,60 @@
+//
+//  TCPConnectRace.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+@class IPAddress, RecentAddress, RecentAddressStore, MYResolverCache;
+
+
+/** Opens a TCP socket to a peer that has several addresses, by racing connection attempts to
+    them ("Happy Eyeballs", RFC 8305). Instead of waiting for one address to time out before
+    trying the next, a new attempt starts every `attemptDelay` seconds (or as soon as the previous
+    one fails), while the earlier ones keep going. The first to connect wins; the rest are
+    canceled.
+    Addresses are tried in this order: those that recently won a race first, most recent first;
+    then the rest, alternating between IPv6 and IPv4. Every win is recorded in a RecentAddress.
+    A race runs on the run loop of the thread that starts it. TCPConnection uses it for DNS
+    host names and for resolved Bonjour services. */
+@interface TCPConnectRace : NSObject
+
+/** Initializes a race between the given addresses, which are NSData objects containing struct
+    sockaddrs (as in NSNetService.addresses.) */
+- (id) initWithAddresses: (NSArray*)addresses;
+
+/** Initializes a race that first resolves a DNS name, then races its A and AAAA addresses. */
+- (id) initWithHostname: (NSString*)hostname port: (UInt16)port;
+
+/** The cache used to resolve the hostname. Defaults to the shared MYResolverCache. */
+@property (strong) MYResolverCache *resolverCache;
+
+/** The delay before starting the next attempt, while the current ones are still pending.
+    Defaults to 250ms, as RFC 8305 recommends. */
+@property NSTimeInterval attemptDelay;
+
+/** Starts the race. When it's over, the block is called on this thread with either the connected
+    socket, which the caller now owns, and the address it's connected to; or -1 and an error. */
+- (void) startWithCompletion: (void(^)(CFSocketNativeHandle socket, NSData *address,
+                                       NSError *error))onComplete;
+
+/** Stops the race, closing all the sockets. The completion block won't be called. */
+- (void) cancel;
+
+/** The number of connection attempts started so far. */
+@property (readonly) NSUInteger attemptCount;
+
+/** Sorts sockaddr NSData objects into the order they should be attempted in. */
++ (NSArray*) orderAddresses: (NSArray*)addresses;
+
+/** The recorded history of connections to an address, or nil if it's never won a race. */
++ (RecentAddress*) historyForAddress: (IPAddress*)address;
+
+/** A persistent store to record the history in, so it survives relaunches. Defaults to nil,
+    meaning the history is kept in memory. (Any history kept in memory is not copied over.) */
++ (RecentAddressStore*) historyStore;
++ (void) setHistoryStore: (RecentAddressStore*)store;
+
+@end
@@ -0,0 +1,487 @@
+//
+//  TCPConnectRace.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "TCPConnectRace.h"
+#import "IPAddress.h"
+#import "RecentAddressStore.h"
+#import "MYResolverCache.h"
+
+#import "Logging.h"
+#import "Test.h"
+
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <unistd.h>
+
+
+#define kDefaultAttemptDelay 0.25
+
+
+static NSMutableDictionary *sHistory;      // IPAddress -> RecentAddress
+static RecentAddressStore *sHistoryStore;
+
+
+static int addressFamily( NSData *address ) {
+    if( address.length < sizeof(struct sockaddr) )
+        return AF_UNSPEC;
+    return ((const struct sockaddr*)address.bytes)->sa_family;
+}
+
+static NSString* describeAddress( NSData *address ) {
+    const struct sockaddr *sa = address.bytes;
+    char name[INET6_ADDRSTRLEN] = "?";
+    if( sa->sa_family == AF_INET6 ) {
+        const struct sockaddr_in6 *sa6 = (const struct sockaddr_in6*)sa;
+        inet_ntop(AF_INET6, &sa6->sin6_addr, name, sizeof(name));
+        return [NSString stringWithFormat: @"[%s]:%u", name, (unsigned)ntohs(sa6->sin6_port)];
+    } else {
+        const struct sockaddr_in *sa4 = (const struct sockaddr_in*)sa;
+        inet_ntop(AF_INET, &sa4->sin_addr, name, sizeof(name));
+        return [NSString stringWithFormat: @"%s:%u", name, (unsigned)ntohs(sa4->sin_port)];
+    }
+}
+
+// Returns a copy of the sockaddrs with their port numbers set.
+static NSArray* withPort( NSArray *addresses, UInt16 port ) {
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity: addresses.count];
+    for( NSData *address in addresses ) {
+        NSMutableData *copy = [address mutableCopy];
+        struct sockaddr *sa = copy.mutableBytes;
+        if( sa->sa_family == AF_INET6 )
+            ((struct sockaddr_in6*)sa)->sin6_port = htons(port);
+        else
+            ((struct sockaddr_in*)sa)->sin_port = htons(port);
+        [result addObject: copy];
+    }
+    return result;
+}
+
+static void connectCallback( CFSocketRef socket, CFSocketCallBackType type, CFDataRef address,
+                             const void *data, void *info );
+
+
+@interface TCPConnectRace ()
+- (void) _attempt: (CFSocketRef)socket finishedWithError: (int)err;
+@end
+
+
+@implementation TCPConnectRace
+{
+    NSString *_hostname;
+    UInt16 _port;
+    MYResolverCache *_resolverCache;
+    NSArray *_addresses;                // in the order they'll be attempted
+    NSUInteger _nextAddress;
+    NSMutableArray *_attempts;          // CFSocketRefs of pending attempts
+    NSMutableArray *_attemptAddresses;  // address of each item in _attempts
+    NSTimeInterval _attemptDelay;
+    NSUInteger _attemptCount;
+    int _lastErrno;
+    BOOL _running;
+    void (^_onComplete)(CFSocketNativeHandle, NSData*, NSError*);
+}
+
+
+- (id) _init
+{
+    self = [super init];
+    if (self != nil) {
+        _attemptDelay = kDefaultAttemptDelay;
+        _attempts = [[NSMutableArray alloc] init];
+        _attemptAddresses = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (id) initWithAddresses: (NSArray*)addresses
+{
+    self = [self _init];
+    if (self != nil) {
+        _addresses = [[self class] orderAddresses: addresses];
+    }
+    return self;
+}
+
+- (id) initWithHostname: (NSString*)hostname port: (UInt16)port
+{
+    Assert(hostname);
+    self = [self _init];
+    if (self != nil) {
+        _hostname = [hostname copy];
+        _port = port;
+        _resolverCache = [MYResolverCache sharedCache];
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    [self _closeAttempts];
+}
+
+
+- (NSString*) description
+{
+    return [NSString stringWithFormat: @"%@[%@]", self.class,
+            (_hostname ?: [NSString stringWithFormat: @"%lu addresses", (unsigned long)_addresses.count])];
+}
+
+
+@synthesize attemptDelay=_attemptDelay, attemptCount=_attemptCount, resolverCache=_resolverCache;
+
+
+- (void) startWithCompletion: (void(^)(CFSocketNativeHandle, NSData*, NSError*))onComplete
+{
+    Assert(onComplete);
+    Assert(!_running, @"%@ already started", self);
+    _onComplete = [onComplete copy];
+    _running = YES;
+    if( _addresses )
+        [self _startNextAttempt];
+    else
+        [self _resolve];
+}
+
+
+- (void) cancel
+{
+    if( _running ) {
+        LogTo(TCP,@"%@: canceled",self);
+        _running = NO;
+        _onComplete = nil;
+        [NSObject cancelPreviousPerformRequestsWithTarget: self];
+        [self _closeAttempts];
+    }
+}
+
+
+- (void) _finishWithSocket: (CFSocketNativeHandle)socket address: (NSData*)address
+                     error: (NSError*)error
+{
+    _running = NO;
+    [NSObject cancelPreviousPerformRequestsWithTarget: self];
+    [self _closeAttempts];
+    void (^onComplete)(CFSocketNativeHandle, NSData*, NSError*) = _onComplete;
+    _onComplete = nil;
+    onComplete(socket, address, error);
+}
+
+
+#pragma mark -
+#pragma mark RESOLVING:
+
+
+- (void) _resolve
+{
+    LogTo(TCP,@"%@: resolving",self);
+    [_resolverCache resolveHostname: _hostname completion: ^(NSArray *addresses, NSError *error) {
+        [self _resolvedAddresses: addresses error: error];
+    }];
+}
+
+- (void) _resolvedAddresses: (NSArray*)addresses error: (NSError*)error
+{
+    if( ! _running )
+        return;
+    if( ! addresses ) {
+        LogTo(TCP,@"%@: couldn't resolve: %@",self,error);
+        [self _finishWithSocket: -1 address: nil error: error];
+        return;
+    }
+    _addresses = [[self class] orderAddresses: withPort(addresses, _port)];
+    [self _startNextAttempt];
+}
+
+
+#pragma mark -
+#pragma mark CONNECTING:
+
+
+- (void) _startNextAttempt
+{
+    [NSObject cancelPreviousPerformRequestsWithTarget: self selector: @selector(_startNextAttempt)
+                                               object: nil];
+    while( _running && _nextAddress < _addresses.count ) {
+        if( [self _attemptAddress: _addresses[_nextAddress++]] ) {
+            // Give this attempt a head start before trying the next address:
+            if( _nextAddress < _addresses.count )
+                [self performSelector: @selector(_startNextAttempt) withObject: nil
+                           afterDelay: _attemptDelay];
+            return;
+        }
+    }
+    if( _running && _attempts.count == 0 ) {
+        // Every address has failed:
+        LogTo(TCP,@"%@: all %lu attempts failed",self,(unsigned long)_attemptCount);
+        if( _hostname )
+            [_resolverCache removeHostname: _hostname];     // maybe the host has moved
+        [self _finishWithSocket: -1 address: nil
+                          error: [NSError errorWithDomain: NSPOSIXErrorDomain
+                                                     code: (_lastErrno ?: ECONNREFUSED)
+                                                 userInfo: nil]];
+    }
+}
+
+
+- (BOOL) _attemptAddress: (NSData*)address
+{
+    CFSocketContext context = {0, (__bridge void*)self, NULL, NULL, NULL};
+    CFSocketRef socket = CFSocketCreate(NULL, addressFamily(address), SOCK_STREAM, IPPROTO_TCP,
+                                        kCFSocketConnectCallBack, &connectCallback, &context);
+    if( ! socket ) {
+        _lastErrno = errno;
+        return NO;
+    }
+#ifdef SO_NOSIGPIPE
+    int yes = 1;
+    setsockopt(CFSocketGetNative(socket), SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+    ++_attemptCount;
+    LogTo(TCP,@"%@: attempt #%lu, to %@",self,(unsigned long)_attemptCount,describeAddress(address));
+    CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(NULL, socket, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopCommonModes);
+    CFRelease(source);
+    [_attempts addObject: (__bridge id)socket];
+    [_attemptAddresses addObject: address];
+    CFRelease(socket);
+
+    // A negative timeout makes the connect asynchronous; the callback reports the outcome:
+    if( CFSocketConnectToAddress(socket, (__bridge CFDataRef)address, -1.0) != kCFSocketSuccess ) {
+        _lastErrno = errno ?: EHOSTUNREACH;
+        [self _removeAttemptAtIndex: _attempts.count - 1];
+        return NO;
+    }
+    return YES;
+}
+
+
+static void connectCallback( CFSocketRef socket, CFSocketCallBackType type, CFDataRef address,
+                             const void *data, void *info )
+{
+    int err = data ? *(const SInt32*)data : 0;
+    [(__bridge TCPConnectRace*)info _attempt: socket finishedWithError: err];
+}
+
+
+- (void) _attempt: (CFSocketRef)socket finishedWithError: (int)err
+{
+    NSUInteger index = [_attempts indexOfObjectIdenticalTo: (__bridge id)socket];
+    if( index == NSNotFound )
+        return;
+    NSData *address = _attemptAddresses[index];
+    if( err ) {
+        LogTo(TCP,@"%@: attempt to %@ failed: %s",self,describeAddress(address),strerror(err));
+        _lastErrno = err;
+        [self _removeAttemptAtIndex: index];
+        [self _startNextAttempt];       // no need to wait any longer
+        return;
+    }
+
+    // The winner! Keep its native socket open, and cancel the rest:
+    LogTo(TCP,@"%@: connected to %@",self,describeAddress(address));
+    CFSocketSetSocketFlags(socket, CFSocketGetSocketFlags(socket) & ~kCFSocketCloseOnInvalidate);
+    CFSocketNativeHandle native = CFSocketGetNative(socket);
+    [self _removeAttemptAtIndex: index];
+    [[self class] _noteSuccess: address];
+    [self _finishWithSocket: native address: address error: nil];
+}
+
+
+- (void) _removeAttemptAtIndex: (NSUInteger)index
+{
+    CFSocketInvalidate((__bridge CFSocketRef)_attempts[index]);   // closes the socket, if it lost
+    [_attempts removeObjectAtIndex: index];
+    [_attemptAddresses removeObjectAtIndex: index];
+}
+
+- (void) _closeAttempts
+{
+    while( _attempts.count > 0 )
+        [self _removeAttemptAtIndex: _attempts.count - 1];
+}
+
+
+#pragma mark -
+#pragma mark HISTORY:
+
+
++ (RecentAddressStore*) historyStore
+{
+    @synchronized(self) {
+        return sHistoryStore;
+    }
+}
+
++ (void) setHistoryStore: (RecentAddressStore*)store
+{
+    @synchronized(self) {
+        sHistoryStore = store;
+    }
+}
+
++ (RecentAddress*) historyForAddress: (IPAddress*)address
+{
+    if( ! address )
+        return nil;
+    @synchronized(self) {
+        if( sHistoryStore )
+            return [sHistoryStore historyForAddress: address];
+        return sHistory[address];
+    }
+}
+
++ (void) _noteSuccess: (NSData*)sockaddr
+{
+    IPAddress *address = [[IPAddress alloc] initWithData: sockaddr];
+    if( ! address )
+        return;
+    @synchronized(self) {
+        if( sHistoryStore ) {
+            [sHistoryStore noteSuccess: address];
+            return;
+        }
+        if( ! sHistory )
+            sHistory = [[NSMutableDictionary alloc] init];
+        RecentAddress *recent = sHistory[address];
+        if( ! recent ) {
+            recent = [[RecentAddress alloc] initWithIPAddress: address];
+            sHistory[address] = recent;
+        }
+        [recent noteSuccess];
+    }
+}
+
+
++ (NSArray*) orderAddresses: (NSArray*)addresses
+{
+    // Addresses that have won before go first, most recent winner first:
+    NSMutableArray *known = [NSMutableArray array];
+    NSMutableArray *ipv6 = [NSMutableArray array], *ipv4 = [NSMutableArray array];
+    NSMutableDictionary *lastSuccess = [NSMutableDictionary dictionary];
+    for( NSData *address in addresses ) {
+        RecentAddress *history = [self historyForAddress: [[IPAddress alloc] initWithData: address]];
+        if( history ) {
+            [known addObject: address];
+            lastSuccess[address] = @(history.lastSuccess);
+        } else if( addressFamily(address) == AF_INET6 ) {
+            [ipv6 addObject: address];
+        } else {
+            [ipv4 addObject: address];
+        }
+    }
+    [known sortUsingComparator: ^NSComparisonResult(NSData *a, NSData *b) {
+        return [lastSuccess[b] compare: lastSuccess[a]];
+    }];
+
+    // Then the rest, alternating between families, IPv6 first:
+    NSMutableArray *ordered = known;
+    for( NSUInteger i=0; i < MAX(ipv6.count, ipv4.count); i++ ) {
+        if( i < ipv6.count )
+            [ordered addObject: ipv6[i]];
+        if( i < ipv4.count )
+            [ordered addObject: ipv4[i]];
+    }
+    return ordered;
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+static NSData* testIPv4Address( const char *addr, UInt16 port ) {
+    struct sockaddr_in sa = {.sin_len = sizeof(sa), .sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, addr, &sa.sin_addr);
+    return [NSData dataWithBytes: &sa length: sizeof(sa)];
+}
+
+static NSData* testIPv6Address( const char *addr, UInt16 port ) {
+    struct sockaddr_in6 sa = {.sin6_len = sizeof(sa), .sin6_family = AF_INET6, .sin6_port = htons(port)};
+    inet_pton(AF_INET6, addr, &sa.sin6_addr);
+    return [NSData dataWithBytes: &sa length: sizeof(sa)];
+}
+
+// Binds a socket to a random loopback port, and returns the socket and its address.
+static int bindLoopbackSocket( NSData **outAddress ) {
+    int s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in sa = {.sin_len = sizeof(sa), .sin_family = AF_INET,
+                             .sin_addr = {htonl(INADDR_LOOPBACK)}};
+    socklen_t len = sizeof(sa);
+    CAssert(bind(s, (struct sockaddr*)&sa, sizeof(sa)) == 0);
+    CAssert(getsockname(s, (struct sockaddr*)&sa, &len) == 0);
+    *outAddress = [NSData dataWithBytes: &sa length: sizeof(sa)];
+    return s;
+}
+
+static void runRace( TCPConnectRace *race, CFSocketNativeHandle *outSocket, NSData **outAddress,
+                     NSError **outError ) {
+    __block BOOL done = NO;
+    [race startWithCompletion: ^(CFSocketNativeHandle socket, NSData *address, NSError *error) {
+        done = YES;
+        *outSocket = socket;
+        *outAddress = address;
+        *outError = error;
+    }];
+    NSDate *giveUp = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    while( ! done && [giveUp timeIntervalSinceNow] > 0 )
+        [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]];
+    CAssert(done, @"Race didn't finish");
+}
+
+TestCase(TCPConnectRace) {
+    // Families alternate, IPv6 first; previous winners go to the front:
+    NSData *a4 = testIPv4Address("192.0.2.1", 80), *b4 = testIPv4Address("192.0.2.2", 80);
+    NSData *a6 = testIPv6Address("2001:db8::1", 80), *b6 = testIPv6Address("2001:db8::2", 80);
+    CAssertEqual([TCPConnectRace orderAddresses: @[a4, b4, a6, b6]], (@[a6, a4, b6, b4]));
+    [TCPConnectRace _noteSuccess: b4];
+    CAssertEqual([TCPConnectRace orderAddresses: @[a4, b4, a6, b6]], (@[b4, a6, a4, b6]));
+
+    // One address refuses the connection (its socket is bound but not listening), the next
+    // accepts. The second attempt should start as soon as the first fails, not after the delay:
+    NSData *refusingAddr, *listeningAddr;
+    int refusing = bindLoopbackSocket(&refusingAddr);
+    int listening = bindLoopbackSocket(&listeningAddr);
+    CAssert(listen(listening, 5) == 0);
+
+    TCPConnectRace *race = [[TCPConnectRace alloc] initWithAddresses: @[refusingAddr, listeningAddr]];
+    race.attemptDelay = 60.0;
+    CFSocketNativeHandle socket;
+    NSData *address;
+    NSError *error;
+    runRace(race, &socket, &address, &error);
+    CAssert(socket >= 0);
+    CAssertEqual(address, listeningAddr);
+    CAssert(error == nil);
+    CAssertEq(race.attemptCount, 2u);
+    CAssert([TCPConnectRace historyForAddress: [[IPAddress alloc] initWithData: listeningAddr]]
+                .successes >= 1);
+    close(socket);
+
+    // Now the winner is tried first:
+    race = [[TCPConnectRace alloc] initWithAddresses: @[refusingAddr, listeningAddr]];
+    runRace(race, &socket, &address, &error);
+    CAssertEqual(address, listeningAddr);
+    CAssertEq(race.attemptCount, 1u);
+    close(socket);
+
+    // If every attempt fails, the last error is reported:
+    race = [[TCPConnectRace alloc] initWithAddresses: @[refusingAddr]];
+    runRace(race, &socket, &address, &error);
+    CAssertEq(socket, -1);
+    CAssertEqual(error.domain, NSPOSIXErrorDomain);
+    CAssertEq(error.code, (NSInteger)ECONNREFUSED);
+
+    close(refusing);
+    close(listening);
+}
+
+#endif
@@ -28,10 +28,13 @@ typedef enum {
 @interface TCPConnection : TCPEndpoint
 
 /** Initializes a TCPConnection to the given IP address.
+    If the address is a HostAddress (a DNS name), opening the connection resolves the name and
+    races connection attempts to all its addresses; see TCPConnectRace.
     Afer configuring settings, you should call -open to begin the connection. */
 - (id) initToAddress: (IPAddress*)address;
 
 /** Initializes a TCPConnection to the given NSNetService's address and port.
+    If the service is already resolved to several addresses, they're raced as by TCPConnectRace.
     If the service's address cannot be resolved, nil is returned. */
 - (id) initToNetService: (NSNetService*)service;
 
@@ -117,7 +120,8 @@ typedef enum {
 - (void) connection: (TCPConnection*)connection failedToOpen: (NSError*)error;
 /** Called when the identity of the peer is known, if using an SSL connection and the SSL
     settings say to check the peer's certificate.
-    This happens, if at all, after the -connectionDidOpen: call. */
+    This happens, if at all, after the -connectionDidOpen: call.
+    It's called for every connection, including ones that resumed an earlier TLS session. */
 - (BOOL) connection: (TCPConnection*)connection authorizeSSLPeer: (SecCertificateRef)peerCert;
 /** Called after the connection closes.
     You can check the connection's error property to see if it was normal or abnormal. */
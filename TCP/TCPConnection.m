@@ -7,13 +7,22 @@
 //
 
 #import "TCP_Internal.h"
+#import "TCPSessionCache.h"
+#import "TCPConnectRace.h"
 #import "IPAddress.h"
 #import "MYBonjourService.h"
+#import "MYBufferPool.h"
+#import "MYTimerWheel.h"
 
 #import "Logging.h"
 #import "Test.h"
 #import "ExceptionUtils.h"
 
+#import <Security/Security.h>
+#import <unistd.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+
 // SecureTransport.h is missing on old iPhone versions. Add it if it's available
 #import <Availability.h>
 #if TARGET_OS_IPHONE && !defined(__SEC_TYPES__) && defined(__IPHONE_5_0)
@@ -37,7 +46,9 @@ NSString* const TCPErrorDomain = @"TCP";
 @property TCPConnectionStatus status;
 @property (strong) IPAddress *address;
 - (BOOL) _checkIfClosed;
-- (void) _closed;
+- (void) _setSSLPeerID;
+- (void) _noteSSLHandshake;
+@property (readonly) NSString *_sessionPeer;
 @end
 
 
@@ -51,10 +62,23 @@ NSString* const TCPErrorDomain = @"TCP";
     TCPWriter *_writer;
     NSError *_error;
     NSTimeInterval _openTimeout;
+    MYBufferPool *_bufferPool;
+    TCPConnectRace *_connectRace;
+    CFRunLoopRef _runLoop;          // where I was opened; set while I'm registered
+    MYTimer _idleTimer;
+    CFAbsoluteTime _lastTransfer;
 }
 
 
-static NSMutableArray *sAllConnections = NULL;
+// Idle buffers kept per size class. Each stream only has a frame or two in hand at once.
+#define kMaxPooledBuffersPerClass 4
+
+
+// The registry of open connections. The table compares by identity, so adding and removing are
+// constant-time. Connections on any thread register, so the lock guards both collections.
+static NSHashTable *sOpenConnections;
+static NSCountedSet *sOpenRunLoops;     // the _runLoop of each open connection
+static NSCondition *sRegistryLock;      // broadcast when the last open connection closes
 
 
 - (Class) readerClass   {return [TCPReader class];}
@@ -62,34 +86,70 @@ static NSMutableArray *sAllConnections = NULL;
 
 
 - (id) _initWithAddress: (IPAddress*)address
-            inputStream: (NSInputStream*)input
-           outputStream: (NSOutputStream*)output
 {
     static dispatch_once_t predicate;
 	dispatch_once(&predicate, ^{
-		sAllConnections = [[NSMutableArray alloc] init];
+		sOpenConnections = [[NSHashTable alloc] initWithOptions: NSPointerFunctionsStrongMemory |
+                                                    NSPointerFunctionsObjectPointerPersonality
+                                                       capacity: 0];
+        sOpenRunLoops = [[NSCountedSet alloc] init];
+        sRegistryLock = [[NSCondition alloc] init];
 	});
 
     
     self = [super init];
     if (self != nil) {
-        if( !input || !output ) {
-            LogTo(TCP,@"Failed to create %@: addr=%@, in=%@, out=%@",
-                  self.class,address,input,output);
-            return nil;
-        }
         _address = [address copy];
-        _reader = [[[self readerClass] alloc] initWithConnection: self stream: input];
-        _writer = [[[self writerClass] alloc] initWithConnection: self stream: output];
+        _bufferPool = [[MYBufferPool alloc] initWithMaxBuffersPerClass: kMaxPooledBuffersPerClass];
+    }
+    return self;
+}
+
+- (id) _initWithAddress: (IPAddress*)address
+            inputStream: (NSInputStream*)input
+           outputStream: (NSOutputStream*)output
+{
+    if( !input || !output ) {
+        LogTo(TCP,@"Failed to create %@: addr=%@, in=%@, out=%@",
+              [self class],address,input,output);
+        return nil;
+    }
+    self = [self _initWithAddress: address];
+    if (self != nil) {
+        [self _setInputStream: input outputStream: output];
         LogTo(TCP,@"%@ initialized, address=%@",self,address);
     }
     return self;
 }
 
+// The streams get created in -open, from the socket that wins the race.
+- (id) _initWithAddress: (IPAddress*)address
+            connectRace: (TCPConnectRace*)race
+{
+    self = [self _initWithAddress: address];
+    if (self != nil) {
+        _connectRace = race;
+        LogTo(TCP,@"%@ initialized, address=%@; will race %@",self,address,race);
+    }
+    return self;
+}
+
+- (void) _setInputStream: (NSInputStream*)input outputStream: (NSOutputStream*)output
+{
+    _reader = [[[self readerClass] alloc] initWithConnection: self stream: input];
+    _writer = [[[self writerClass] alloc] initWithConnection: self stream: output];
+}
+
 
 
 - (id) initToAddress: (IPAddress*)address
 {
+    if( [address isKindOfClass: [HostAddress class]] ) {
+        // A DNS name may have several addresses (often IPv6 and IPv4), so race them:
+        TCPConnectRace *race = [[TCPConnectRace alloc] initWithHostname: address.hostname
+                                                                   port: address.port];
+        return [self _initWithAddress: address connectRace: race];
+    }
     CFReadStreamRef cfInput;
     CFWriteStreamRef cfOutput;
     CFStreamCreatePairWithSocketToHost(NULL, (__bridge CFStringRef)address.hostname, address.port,
@@ -109,6 +169,12 @@ static NSMutableArray *sAllConnections = NULL;
         NSArray *addresses = service.addresses;
         if( addresses.count > 0 )
             address = [[IPAddress alloc] initWithSockAddr: [addresses[0] bytes]];
+        if( addresses.count > 1 ) {
+            // The service is already resolved, so race its addresses instead of letting the
+            // streams try them one at a time:
+            TCPConnectRace *race = [[TCPConnectRace alloc] initWithAddresses: addresses];
+            return [self _initWithAddress: address connectRace: race];
+        }
     } else {
         input = nil;
         output = nil;
@@ -148,6 +214,9 @@ static NSMutableArray *sAllConnections = NULL;
 - (void) dealloc
 {
     LogTo(TCP,@"DEALLOC %@",self);
+    MYTimerCancel(&_idleTimer);
+    if( _runLoop )
+        CFRelease(_runLoop);
 }
 
 
@@ -158,7 +227,8 @@ static NSMutableArray *sAllConnections = NULL;
 
 
 @synthesize address=_address, isIncoming=_isIncoming, status=_status,
-            reader=_reader, writer=_writer, server=_server, openTimeout=_openTimeout;
+            reader=_reader, writer=_writer, server=_server, openTimeout=_openTimeout,
+            bufferPool=_bufferPool;
 
 - (id<TCPConnectionDelegate>) tcpDelegate {
     return _delegate;
@@ -199,19 +269,86 @@ static NSMutableArray *sAllConnections = NULL;
 
 - (void) open
 {
-    if( _status<=kTCP_Closed && _reader ) {
-        _reader.SSLProperties = _sslProperties;
-        _writer.SSLProperties = _sslProperties;
-        [_reader open];
-        [_writer open];
-        if( ! [sAllConnections my_containsObjectIdenticalTo: self] )
-            [sAllConnections addObject: self];
-        self.status = kTCP_Opening;
-        if( _openTimeout > 0 )
+    if( _status<=kTCP_Closed && (_reader || _connectRace) ) {
+        if( _reader ) {
+            [self _openStreams];
+            [self _register];
+            self.status = kTCP_Opening;
+        } else {
+            // A race can finish before -startWithCompletion: returns (if every address fails
+            // right away), so I have to be registered and Opening before it starts:
+            [self _register];
+            self.status = kTCP_Opening;
+            __weak TCPConnection *weakSelf = self;
+            TCPConnectRace *race = _connectRace;    // (the completion may clear _connectRace)
+            [race startWithCompletion: ^(CFSocketNativeHandle socket, NSData *address,
+                                                 NSError *error) {
+                [weakSelf _connectRaceFinishedWithSocket: socket address: address error: error];
+            }];
+        }
+        if( _openTimeout > 0 && _status == kTCP_Opening )
             [self performSelector: @selector(_openTimeoutExpired) withObject: nil afterDelay: _openTimeout];
     }
 }
 
+- (void) _openStreams
+{
+    _reader.SSLProperties = _sslProperties;
+    _writer.SSLProperties = _sslProperties;
+    [_reader open];
+    [_writer open];
+    if( _sslProperties && _sessionCache )
+        [self _setSSLPeerID];
+}
+
+- (void) _connectRaceFinishedWithSocket: (CFSocketNativeHandle)socket
+                                address: (NSData*)sockaddr
+                                  error: (NSError*)error
+{
+    _connectRace = nil;
+    if( _status != kTCP_Opening ) {
+        if( socket >= 0 )
+            close(socket);
+        return;
+    }
+    if( socket < 0 ) {
+        LogTo(TCP,@"%@: couldn't connect: %@",self,error);
+        _error = error;
+        [self _closed];
+        return;
+    }
+
+    // Now that the peer's address is known, record it (but keep the DNS name):
+    IPAddress *address;
+    if( [_address isKindOfClass: [HostAddress class]] )
+        address = [[HostAddress alloc] initWithHostname: _address.hostname
+                                               sockaddr: sockaddr.bytes port: _address.port];
+    else
+        address = [[IPAddress alloc] initWithData: sockaddr];
+    if( address )
+        self.address = address;
+
+    CFReadStreamRef readStream = NULL;
+    CFWriteStreamRef writeStream = NULL;
+    CFStreamCreatePairWithSocket(kCFAllocatorDefault, socket, &readStream, &writeStream);
+    CFReadStreamSetProperty(readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+    CFWriteStreamSetProperty(writeStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+    [self _setInputStream: (NSInputStream*)CFBridgingRelease(readStream)
+             outputStream: (NSOutputStream*)CFBridgingRelease(writeStream)];
+
+    // A stream made from a socket doesn't know the host name, which SSL needs to verify the cert:
+    if( _sslProperties && !_sslProperties[kTCPPropertySSLPeerName]
+                       && [_address isKindOfClass: [HostAddress class]] )
+        _sslProperties[kTCPPropertySSLPeerName] = _address.hostname;
+    LogTo(TCP,@"%@: connected; opening streams",self);
+    [self _openStreams];
+}
+
+- (BOOL) _isConnecting
+{
+    return _connectRace != nil;
+}
+
 - (void) _stopOpenTimer
 {
     [NSObject cancelPreviousPerformRequestsWithTarget: self selector: @selector(_openTimeoutExpired) object: nil];
@@ -231,9 +368,14 @@ static NSMutableArray *sAllConnections = NULL;
 {
     if( _status > kTCP_Closed ) {
         LogTo(TCP,@"%@ disconnecting",self);
-        [_writer disconnect];
-        [_reader disconnect];
-        self.status = kTCP_Disconnected;
+        if( _connectRace ) {
+            // Still connecting, so there are no streams yet to report the disconnection:
+            [self _closed];
+        } else {
+            [_writer disconnect];
+            [_reader disconnect];
+            self.status = kTCP_Disconnected;
+        }
     }
     [self _stopOpenTimer];
 }
@@ -318,28 +460,226 @@ static NSMutableArray *sAllConnections = NULL;
         else
             [self tellDelegate: @selector(connectionDidClose:) withObject: nil];
     }
+    [_connectRace cancel];
+    _connectRace = nil;
+    MYTimerCancel(&_idleTimer);
+    [_server _connectionClosed: self];
     [self _stopCloseTimer];
     [self _stopOpenTimer];
-    [sAllConnections removeObjectIdenticalTo: self];
+    LogTo(TCP,@"%@ buffer pool: %lu allocated, %lu reused",
+          self, (unsigned long)_bufferPool.allocations, (unsigned long)_bufferPool.reuses);
+    [self _unregister];
+}
+
+
+#pragma mark -
+#pragma mark IDLE CONNECTIONS:
+
+
+- (void) _enableKeepAlive
+{
+    NSData *handle = [_reader propertyForKey: kCFStreamPropertySocketNativeHandle];
+    if( handle.length != sizeof(CFSocketNativeHandle) )
+        return;
+    CFSocketNativeHandle socket = *(const CFSocketNativeHandle*)handle.bytes;
+    int yes = 1, idle = (int)ceil(_keepAliveInterval);
+    if( setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) < 0 ) {
+        Warn(@"%@: couldn't enable keepalive (errno %d)",self,errno);
+        return;
+    }
+#if defined(TCP_KEEPALIVE)
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof(idle));     // (Darwin's name)
+#elif defined(TCP_KEEPIDLE)
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+#endif
+#if defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+    // Give up after three unanswered probes, a third of the interval apart:
+    int interval = MAX(1, idle/3), count = 3;
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+    LogTo(TCP,@"%@: keepalive after %d sec idle",self,idle);
+}
+
+
+// Called by my streams whenever they read or write. Just takes the time; the idle timer only
+// looks at it when it fires, so activity never has to re-arm it.
+- (void) _streamTransferredData
+{
+    if( _idleTimeout > 0 )
+        _lastTransfer = CFAbsoluteTimeGetCurrent();
+}
+
+- (void) _armIdleTimer: (NSTimeInterval)delay
+{
+    _idleTimer.target = self;
+    _idleTimer.action = @selector(_idleTimerFired:);
+    [[MYTimerWheel sharedWheel] arm: &_idleTimer after: delay];
+}
+
+- (void) _idleTimerFired: (MYTimer*)timer
+{
+    if( _status != kTCP_Open )
+        return;
+    NSTimeInterval idle = CFAbsoluteTimeGetCurrent() - _lastTransfer;
+    if( idle < _idleTimeout ) {
+        [self _armIdleTimer: _idleTimeout - idle];
+    } else if( _reader.isBusy || _writer.isBusy ) {
+        // Stuck partway through a message; the peer has stopped responding, or reading:
+        LogTo(TCP,@"%@: stalled for %.0f sec; disconnecting",self,idle);
+        [self _stream: _writer gotError: [NSError errorWithDomain: NSPOSIXErrorDomain
+                                                             code: ETIMEDOUT userInfo: nil]];
+    } else {
+        LogTo(TCP,@"%@: idle for %.0f sec; closing",self,idle);
+        [self close];
+    }
+}
+
+
+#pragma mark -
+#pragma mark REGISTRY:
+
+
+- (void) _register
+{
+    [sRegistryLock lock];
+    if( ! [sOpenConnections member: self] ) {
+        if( _runLoop )
+            CFRelease(_runLoop);
+        _runLoop = (CFRunLoopRef)CFRetain(CFRunLoopGetCurrent());
+        [sOpenConnections addObject: self];
+        [sOpenRunLoops addObject: [NSValue valueWithPointer: _runLoop]];
+    }
+    [sRegistryLock unlock];
+}
+
+- (void) _unregister
+{
+    [sRegistryLock lock];
+    if( [sOpenConnections member: self] ) {
+        [sOpenConnections removeObject: self];
+        [sOpenRunLoops removeObject: [NSValue valueWithPointer: _runLoop]];
+        if( sOpenConnections.count == 0 )
+            [sRegistryLock broadcast];
+    }
+    [sRegistryLock unlock];
+}
+
++ (NSUInteger) _openConnectionCount
+{
+    [sRegistryLock lock];
+    NSUInteger count = sOpenConnections.count;
+    [sRegistryLock unlock];
+    return count;
 }
 
 
 + (void) closeAllWithTimeout: (NSTimeInterval)timeout
 {
-    NSArray *connections = [sAllConnections copy];
+    [sRegistryLock lock];
+    NSArray *connections = sOpenConnections.allObjects;
+    NSMutableArray *runLoops = [NSMutableArray arrayWithCapacity: connections.count];
     for( TCPConnection *conn in connections )
-        [conn closeWithTimeout: timeout];
+        [runLoops addObject: (__bridge id)conn->_runLoop];
+    [sRegistryLock unlock];
+
+    CFRunLoopRef currentRunLoop = CFRunLoopGetCurrent();
+    [connections enumerateObjectsUsingBlock: ^(TCPConnection *conn, NSUInteger i, BOOL *stop) {
+        CFRunLoopRef runLoop = (__bridge CFRunLoopRef)runLoops[i];
+        if( runLoop == currentRunLoop ) {
+            [conn closeWithTimeout: timeout];
+        } else {
+            // A connection can only be used on its own thread:
+            CFRunLoopPerformBlock(runLoop, kCFRunLoopCommonModes, ^{
+                [conn closeWithTimeout: timeout];
+            });
+            CFRunLoopWakeUp(runLoop);
+        }
+    }];
 }
 
 + (void) waitTillAllClosed
 {
-    while( sAllConnections.count ) {
-        if( ! [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
-                                       beforeDate: [NSDate distantFuture]] )
-            break;
+    NSValue *currentRunLoop = [NSValue valueWithPointer: CFRunLoopGetCurrent()];
+    [sRegistryLock lock];
+    while( sOpenConnections.count > 0 ) {
+        if( [sOpenRunLoops countForObject: currentRunLoop] > 0 ) {
+            // Some connections run on this thread, so it has to run its run loop till they close:
+            [sRegistryLock unlock];
+            BOOL ran = [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                                beforeDate: [NSDate distantFuture]];
+            [sRegistryLock lock];
+            if( ! ran )
+                break;
+        } else {
+            // The rest are on other threads; sleep till the last one closes:
+            [sRegistryLock wait];
+        }
+    }
+    [sRegistryLock unlock];
+}
+
+
+#pragma mark -
+#pragma mark SSL SESSIONS:
+
+
+// Identifies the peer to my sessionCache. An outgoing connection goes to a known host and port;
+// an incoming one comes from a different port every time, so only the peer's address counts.
+- (NSString*) _sessionPeer
+{
+    if( _isIncoming )
+        return $sprintf(@"in:%@>%u", _address.hostname, (unsigned)_server.port);
+    else
+        return $sprintf(@"out:%@:%u", _address.hostname, (unsigned)_address.port);
+}
+
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+// Gives SecureTransport the same peer ID as earlier connections with this peer, which lets it
+// resume their TLS session instead of doing a full handshake. The streams' SSL context exists
+// once they've been opened, and the handshake hasn't started yet.
+- (void) _setSSLPeerID
+{
+    SSLContextRef ctx = (__bridge SSLContextRef)[_reader propertyForKey: kCFStreamPropertySSLContext];
+    if( ! ctx )
+        return;
+    NSArray *certs = _sslProperties[kTCPPropertySSLCertificates];
+    id identity = certs.count ?certs[0] :nil;
+    if( identity && CFGetTypeID((__bridge CFTypeRef)identity) != SecIdentityGetTypeID() )
+        identity = nil;
+    NSData *peerID = [_sessionCache peerIDForPeer: self._sessionPeer
+                                         identity: (__bridge SecIdentityRef)identity];
+    OSStatus err = SSLSetPeerID(ctx, peerID.bytes, peerID.length);
+    if( err ) {
+        Warn(@"%@: SSLSetPeerID failed (%d)",self,(int)err);
+        return;
+    }
+#if (!TARGET_OS_IPHONE && defined(__MAC_10_13)) || (TARGET_OS_IPHONE && defined(__IPHONE_11_0))
+    // Session tickets also let a client resume with a server that doesn't keep session state:
+    if( ! _isIncoming && &SSLSetSessionTicketsEnabled != NULL )
+        SSLSetSessionTicketsEnabled(ctx, true);
+#endif
+    LogTo(TCPVerbose,@"%@: SSL peer ID = %@",self,peerID);
+}
+
+// Records whether the handshake resumed an earlier session.
+- (void) _noteSSLHandshake
+{
+    SSLContextRef ctx = (__bridge SSLContextRef)[_reader propertyForKey: kCFStreamPropertySSLContext];
+    Boolean resumed = false;
+    UInt8 sessionID[32];
+    size_t sessionIDLength = sizeof(sessionID);
+    if( ctx && SSLGetResumableSessionInfo(ctx, &resumed, sessionID, &sessionIDLength) == noErr ) {
+        LogTo(TCP,@"%@: SSL handshake %@",self,(resumed ?@"resumed a session" :@"was full"));
+        [_sessionCache noteHandshakeResumed: resumed];
     }
 }
 
+#pragma clang diagnostic pop
+
 
 #pragma mark -
 #pragma mark STREAM CALLBACKS:
@@ -353,6 +693,12 @@ static NSMutableArray *sAllConnections = NULL;
         LogTo(TCP,@"%@ opened; address=%@",self,_address);
         [self _stopOpenTimer];
         self.status = kTCP_Open;
+        if( _keepAliveInterval > 0 )
+            [self _enableKeepAlive];
+        if( _idleTimeout > 0 ) {
+            _lastTransfer = CFAbsoluteTimeGetCurrent();
+            [self _armIdleTimer: _idleTimeout];
+        }
         [self tellDelegate: @selector(connectionDidOpen:) withObject: nil];
     }
 }
@@ -365,10 +711,14 @@ static NSMutableArray *sAllConnections = NULL;
         @try{
             _checkedPeerCert = YES;
             if( stream.securityLevel != nil ) {
+                if( _sessionCache )
+                    [self _noteSSLHandshake];
                 NSArray *certs = stream.peerSSLCerts;
                 if( ! certs && ! _isIncoming )
                     allow = NO; // Server MUST have a cert!
                 else {
+                    // The delegate decides even if the session was resumed; the session cache
+                    // only makes the handshake cheaper.
                     SecCertificateRef cert = certs.count ?(__bridge SecCertificateRef)certs[0] :NULL;
                     if ([TCPEndpoint respondsToSelector: @selector(describeCert:)])
                         LogTo(TCP,@"%@: Peer cert = %@",self,[TCPEndpoint describeCert: cert]);
@@ -381,11 +731,13 @@ static NSMutableArray *sAllConnections = NULL;
             _checkedPeerCert = NO;
             allow = NO;
         }
-        if( ! allow )
+        if( ! allow ) {
+            [_sessionCache forgetPeer: self._sessionPeer];
             [self _stream: stream 
                  gotError: [NSError errorWithDomain: NSStreamSocketSSLErrorDomain
                                                code: errSSLClosedAbort
                                            userInfo: nil]];
+        }
     }
     return allow;
 }
@@ -451,6 +803,77 @@ static NSMutableArray *sAllConnections = NULL;
 @end
 
 
+
+#if DEBUG
+
+TestCase(TCPConnectionRegistry) {
+    // Registering and unregistering is constant-time, however many connections are open:
+    IPAddress *address = [[IPAddress alloc] initWithHostname: @"127.0.0.1" port: 9];
+    NSMutableArray *connections = [NSMutableArray array];
+    for( int i=0; i<5000; i++ )
+        [connections addObject: [[TCPConnection alloc] initToAddress: address]];
+    NSUInteger before = [TCPConnection _openConnectionCount];
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for( TCPConnection *conn in connections )
+        [conn _register];
+    for( TCPConnection *conn in connections )
+        [conn _register];       // no effect
+    CAssertEq([TCPConnection _openConnectionCount], before + connections.count);
+    for( TCPConnection *conn in connections )
+        [conn _unregister];
+    Log(@"Registered and unregistered %u connections in %.3f sec",
+        (unsigned)connections.count, CFAbsoluteTimeGetCurrent() - start);
+    CAssertEq([TCPConnection _openConnectionCount], before);
+
+    // Waiting for a connection on another thread sleeps until it closes. The connection is
+    // registered on a thread with its own run loop, which closes it a bit later:
+    if( before == 0 ) {
+        TCPConnection *conn = connections[0];
+        dispatch_semaphore_t registered = dispatch_semaphore_create(0);
+        __block BOOL unregistered = NO;
+        NSThread *thread = [[NSThread alloc] initWithBlock: ^{
+            @autoreleasepool {
+                [conn _register];
+                dispatch_semaphore_signal(registered);
+                [NSTimer scheduledTimerWithTimeInterval: 0.2 repeats: NO block: ^(NSTimer *t) {
+                    [conn _unregister];
+                    unregistered = YES;
+                }];
+                while( ! unregistered )
+                    [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                             beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.05]];
+            }
+        }];
+        [thread start];
+        dispatch_semaphore_wait(registered, DISPATCH_TIME_FOREVER);
+        CAssertEq([TCPConnection _openConnectionCount], 1u);
+        CAssert(conn->_runLoop != CFRunLoopGetCurrent());
+
+        start = CFAbsoluteTimeGetCurrent();
+        [TCPConnection waitTillAllClosed];
+        CFAbsoluteTime waited = CFAbsoluteTimeGetCurrent() - start;
+        CAssertEq([TCPConnection _openConnectionCount], 0u);
+        CAssert(waited >= 0.1, @"Didn't wait for the connection (%.3f sec)", waited);
+    }
+}
+
+
+TestCase(TCPConnectionFailedRace) {
+    // A race with no addresses fails before -open returns. The connection still has to report
+    // the failure and unregister, or -waitTillAllClosed would wait for it forever:
+    IPAddress *address = [[IPAddress alloc] initWithHostname: @"127.0.0.1" port: 9];
+    TCPConnectRace *race = [[TCPConnectRace alloc] initWithAddresses: @[]];
+    TCPConnection *conn = [[TCPConnection alloc] _initWithAddress: address connectRace: race];
+    NSUInteger before = [TCPConnection _openConnectionCount];
+    [conn open];
+    CAssertEq(conn.status, kTCP_Disconnected);
+    CAssertEqual(conn.error.domain, NSPOSIXErrorDomain);
+    CAssertEq([TCPConnection _openConnectionCount], before);
+}
+
+#endif
+
+
 /*
  Copyright (c) 2008, Jens Alfke <jens@mooseyard.com>. All rights reserved.
  
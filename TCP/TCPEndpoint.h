@@ -13,6 +13,7 @@
 #else
 #import <CoreServices/CoreServices.h>
 #endif
+@class TCPSessionCache;
 
 
 // SSL properties:
@@ -65,6 +66,24 @@ typedef enum {
     requires peers to use SSL, turns off root checking and peer-name checking. */
 - (void) setPeerToPeerIdentity: (SecIdentityRef)identity;
 
+/** Where SSL connections remember peers' TLS sessions, to make reconnecting faster (see
+    TCPSessionCache.) Defaults to the shared cache; set to nil to make every connection do a full
+    handshake. Peer certificates are still checked on every connection. A TCPListener passes its
+    cache on to the connections it accepts. */
+@property (strong) TCPSessionCache *sessionCache;
+
+/** If nonzero, connections turn on TCP keepalive: after this many seconds without traffic the OS
+    starts probing the peer, so a peer that has vanished is noticed even while nothing is being
+    sent. Must be set before the connection opens. A TCPListener passes it on to the connections
+    it accepts. Defaults to zero (off). */
+@property NSTimeInterval keepAliveInterval;
+
+/** If nonzero, a connection that has neither sent nor received any data for this many seconds
+    is closed. If it was in the middle of a message (e.g. its peer has stopped reading) it's
+    disconnected with an ETIMEDOUT error. Must be set before the connection opens. A TCPListener
+    passes it on to the connections it accepts. Defaults to zero (never.) */
+@property NSTimeInterval idleTimeout;
+
 //protected:
 - (void) tellDelegate: (SEL)selector withObject: (id)param;
 
@@ -8,6 +8,7 @@
 
 #import "TCPEndpoint.h"
 #import "TCP_Internal.h"
+#import "TCPSessionCache.h"
 #import "Test.h"
 #import "CollectionUtils.h"
 #import "ExceptionUtils.h"
@@ -21,6 +22,19 @@ NSString* const kTCPPropertySSLClientSideAuthentication = @"kTCPPropertySSLClien
 @implementation TCPEndpoint
 
 
+- (id) init
+{
+    self = [super init];
+    if (self != nil) {
+        _sessionCache = [TCPSessionCache sharedCache];
+    }
+    return self;
+}
+
+
+@synthesize sessionCache=_sessionCache, keepAliveInterval=_keepAliveInterval, idleTimeout=_idleTimeout;
+
+
 - (NSMutableDictionary*) SSLProperties {return _sslProperties;}
 
 - (void) setSSLProperties: (NSMutableDictionary*)props
@@ -5,7 +5,7 @@
 //  Created by Jens Alfke on 5/10/08.
 //  Copyright 2008 Jens Alfke. All rights reserved.
 
-@class TCPConnection, IPAddress;
+@class TCPConnection, IPAddress, IPAddressSet;
 @protocol TCPListenerDelegate;
 
 
@@ -66,6 +66,42 @@
 @property (readonly) BOOL isOpen;
 
 
+#pragma mark ADMISSION CONTROL:
+
+/* These limits are checked as each socket is accepted, before a TCPConnection is created for it,
+   so a flood of incoming connections costs little more than the accept calls. A connection that's
+   over a limit is refused by resetting it. All default to zero, meaning unlimited, and can be
+   changed while the listener is open. */
+
+/** The maximum number of connections accepted per second, on average. When the limit is reached,
+    the listener stops accepting until it's allowed to again; meanwhile new connections wait in
+    the kernel's listen queue, where they cost nothing (and if it fills up, the kernel tells
+    further clients to retry.) */
+@property double acceptRate;
+
+/** The number of connections that can be accepted at once, after a quiet period, when acceptRate
+    is set. Defaults to acceptRate (i.e. one second's worth.) */
+@property NSUInteger acceptBurst;
+
+/** If set, only connections from addresses in this set are accepted; others are refused. */
+@property (strong) IPAddressSet *allowedAddresses;
+
+/** The maximum number of connections from this listener that can be open at once. Beyond this,
+    new connections are refused. */
+@property NSUInteger maxConnections;
+
+/** The maximum number of connections from any one IP address that can be open at once. Beyond
+    this, new connections from that address are refused. */
+@property NSUInteger maxConnectionsPerAddress;
+
+/** The number of currently open connections that this listener accepted. */
+@property (readonly) NSUInteger connectionCount;
+
+/** The total number of incoming connections accepted, and refused (by a limit above or by the
+    delegate's -listener:shouldAcceptConnectionFrom: method.) */
+@property (readonly) NSUInteger acceptedCount, refusedCount;
+
+
 #pragma mark BONJOUR:
 
 /** The Bonjour service type to advertise. Defaults to nil; setting it implicitly enables Bonjour.
@@ -121,7 +157,8 @@
 /** Called when an incoming connection request arrives, but before the conncetion is opened;
     return YES to accept the connection, NO to refuse it.
     This method can only use criteria like the peer IP address, or the number of currently
-    open connections, to determine whether to accept. If you also want to check the
+    open connections, to determine whether to accept. (It's called only for connections that
+    are within the listener's admission limits, like maxConnectionsPerAddress.) If you also want to check the
     peer's SSL certificate, then return YES from this method, and use the TCPConnection
     delegate method -connection:authorizeSSLPeer: to examine the certificate. */
 - (BOOL) listener: (TCPListener*)listener shouldAcceptConnectionFrom: (IPAddress*)address;
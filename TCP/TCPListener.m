@@ -14,18 +14,27 @@
 #import "Test.h"
 #import "ExceptionUtils.h"
 #import "IPAddress.h"
+#import "IPAddressSet.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 
+// Most sockets accepted in one go, before letting the run loop handle other sources.
+#define kMaxAcceptBatch 64
+
+// How long to stop accepting when the process runs out of file descriptors.
+#define kOutOfDescriptorsDelay 0.5
+
+
 #ifndef __has_feature
 #define __has_feature(x) 0 // Compatibility with non-clang compilers.
 #endif
 
-static void TCPListenerAcceptCallBack(CFSocketRef socket, CFSocketCallBackType type, 
-                                      CFDataRef address, const void *data, void *info);
+static void TCPListenerReadCallBack(CFSocketRef socket, CFSocketCallBackType type,
+                                    CFDataRef address, const void *data, void *info);
 
 @interface TCPListener()
 - (void) _openBonjour;
@@ -57,6 +66,16 @@ static void TCPListenerAcceptCallBack(CFSocketRef socket, CFSocketCallBackType t
     NSInteger /*NSNetServicesError*/ _bonjourError;
 
     Class __strong _connectionClass;
+
+    double _acceptRate, _acceptTokens;
+    NSUInteger _acceptBurst;
+    CFAbsoluteTime _acceptTokensTime;
+    BOOL _acceptPaused;
+    NSUInteger _maxConnections, _maxConnectionsPerAddress;
+    IPAddressSet *_allowedAddresses;
+    NSMapTable *_connections;           // open TCPConnection -> its peer's IPAddress (no port)
+    NSCountedSet *_connectionsPerAddress;
+    NSUInteger _acceptedCount, _refusedCount;
 }
 
 
@@ -72,6 +91,8 @@ static void TCPListenerAcceptCallBack(CFSocketRef socket, CFSocketCallBackType t
     if (self != nil) {
         _port = port;
         _connectionClass = [TCPConnection class];
+        _connections = [NSMapTable strongToStrongObjectsMapTable];
+        _connectionsPerAddress = [[NSCountedSet alloc] init];
     }
     return self;
 }
@@ -88,7 +109,10 @@ static void TCPListenerAcceptCallBack(CFSocketRef socket, CFSocketCallBackType t
             bonjourServiceType=_bonjourServiceType, bonjourServiceOptions=_bonjourServiceOptions,
             bonjourPublished=_bonjourPublished, bonjourError=_bonjourError,
             bonjourService=_netService,
-            pickAvailablePort=_pickAvailablePort;
+            pickAvailablePort=_pickAvailablePort,
+            maxConnections=_maxConnections, maxConnectionsPerAddress=_maxConnectionsPerAddress,
+            allowedAddresses=_allowedAddresses,
+            acceptedCount=_acceptedCount, refusedCount=_refusedCount;
 
 
 - (id<TCPListenerDelegate>) delegate                      {return _delegate;}
@@ -123,13 +147,18 @@ static CFSocketRef closeSocket( CFSocketRef socket ) {
                         error: (NSError**)error
 {
     CFSocketContext socketCtxt = {0, (__bridge void *)(self), NULL, NULL, NULL};
-    CFSocketRef socket = CFSocketCreate(kCFAllocatorDefault, PF_INET, SOCK_STREAM, IPPROTO_TCP,
-                                        kCFSocketAcceptCallBack, &TCPListenerAcceptCallBack, &socketCtxt);
+    CFSocketRef socket = CFSocketCreate(kCFAllocatorDefault, protocolFamily, SOCK_STREAM, IPPROTO_TCP,
+                                        kCFSocketReadCallBack, &TCPListenerReadCallBack, &socketCtxt);
     if( ! socket ) 
         return getLastCFSocketError(error);   // CFSocketCreate leaves error code in errno
     
+    // The socket only signals readability; -_acceptFrom: calls accept until it would block.
+    CFSocketNativeHandle fd = CFSocketGetNative(socket);
     int yes = 1;
-    setsockopt(CFSocketGetNative(socket), SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
+    if( protocolFamily == PF_INET6 )
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes));  // IPv4 has its own socket
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
     
     NSData *addressData = [NSData dataWithBytes:address length:address->sa_len];
     if (kCFSocketSuccess != CFSocketSetAddress(socket, (__bridge CFDataRef)addressData)) {
@@ -204,6 +233,9 @@ static CFSocketRef closeSocket( CFSocketRef socket ) {
         }
     }
     
+    _acceptTokens = self.acceptBurst;
+    _acceptTokensTime = CFAbsoluteTimeGetCurrent();
+
     [self _openBonjour];
 
     LogTo(TCP,@"%@ is open",self);
@@ -220,6 +252,10 @@ static CFSocketRef closeSocket( CFSocketRef socket ) {
 - (void) close 
 {
     if( _ipv4socket ) {
+        [NSObject cancelPreviousPerformRequestsWithTarget: self
+                                                 selector: @selector(_resumeAccepting)
+                                                   object: nil];
+        _acceptPaused = NO;
         [self _closeBonjour];
         _ipv4socket = closeSocket(_ipv4socket);
         _ipv6socket = closeSocket(_ipv6socket);
@@ -243,11 +279,147 @@ static CFSocketRef closeSocket( CFSocketRef socket ) {
 @synthesize connectionClass = _connectionClass;
 
 
-- (BOOL) acceptConnection: (CFSocketNativeHandle)socket
+- (double) acceptRate                   {return _acceptRate;}
+- (NSUInteger) acceptBurst              {return _acceptBurst ?: MAX((NSUInteger)_acceptRate, (NSUInteger)1);}
+- (void) setAcceptBurst: (NSUInteger)burst {_acceptBurst = burst;}
+
+- (void) setAcceptRate: (double)rate
+{
+    Assert(rate >= 0.0);
+    if( _acceptRate <= 0.0 ) {
+        _acceptTokens = INFINITY;       // start with a full bucket
+        _acceptTokensTime = CFAbsoluteTimeGetCurrent();
+    }
+    _acceptRate = rate;
+    _acceptTokens = MIN(_acceptTokens, (double)self.acceptBurst);
+}
+
+
+- (NSUInteger) connectionCount
+{
+    return _connections.count;
+}
+
+
+// Token bucket: returns the number of connections that may be accepted right now.
+- (double) _availableAcceptTokens
+{
+    if( _acceptRate <= 0.0 )
+        return INFINITY;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    _acceptTokens = MIN(_acceptTokens + (now - _acceptTokensTime) * _acceptRate,
+                        (double)self.acceptBurst);
+    _acceptTokensTime = now;
+    return _acceptTokens;
+}
+
+
+// Stops the listening sockets' callbacks for a while, leaving new connections in the kernel's
+// listen queue.
+- (void) _pauseAcceptingFor: (NSTimeInterval)delay
+{
+    if( _acceptPaused )
+        return;
+    LogTo(TCPVerbose,@"%@: pausing accepting for %.3f sec",self,delay);
+    _acceptPaused = YES;
+    CFSocketDisableCallBacks(_ipv4socket, kCFSocketReadCallBack);
+    if( _ipv6socket )
+        CFSocketDisableCallBacks(_ipv6socket, kCFSocketReadCallBack);
+    [self performSelector: @selector(_resumeAccepting) withObject: nil afterDelay: delay];
+}
+
+- (void) _resumeAccepting
+{
+    if( ! _acceptPaused || ! self.isOpen )
+        return;
+    LogTo(TCPVerbose,@"%@: resuming accepting",self);
+    _acceptPaused = NO;
+    CFSocketEnableCallBacks(_ipv4socket, kCFSocketReadCallBack);
+    if( _ipv6socket )
+        CFSocketEnableCallBacks(_ipv6socket, kCFSocketReadCallBack);
+}
+
+
+// Refuses a connection by resetting it, which is cheaper for both sides than a graceful close.
+static void refuseSocket( CFSocketNativeHandle socket ) {
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(socket);
+}
+
+
+// Accepts all the pending connections on a listening socket, as far as the limits allow.
+- (void) _acceptFrom: (CFSocketRef)listenSocket
+{
+    CFSocketNativeHandle listenFD = CFSocketGetNative(listenSocket);
+    for( int i=0; i<kMaxAcceptBatch && self.isOpen; i++ ) {
+        double tokens = [self _availableAcceptTokens];
+        if( tokens < 1.0 ) {
+            [self _pauseAcceptingFor: (1.0 - tokens) / _acceptRate];
+            return;
+        }
+
+        uint8_t addrBuf[SOCK_MAXADDRLEN];
+        socklen_t addrLen = sizeof(addrBuf);
+        CFSocketNativeHandle socket = accept(listenFD, (struct sockaddr*)addrBuf, &addrLen);
+        if( socket < 0 ) {
+            if( errno == EINTR || errno == ECONNABORTED )
+                continue;
+            else if( errno == EMFILE || errno == ENFILE ) {
+                Warn(@"%@: out of file descriptors; can't accept connections",self);
+                [self _pauseAcceptingFor: kOutOfDescriptorsDelay];
+            } else if( errno != EAGAIN && errno != EWOULDBLOCK )
+                Warn(@"%@: accept failed, errno=%i",self,errno);
+            return;
+        }
+        if( _acceptRate > 0.0 )
+            _acceptTokens -= 1.0;
+
+        // Accepted sockets inherit non-blocking mode; put it back the way CFSocket used to leave it
+        fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) & ~O_NONBLOCK);
+
+        BOOL accepted = NO;
+        @try{
+            IPAddress *addr = [[IPAddress alloc] initWithSockAddr: (struct sockaddr*)addrBuf];
+            accepted = [self _acceptConnection: socket from: addr];
+        }catchAndReport(@"TCPListener accept");
+        if( accepted ) {
+            _acceptedCount++;
+        } else {
+            _refusedCount++;
+            refuseSocket(socket);
+        }
+    }
+}
+
+
+// Checks the cheap limits on a new connection.
+- (BOOL) _admitConnectionFrom: (IPAddress*)host
+{
+    if( _allowedAddresses && ! [_allowedAddresses containsAddress: host] ) {
+        LogTo(TCPVerbose,@"%@: refusing connection from %@: not in allowedAddresses",self,host);
+        return NO;
+    }
+    if( _maxConnections && _connections.count >= _maxConnections ) {
+        LogTo(TCPVerbose,@"%@: refusing connection from %@: at maxConnections",self,host);
+        return NO;
+    }
+    if( _maxConnectionsPerAddress
+            && [_connectionsPerAddress countForObject: host] >= _maxConnectionsPerAddress ) {
+        LogTo(TCPVerbose,@"%@: refusing connection from %@: at maxConnectionsPerAddress",self,host);
+        return NO;
+    }
+    return YES;
+}
+
+
+- (BOOL) _acceptConnection: (CFSocketNativeHandle)socket from: (IPAddress*)addr
 {
-    IPAddress *addr = [IPAddress addressOfSocket: socket];
     if( ! addr )
         return NO;
+    IPAddress *host = [addr addressWithPort: 0];
+    if( ! [self _admitConnectionFrom: host] )
+        return NO;
     if( [_delegate respondsToSelector: @selector(listener:shouldAcceptConnectionFrom:)]
        && ! [_delegate listener: self shouldAcceptConnectionFrom: addr] )
         return NO;
@@ -257,32 +429,40 @@ static CFSocketRef closeSocket( CFSocketRef socket ) {
                                                                       listener: self];
     if( ! conn )
         return NO;
+    [_connections setObject: host forKey: conn];
+    [_connectionsPerAddress addObject: host];
     
     if( _sslProperties ) {
         conn.SSLProperties = _sslProperties;
         [conn setSSLProperty: $true forKey: (id)kCFStreamSSLIsServer];
     }
+    conn.sessionCache = _sessionCache;
+    conn.keepAliveInterval = _keepAliveInterval;
+    conn.idleTimeout = _idleTimeout;
     [conn open];
     [self tellDelegate: @selector(listener:didAcceptConnection:) withObject: conn];
     return YES;
 }
 
 
-static void TCPListenerAcceptCallBack(CFSocketRef socket, CFSocketCallBackType type, CFDataRef address, const void *data, void *info) 
+- (void) _connectionClosed: (TCPConnection*)connection
 {
-    TCPListener *server = (__bridge TCPListener *)info;
-    if (kCFSocketAcceptCallBack == type) { 
-        CFSocketNativeHandle nativeSocketHandle = *(CFSocketNativeHandle *)data;
-        BOOL accepted = NO;
-        @try{
-            accepted = [server acceptConnection: nativeSocketHandle];
-        }catchAndReport(@"TCPListenerAcceptCallBack");
-        if( ! accepted )
-            close(nativeSocketHandle);
+    IPAddress *host = [_connections objectForKey: connection];
+    if( host ) {
+        [_connectionsPerAddress removeObject: host];
+        [_connections removeObjectForKey: connection];
     }
 }
 
 
+static void TCPListenerReadCallBack(CFSocketRef socket, CFSocketCallBackType type, CFDataRef address, const void *data, void *info) 
+{
+    TCPListener *server = (__bridge TCPListener *)info;
+    if (kCFSocketReadCallBack == type)
+        [server _acceptFrom: socket];
+}
+
+
 #pragma mark -
 #pragma mark BONJOUR:
 
@@ -386,6 +566,168 @@ static void TCPListenerAcceptCallBack(CFSocketRef socket, CFSocketCallBackType t
 
 
 
+#if DEBUG
+
+/** Load-test harness: records the connections a listener accepts. */
+@interface TCPListenerLoadTester : NSObject <TCPListenerDelegate>
+{
+    @public
+    NSMutableArray *accepted;
+}
+@end
+
+@implementation TCPListenerLoadTester
+- (id) init {
+    self = [super init];
+    if( self )
+        accepted = [NSMutableArray array];
+    return self;
+}
+- (void) listener: (TCPListener*)listener didAcceptConnection: (TCPConnection*)connection {
+    [accepted addObject: connection];
+}
+- (void) closeAll {
+    for( TCPConnection *conn in accepted )
+        [conn disconnect];
+    [accepted removeAllObjects];
+}
+@end
+
+
+static void runListener( NSTimeInterval duration ) {
+    [[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                             beforeDate: [NSDate dateWithTimeIntervalSinceNow: duration]];
+}
+
+// Starts `count` connections to the listener from loopback, without waiting for them to complete.
+static NSMutableArray* connectClients( TCPListener *listener, unsigned count ) {
+    struct sockaddr_in addr = {.sin_len = sizeof(addr), .sin_family = AF_INET,
+                               .sin_port = htons(listener.port),
+                               .sin_addr = {htonl(INADDR_LOOPBACK)}};
+    NSMutableArray *clients = [NSMutableArray arrayWithCapacity: count];
+    for( unsigned i=0; i<count; i++ ) {
+        int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        CAssert(fd >= 0);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        int result = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+        CAssert(result == 0 || errno == EINPROGRESS, @"connect failed, errno=%i", errno);
+        [clients addObject: @(fd)];
+    }
+    return clients;
+}
+
+static void closeClients( NSArray *clients ) {
+    for( NSNumber *fd in clients )
+        close(fd.intValue);
+}
+
+static TCPListener* openLoadListener( TCPListenerLoadTester *tester ) {
+    TCPListener *listener = [[TCPListener alloc] initWithPort: 0];
+    listener.delegate = tester;
+    NSError *error;
+    CAssert([listener open: &error], @"Listener failed to open: %@", error);
+    return listener;
+}
+
+TestCase(TCPListenerAdmission) {
+    TCPListenerLoadTester *tester = [[TCPListenerLoadTester alloc] init];
+
+    // Per-address limit (every client is on loopback):
+    TCPListener *listener = openLoadListener(tester);
+    listener.maxConnectionsPerAddress = 5;
+    NSArray *clients = connectClients(listener, 20);
+    runListener(1.0);
+    CAssertEq(tester->accepted.count, 5u);
+    CAssertEq(listener.connectionCount, 5u);
+    CAssertEq(listener.refusedCount, 15u);
+    [tester closeAll];
+    runListener(0.2);
+    CAssertEq(listener.connectionCount, 0u);
+    closeClients(clients);
+    [listener close];
+
+    // Overall limit; closing connections makes room for more:
+    listener = openLoadListener(tester);
+    listener.maxConnections = 3;
+    clients = connectClients(listener, 10);
+    runListener(1.0);
+    CAssertEq(tester->accepted.count, 3u);
+    CAssertEq(listener.refusedCount, 7u);
+    [tester closeAll];
+    runListener(0.2);
+    closeClients(clients);
+    clients = connectClients(listener, 1);
+    runListener(0.5);
+    CAssertEq(tester->accepted.count, 1u);
+    CAssertEq(listener.acceptedCount, 4u);
+    [tester closeAll];
+    closeClients(clients);
+    [listener close];
+
+    // Allowlist:
+    listener = openLoadListener(tester);
+    listener.allowedAddresses = [[IPAddressSet alloc] initWithCIDRs: @[@"10.0.0.0/8", @"::1"]];
+    clients = connectClients(listener, 3);
+    runListener(0.5);
+    CAssertEq(tester->accepted.count, 0u);
+    CAssertEq(listener.refusedCount, 3u);
+    [listener.allowedAddresses addCIDR: @"127.0.0.0/8"];
+    closeClients(clients);
+    clients = connectClients(listener, 3);
+    runListener(0.5);
+    CAssertEq(tester->accepted.count, 3u);
+    [tester closeAll];
+    closeClients(clients);
+    [listener close];
+
+    // Rate limit: a burst goes through at once, the rest wait in the listen queue:
+    listener = openLoadListener(tester);
+    listener.acceptRate = 20;
+    listener.acceptBurst = 5;
+    clients = connectClients(listener, 25);
+    runListener(0.1);
+    NSUInteger early = tester->accepted.count;
+    CAssert(early >= 5 && early <= 10, @"Accepted %u", (unsigned)early);
+    NSDate *giveUp = [NSDate dateWithTimeIntervalSinceNow: 3.0];
+    while( tester->accepted.count < 25 && [giveUp timeIntervalSinceNow] > 0 )
+        runListener(0.05);
+    CAssertEq(tester->accepted.count, 25u);
+    CAssertEq(listener.refusedCount, 0u);
+    [tester closeAll];
+    closeClients(clients);
+    [listener close];
+}
+
+TestCase(TCPListenerLoad) {
+    // Throughput of accepting a burst of connections, with and without shedding most of them:
+    for( int shed=0; shed<=1; shed++ ) {
+        TCPListenerLoadTester *tester = [[TCPListenerLoadTester alloc] init];
+        TCPListener *listener = openLoadListener(tester);
+        if( shed )
+            listener.maxConnections = 10;
+        const unsigned kNClients = 100;
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        NSArray *clients = connectClients(listener, kNClients);
+        while( listener.acceptedCount + listener.refusedCount < kNClients
+                && CFAbsoluteTimeGetCurrent() - start < 10.0 )
+            runListener(0.01);
+        CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+        CAssertEq(listener.acceptedCount + listener.refusedCount, kNClients);
+        Log(@"%s: accepted %u, refused %u connections in %.3f sec (%.0f/sec)",
+            (shed ? "Shedding" : "Accepting"),
+            (unsigned)listener.acceptedCount, (unsigned)listener.refusedCount,
+            elapsed, kNClients/elapsed);
+        [tester closeAll];
+        closeClients(clients);
+        runListener(0.2);
+        [listener close];
+    }
+}
+
+#endif
+
+
+
 /*
  Copyright (c) 2008, Jens Alfke <jens@mooseyard.com>. All rights reserved.
  
@@ -0,0 +1,47 @@
+//
+//  TCPSessionCache.h
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import <Security/SecBase.h>
+
+
+/** Lets reconnections to a peer resume their TLS session, which makes the handshake cheaper.
+    Each peer gets a stable SecureTransport "peer ID". SecureTransport keys its cache of session
+    IDs and tickets by peer ID, so a connection that uses the same ID as an earlier one to the
+    same peer can resume that session with an abbreviated handshake.
+    A peer is identified by its address, plus the local SSL identity, since a session established
+    under one identity mustn't be resumed under another.
+    This only affects the handshake: a connection's delegate is still asked to authorize the
+    peer's certificate every time, whether or not the session was resumed.
+    Every TCPEndpoint uses the shared cache by default. The cache is thread-safe. */
+@interface TCPSessionCache : NSObject
+
++ (TCPSessionCache*) sharedCache;
+
+/** Initializes a cache that remembers up to `capacity` forgotten peers (see -forgetPeer:),
+    discarding the least recently used beyond that. */
+- (id) initWithCapacity: (NSUInteger)capacity;
+
+@property (readonly) NSUInteger capacity;
+
+/** Returns the peer ID to give SecureTransport for a connection to or from a peer.
+    `peer` is a string identifying the peer's address; `identity` is the local SSL identity,
+    if any. The same inputs always produce the same ID. */
+- (NSData*) peerIDForPeer: (NSString*)peer identity: (SecIdentityRef)identity;
+
+/** Stops the peer's current session from being resumed, e.g. because its connection failed
+    authentication: its peer ID changes, so the next connection does a full handshake. */
+- (void) forgetPeer: (NSString*)peer;
+
+/** Instrumentation: the number of TLS handshakes that resumed an earlier session, and the number
+    that had to do a full handshake. */
+@property (readonly) NSUInteger resumedHandshakes, fullHandshakes;
+
+- (void) noteHandshakeResumed: (BOOL)resumed;
+
+@end
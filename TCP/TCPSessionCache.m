@@ -0,0 +1,165 @@
+//
+//  TCPSessionCache.m
+//  MYNetwork
+//
+//  Created by agent on 10/19/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "TCPSessionCache.h"
+#import <Security/Security.h>
+#import <CommonCrypto/CommonDigest.h>
+
+#import "Logging.h"
+#import "Test.h"
+#import "CollectionUtils.h"
+
+
+#define kDefaultCapacity 256
+
+
+@implementation TCPSessionCache
+{
+    NSUInteger _capacity;
+    NSMutableDictionary *_generations;      // peer -> NSNumber, bumped by -forgetPeer:
+    NSMutableOrderedSet *_peersByAge;       // least recently used first
+    NSUInteger _resumedHandshakes, _fullHandshakes;
+}
+
+
++ (TCPSessionCache*) sharedCache
+{
+    static TCPSessionCache *sShared;
+    static dispatch_once_t predicate;
+    dispatch_once(&predicate, ^{
+        sShared = [[self alloc] initWithCapacity: kDefaultCapacity];
+    });
+    return sShared;
+}
+
+
+- (id) initWithCapacity: (NSUInteger)capacity
+{
+    Assert(capacity > 0);
+    self = [super init];
+    if (self != nil) {
+        _capacity = capacity;
+        _generations = [[NSMutableDictionary alloc] init];
+        _peersByAge = [[NSMutableOrderedSet alloc] init];
+    }
+    return self;
+}
+
+- (id) init
+{
+    return [self initWithCapacity: kDefaultCapacity];
+}
+
+
+@synthesize capacity=_capacity;
+
+
+- (NSData*) peerIDForPeer: (NSString*)peer identity: (SecIdentityRef)identity
+{
+    // The ID is a digest of the peer and of my certificate, so it's compact and fixed-size:
+    CC_SHA256_CTX ctx;
+    CC_SHA256_Init(&ctx);
+    NSData *peerData = [peer dataUsingEncoding: NSUTF8StringEncoding];
+    CC_SHA256_Update(&ctx, peerData.bytes, (CC_LONG)peerData.length);
+    UInt32 generation;
+    @synchronized(self) {
+        generation = [_generations[peer] unsignedIntValue];
+    }
+    if( generation > 0 ) {
+        CC_SHA256_Update(&ctx, "#", 1);
+        CC_SHA256_Update(&ctx, &generation, sizeof(generation));
+    }
+    if( identity ) {
+        SecCertificateRef cert = NULL;
+        if( SecIdentityCopyCertificate(identity, &cert) == noErr ) {
+            NSData *certData = CFBridgingRelease(SecCertificateCopyData(cert));
+            CFRelease(cert);
+            CC_SHA256_Update(&ctx, "\0", 1);
+            CC_SHA256_Update(&ctx, certData.bytes, (CC_LONG)certData.length);
+        }
+    }
+    UInt8 digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256_Final(digest, &ctx);
+    return [NSData dataWithBytes: digest length: sizeof(digest)];
+}
+
+
+- (void) forgetPeer: (NSString*)peer
+{
+    if( ! peer )
+        return;
+    @synchronized(self) {
+        NSNumber *generation = _generations[peer];
+        if( generation )
+            [_peersByAge removeObject: peer];
+        _generations[peer] = @(generation.unsignedIntValue + 1);
+        [_peersByAge addObject: peer];
+        while( _peersByAge.count > _capacity ) {
+            LogTo(TCPVerbose,@"%@: evicting %@",self,_peersByAge[0]);
+            [_generations removeObjectForKey: _peersByAge[0]];
+            [_peersByAge removeObjectAtIndex: 0];
+        }
+    }
+}
+
+
+- (NSUInteger) resumedHandshakes    {@synchronized(self) {return _resumedHandshakes;}}
+- (NSUInteger) fullHandshakes       {@synchronized(self) {return _fullHandshakes;}}
+
+- (void) noteHandshakeResumed: (BOOL)resumed
+{
+    @synchronized(self) {
+        if( resumed )
+            ++_resumedHandshakes;
+        else
+            ++_fullHandshakes;
+    }
+}
+
+
+@end
+
+
+
+#if DEBUG
+
+TestCase(TCPSessionCache) {
+    TCPSessionCache *cache = [[TCPSessionCache alloc] initWithCapacity: 2];
+
+    // Peer IDs are stable, and differ between peers:
+    NSData *idA = [cache peerIDForPeer: @"out:example.com:443" identity: NULL];
+    CAssertEq(idA.length, (NSUInteger)CC_SHA256_DIGEST_LENGTH);
+    CAssertEqual([cache peerIDForPeer: @"out:example.com:443" identity: NULL], idA);
+    CAssert(! [[cache peerIDForPeer: @"out:example.com:8443" identity: NULL] isEqual: idA]);
+
+    // Forgetting a peer gives it a new ID, so its old session can't be resumed; other peers
+    // keep theirs:
+    NSData *idB = [cache peerIDForPeer: @"b" identity: NULL];
+    [cache forgetPeer: @"out:example.com:443"];
+    NSData *idA2 = [cache peerIDForPeer: @"out:example.com:443" identity: NULL];
+    CAssert(! [idA2 isEqual: idA]);
+    CAssertEqual([cache peerIDForPeer: @"out:example.com:443" identity: NULL], idA2);
+    CAssertEqual([cache peerIDForPeer: @"b" identity: NULL], idB);
+    [cache forgetPeer: @"out:example.com:443"];
+    NSData *idA3 = [cache peerIDForPeer: @"out:example.com:443" identity: NULL];
+    CAssert(! [idA3 isEqual: idA] && ! [idA3 isEqual: idA2]);
+
+    // Only `capacity` forgotten peers are tracked; the least recently forgotten go first:
+    [cache forgetPeer: @"b"];
+    [cache forgetPeer: @"c"];
+    CAssertEqual([cache peerIDForPeer: @"out:example.com:443" identity: NULL], idA);
+    CAssert(! [[cache peerIDForPeer: @"b" identity: NULL] isEqual: idB]);
+
+    [cache noteHandshakeResumed: NO];
+    [cache noteHandshakeResumed: YES];
+    [cache noteHandshakeResumed: YES];
+    CAssertEq(cache.fullHandshakes, 1u);
+    CAssertEq(cache.resumedHandshakes, 2u);
+}
+
+#endif
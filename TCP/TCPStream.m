@@ -9,6 +9,7 @@
 #import "TCPStream.h"
 #import "TCP_Internal.h"
 #import "IPAddress.h"
+#import "MYBufferPool.h"
 
 #import "Logging.h"
 #import "Test.h"
@@ -33,6 +34,7 @@ static NSError* fixStreamError( NSError *error );
     self = [super init];
     if (self != nil) {
         _conn = conn;
+        _bufferPool = conn.bufferPool;
         _stream = stream;
         _stream.delegate = self;
         [_stream scheduleInRunLoop: [NSRunLoop currentRunLoop] forMode: NSRunLoopCommonModes];
@@ -50,6 +52,9 @@ static NSError* fixStreamError( NSError *error );
 }
 
 
+@synthesize bufferPool=_bufferPool;
+
+
 - (id) propertyForKey: (CFStringRef)cfStreamProperty
 {
     return [_stream propertyForKey: (__bridge NSString*)cfStreamProperty];
@@ -257,6 +262,8 @@ static NSError* fixStreamError( NSError *error );
     NSInteger bytesRead = [(NSInputStream*)_stream read:dst maxLength: maxLength];
     if( bytesRead < 0 )
         [self _gotError];
+    else if( bytesRead > 0 )
+        [_conn _streamTransferredData];
     return bytesRead;
 }
 
@@ -16,7 +16,8 @@
 @property (readonly) TCPReader *reader;
 
 /** Schedules data to be written to the socket.
-    Always returns immediately; the bytes won't actually be sent until there's room. */
+    Always returns immediately; the bytes won't actually be sent until there's room.
+    If the data came from the connection's buffer pool, it's recycled after it's been written. */
 - (void) writeData: (NSData*)data;
 
 //protected:
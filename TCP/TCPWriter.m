@@ -8,6 +8,7 @@
 
 #import "TCPWriter.h"
 #import "TCP_Internal.h"
+#import "MYBufferPool.h"
 
 #import "Logging.h"
 #import "Test.h"
@@ -60,6 +61,8 @@
     src += _currentDataPos;
     NSInteger len = _currentData.length - _currentDataPos;
     NSInteger written = [(NSOutputStream*)_stream write: src maxLength: len];
+    if( written > 0 )
+        [_conn _streamTransferredData];
     if( written < 0 )
         [self _gotError];
     else if( written < len ) {
@@ -67,6 +70,7 @@
         _currentDataPos += written;
     } else {
         LogTo(TCPVerbose,@"%@ wrote %li bytes, released %p", self,(long)written,_currentData);
+        [_bufferPool recycle: _currentData];    // (ignored unless it's from the pool)
         _currentData = nil;
     }
 }
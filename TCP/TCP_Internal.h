@@ -10,6 +10,7 @@
 #import "TCPWriter.h"
 #import "TCPConnection.h"
 #import "TCPListener.h"
+@class MYBufferPool;
 
 /* Private declarations and APIs for TCP client/server implementation. */
 
@@ -23,6 +24,18 @@
 - (void) _streamCanClose: (TCPStream*)stream;
 - (void) _streamGotEOF: (TCPStream*)stream;
 - (void) _streamDisconnected: (TCPStream*)stream;
+- (void) _streamTransferredData;
+- (void) _closed;
+/** YES while a TCPConnectRace is still connecting the socket, before the streams exist. */
+@property (readonly) BOOL _isConnecting;
+/** Pool of frame buffers shared by the reader and writer (which both run on the I/O thread.) */
+@property (readonly) MYBufferPool *bufferPool;
+@end
+
+
+@interface TCPListener ()
+/** Called by a connection this listener accepted, when it closes. */
+- (void) _connectionClosed: (TCPConnection*)connection;
 @end
 
 
@@ -31,9 +44,11 @@
     @protected
     __weak TCPConnection *_conn;
     NSStream *_stream;
+    MYBufferPool *_bufferPool;
     BOOL _shouldClose;
 }
 - (void) _unclose;
+@property (readonly) MYBufferPool *bufferPool;
 @end
 
 
@@ -41,6 +56,8 @@
 {
     @protected
     NSMutableDictionary *_sslProperties;
+    TCPSessionCache *_sessionCache;
+    NSTimeInterval _keepAliveInterval, _idleTimeout;
     __weak id _delegate;
 }
 @end